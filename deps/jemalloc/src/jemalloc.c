@@ -2591,3 +2591,54 @@ jemalloc_postfork_child(void)
 }
 
 /******************************************************************************/
+
+/*
+ * Redis addition: helps the application decide if a pointer is worth
+ * re-allocating in order to reduce fragmentation.
+ * Returns 0 if the allocation is in the currently active run, or when it is
+ * not causing any fragmentation issue (large or huge allocations).
+ * Otherwise returns 1 and fills the bin utilization and the run utilization,
+ * both as 16:16 fixed point values. If the application decides to
+ * re-allocate it should use MALLOCX_TCACHE_NONE when doing so, so that the
+ * thread cache does not hand back the same region.
+ */
+JEMALLOC_EXPORT int JEMALLOC_NOTHROW
+je_get_defrag_hint(void* ptr, int *bin_util, int *run_util)
+{
+	int defrag = 0;
+	arena_chunk_t *chunk = (arena_chunk_t *)CHUNK_ADDR2BASE(ptr);
+
+	if (!config_stats)
+		return (0);
+	if (likely(chunk != ptr)) { /* Not a huge allocation. */
+		size_t pageind = ((uintptr_t)ptr - (uintptr_t)chunk) >> LG_PAGE;
+		size_t mapbits = arena_mapbits_get(chunk, pageind);
+		if (likely((mapbits & CHUNK_MAP_LARGE) == 0)) { /* Small. */
+			arena_t *arena = extent_node_arena_get(&chunk->node);
+			size_t rpages_ind = pageind -
+			    arena_mapbits_small_runind_get(chunk, pageind);
+			arena_run_t *run = &arena_miscelm_get(chunk,
+			    rpages_ind)->run;
+			arena_bin_t *bin = &arena->bins[run->binind];
+			malloc_mutex_lock(&bin->lock);
+			/*
+			 * Runs in the same chunk as the current run are likely
+			 * to become the next current run, don't move them.
+			 */
+			if (chunk != (arena_chunk_t *)
+			    CHUNK_ADDR2BASE(bin->runcur)) {
+				arena_bin_info_t *bin_info =
+				    &arena_bin_info[run->binind];
+				size_t availregs = bin_info->nregs *
+				    bin->stats.curruns;
+				*bin_util = (bin->stats.curregs<<16) /
+				    availregs;
+				*run_util = ((bin_info->nregs - run->nfree)
+				    <<16) / bin_info->nregs;
+				defrag = 1;
+			}
+			malloc_mutex_unlock(&bin->lock);
+		}
+	}
+	return (defrag);
+}
@@ -52,10 +52,10 @@ list *listCreate(void)
     return list;
 }
 
-/* Free the whole list.
+/* Remove all the elements from the list without destroying the list itself.
  *
  * This function can't fail. */
-void listRelease(list *list)
+void listEmpty(list *list)
 {
     unsigned long len;
     listNode *current, *next;
@@ -68,6 +68,16 @@ void listRelease(list *list)
         zfree(current);
         current = next;
     }
+    list->head = list->tail = NULL;
+    list->len = 0;
+}
+
+/* Free the whole list.
+ *
+ * This function can't fail. */
+void listRelease(list *list)
+{
+    listEmpty(list);
     zfree(list);
 }
 
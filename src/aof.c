@@ -39,6 +39,7 @@
 #include <sys/resource.h>
 #include <sys/wait.h>
 #include <sys/param.h>
+#include <pthread.h>
 
 void aofUpdateCurrentSize(void);
 void aofClosePipes(void);
@@ -113,6 +114,13 @@ void aofChildWriteDiffData(aeEventLoop *el, int fd, void *privdata, int mask) {
             nwritten = write(server.aof_pipe_write_data_to_child,
                              block->buf,block->used);
             if (nwritten <= 0) return;
+            /* The child appends the diff after its last checksum trailer:
+             * it is the start of the open segment of the rewritten AOF. */
+            if (server.aof_checksum) {
+                server.aof_child_diff_crc = crc64(server.aof_child_diff_crc,
+                    (unsigned char*)block->buf,nwritten);
+            }
+            server.aof_child_diff_bytes += nwritten;
             memmove(block->buf,block->buf+nwritten,block->used-nwritten);
             block->used -= nwritten;
         }
@@ -169,8 +177,9 @@ void aofRewriteBufferAppend(unsigned char *s, unsigned long len) {
 
 /* Write the buffer (possibly composed of multiple blocks) into the specified
  * fd. If a short write or any other error happens -1 is returned,
- * otherwise the number of bytes written is returned. */
-ssize_t aofRewriteBufferWrite(int fd) {
+ * otherwise the number of bytes written is returned. The checksum of the
+ * written data is accumulated into '*crc'. */
+ssize_t aofRewriteBufferWrite(int fd, uint64_t *crc) {
     listNode *ln;
     listIter li;
     ssize_t count = 0;
@@ -186,12 +195,1077 @@ ssize_t aofRewriteBufferWrite(int fd) {
                 if (nwritten == 0) errno = EIO;
                 return -1;
             }
+            *crc = crc64(*crc,(unsigned char*)block->buf,block->used);
             count += nwritten;
         }
     }
     return count;
 }
 
+/* ----------------------------------------------------------------------------
+ * AOF writer thread
+ *
+ * When aof-writer-thread is enabled the main thread never calls write(2) or
+ * fsync(2) against the AOF file: before re-entering the event loop it just
+ * moves the content of server.aof_buf to the buffer of the writer thread,
+ * that performs the write and the fsync according to the fsync policy.
+ *
+ * Every byte handed to the writer has an offset in the AOF stream. The
+ * writer thread tracks the offset written to the file and the offset that
+ * is durable according to the fsync policy, and wakes up the main thread
+ * using a pipe every time it makes progress.
+ *
+ * With "appendfsync always" this allows to implement group commit: the
+ * replies of the clients are not sent as long as the AOF offset that was
+ * current when the reply was created is not durable. Such clients are
+ * parked in server.clients_waiting_aof and are put back in the list of
+ * clients with pending writes as soon as the writer thread fsynced enough
+ * data. The event loop never blocks, and a single fsync acknowledges all
+ * the writes performed in the meantime.
+ * ------------------------------------------------------------------------- */
+
+#define AOF_WRITER_HIST_BUCKETS 24 /* Latency buckets: <1us, <2us, ..., inf */
+
+static struct aofWriter {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t job_cond;    /* Signaled when there is new data to write. */
+    pthread_cond_t idle_cond;   /* Signaled when the writer does no I/O. */
+    sds buf;                    /* Data handed by the main thread. */
+    int fd;                     /* File descriptor 'buf' must be written to. */
+    int fsync_policy;           /* server.aof_fsync at the time of hand off. */
+    int no_fsync;               /* No fsync because of children doing I/O. */
+    int busy;                   /* True while writing or fsyncing. */
+    int paused;                 /* DEBUG AOF-WRITER-PAUSE: don't do I/O. */
+    int write_errno;            /* errno of the last failed write, or 0. */
+    long long written;          /* Offset written to the AOF file. */
+    long long durable;          /* Offset durable according to the policy. */
+    time_t last_fsync;          /* UNIX time of last fsync(). */
+    long long max_write_usec;   /* Slowest write since the last notification. */
+    long long max_fsync_usec;   /* Slowest fsync since the last notification. */
+    unsigned long long fsyncs;  /* Number of fsync() calls performed. */
+    unsigned long long write_hist[AOF_WRITER_HIST_BUCKETS];
+    unsigned long long fsync_hist[AOF_WRITER_HIST_BUCKETS];
+    int notify_pipe[2];         /* Writer -> main thread notifications. */
+} aofw;
+
+/* Account a write or fsync latency into the histogram 'hist'. Bucket N
+ * counts the operations that took less than 2^N microseconds, the last
+ * bucket counts all the slower ones. */
+static void aofWriterHistAdd(unsigned long long *hist, long long usec) {
+    int j = 0;
+
+    while (j < AOF_WRITER_HIST_BUCKETS-1 && usec >= (1LL<<j)) j++;
+    hist[j]++;
+}
+
+/* Wake up the main thread. The pipe is non blocking: if it is full the
+ * main thread has a notification to process already. */
+static void aofWriterNotify(void) {
+    if (write(aofw.notify_pipe[1],"x",1) == -1) {
+        /* Nothing to do, see the top comment. */
+    }
+}
+
+/* Write 'buf' to 'fd', retrying on short writes. On error the number of
+ * bytes written before the error is returned and errno is set. */
+static ssize_t aofWriterWrite(int fd, sds buf) {
+    size_t len = sdslen(buf), nwritten = 0;
+    long long start, usec;
+
+    while (nwritten < len) {
+        ssize_t n;
+
+        start = ustime();
+        n = write(fd,buf+nwritten,len-nwritten);
+        usec = ustime()-start;
+        pthread_mutex_lock(&aofw.mutex);
+        aofWriterHistAdd(aofw.write_hist,usec);
+        if (usec > aofw.max_write_usec) aofw.max_write_usec = usec;
+        pthread_mutex_unlock(&aofw.mutex);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return nwritten;
+        }
+        nwritten += n;
+    }
+    return nwritten;
+}
+
+/* Perform the fsync of 'fd' accounting its latency. */
+static void aofWriterFsync(int fd) {
+    long long start = ustime(), usec;
+
+    aof_fsync(fd);
+    usec = ustime()-start;
+    pthread_mutex_lock(&aofw.mutex);
+    aofWriterHistAdd(aofw.fsync_hist,usec);
+    if (usec > aofw.max_fsync_usec) aofw.max_fsync_usec = usec;
+    aofw.fsyncs++;
+    pthread_mutex_unlock(&aofw.mutex);
+}
+
+/* Return true if the writer has written data that, with the "everysec"
+ * policy, still needs an fsync. Called with the mutex locked. */
+static int aofWriterNeedsEverysecFsync(void) {
+    return aofw.fd != -1 && aofw.durable < aofw.written &&
+           aofw.fsync_policy == AOF_FSYNC_EVERYSEC && !aofw.no_fsync;
+}
+
+static void *aofWriterMain(void *arg) {
+    sds buf = sdsempty();
+    sigset_t sigset;
+    UNUSED(arg);
+
+    /* Block SIGALRM so we are sure that only the main thread will
+     * receive the watchdog signal. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    if (pthread_sigmask(SIG_BLOCK, &sigset, NULL))
+        serverLog(LL_WARNING,
+            "Warning: can't mask SIGALRM in the AOF writer thread: %s",
+            strerror(errno));
+
+    pthread_mutex_lock(&aofw.mutex);
+    while(1) {
+        int fd, policy, no_fsync, dofsync, err = 0;
+        ssize_t nwritten;
+        size_t len;
+        time_t now;
+
+        /* Wait for data to write. With the everysec policy, wake up once
+         * per second in order to fsync the data written so far. After a
+         * write error, retry once per second. */
+        while (sdslen(aofw.buf) == 0 || aofw.write_errno) {
+            if (aofWriterNeedsEverysecFsync() || aofw.write_errno) {
+                struct timespec deadline;
+
+                if (!aofw.write_errno && time(NULL) > aofw.last_fsync) break;
+                clock_gettime(CLOCK_REALTIME,&deadline);
+                deadline.tv_sec += 1;
+                if (pthread_cond_timedwait(&aofw.job_cond,&aofw.mutex,
+                    &deadline) == ETIMEDOUT && aofw.write_errno) break;
+            } else {
+                pthread_cond_wait(&aofw.job_cond,&aofw.mutex);
+            }
+        }
+        while (aofw.paused) pthread_cond_wait(&aofw.job_cond,&aofw.mutex);
+
+        /* Take the buffer, so that the main thread can keep appending
+         * while we do I/O without holding the lock. */
+        sds tmp = aofw.buf;
+        aofw.buf = buf;
+        buf = tmp;
+        fd = aofw.fd;
+        policy = aofw.fsync_policy;
+        no_fsync = aofw.no_fsync;
+        aofw.busy = 1;
+        pthread_mutex_unlock(&aofw.mutex);
+
+        len = sdslen(buf);
+        nwritten = aofWriterWrite(fd,buf);
+        if ((size_t)nwritten != len) err = errno;
+
+        now = time(NULL);
+        dofsync = !err && !no_fsync &&
+                  (policy == AOF_FSYNC_ALWAYS ||
+                   (policy == AOF_FSYNC_EVERYSEC && now > aofw.last_fsync));
+        if (dofsync) aofWriterFsync(fd);
+
+        pthread_mutex_lock(&aofw.mutex);
+        /* The main thread only needs to be woken up for group commit, or
+         * when the error state changes: everything else is collected by
+         * serverCron(). */
+        int notify = policy == AOF_FSYNC_ALWAYS || err != aofw.write_errno;
+        aofw.written += nwritten;
+        if (dofsync) {
+            aofw.durable = aofw.written;
+            aofw.last_fsync = now;
+        } else if (policy == AOF_FSYNC_NO || no_fsync) {
+            aofw.durable = aofw.written;
+        }
+        aofw.write_errno = err;
+        if (err) {
+            /* Put what we were not able to write in front of the data
+             * the main thread handed us in the meantime. */
+            sdsrange(buf,nwritten,-1);
+            buf = sdscatsds(buf,aofw.buf);
+            tmp = aofw.buf;
+            aofw.buf = buf;
+            buf = tmp;
+        }
+        /* Re-use the buffer when it is small enough, like the main thread
+         * does with server.aof_buf. */
+        if ((sdslen(buf)+sdsavail(buf)) < 4000) {
+            sdsclear(buf);
+        } else {
+            sdsfree(buf);
+            buf = sdsempty();
+        }
+        aofw.busy = 0;
+        pthread_cond_broadcast(&aofw.idle_cond);
+        if (notify) aofWriterNotify();
+    }
+    return NULL;
+}
+
+/* Create the writer thread and the notification pipe. Called at startup
+ * when aof-writer-thread is enabled. */
+void aofWriterInit(void) {
+    pthread_attr_t attr;
+    size_t stacksize;
+
+    pthread_mutex_init(&aofw.mutex,NULL);
+    pthread_cond_init(&aofw.job_cond,NULL);
+    pthread_cond_init(&aofw.idle_cond,NULL);
+    aofw.buf = sdsempty();
+    aofw.fd = -1;
+    aofw.fsync_policy = server.aof_fsync;
+    aofw.last_fsync = time(NULL);
+
+    if (pipe(aofw.notify_pipe) == -1 ||
+        anetNonBlock(NULL,aofw.notify_pipe[0]) != ANET_OK ||
+        anetNonBlock(NULL,aofw.notify_pipe[1]) != ANET_OK ||
+        aeCreateFileEvent(server.el,aofw.notify_pipe[0],AE_READABLE,
+            aofWriterNotifyReadable,NULL) == AE_ERR)
+    {
+        serverLog(LL_WARNING,
+            "Can't create the AOF writer thread notification pipe: %s",
+            strerror(errno));
+        exit(1);
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_getstacksize(&attr,&stacksize);
+    if (!stacksize) stacksize = 1; /* The world is full of Solaris Fixes */
+    while (stacksize < REDIS_THREAD_STACK_SIZE) stacksize *= 2;
+    pthread_attr_setstacksize(&attr, stacksize);
+    if (pthread_create(&aofw.thread,&attr,aofWriterMain,NULL) != 0) {
+        serverLog(LL_WARNING,"Fatal: Can't initialize the AOF writer thread.");
+        exit(1);
+    }
+}
+
+/* Move the content of server.aof_buf to the writer thread. */
+void aofWriterEnqueue(void) {
+    size_t len = sdslen(server.aof_buf);
+
+    pthread_mutex_lock(&aofw.mutex);
+    if (sdslen(aofw.buf) == 0) {
+        sds tmp = aofw.buf;
+        aofw.buf = server.aof_buf;
+        server.aof_buf = tmp;
+    } else {
+        aofw.buf = sdscatsds(aofw.buf,server.aof_buf);
+        sdsclear(server.aof_buf);
+    }
+    aofw.fd = server.aof_fd;
+    aofw.fsync_policy = server.aof_fsync;
+    aofw.no_fsync = server.aof_no_fsync_on_rewrite &&
+        (server.aof_child_pid != -1 || server.rdb_child_pid != -1);
+    pthread_cond_signal(&aofw.job_cond);
+    pthread_mutex_unlock(&aofw.mutex);
+
+    server.aof_enqueued_offset += len;
+    server.aof_current_size += len;
+}
+
+/* Wait for the writer thread to write all the data handed to it so far,
+ * and detach it from the current AOF file descriptor, so that the caller
+ * can fsync, close or replace it. If the writer is not able to write
+ * because of an error, the pending data is discarded.
+ *
+ * Since all the callers fsync the file or replace it with a file that was
+ * just fsynced, all the data is considered durable on return, and all
+ * the clients waiting for the AOF are released. */
+void aofWriterDrain(void) {
+    long long start = ustime();
+
+    pthread_mutex_lock(&aofw.mutex);
+    if (aofw.paused) {
+        aofw.paused = 0;
+        pthread_cond_signal(&aofw.job_cond);
+    }
+    while ((sdslen(aofw.buf) && !aofw.write_errno) || aofw.busy)
+        pthread_cond_wait(&aofw.idle_cond,&aofw.mutex);
+    if (sdslen(aofw.buf)) {
+        serverLog(LL_WARNING,"Discarding %zu bytes the AOF writer thread was "
+            "unable to write: %s", sdslen(aofw.buf), strerror(aofw.write_errno));
+        sdsclear(aofw.buf);
+        aofw.write_errno = 0;
+    }
+    aofw.fd = -1;
+    aofw.written = aofw.durable = server.aof_enqueued_offset;
+    pthread_mutex_unlock(&aofw.mutex);
+
+    latencyAddSampleIfNeeded("aof-writer-drain",(ustime()-start)/1000);
+    server.aof_durable_offset = server.aof_enqueued_offset;
+    aofReleaseClientsWaitingFsync();
+}
+
+/* Account 'len' bytes of the AOF stream that will never reach the writer
+ * thread, because they were written to the AOF by other means, as
+ * durable. */
+void aofWriterSkip(size_t len) {
+    server.aof_enqueued_offset += len;
+    pthread_mutex_lock(&aofw.mutex);
+    aofw.written = aofw.durable = server.aof_enqueued_offset;
+    pthread_mutex_unlock(&aofw.mutex);
+    server.aof_durable_offset = server.aof_enqueued_offset;
+    aofReleaseClientsWaitingFsync();
+}
+
+/* Pause or resume the I/O of the writer thread. This is only used by
+ * DEBUG AOF-WRITER-PAUSE in order to test the group commit. */
+void aofWriterSetPaused(int paused) {
+    pthread_mutex_lock(&aofw.mutex);
+    aofw.paused = paused;
+    pthread_cond_signal(&aofw.job_cond);
+    pthread_mutex_unlock(&aofw.mutex);
+}
+
+/* With the writer thread and "appendfsync always", the replies of the
+ * client 'c' can be sent only once the AOF is durable up to the current
+ * offset, including the data not yet handed to the thread: they may
+ * depend on writes that are not yet on disk. Called every time a reply is
+ * built, and again once the command that built it was propagated, so
+ * that the reply also waits for the command's own write. */
+void aofUpdateClientWaitOffset(client *c) {
+    long long offset;
+
+    if (!server.aof_writer_thread || server.aof_fsync != AOF_FSYNC_ALWAYS ||
+        server.aof_state != AOF_ON) return;
+    if (c->flags & (CLIENT_LUA|CLIENT_MODULE|CLIENT_SLAVE|CLIENT_MASTER) ||
+        c->fd <= 0) return;
+
+    offset = server.aof_enqueued_offset+sdslen(server.aof_buf);
+    if (offset > c->aof_wait_offset) c->aof_wait_offset = offset;
+}
+
+/* Put back in the list of clients with pending writes the clients parked
+ * waiting for an AOF offset that is now durable. */
+void aofReleaseClientsWaitingFsync(void) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.clients_waiting_aof,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+
+        if (c->aof_wait_offset > server.aof_durable_offset) continue;
+        listDelNode(server.clients_waiting_aof,ln);
+        c->flags &= ~CLIENT_PENDING_AOF_FSYNC;
+        server.stat_aof_group_commit_clients++;
+        if (!(c->flags & CLIENT_PENDING_WRITE)) {
+            c->flags |= CLIENT_PENDING_WRITE;
+            listAddNodeHead(server.clients_pending_write,c);
+        }
+    }
+}
+
+/* Remove from the list of clients with pending writes the clients whose
+ * replies depend on AOF data that is not durable yet, and park them
+ * in server.clients_waiting_aof. Called before writing the replies. */
+void aofParkClientsWaitingFsync(void) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.clients_pending_write,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+
+        if (c->aof_wait_offset <= server.aof_durable_offset) continue;
+        c->flags &= ~CLIENT_PENDING_WRITE;
+        listDelNode(server.clients_pending_write,ln);
+        aofParkClient(c);
+    }
+}
+
+/* Park the client 'c' waiting for its AOF offset to be durable. */
+void aofParkClient(client *c) {
+    if (c->flags & CLIENT_PENDING_AOF_FSYNC) return;
+    aeDeleteFileEvent(server.el,c->fd,AE_WRITABLE);
+    c->flags |= CLIENT_PENDING_AOF_FSYNC;
+    listAddNodeTail(server.clients_waiting_aof,c);
+}
+
+/* Fetch the offsets and errors of the writer thread, and release the
+ * clients waiting for the AOF to be durable. Called when the writer thread
+ * notifies the main thread, and from serverCron(). */
+void aofWriterCollect(void) {
+    long long durable, max_write_usec, max_fsync_usec;
+    int write_errno;
+
+    pthread_mutex_lock(&aofw.mutex);
+    durable = aofw.durable;
+    write_errno = aofw.write_errno;
+    max_write_usec = aofw.max_write_usec;
+    max_fsync_usec = aofw.max_fsync_usec;
+    aofw.max_write_usec = aofw.max_fsync_usec = 0;
+    pthread_mutex_unlock(&aofw.mutex);
+
+    latencyAddSampleIfNeeded("aof-write-thread",max_write_usec/1000);
+    latencyAddSampleIfNeeded("aof-fsync-thread",max_fsync_usec/1000);
+
+    if (write_errno) {
+        if (server.aof_fsync == AOF_FSYNC_ALWAYS) {
+            /* Like in flushAppendOnlyFile(), we can't recover when the
+             * fsync policy is 'always'. */
+            serverLog(LL_WARNING,"Error writing to the AOF file: %s",
+                strerror(write_errno));
+            serverLog(LL_WARNING,"Can't recover from AOF write error when the AOF fsync policy is 'always'. Exiting...");
+            exit(1);
+        }
+        if (server.aof_last_write_status == C_OK) {
+            serverLog(LL_WARNING,"Error writing to the AOF file: %s",
+                strerror(write_errno));
+        }
+        server.aof_last_write_status = C_ERR;
+        server.aof_last_write_errno = write_errno;
+    } else if (server.aof_last_write_status == C_ERR) {
+        serverLog(LL_WARNING,
+            "AOF write error looks solved, Redis can write again.");
+        server.aof_last_write_status = C_OK;
+    }
+
+    if (durable > server.aof_durable_offset) {
+        server.aof_durable_offset = durable;
+        aofReleaseClientsWaitingFsync();
+    }
+}
+
+/* Read handler of the pipe used by the writer thread to notify progress. */
+void aofWriterNotifyReadable(aeEventLoop *el, int fd, void *privdata, int mask) {
+    char buf[128];
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    while (read(fd,buf,sizeof(buf)) > 0);
+    aofWriterCollect();
+}
+
+/* Append to 'info' the name:value line with the not empty buckets of the
+ * latency histogram 'hist'. */
+static sds aofWriterCatHist(sds info, const char *name,
+                            unsigned long long *hist)
+{
+    int j, first = 1;
+
+    info = sdscatprintf(info,"%s:",name);
+    for (j = 0; j < AOF_WRITER_HIST_BUCKETS; j++) {
+        if (hist[j] == 0) continue;
+        if (j == AOF_WRITER_HIST_BUCKETS-1)
+            info = sdscatprintf(info,"%slt_inf=%llu",first ? "" : ",",
+                hist[j]);
+        else
+            info = sdscatprintf(info,"%slt_%llu=%llu",first ? "" : ",",
+                1ULL<<j, hist[j]);
+        first = 0;
+    }
+    return sdscatlen(info,"\r\n",2);
+}
+
+/* Append the AOF writer thread fields to the INFO persistence section. */
+sds genAofWriterInfoString(sds info) {
+    unsigned long long write_hist[AOF_WRITER_HIST_BUCKETS];
+    unsigned long long fsync_hist[AOF_WRITER_HIST_BUCKETS];
+    unsigned long long fsyncs;
+    size_t pending;
+    long long written, durable;
+
+    pthread_mutex_lock(&aofw.mutex);
+    memcpy(write_hist,aofw.write_hist,sizeof(write_hist));
+    memcpy(fsync_hist,aofw.fsync_hist,sizeof(fsync_hist));
+    fsyncs = aofw.fsyncs;
+    pending = sdslen(aofw.buf);
+    written = aofw.written;
+    durable = aofw.durable;
+    pthread_mutex_unlock(&aofw.mutex);
+
+    info = sdscatprintf(info,
+        "aof_writer_pending_bytes:%zu\r\n"
+        "aof_writer_enqueued_offset:%lld\r\n"
+        "aof_writer_written_offset:%lld\r\n"
+        "aof_writer_durable_offset:%lld\r\n"
+        "aof_writer_fsyncs:%llu\r\n"
+        "aof_writer_waiting_clients:%lu\r\n"
+        "aof_group_commit_clients:%lld\r\n",
+        pending,
+        server.aof_enqueued_offset,
+        written,
+        durable,
+        fsyncs,
+        listLength(server.clients_waiting_aof),
+        server.stat_aof_group_commit_clients);
+    info = aofWriterCatHist(info,"aof_write_latency_usec",write_hist);
+    info = aofWriterCatHist(info,"aof_fsync_latency_usec",fsync_hist);
+    return info;
+}
+
+/* ----------------------------------------------------------------------------
+ * AOF checksums
+ *
+ * When aof-checksum is enabled the AOF is divided into segments of about AOF_CHECKSUM_SEGMENT_BYTES, and
+ * every segment is terminated by a trailer line with the CRC64 of its
+ * content:
+ *
+ *   #CRC64:<16 hex digits>\r\n
+ *
+ * The first segment starts at the beginning of the file, or just after the
+ * RDB preamble (that has its own checksum), and every other segment just
+ * after the trailer of the previous one. The data after the last trailer is
+ * the open segment the server is still appending to.
+ *
+ * When loading, every trailer is verified regardless of the option, so that
+ * a corruption is detected even when the damaged data is still well formed,
+ * and the files that must be complete, like the BASE file of a multi part
+ * AOF, are required to end with a trailer if they contain any, so that a
+ * truncation happening exactly at a command boundary is detected as well.
+ *
+ * Note that the trailers are a format change: older Redis versions can't
+ * load an AOF containing them, even after the option is turned off. This
+ * is why the option is disabled by default, and can only be set at
+ * startup, since enabling it in the middle of a segment would produce a
+ * wrong checksum.
+ * ------------------------------------------------------------------------- */
+
+/* Append to 'buf' the checksum trailer for a segment with checksum 'crc'. */
+sds catAofChecksumTrailer(sds buf, uint64_t crc) {
+    return sdscatprintf(buf,"%s%016llx\r\n",AOF_CHECKSUM_PREFIX,
+        (unsigned long long)crc);
+}
+
+/* Parse the checksum trailer at 'line' (without the final newline). Returns
+ * 1 and sets '*crc' on success, 0 if the line is not a valid trailer. */
+int parseAofChecksumTrailer(const char *line, size_t len, uint64_t *crc) {
+    unsigned long long value = 0;
+    size_t j;
+
+    if (len > 0 && line[len-1] == '\r') len--;
+    if (len != AOF_CHECKSUM_PREFIX_LEN+16 ||
+        memcmp(line,AOF_CHECKSUM_PREFIX,AOF_CHECKSUM_PREFIX_LEN) != 0)
+        return 0;
+    for (j = AOF_CHECKSUM_PREFIX_LEN; j < len; j++) {
+        char c = line[j];
+        if (c >= '0' && c <= '9') value = (value<<4)|(c-'0');
+        else if (c >= 'a' && c <= 'f') value = (value<<4)|(c-'a'+10);
+        else if (c >= 'A' && c <= 'F') value = (value<<4)|(c-'A'+10);
+        else return 0;
+    }
+    *crc = value;
+    return 1;
+}
+
+/* Terminate the open segment of the AOF with its checksum trailer, unless
+ * the segment is empty. */
+void aofChecksumSeal(void) {
+    if (!server.aof_checksum || server.aof_segment_bytes == 0) return;
+    server.aof_buf = catAofChecksumTrailer(server.aof_buf,
+                                           server.aof_segment_crc);
+    server.aof_segment_crc = 0;
+    server.aof_segment_bytes = 0;
+}
+
+/* Account the 'len' bytes at 'buf', just appended to server.aof_buf, to the
+ * open segment, sealing it once it is big enough. */
+static void aofChecksumFeed(const char *buf, size_t len) {
+    if (!server.aof_checksum) return;
+    server.aof_segment_crc = crc64(server.aof_segment_crc,
+                                   (const unsigned char*)buf,len);
+    server.aof_segment_bytes += len;
+    if (server.aof_segment_bytes >= AOF_CHECKSUM_SEGMENT_BYTES)
+        aofChecksumSeal();
+}
+
+/* ----------------------------------------------------------------------------
+ * Multi part AOF
+ *
+ * When aof-multi-part is enabled the AOF is not a single file, but a set of
+ * files stored in the directory 'appenddirname':
+ *
+ * - A BASE file, the output of the latest rewrite. It contains either an
+ *   RDB payload or commands, depending on aof-use-rdb-preamble.
+ * - One or more INCR files, containing the commands executed after the
+ *   BASE file was produced, in order.
+ * - A manifest listing the files above, one per line, in the form:
+ *
+ *   file <name> seq <seq> type <b|i>
+ *
+ * A rewrite just opens a new INCR file, where the parent keeps appending
+ * commands, while the child writes the new BASE file. When the child is
+ * done the manifest is atomically replaced with one referencing the new
+ * BASE and the INCR files opened since the fork, and the old files are
+ * deleted. The parent never needs to accumulate the differences in the
+ * rewrite buffer and to send them to the child.
+ * ------------------------------------------------------------------------- */
+
+#define AOF_MANIFEST_LINE_MAX 1024
+
+aofManifest *aofManifestCreate(void) {
+    aofManifest *am = zcalloc(sizeof(*am));
+    am->incr_list = listCreate();
+    return am;
+}
+
+static aofFile *aofFileCreate(sds name, long long seq, int type) {
+    aofFile *af = zmalloc(sizeof(*af));
+    af->name = name;
+    af->seq = seq;
+    af->type = type;
+    return af;
+}
+
+static void aofFileFree(aofFile *af) {
+    sdsfree(af->name);
+    zfree(af);
+}
+
+void aofManifestFree(aofManifest *am) {
+    listIter li;
+    listNode *ln;
+
+    if (am->base) aofFileFree(am->base);
+    listRewind(am->incr_list,&li);
+    while((ln = listNext(&li))) aofFileFree(listNodeValue(ln));
+    listRelease(am->incr_list);
+    zfree(am);
+}
+
+static aofManifest *aofManifestDup(aofManifest *orig) {
+    aofManifest *am = aofManifestCreate();
+    listIter li;
+    listNode *ln;
+
+    if (orig->base) {
+        am->base = aofFileCreate(sdsdup(orig->base->name),orig->base->seq,
+                                 AOF_FILE_TYPE_BASE);
+    }
+    listRewind(orig->incr_list,&li);
+    while((ln = listNext(&li))) {
+        aofFile *af = listNodeValue(ln);
+        listAddNodeTail(am->incr_list,
+            aofFileCreate(sdsdup(af->name),af->seq,AOF_FILE_TYPE_INCR));
+    }
+    am->curr_base_seq = orig->curr_base_seq;
+    am->curr_incr_seq = orig->curr_incr_seq;
+    return am;
+}
+
+/* Return the path of the AOF file 'name' inside appenddirname. The
+ * returned sds string should be freed by the caller. */
+sds aofFilePath(const char *name) {
+    return sdscatfmt(sdsempty(),"%s/%s",server.aof_dirname,name);
+}
+
+static sds aofManifestPath(void) {
+    sds name = sdscatfmt(sdsempty(),"%s.manifest",server.aof_filename);
+    sds path = aofFilePath(name);
+    sdsfree(name);
+    return path;
+}
+
+/* Load the manifest from appenddirname into server.aof_manifest. A missing
+ * manifest results into an empty one, while a corrupted manifest is a
+ * fatal error, since we can't know which files make the AOF. */
+void aofLoadManifestFromDisk(void) {
+    aofManifest *am = aofManifestCreate();
+    sds path = aofManifestPath();
+    char buf[AOF_MANIFEST_LINE_MAX];
+    int linenum = 0;
+    FILE *fp;
+
+    if ((fp = fopen(path,"r")) == NULL) {
+        if (errno != ENOENT) {
+            serverLog(LL_WARNING,"Fatal error: can't open the AOF manifest "
+                "%s for reading: %s", path, strerror(errno));
+            exit(1);
+        }
+        goto done;
+    }
+
+    while(fgets(buf,sizeof(buf),fp) != NULL) {
+        sds *argv, line = sdstrim(sdsnew(buf)," \t\r\n");
+        int argc, type;
+        long long seq;
+
+        linenum++;
+        if (sdslen(line) == 0) {
+            sdsfree(line);
+            continue;
+        }
+        argv = sdssplitargs(line,&argc);
+        sdsfree(line);
+        if (argv == NULL || argc != 6 || strcmp(argv[0],"file") ||
+            strcmp(argv[2],"seq") || strcmp(argv[4],"type") ||
+            string2ll(argv[3],sdslen(argv[3]),&seq) == 0 || seq <= 0 ||
+            sdslen(argv[5]) != 1 ||
+            (argv[5][0] != AOF_FILE_TYPE_BASE &&
+             argv[5][0] != AOF_FILE_TYPE_INCR) ||
+            (argv[5][0] == AOF_FILE_TYPE_BASE && am->base))
+        {
+            serverLog(LL_WARNING,"Fatal error: invalid line %d in the AOF "
+                "manifest %s", linenum, path);
+            exit(1);
+        }
+        type = argv[5][0];
+        if (type == AOF_FILE_TYPE_BASE) {
+            am->base = aofFileCreate(sdsdup(argv[1]),seq,type);
+            if (seq > am->curr_base_seq) am->curr_base_seq = seq;
+        } else {
+            listAddNodeTail(am->incr_list,
+                aofFileCreate(sdsdup(argv[1]),seq,type));
+            if (seq > am->curr_incr_seq) am->curr_incr_seq = seq;
+        }
+        sdsfreesplitres(argv,argc);
+    }
+    fclose(fp);
+
+done:
+    sdsfree(path);
+    if (server.aof_manifest) aofManifestFree(server.aof_manifest);
+    server.aof_manifest = am;
+}
+
+/* Write the manifest 'am' to disk, atomically replacing the old one.
+ * Returns C_OK on success, C_ERR on error. */
+int aofPersistManifest(aofManifest *am) {
+    sds path = aofManifestPath();
+    sds tmppath = sdscatfmt(sdsempty(),"%s/temp-%s.manifest",
+                            server.aof_dirname,server.aof_filename);
+    sds content = sdsempty();
+    listIter li;
+    listNode *ln;
+    int fd = -1, retval = C_ERR;
+
+    if (am->base) {
+        content = sdscatprintf(content,"file %s seq %lld type %c\n",
+            am->base->name,am->base->seq,AOF_FILE_TYPE_BASE);
+    }
+    listRewind(am->incr_list,&li);
+    while((ln = listNext(&li))) {
+        aofFile *af = listNodeValue(ln);
+        content = sdscatprintf(content,"file %s seq %lld type %c\n",
+            af->name,af->seq,AOF_FILE_TYPE_INCR);
+    }
+
+    if ((fd = open(tmppath,O_WRONLY|O_TRUNC|O_CREAT,0644)) == -1 ||
+        write(fd,content,sdslen(content)) != (ssize_t)sdslen(content) ||
+        aof_fsync(fd) == -1 || rename(tmppath,path) == -1)
+    {
+        serverLog(LL_WARNING,"Error writing the AOF manifest %s: %s",
+            path, strerror(errno));
+        unlink(tmppath);
+        goto cleanup;
+    }
+    retval = C_OK;
+
+cleanup:
+    if (fd != -1) close(fd);
+    sdsfree(content);
+    sdsfree(tmppath);
+    sdsfree(path);
+    return retval;
+}
+
+/* Delete the AOF file 'name' without blocking the server: the file is
+ * unlinked while still open, and the last close(2), that actually
+ * reclaims the space, is performed by a background thread. */
+static void aofDeleteFile(sds name) {
+    sds path = aofFilePath(name);
+    int fd = open(path,O_RDONLY|O_NONBLOCK);
+
+    if (unlink(path) == -1 && errno != ENOENT) {
+        serverLog(LL_WARNING,"Error deleting the old AOF file %s: %s",
+            path, strerror(errno));
+    }
+    if (fd != -1) bioCreateBackgroundJob(BIO_CLOSE_FILE,(void*)(long)fd,NULL,NULL);
+    sdsfree(path);
+}
+
+/* Rotation to a new INCR file waiting for the previous INCR file to be
+ * fsynced, see aofOpenNewIncrFile(). */
+static struct {
+    int fd;                 /* New INCR file, or -1 if no rotation pending. */
+    aofManifest *manifest;  /* Manifest referencing the new INCR file. */
+    time_t failed_time;     /* Last failure persisting the manifest. */
+} aofrot = {-1, NULL, 0};
+
+/* Make 'fd' the target of the AOF writes and 'am' the current manifest.
+ * The old INCR file is closed in background. */
+static void aofSwitchIncrFile(int fd, aofManifest *am) {
+    if (server.aof_fd != -1)
+        bioCreateBackgroundJob(BIO_CLOSE_FILE,(void*)(long)server.aof_fd,NULL,NULL);
+    server.aof_fd = fd;
+    aofManifestFree(server.aof_manifest);
+    server.aof_manifest = am;
+}
+
+/* Create a new INCR file and make it the target of the AOF writes. The
+ * new file is added to the manifest, that is persisted to disk only if
+ * 'persist' is true. Returns C_OK on success, C_ERR on error.
+ *
+ * The new manifest can't be persisted before the old INCR file is on disk,
+ * otherwise after a crash the writes in the new file could be loaded
+ * without some of the writes preceding them. So when there is an old file
+ * it is fsynced in background, and the writes are postponed until
+ * aofCompleteIncrRotation() persists the manifest and switches file. */
+static int aofOpenNewIncrFile(int persist) {
+    aofManifest *am = aofManifestDup(server.aof_manifest);
+    long long seq = am->curr_incr_seq+1;
+    sds name = sdscatfmt(sdsempty(),"%s.%I.incr.aof",server.aof_filename,seq);
+    sds path = aofFilePath(name);
+    int fd;
+
+    fd = open(path,O_WRONLY|O_APPEND|O_CREAT|O_TRUNC,0644);
+    if (fd == -1) {
+        serverLog(LL_WARNING,"Can't open the AOF file %s: %s",
+            path, strerror(errno));
+        goto err;
+    }
+    listAddNodeTail(am->incr_list,aofFileCreate(name,seq,AOF_FILE_TYPE_INCR));
+    name = NULL;
+    am->curr_incr_seq = seq;
+    if (persist && server.aof_fd != -1) {
+        /* Writes still pending for the old file were flushed by the
+         * caller: from now on server.aof_buf belongs to the new file. */
+        bioCreateBackgroundJob(BIO_AOF_FSYNC,(void*)(long)server.aof_fd,NULL,NULL);
+        aofrot.fd = fd;
+        aofrot.manifest = am;
+    } else if (persist && aofPersistManifest(am) == C_ERR) {
+        close(fd);
+        unlink(path);
+        goto err;
+    } else {
+        aofSwitchIncrFile(fd,am);
+    }
+    server.aof_selected_db = -1; /* Make sure SELECT is re-issued */
+    server.aof_segment_crc = 0;
+    server.aof_segment_bytes = 0;
+    sdsfree(path);
+    return C_OK;
+
+err:
+    if (name) sdsfree(name);
+    sdsfree(path);
+    aofManifestFree(am);
+    return C_ERR;
+}
+
+/* Complete the rotation started by aofOpenNewIncrFile(), if any, once the
+ * old INCR file is on disk: if 'wait' is false and the fsync is still in
+ * progress C_ERR is returned. Otherwise the new manifest is persisted and
+ * the writes switch to the new INCR file. Returns C_ERR if the manifest
+ * can't be persisted, in which case the rotation is retried later. */
+static int aofCompleteIncrRotation(int wait) {
+    if (aofrot.fd == -1) return C_OK;
+    if (!wait && (bioPendingJobsOfType(BIO_AOF_FSYNC) ||
+                  aofrot.failed_time == server.unixtime)) return C_ERR;
+    while (bioPendingJobsOfType(BIO_AOF_FSYNC))
+        bioWaitStepOfType(BIO_AOF_FSYNC);
+
+    /* Like for write errors, writes are refused until the manifest can be
+     * persisted: the data would be accumulated in memory meanwhile. */
+    if (aofPersistManifest(aofrot.manifest) == C_ERR) {
+        aofrot.failed_time = server.unixtime;
+        server.aof_last_write_status = C_ERR;
+        server.aof_last_write_errno = errno;
+        return C_ERR;
+    }
+    if (server.aof_last_write_status == C_ERR) {
+        serverLog(LL_WARNING,
+            "AOF write error looks solved, Redis can write again.");
+        server.aof_last_write_status = C_OK;
+    }
+    aofSwitchIncrFile(aofrot.fd,aofrot.manifest);
+    aofrot.fd = -1;
+    aofrot.manifest = NULL;
+    return C_OK;
+}
+
+/* Give up the rotation started by aofOpenNewIncrFile(), if any: the writes
+ * keep going to the old INCR file, that is still referenced by the manifest
+ * on disk. Only safe if no rewrite is going to rely on the rotation. */
+static void aofDiscardIncrRotation(void) {
+    aofFile *af;
+    sds path;
+
+    if (aofrot.fd == -1) return;
+    af = listNodeValue(listLast(aofrot.manifest->incr_list));
+    path = aofFilePath(af->name);
+    close(aofrot.fd);
+    unlink(path);
+    sdsfree(path);
+    aofManifestFree(aofrot.manifest);
+    aofrot.fd = -1;
+    aofrot.manifest = NULL;
+}
+
+/* Called before forking the AOF rewrite child: remember which INCR files
+ * will be covered by the new BASE file, and, if the AOF is enabled, rotate
+ * to a new INCR file that will receive the writes performed from now on. */
+int aofRotateIncrFile(void) {
+    server.aof_rewrite_incr_seq = server.aof_manifest->curr_incr_seq+1;
+    server.aof_rewrite_base_rdb = server.aof_use_rdb_preamble;
+    if (server.aof_state == AOF_OFF) return C_OK;
+
+    /* Everything in server.aof_buf belongs to the old INCR file, that is
+     * terminated with a checksum trailer, if enabled, since it is now
+     * complete. */
+    if (server.aof_fd != -1) {
+        aofChecksumSeal();
+        flushAppendOnlyFile(1);
+    }
+    return aofOpenNewIncrFile(server.aof_state == AOF_ON);
+}
+
+/* Called at startup: load the manifest and, if the AOF is enabled, open the
+ * INCR file to append to. If there is no manifest but a single file AOF
+ * exists, it is moved inside appenddirname and used as first INCR file:
+ * unlike the BASE files, written by rewrites, it may not end with a
+ * checksum trailer. */
+void aofOpenIfNeededOnServerStart(void) {
+    struct redis_stat sb;
+
+    if (mkdir(server.aof_dirname,0755) == -1 && errno != EEXIST) {
+        serverLog(LL_WARNING,"Can't create the AOF directory %s: %s",
+            server.aof_dirname, strerror(errno));
+        exit(1);
+    }
+    aofLoadManifestFromDisk();
+    if (server.aof_state != AOF_ON) return;
+
+    aofManifest *am = server.aof_manifest;
+    if (am->base == NULL && listLength(am->incr_list) == 0 &&
+        redis_stat(server.aof_filename,&sb) == 0)
+    {
+        sds name = sdscatfmt(sdsempty(),"%s.1.incr.aof",server.aof_filename);
+        sds path = aofFilePath(name);
+
+        if (rename(server.aof_filename,path) == -1) {
+            serverLog(LL_WARNING,"Can't move the AOF file %s into %s: %s",
+                server.aof_filename, path, strerror(errno));
+            exit(1);
+        }
+        serverLog(LL_NOTICE,"Upgraded the single file AOF %s to the multi "
+            "part AOF file %s", server.aof_filename, path);
+        listAddNodeTail(am->incr_list,aofFileCreate(name,1,AOF_FILE_TYPE_INCR));
+        am->curr_incr_seq = 1;
+        if (aofPersistManifest(am) == C_ERR) exit(1);
+        sdsfree(path);
+    }
+
+    if (listLength(am->incr_list)) {
+        aofFile *af = listNodeValue(listLast(am->incr_list));
+        sds path = aofFilePath(af->name);
+
+        server.aof_fd = open(path,O_WRONLY|O_APPEND|O_CREAT,0644);
+        if (server.aof_fd == -1) {
+            serverLog(LL_WARNING,"Can't open the append-only file %s: %s",
+                path, strerror(errno));
+            exit(1);
+        }
+        sdsfree(path);
+    } else if (aofOpenNewIncrFile(1) == C_ERR) {
+        exit(1);
+    }
+}
+
+/* Set server.aof_current_size and server.aof_rewrite_base_size according
+ * to the size of the files referenced by the manifest. */
+void aofMultiPartUpdateSizes(void) {
+    aofManifest *am = server.aof_manifest;
+    struct redis_stat sb;
+    listIter li;
+    listNode *ln;
+    off_t size = 0;
+
+    if (am->base) {
+        sds path = aofFilePath(am->base->name);
+        if (redis_stat(path,&sb) == 0) size = sb.st_size;
+        sdsfree(path);
+    }
+    server.aof_rewrite_base_size = size;
+    listRewind(am->incr_list,&li);
+    while((ln = listNext(&li))) {
+        aofFile *af = listNodeValue(ln);
+        sds path = aofFilePath(af->name);
+        if (redis_stat(path,&sb) == 0) size += sb.st_size;
+        sdsfree(path);
+    }
+    server.aof_current_size = size;
+}
+
+/* The rewrite child terminated with success: install the file it produced
+ * as the new BASE file, and drop the old BASE and the INCR files it covers.
+ * Returns C_OK on success, C_ERR on error. */
+int aofMultiPartRewriteDone(char *tmpfile) {
+    aofManifest *am;
+    list *obsolete;
+    listIter li;
+    listNode *ln;
+    sds name, path;
+
+    /* The INCR files covered by the rewrite are the ones before the
+     * rotation performed when it started. */
+    if (aofCompleteIncrRotation(1) == C_ERR) return C_ERR;
+    if (server.aof_manifest->curr_incr_seq < server.aof_rewrite_incr_seq) {
+        serverLog(LL_WARNING,"The AOF rewrite can't be used since the "
+            "writes performed meanwhile went to the old INCR file.");
+        return C_ERR;
+    }
+    am = aofManifestDup(server.aof_manifest);
+    obsolete = listCreate();
+    am->curr_base_seq++;
+    name = sdscatfmt(sdsempty(),"%s.%I.base.%s",server.aof_filename,
+        am->curr_base_seq, server.aof_rewrite_base_rdb ? "rdb" : "aof");
+    if (am->base) {
+        listAddNodeTail(obsolete,am->base->name);
+        zfree(am->base);
+    }
+    am->base = aofFileCreate(name,am->curr_base_seq,AOF_FILE_TYPE_BASE);
+    listRewind(am->incr_list,&li);
+    while((ln = listNext(&li))) {
+        aofFile *af = listNodeValue(ln);
+        if (af->seq >= server.aof_rewrite_incr_seq) continue;
+        listAddNodeTail(obsolete,af->name);
+        zfree(af);
+        listDelNode(am->incr_list,ln);
+    }
+
+    path = aofFilePath(name);
+    if (rename(tmpfile,path) == -1) {
+        serverLog(LL_WARNING,
+            "Error trying to rename the temporary AOF file %s into %s: %s",
+            tmpfile, path, strerror(errno));
+        goto err;
+    }
+    if (aofPersistManifest(am) == C_ERR) {
+        unlink(path);
+        goto err;
+    }
+    aofManifestFree(server.aof_manifest);
+    server.aof_manifest = am;
+
+    listRewind(obsolete,&li);
+    while((ln = listNext(&li))) {
+        aofDeleteFile(listNodeValue(ln));
+        sdsfree(listNodeValue(ln));
+    }
+    listRelease(obsolete);
+    sdsfree(path);
+    aofMultiPartUpdateSizes();
+    return C_OK;
+
+err:
+    listRewind(obsolete,&li);
+    while((ln = listNext(&li))) sdsfree(listNodeValue(ln));
+    listRelease(obsolete);
+    sdsfree(path);
+    aofManifestFree(am);
+    return C_ERR;
+}
+
 /* ----------------------------------------------------------------------------
  * AOF file implementation
  * ------------------------------------------------------------------------- */
@@ -206,6 +1280,7 @@ void aof_background_fsync(int fd) {
  * at runtime using the CONFIG command. */
 void stopAppendOnly(void) {
     serverAssert(server.aof_state != AOF_OFF);
+    aofChecksumSeal();
     flushAppendOnlyFile(1);
     aof_fsync(server.aof_fd);
     close(server.aof_fd);
@@ -238,8 +1313,22 @@ int startAppendOnly(void) {
     char cwd[MAXPATHLEN]; /* Current working dir path for error messages. */
 
     server.aof_last_fsync = server.unixtime;
-    server.aof_fd = open(server.aof_filename,O_WRONLY|O_APPEND|O_CREAT,0644);
     serverAssert(server.aof_state == AOF_OFF);
+    if (server.aof_multi_part) {
+        /* The rewrite opens the INCR file where the writes performed while
+         * it is in progress are appended. */
+        server.aof_state = AOF_WAIT_REWRITE;
+        if (rewriteAppendOnlyFileBackground() == C_ERR) {
+            if (server.aof_fd != -1) close(server.aof_fd);
+            server.aof_fd = -1;
+            server.aof_state = AOF_OFF;
+            serverLog(LL_WARNING,"Redis needs to enable the AOF but can't trigger a background AOF rewrite operation. Check the above logs for more info about the error.");
+            return C_ERR;
+        }
+        return C_OK;
+    }
+
+    server.aof_fd = open(server.aof_filename,O_WRONLY|O_APPEND|O_CREAT,0644);
     if (server.aof_fd == -1) {
         char *cwdp = getcwd(cwd,MAXPATHLEN);
 
@@ -286,6 +1375,32 @@ void flushAppendOnlyFile(int force) {
     int sync_in_progress = 0;
     mstime_t latency;
 
+    /* Nothing can be written to the new INCR file before the rotation is
+     * complete. With 'force', or with the "always" policy where replies
+     * can't be delayed, we wait for the old file to be fsynced. */
+    if (aofCompleteIncrRotation(force ||
+            server.aof_fsync == AOF_FSYNC_ALWAYS) == C_ERR)
+    {
+        if (force) {
+            serverLog(LL_WARNING,"Writing to the old AOF INCR file since "
+                "the new one can't be added to the manifest.");
+            aofDiscardIncrRotation();
+        } else if (server.aof_fsync == AOF_FSYNC_ALWAYS) {
+            serverLog(LL_WARNING,"Can't persist the AOF manifest when the AOF fsync policy is 'always'. Exiting...");
+            exit(1);
+        } else {
+            return;
+        }
+    }
+
+    /* With the writer thread we just hand the buffer to the thread, and
+     * wait for it to complete the write only if 'force' is true. */
+    if (server.aof_writer_thread) {
+        if (sdslen(server.aof_buf)) aofWriterEnqueue();
+        if (force) aofWriterDrain();
+        return;
+    }
+
     if (sdslen(server.aof_buf) == 0) return;
 
     if (server.aof_fsync == AOF_FSYNC_EVERYSEC)
@@ -364,7 +1479,13 @@ void flushAppendOnlyFile(int force) {
                                        (long long)sdslen(server.aof_buf));
             }
 
-            if (ftruncate(server.aof_fd, server.aof_current_size) == -1) {
+            /* With a multi part AOF the current size accounts for all the
+             * files, so we need the size of the INCR file before the write. */
+            off_t valid_size = server.aof_multi_part ?
+                lseek(server.aof_fd,0,SEEK_END) - nwritten :
+                server.aof_current_size;
+
+            if (ftruncate(server.aof_fd, valid_size) == -1) {
                 if (can_log) {
                     serverLog(LL_WARNING, "Could not remove short write "
                              "from the append-only file.  Redis may refuse "
@@ -542,14 +1663,20 @@ void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int a
     /* Append to the AOF buffer. This will be flushed on disk just before
      * of re-entering the event loop, so before the client will get a
      * positive reply about the operation performed. */
-    if (server.aof_state == AOF_ON)
+    if (server.aof_state == AOF_ON ||
+        (server.aof_multi_part && server.aof_state == AOF_WAIT_REWRITE))
+    {
         server.aof_buf = sdscatlen(server.aof_buf,buf,sdslen(buf));
+        aofChecksumFeed(buf,sdslen(buf));
+    }
 
     /* If a background append only file rewriting is in progress we want to
      * accumulate the differences between the child DB and the current one
      * in a buffer, so that when the child process will do its work we
-     * can append the differences to the new append only file. */
-    if (server.aof_child_pid != -1)
+     * can append the differences to the new append only file. This is not
+     * needed with a multi part AOF: the differences are already in the INCR
+     * file opened when the rewrite started. */
+    if (server.aof_child_pid != -1 && !server.aof_multi_part)
         aofRewriteBufferAppend((unsigned char*)buf,sdslen(buf));
 
     sdsfree(buf);
@@ -579,10 +1706,11 @@ struct client *createFakeClient(void) {
     c->replstate = SLAVE_STATE_WAIT_BGSAVE_START;
     c->reply = listCreate();
     c->reply_bytes = 0;
+    c->reply_obj_bytes = 0;
     c->obuf_soft_limit_reached_time = 0;
     c->watched_keys = listCreate();
     c->peerid = NULL;
-    listSetFreeMethod(c->reply,decrRefCountVoid);
+    listSetFreeMethod(c->reply,freeClientReplyValue);
     listSetDupMethod(c->reply,dupClientReplyValue);
     initClientMultiState(c);
     return c;
@@ -604,19 +1732,432 @@ void freeFakeClient(struct client *c) {
     zfree(c);
 }
 
-/* Replay the append log file. On success C_OK is returned. On non fatal
- * error (the append only file is zero-length) C_ERR is returned. On
- * fatal error an error message is logged and the program exists. */
-int loadAppendOnlyFile(char *filename) {
+/* ----------------------------------------------------------------------------
+ * AOF parsing
+ *
+ * The AOF is parsed into batches of commands by aofParseBatch(), either by
+ * the main thread right before executing them, or, when
+ * aof-load-reader-thread is enabled, by a reader thread that keeps parsing
+ * the next batches while the main thread executes the previous ones.
+ *
+ * The parser reads the file with large pread(2) calls instead of stdio,
+ * creates the argument vectors, resolves the command names into commands,
+ * and verifies the checksum trailers, so that the main thread is left
+ * with just the execution of the commands.
+ *
+ * The reader thread only allocates new objects and performs lookups in the
+ * command table, that is not modified while loading, so no other
+ * synchronization is needed.
+ * ------------------------------------------------------------------------- */
+
+#define AOF_LOAD_BUF_BYTES (1024*1024*4) /* Size of the read buffer. */
+#define AOF_LOAD_MAX_LINE 128 /* Max length of the *<argc> and $<len> lines. */
+#define AOF_LOAD_BATCH_CMDS 1024 /* Max commands in a batch. */
+#define AOF_LOAD_BATCH_BYTES (1024*1024) /* Max parsed bytes in a batch. */
+#define AOF_LOAD_BATCHES 4 /* Batches in flight with the reader thread. */
+
+/* Parser status. */
+#define AOF_PARSE_OK 0       /* More commands may follow. */
+#define AOF_PARSE_EOF 1      /* End of file after a complete command. */
+#define AOF_PARSE_UXEOF 2    /* End of file in the middle of a command. */
+#define AOF_PARSE_FMTERR 3   /* Bad file format. */
+#define AOF_PARSE_READERR 4  /* Read error. */
+#define AOF_PARSE_CKSUMERR 5 /* A checksum trailer does not match. */
+
+typedef struct aofLoadCommand {
+    int argc;
+    robj **argv;
+    struct redisCommand *cmd;   /* NULL if the command is unknown. */
+    off_t offset;               /* File offset just after the command. */
+    off_t segment_start;        /* Open checksum segment at 'offset'... */
+    uint64_t segment_crc;       /* ...and its checksum. */
+} aofLoadCommand;
+
+typedef struct aofLoadBatch {
+    aofLoadCommand cmds[AOF_LOAD_BATCH_CMDS];
+    int count;                  /* Number of commands in the batch. */
+    int status;                 /* AOF_PARSE_* after the last command. */
+    int errnum;                 /* errno for AOF_PARSE_READERR. */
+    off_t offset;               /* Offset where the parser stopped... */
+    off_t segment_start;        /* ...the open checksum segment there... */
+    uint64_t segment_crc;       /* ...and its checksum. */
+} aofLoadBatch;
+
+static struct aofLoader {
+    /* Parser state. */
+    int fd;
+    char *buf;                  /* Read buffer. */
+    size_t pos;                 /* Parsing position in 'buf'. */
+    size_t len;                 /* Valid bytes in 'buf'. */
+    size_t crc_pos;             /* Bytes of 'buf' already checksummed. */
+    off_t offset;               /* File offset of buf[0]. */
+    off_t segment_start;        /* File offset of the open segment. */
+    uint64_t segment_crc;       /* Checksum of the open segment. */
+    int eof;                    /* True once pread() returned 0. */
+    int errnum;                 /* errno of the last read error. */
+    struct redisCommand *lastcmd; /* Latest command looked up. */
+    /* Batches, and reader thread. */
+    aofLoadBatch *batches;      /* Ring of batches. */
+    int numbatches;             /* Size of the ring. */
+    long long parsed;           /* Batches parsed so far. */
+    long long executed;         /* Batches executed so far. */
+    int threaded;               /* True if the reader thread is active. */
+    int shutdown;               /* Ask the reader thread to exit. */
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t parsed_cond; /* Signaled when a batch is parsed. */
+    pthread_cond_t free_cond;   /* Signaled when a batch is executed. */
+} aofloader;
+
+/* Add the bytes parsed so far to the checksum of the open segment. */
+static void aofParseUpdateChecksum(void) {
+    if (aofloader.pos > aofloader.crc_pos) {
+        aofloader.segment_crc = crc64(aofloader.segment_crc,
+            (unsigned char*)aofloader.buf+aofloader.crc_pos,
+            aofloader.pos-aofloader.crc_pos);
+        aofloader.crc_pos = aofloader.pos;
+    }
+}
+
+/* Read more data at the end of the buffer, discarding the parsed data.
+ * Returns AOF_PARSE_OK if some data was read, AOF_PARSE_EOF at end of file,
+ * and AOF_PARSE_READERR on errors. */
+static int aofParseFill(void) {
+    ssize_t nread;
+
+    if (aofloader.eof) return AOF_PARSE_EOF;
+    aofParseUpdateChecksum();
+    if (aofloader.pos) {
+        memmove(aofloader.buf,aofloader.buf+aofloader.pos,
+                aofloader.len-aofloader.pos);
+        aofloader.offset += aofloader.pos;
+        aofloader.len -= aofloader.pos;
+        aofloader.pos = aofloader.crc_pos = 0;
+    }
+    nread = pread(aofloader.fd,aofloader.buf+aofloader.len,
+                  AOF_LOAD_BUF_BYTES-aofloader.len,
+                  aofloader.offset+aofloader.len);
+    if (nread == -1) {
+        if (errno == EINTR) return AOF_PARSE_OK;
+        aofloader.errnum = errno;
+        return AOF_PARSE_READERR;
+    }
+    if (nread == 0) {
+        aofloader.eof = 1;
+        return AOF_PARSE_EOF;
+    }
+    aofloader.len += nread;
+    return AOF_PARSE_OK;
+}
+
+/* Make sure at least 'len' unparsed bytes are in the buffer. 'len' should
+ * not be greater than AOF_LOAD_BUF_BYTES. */
+static int aofParseNeed(size_t len) {
+    while (aofloader.len-aofloader.pos < len) {
+        int status = aofParseFill();
+        if (status == AOF_PARSE_EOF) return AOF_PARSE_UXEOF;
+        if (status != AOF_PARSE_OK) return status;
+    }
+    return AOF_PARSE_OK;
+}
+
+/* Parse a line, setting '*line' to its start and '*linelen' to its length
+ * without the final newline. On success the line is consumed and
+ * AOF_PARSE_OK is returned. AOF_PARSE_EOF is returned if there is nothing
+ * more to parse. */
+static int aofParseLine(char **line, size_t *linelen) {
+    char *nl;
+
+    while ((nl = memchr(aofloader.buf+aofloader.pos,'\n',
+                        aofloader.len-aofloader.pos)) == NULL)
+    {
+        size_t pending = aofloader.len-aofloader.pos;
+        int status;
+
+        if (pending > AOF_LOAD_MAX_LINE) return AOF_PARSE_FMTERR;
+        status = aofParseFill();
+        if (status == AOF_PARSE_EOF)
+            return pending ? AOF_PARSE_UXEOF : AOF_PARSE_EOF;
+        if (status != AOF_PARSE_OK) return status;
+    }
+    *line = aofloader.buf+aofloader.pos;
+    *linelen = nl-*line;
+    aofloader.pos += *linelen+1;
+    return AOF_PARSE_OK;
+}
+
+/* Parse a bulk string of 'len' bytes followed by CRLF into '*ptr'. Strings
+ * bigger than the read buffer are read directly into the string. */
+static int aofParseBulk(long long len, sds *ptr) {
+    sds s = sdsnewlen(NULL,len);
+    size_t avail = aofloader.len-aofloader.pos;
+    int status;
+
+    if ((size_t)len+2 <= AOF_LOAD_BUF_BYTES) {
+        if ((status = aofParseNeed(len)) != AOF_PARSE_OK) goto err;
+        memcpy(s,aofloader.buf+aofloader.pos,len);
+        aofloader.pos += len;
+    } else {
+        size_t copied = avail, toread;
+
+        memcpy(s,aofloader.buf+aofloader.pos,copied);
+        aofloader.pos += copied;
+        aofParseUpdateChecksum();
+        aofloader.offset += aofloader.len;
+        aofloader.pos = aofloader.len = aofloader.crc_pos = 0;
+        while (copied < (size_t)len) {
+            ssize_t nread;
+
+            toread = len-copied;
+            nread = pread(aofloader.fd,s+copied,toread,aofloader.offset);
+            if (nread == -1 && errno == EINTR) continue;
+            if (nread <= 0) {
+                if (nread == 0) {
+                    status = AOF_PARSE_UXEOF;
+                } else {
+                    aofloader.errnum = errno;
+                    status = AOF_PARSE_READERR;
+                }
+                goto err;
+            }
+            aofloader.segment_crc = crc64(aofloader.segment_crc,
+                (unsigned char*)s+copied,nread);
+            aofloader.offset += nread;
+            copied += nread;
+        }
+    }
+    /* Discard the CRLF. */
+    if ((status = aofParseNeed(2)) != AOF_PARSE_OK) goto err;
+    aofloader.pos += 2;
+    *ptr = s;
+    return AOF_PARSE_OK;
+
+err:
+    sdsfree(s);
+    return status;
+}
+
+/* Parse the next command into 'lc'. Checksum trailers found before the
+ * command are verified. */
+static int aofParseCommand(aofLoadCommand *lc) {
+    char *line;
+    size_t linelen;
+    long long argc, len;
+    int j, status;
+
+    while(1) {
+        uint64_t crc;
+
+        aofParseUpdateChecksum();
+        if ((status = aofParseLine(&line,&linelen)) != AOF_PARSE_OK)
+            return status;
+        if (line[0] != '#') break;
+
+        /* Checksum trailer. */
+        if (!parseAofChecksumTrailer(line,linelen,&crc))
+            return AOF_PARSE_FMTERR;
+        if (crc != aofloader.segment_crc) return AOF_PARSE_CKSUMERR;
+        aofloader.crc_pos = aofloader.pos;
+        aofloader.segment_crc = 0;
+        aofloader.segment_start = aofloader.offset+aofloader.pos;
+    }
+
+    if (line[0] != '*') return AOF_PARSE_FMTERR;
+    if (string2ll(line+1,linelen-1-(line[linelen-1] == '\r'),&argc) == 0 ||
+        argc < 1 || argc > INT_MAX) return AOF_PARSE_FMTERR;
+
+    lc->argv = zmalloc(sizeof(robj*)*argc);
+    for (j = 0; j < argc; j++) {
+        sds arg;
+
+        if ((status = aofParseLine(&line,&linelen)) != AOF_PARSE_OK) {
+            if (status == AOF_PARSE_EOF) status = AOF_PARSE_UXEOF;
+            goto err;
+        }
+        if (line[0] != '$') {
+            status = AOF_PARSE_FMTERR;
+            goto err;
+        }
+        len = strtoll(line+1,NULL,10);
+        if (len < 0) {
+            status = AOF_PARSE_FMTERR;
+            goto err;
+        }
+        if ((status = aofParseBulk(len,&arg)) != AOF_PARSE_OK) goto err;
+        lc->argv[j] = createObject(OBJ_STRING,arg);
+    }
+    lc->argc = argc;
+
+    /* Command lookup: consecutive commands are often the same. */
+    if (aofloader.lastcmd == NULL ||
+        strcasecmp(aofloader.lastcmd->name,lc->argv[0]->ptr))
+    {
+        aofloader.lastcmd = lookupCommand(lc->argv[0]->ptr);
+    }
+    lc->cmd = aofloader.lastcmd;
+
+    aofParseUpdateChecksum();
+    lc->offset = aofloader.offset+aofloader.pos;
+    lc->segment_start = aofloader.segment_start;
+    lc->segment_crc = aofloader.segment_crc;
+    return AOF_PARSE_OK;
+
+err:
+    while(j--) decrRefCount(lc->argv[j]);
+    zfree(lc->argv);
+    return status;
+}
+
+/* Fill the batch 'b' with the next commands. */
+static void aofParseBatch(aofLoadBatch *b) {
+    off_t start = aofloader.offset+aofloader.pos;
+    int status = AOF_PARSE_OK;
+
+    b->count = 0;
+    while (b->count < AOF_LOAD_BATCH_CMDS &&
+           aofloader.offset+aofloader.pos-start < AOF_LOAD_BATCH_BYTES)
+    {
+        status = aofParseCommand(b->cmds+b->count);
+        if (status != AOF_PARSE_OK) break;
+        b->count++;
+    }
+    aofParseUpdateChecksum();
+    b->status = status;
+    b->errnum = aofloader.errnum;
+    b->offset = aofloader.offset+aofloader.pos;
+    b->segment_start = aofloader.segment_start;
+    b->segment_crc = aofloader.segment_crc;
+}
+
+void *aofReaderThreadMain(void *arg) {
+    UNUSED(arg);
+
+    while(1) {
+        aofLoadBatch *b;
+        int stop;
+
+        pthread_mutex_lock(&aofloader.mutex);
+        while (!aofloader.shutdown &&
+               aofloader.parsed-aofloader.executed == aofloader.numbatches)
+            pthread_cond_wait(&aofloader.free_cond,&aofloader.mutex);
+        stop = aofloader.shutdown;
+        pthread_mutex_unlock(&aofloader.mutex);
+        if (stop) break;
+
+        b = aofloader.batches+(aofloader.parsed % aofloader.numbatches);
+        aofParseBatch(b);
+
+        pthread_mutex_lock(&aofloader.mutex);
+        aofloader.parsed++;
+        pthread_cond_signal(&aofloader.parsed_cond);
+        pthread_mutex_unlock(&aofloader.mutex);
+        if (b->status != AOF_PARSE_OK) break;
+    }
+    return NULL;
+}
+
+/* Start parsing the AOF open as 'fd' from 'offset'. */
+static void aofLoaderStart(int fd, off_t offset) {
+    aofloader.fd = fd;
+    aofloader.buf = zmalloc(AOF_LOAD_BUF_BYTES);
+    aofloader.pos = aofloader.len = aofloader.crc_pos = 0;
+    aofloader.offset = aofloader.segment_start = offset;
+    aofloader.segment_crc = 0;
+    aofloader.eof = 0;
+    aofloader.errnum = 0;
+    aofloader.lastcmd = NULL;
+    aofloader.threaded = server.aof_load_reader_thread;
+    aofloader.numbatches = aofloader.threaded ? AOF_LOAD_BATCHES : 1;
+    aofloader.batches = zmalloc(sizeof(aofLoadBatch)*aofloader.numbatches);
+    aofloader.parsed = aofloader.executed = 0;
+    aofloader.shutdown = 0;
+    if (!aofloader.threaded) return;
+
+    /* The reader thread looks up the command table: make sure it is not
+     * modified by incremental rehashing while the thread is running. */
+    while (dictIsRehashing(server.commands)) dictRehash(server.commands,100);
+    pthread_mutex_init(&aofloader.mutex,NULL);
+    pthread_cond_init(&aofloader.parsed_cond,NULL);
+    pthread_cond_init(&aofloader.free_cond,NULL);
+    if (pthread_create(&aofloader.thread,NULL,aofReaderThreadMain,NULL)) {
+        serverLog(LL_WARNING,"Fatal: Can't initialize the AOF reader thread.");
+        exit(1);
+    }
+}
+
+/* Return the next batch of commands to execute. */
+static aofLoadBatch *aofLoaderNextBatch(void) {
+    aofLoadBatch *b;
+
+    b = aofloader.batches+(aofloader.executed % aofloader.numbatches);
+    if (!aofloader.threaded) {
+        aofParseBatch(b);
+        return b;
+    }
+    pthread_mutex_lock(&aofloader.mutex);
+    while (aofloader.parsed == aofloader.executed)
+        pthread_cond_wait(&aofloader.parsed_cond,&aofloader.mutex);
+    pthread_mutex_unlock(&aofloader.mutex);
+    return b;
+}
+
+/* Give back to the parser the batch returned by aofLoaderNextBatch(), once
+ * all its commands were executed. */
+static void aofLoaderReleaseBatch(void) {
+    if (!aofloader.threaded) {
+        aofloader.executed++;
+        return;
+    }
+    pthread_mutex_lock(&aofloader.mutex);
+    aofloader.executed++;
+    pthread_cond_signal(&aofloader.free_cond);
+    pthread_mutex_unlock(&aofloader.mutex);
+}
+
+/* Stop the reader thread, if any, and release the parser resources. */
+static void aofLoaderStop(void) {
+    if (aofloader.threaded) {
+        pthread_mutex_lock(&aofloader.mutex);
+        aofloader.shutdown = 1;
+        pthread_cond_signal(&aofloader.free_cond);
+        pthread_mutex_unlock(&aofloader.mutex);
+        pthread_join(aofloader.thread,NULL);
+        pthread_mutex_destroy(&aofloader.mutex);
+        pthread_cond_destroy(&aofloader.parsed_cond);
+        pthread_cond_destroy(&aofloader.free_cond);
+    }
+    zfree(aofloader.batches);
+    zfree(aofloader.buf);
+}
+
+/* Load flags for loadSingleAppendOnlyFile(). */
+#define AOF_LOAD_LAST (1<<0)    /* The AOF keeps appending to this file. */
+#define AOF_LOAD_SEALED (1<<1)  /* The file must end with a checksum trailer. */
+
+/* Replay a single append log file. On success C_OK is returned. On non
+ * fatal error (the append only file is zero-length) C_ERR is returned. On
+ * fatal error an error message is logged and the program exists.
+ *
+ * A truncated file is loaded anyway if aof-load-truncated is enabled, but
+ * only for the AOF_LOAD_LAST file: only the file the AOF was appending to
+ * can be legitimately truncated by a crash. For the same reason, the other
+ * files are expected to end with a checksum trailer, and it is a fatal
+ * error if an AOF_LOAD_SEALED file does not. */
+static int loadSingleAppendOnlyFile(char *filename, int flags) {
     struct client *fakeClient;
     FILE *fp = fopen(filename,"r");
     struct redis_stat sb;
     int old_aof_state = server.aof_state;
+    int load_truncated = (flags & AOF_LOAD_LAST) && server.aof_load_truncated;
     long loops = 0;
+    off_t start = 0; /* Offset of the first command, after the preamble. */
     off_t valid_up_to = 0; /* Offset of the latest well-formed command loaded. */
+    off_t segment_start = 0; /* Open checksum segment at valid_up_to. */
+    uint64_t segment_crc = 0;
+    aofLoadBatch *b;
+    int j;
 
     if (fp && redis_fstat(fileno(fp),&sb) != -1 && sb.st_size == 0) {
-        server.aof_current_size = 0;
         fclose(fp);
         return C_ERR;
     }
@@ -631,92 +2172,118 @@ int loadAppendOnlyFile(char *filename) {
     server.aof_state = AOF_OFF;
 
     fakeClient = createFakeClient();
-    startLoading(fp);
+    startLoadingFile(fp);
+
+    /* Check if this AOF file has an RDB preamble. In that case we need to
+     * load the RDB file and later continue loading the AOF tail. */
+    char sig[5]; /* "REDIS" */
+    if (fread(sig,1,5,fp) != 5 || memcmp(sig,"REDIS",5) != 0) {
+        /* No RDB preamble, seek back at 0 offset. */
+        if (fseek(fp,0,SEEK_SET) == -1) goto readerr;
+    } else {
+        /* RDB preamble. Pass loading the RDB functions. */
+        rio rdb;
+
+        serverLog(LL_NOTICE,"Reading RDB preamble from AOF file...");
+        if (fseek(fp,0,SEEK_SET) == -1) goto readerr;
+        rioInitWithFile(&rdb,fp);
+        rdb.update_cksum = rdbLoadProgressCallback;
+        rdb.max_processing_chunk = server.loading_process_events_interval_bytes;
+        if (rdbLoadRio(&rdb,NULL,server.db) != C_OK) {
+            /* Never try to truncate the file here: the RDB payload is not
+             * made of commands, so there is no valid prefix to keep. */
+            serverLog(LL_WARNING,"Error reading the RDB preamble of the AOF file, AOF loading aborted");
+            exit(1);
+        } else {
+            serverLog(LL_NOTICE,"Reading the remaining AOF tail...");
+            start = ftello(fp);
+        }
+    }
+    valid_up_to = segment_start = start;
 
+    aofLoaderStart(fileno(fp),start);
     while(1) {
-        int argc, j;
-        unsigned long len;
-        robj **argv;
-        char buf[128];
-        sds argsds;
-        struct redisCommand *cmd;
-
-        /* Serve the clients from time to time */
-        if (!(loops++ % 1000)) {
-            loadingProgress(ftello(fp));
-            processEventsWhileBlocked();
-        }
+        int status;
 
-        if (fgets(buf,sizeof(buf),fp) == NULL) {
-            if (feof(fp))
-                break;
-            else
-                goto readerr;
-        }
-        if (buf[0] != '*') goto fmterr;
-        if (buf[1] == '\0') goto readerr;
-        argc = atoi(buf+1);
-        if (argc < 1) goto fmterr;
-
-        argv = zmalloc(sizeof(robj*)*argc);
-        fakeClient->argc = argc;
-        fakeClient->argv = argv;
-
-        for (j = 0; j < argc; j++) {
-            if (fgets(buf,sizeof(buf),fp) == NULL) {
-                fakeClient->argc = j; /* Free up to j-1. */
-                freeFakeClientArgv(fakeClient);
-                goto readerr;
-            }
-            if (buf[0] != '$') goto fmterr;
-            len = strtol(buf+1,NULL,10);
-            argsds = sdsnewlen(NULL,len);
-            if (len && fread(argsds,len,1,fp) == 0) {
-                sdsfree(argsds);
-                fakeClient->argc = j; /* Free up to j-1. */
-                freeFakeClientArgv(fakeClient);
-                goto readerr;
+        b = aofLoaderNextBatch();
+        for (j = 0; j < b->count; j++) {
+            aofLoadCommand *lc = b->cmds+j;
+
+            /* Serve the clients from time to time */
+            if (!(loops++ % 1000)) {
+                loadingProgress(lc->offset);
+                processEventsWhileBlocked();
             }
-            argv[j] = createObject(OBJ_STRING,argsds);
-            if (fread(buf,2,1,fp) == 0) {
-                fakeClient->argc = j+1; /* Free up to j. */
-                freeFakeClientArgv(fakeClient);
-                goto readerr; /* discard CRLF */
+
+            if (!lc->cmd) {
+                serverLog(LL_WARNING,"Unknown command '%s' reading the append only file", (char*)lc->argv[0]->ptr);
+                exit(1);
             }
-        }
 
-        /* Command lookup */
-        cmd = lookupCommand(argv[0]->ptr);
-        if (!cmd) {
-            serverLog(LL_WARNING,"Unknown command '%s' reading the append only file", (char*)argv[0]->ptr);
+            /* Run the command in the context of a fake client */
+            fakeClient->argc = lc->argc;
+            fakeClient->argv = lc->argv;
+            lc->cmd->proc(fakeClient);
+
+            /* The fake client should not have a reply */
+            serverAssert(fakeClient->bufpos == 0 && listLength(fakeClient->reply) == 0);
+            /* The fake client should never get blocked */
+            serverAssert((fakeClient->flags & CLIENT_BLOCKED) == 0);
+
+            /* Clean up. Command code may have changed argv/argc so we use the
+             * argv/argc of the client instead of the local variables. */
+            freeFakeClientArgv(fakeClient);
+            valid_up_to = lc->offset;
+            segment_start = lc->segment_start;
+            segment_crc = lc->segment_crc;
+        }
+        status = b->status;
+        aofLoaderReleaseBatch();
+        if (status == AOF_PARSE_OK) continue;
+        if (status == AOF_PARSE_EOF) break;
+        if (status == AOF_PARSE_UXEOF) goto uxeof;
+        if (status == AOF_PARSE_FMTERR) goto fmterr;
+        if (status == AOF_PARSE_CKSUMERR) {
+            serverLog(LL_WARNING,"Checksum mismatch in the append only file %s, in the segment starting at offset %lld: the file is corrupted.",
+                filename, (long long) b->segment_start);
             exit(1);
         }
-
-        /* Run the command in the context of a fake client */
-        cmd->proc(fakeClient);
-
-        /* The fake client should not have a reply */
-        serverAssert(fakeClient->bufpos == 0 && listLength(fakeClient->reply) == 0);
-        /* The fake client should never get blocked */
-        serverAssert((fakeClient->flags & CLIENT_BLOCKED) == 0);
-
-        /* Clean up. Command code may have changed argv/argc so we use the
-         * argv/argc of the client instead of the local variables. */
-        freeFakeClientArgv(fakeClient);
-        if (server.aof_load_truncated) valid_up_to = ftello(fp);
+        errno = b->errnum;
+        goto readerr;
     }
 
     /* This point can only be reached when EOF is reached without errors.
      * If the client is in the middle of a MULTI/EXEC, log error and quit. */
     if (fakeClient->flags & CLIENT_MULTI) goto uxeof;
 
+    /* Files we are no longer appending to should end with a checksum
+     * trailer, otherwise they may have been truncated. This only applies
+     * to the files written with aof-checksum enabled, that contain at
+     * least a trailer. */
+    valid_up_to = b->offset;
+    segment_start = b->segment_start;
+    segment_crc = b->segment_crc;
+    if (segment_start != start && segment_start != valid_up_to) {
+        if (flags & AOF_LOAD_SEALED) {
+            serverLog(LL_WARNING,"The append only file %s does not end with a checksum trailer: it is truncated.", filename);
+            exit(1);
+        } else if (!(flags & AOF_LOAD_LAST)) {
+            serverLog(LL_WARNING,"The append only file %s does not end with a checksum trailer: it may be truncated.", filename);
+        }
+    }
+
 loaded_ok: /* DB loaded, cleanup and return C_OK to the caller. */
+    aofLoaderStop();
     fclose(fp);
     freeFakeClient(fakeClient);
     server.aof_state = old_aof_state;
     stopLoading();
-    aofUpdateCurrentSize();
-    server.aof_rewrite_base_size = server.aof_current_size;
+
+    /* We'll continue appending to this file: resume the open segment. */
+    if (flags & AOF_LOAD_LAST) {
+        server.aof_segment_crc = segment_crc;
+        server.aof_segment_bytes = valid_up_to-segment_start;
+    }
     return C_OK;
 
 readerr: /* Read error. If feof(fp) is true, fall through to unexpected EOF. */
@@ -726,7 +2293,7 @@ readerr: /* Read error. If feof(fp) is true, fall through to unexpected EOF. */
     }
 
 uxeof: /* Unexpected AOF end of file. */
-    if (server.aof_load_truncated) {
+    if (load_truncated) {
         serverLog(LL_WARNING,"!!! Warning: short read while loading the AOF file !!!");
         serverLog(LL_WARNING,"!!! Truncating the AOF at offset %llu !!!",
             (unsigned long long) valid_up_to);
@@ -758,6 +2325,51 @@ fmterr: /* Format error. */
     exit(1);
 }
 
+/* Replay the append only file 'filename'. See loadSingleAppendOnlyFile()
+ * for the return values. */
+int loadAppendOnlyFile(char *filename) {
+    if (loadSingleAppendOnlyFile(filename,AOF_LOAD_LAST) == C_ERR) {
+        server.aof_current_size = 0;
+        return C_ERR;
+    }
+    aofUpdateCurrentSize();
+    server.aof_rewrite_base_size = server.aof_current_size;
+    return C_OK;
+}
+
+/* Load the AOF, that is, the single AOF file or, when aof-multi-part is
+ * enabled, the BASE file followed by all the INCR files listed in the
+ * manifest. C_ERR is returned if there was nothing to load. */
+int loadAppendOnlyFiles(void) {
+    aofManifest *am = server.aof_manifest;
+    listIter li;
+    listNode *ln;
+    int loaded = 0;
+
+    if (!server.aof_multi_part) return loadAppendOnlyFile(server.aof_filename);
+
+    if (am->base) {
+        sds path = aofFilePath(am->base->name);
+        int flags = AOF_LOAD_SEALED;
+
+        if (listLength(am->incr_list) == 0) flags |= AOF_LOAD_LAST;
+        serverLog(LL_NOTICE,"Loading the AOF base file %s", am->base->name);
+        if (loadSingleAppendOnlyFile(path,flags) == C_OK) loaded++;
+        sdsfree(path);
+    }
+    listRewind(am->incr_list,&li);
+    while((ln = listNext(&li))) {
+        aofFile *af = listNodeValue(ln);
+        sds path = aofFilePath(af->name);
+        int flags = ln == listLast(am->incr_list) ? AOF_LOAD_LAST : 0;
+
+        if (loadSingleAppendOnlyFile(path,flags) == C_OK) loaded++;
+        sdsfree(path);
+    }
+    aofMultiPartUpdateSizes();
+    return loaded ? C_OK : C_ERR;
+}
+
 /* ----------------------------------------------------------------------------
  * AOF rewrite
  * ------------------------------------------------------------------------- */
@@ -995,51 +2607,53 @@ ssize_t aofReadDiffFromParent(void) {
     return total;
 }
 
+/* Offset of the current checksum segment in the rewritten AOF, only used
+ * by the rewriting child. */
+static size_t rewrite_segment_start;
+
+/* Terminate the current checksum segment of the rewritten AOF, unless it is
+ * empty. The rio checksum must cover the segment content. Returns 0 on
+ * error, 1 on success. */
+static int rioWriteAofChecksum(rio *aof) {
+    sds trailer;
+    size_t written;
+
+    if (!server.aof_checksum ||
+        aof->processed_bytes == rewrite_segment_start) return 1;
+    trailer = catAofChecksumTrailer(sdsempty(),aof->cksum);
+    written = rioWrite(aof,trailer,sdslen(trailer));
+    sdsfree(trailer);
+    aof->cksum = 0;
+    rewrite_segment_start = aof->processed_bytes;
+    return written != 0;
+}
+
 /* Write a sequence of commands able to fully rebuild the dataset into
- * "filename". Used both by REWRITEAOF and BGREWRITEAOF.
+ * the specified rio stream. On success C_OK is returned, otherwise C_ERR
+ * is returned and errno is set according to the I/O error.
  *
  * In order to minimize the number of commands needed in the rewritten
  * log Redis uses variadic commands when possible, such as RPUSH, SADD
  * and ZADD. However at max AOF_REWRITE_ITEMS_PER_CMD items per time
  * are inserted using a single command. */
-int rewriteAppendOnlyFile(char *filename) {
+int rewriteAppendOnlyFileRio(rio *aof) {
     dictIterator *di = NULL;
     dictEntry *de;
-    rio aof;
-    FILE *fp;
-    char tmpfile[256];
     int j;
     long long now = mstime();
-    char byte;
     size_t processed = 0;
 
-    /* Note that we have to use a different temp name here compared to the
-     * one used by rewriteAppendOnlyFileBackground() function. */
-    snprintf(tmpfile,256,"temp-rewriteaof-%d.aof", (int) getpid());
-    fp = fopen(tmpfile,"w");
-    if (!fp) {
-        serverLog(LL_WARNING, "Opening the temp file for AOF rewrite in rewriteAppendOnlyFile(): %s", strerror(errno));
-        return C_ERR;
-    }
-
-    server.aof_child_diff = sdsempty();
-    rioInitWithFile(&aof,fp);
-    if (server.aof_rewrite_incremental_fsync)
-        rioSetAutoSync(&aof,AOF_AUTOSYNC_BYTES);
     for (j = 0; j < server.dbnum; j++) {
         char selectcmd[] = "*2\r\n$6\r\nSELECT\r\n";
         redisDb *db = server.db+j;
         dict *d = db->dict;
         if (dictSize(d) == 0) continue;
         di = dictGetSafeIterator(d);
-        if (!di) {
-            fclose(fp);
-            return C_ERR;
-        }
+        if (!di) return C_ERR;
 
         /* SELECT the new DB */
-        if (rioWrite(&aof,selectcmd,sizeof(selectcmd)-1) == 0) goto werr;
-        if (rioWriteBulkLongLong(&aof,j) == 0) goto werr;
+        if (rioWrite(aof,selectcmd,sizeof(selectcmd)-1) == 0) goto werr;
+        if (rioWriteBulkLongLong(aof,j) == 0) goto werr;
 
         /* Iterate this DB writing every entry */
         while((de = dictNext(di)) != NULL) {
@@ -1051,7 +2665,7 @@ int rewriteAppendOnlyFile(char *filename) {
             o = dictGetVal(de);
             initStaticStringObject(key,keystr);
 
-            expiretime = getExpire(db,&key);
+            expiretime = dbEntryGetExpire(de);
 
             /* If this key is already expired skip it */
             if (expiretime != -1 && expiretime < now) continue;
@@ -1060,42 +2674,56 @@ int rewriteAppendOnlyFile(char *filename) {
             if (o->type == OBJ_STRING) {
                 /* Emit a SET command */
                 char cmd[]="*3\r\n$3\r\nSET\r\n";
-                if (rioWrite(&aof,cmd,sizeof(cmd)-1) == 0) goto werr;
+                if (rioWrite(aof,cmd,sizeof(cmd)-1) == 0) goto werr;
                 /* Key and value */
-                if (rioWriteBulkObject(&aof,&key) == 0) goto werr;
-                if (rioWriteBulkObject(&aof,o) == 0) goto werr;
+                if (rioWriteBulkObject(aof,&key) == 0) goto werr;
+                if (rioWriteBulkObject(aof,o) == 0) goto werr;
             } else if (o->type == OBJ_LIST) {
-                if (rewriteListObject(&aof,&key,o) == 0) goto werr;
+                if (rewriteListObject(aof,&key,o) == 0) goto werr;
             } else if (o->type == OBJ_SET) {
-                if (rewriteSetObject(&aof,&key,o) == 0) goto werr;
+                if (rewriteSetObject(aof,&key,o) == 0) goto werr;
             } else if (o->type == OBJ_ZSET) {
-                if (rewriteSortedSetObject(&aof,&key,o) == 0) goto werr;
+                if (rewriteSortedSetObject(aof,&key,o) == 0) goto werr;
             } else if (o->type == OBJ_HASH) {
-                if (rewriteHashObject(&aof,&key,o) == 0) goto werr;
+                if (rewriteHashObject(aof,&key,o) == 0) goto werr;
             } else {
                 serverPanic("Unknown object type");
             }
             /* Save the expire time */
             if (expiretime != -1) {
                 char cmd[]="*3\r\n$9\r\nPEXPIREAT\r\n";
-                if (rioWrite(&aof,cmd,sizeof(cmd)-1) == 0) goto werr;
-                if (rioWriteBulkObject(&aof,&key) == 0) goto werr;
-                if (rioWriteBulkLongLong(&aof,expiretime) == 0) goto werr;
+                if (rioWrite(aof,cmd,sizeof(cmd)-1) == 0) goto werr;
+                if (rioWriteBulkObject(aof,&key) == 0) goto werr;
+                if (rioWriteBulkLongLong(aof,expiretime) == 0) goto werr;
             }
+            /* Terminate the checksum segment once it is big enough. */
+            if (aof->processed_bytes-rewrite_segment_start >=
+                AOF_CHECKSUM_SEGMENT_BYTES &&
+                rioWriteAofChecksum(aof) == 0) goto werr;
             /* Read some diff from the parent process from time to time. */
-            if (aof.processed_bytes > processed+1024*10) {
-                processed = aof.processed_bytes;
+            if (!server.aof_multi_part &&
+                aof->processed_bytes > processed+AOF_READ_DIFF_INTERVAL_BYTES)
+            {
+                processed = aof->processed_bytes;
                 aofReadDiffFromParent();
             }
         }
         dictReleaseIterator(di);
         di = NULL;
     }
+    return C_OK;
 
-    /* Do an initial slow fsync here while the parent is still sending
-     * data, in order to make the next final fsync faster. */
-    if (fflush(fp) == EOF) goto werr;
-    if (fsync(fileno(fp)) == -1) goto werr;
+werr:
+    if (di) dictReleaseIterator(di);
+    return C_ERR;
+}
+
+/* Called by the rewrite child once the dataset was written into 'aof': read
+ * the last differences from the parent, until it agrees to stop sending
+ * them, and append them to the rewritten AOF. Returns C_OK on success,
+ * C_ERR on error. */
+static int rewriteAppendOnlyFileReadFinalDiff(rio *aof) {
+    char byte;
 
     /* Read again a few times to get more data from the parent.
      * We can't read forever (the server may receive data from clients
@@ -1117,14 +2745,14 @@ int rewriteAppendOnlyFile(char *filename) {
     }
 
     /* Ask the master to stop sending diffs. */
-    if (write(server.aof_pipe_write_ack_to_parent,"!",1) != 1) goto werr;
+    if (write(server.aof_pipe_write_ack_to_parent,"!",1) != 1) return C_ERR;
     if (anetNonBlock(NULL,server.aof_pipe_read_ack_from_parent) != ANET_OK)
-        goto werr;
+        return C_ERR;
     /* We read the ACK from the server using a 10 seconds timeout. Normally
      * it should reply ASAP, but just in case we lose its reply, we are sure
      * the child will eventually get terminated. */
     if (syncRead(server.aof_pipe_read_ack_from_parent,&byte,1,5000) != 1 ||
-        byte != '!') goto werr;
+        byte != '!') return C_ERR;
     serverLog(LL_NOTICE,"Parent agreed to stop sending diffs. Finalizing AOF...");
 
     /* Read the final diff if any. */
@@ -1134,8 +2762,70 @@ int rewriteAppendOnlyFile(char *filename) {
     serverLog(LL_NOTICE,
         "Concatenating %.2f MB of AOF diff received from parent.",
         (double) sdslen(server.aof_child_diff) / (1024*1024));
-    if (rioWrite(&aof,server.aof_child_diff,sdslen(server.aof_child_diff)) == 0)
-        goto werr;
+    if (rioWrite(aof,server.aof_child_diff,sdslen(server.aof_child_diff)) == 0)
+        return C_ERR;
+
+    return C_OK;
+}
+
+/* Write the AOF rewrite into "filename". Used both by REWRITEAOF and
+ * BGREWRITEAOF. The dataset is written as a sequence of commands, or, when
+ * aof-use-rdb-preamble is enabled, as an RDB payload that the AOF loading
+ * code is able to recognize. In both the cases the accumulated difference
+ * received from the parent is appended as plain commands. */
+int rewriteAppendOnlyFile(char *filename) {
+    rio aof;
+    FILE *fp;
+    char tmpfile[256];
+
+    /* Note that we have to use a different temp name here compared to the
+     * one used by rewriteAppendOnlyFileBackground() function. */
+    snprintf(tmpfile,256,"temp-rewriteaof-%d.aof", (int) getpid());
+    fp = fopen(tmpfile,"w");
+    if (!fp) {
+        serverLog(LL_WARNING, "Opening the temp file for AOF rewrite in rewriteAppendOnlyFile(): %s", strerror(errno));
+        return C_ERR;
+    }
+
+    server.aof_child_diff = sdsempty();
+    rioInitWithFile(&aof,fp);
+    if (server.aof_rewrite_incremental_fsync)
+        rioSetAutoSync(&aof,AOF_AUTOSYNC_BYTES);
+
+    if (server.aof_use_rdb_preamble) {
+        int error;
+        /* The BASE file of a multi part AOF is a plain RDB file. */
+        int flags = server.aof_multi_part ? RDB_SAVE_NONE :
+                                            RDB_SAVE_AOF_PREAMBLE;
+        if (rdbSaveRio(&aof,&error,flags,NULL) == C_ERR) {
+            errno = error;
+            goto werr;
+        }
+    }
+
+    /* The commands are protected by checksum segments, starting after the
+     * RDB preamble if any. */
+    if (server.aof_checksum) aof.update_cksum = rioGenericUpdateChecksum;
+    aof.cksum = 0;
+    rewrite_segment_start = aof.processed_bytes;
+    if (!server.aof_use_rdb_preamble &&
+        rewriteAppendOnlyFileRio(&aof) == C_ERR) goto werr;
+
+    /* Do an initial slow fsync here while the parent is still sending
+     * data, in order to make the next final fsync faster. */
+    if (fflush(fp) == EOF) goto werr;
+    if (fsync(fileno(fp)) == -1) goto werr;
+
+    /* Seal the rewritten dataset. The diff received from the parent is not
+     * split at command boundaries, so it can't be checksummed here: the
+     * parent, that knows what it sent, continues the segment. */
+    if (rioWriteAofChecksum(&aof) == 0) goto werr;
+
+    /* With a multi part AOF the parent writes the differences accumulated
+     * during the rewrite into a new INCR file, so there is nothing to
+     * receive from it. */
+    if (!server.aof_multi_part &&
+        rewriteAppendOnlyFileReadFinalDiff(&aof) == C_ERR) goto werr;
 
     /* Make sure data will not remain on the OS's output buffers */
     if (fflush(fp) == EOF) goto werr;
@@ -1156,7 +2846,6 @@ werr:
     serverLog(LL_WARNING,"Write error writing append only file on disk: %s", strerror(errno));
     fclose(fp);
     unlink(tmpfile);
-    if (di) dictReleaseIterator(di);
     return C_ERR;
 }
 
@@ -1214,6 +2903,8 @@ int aofCreatePipes(void) {
     server.aof_pipe_write_ack_to_child = fds[5];
     server.aof_pipe_read_ack_from_parent = fds[4];
     server.aof_stop_sending_diff = 0;
+    server.aof_child_diff_crc = 0;
+    server.aof_child_diff_bytes = 0;
     return C_OK;
 
 error:
@@ -1224,6 +2915,7 @@ error:
 }
 
 void aofClosePipes(void) {
+    if (server.aof_multi_part) return; /* No pipes with a multi part AOF. */
     aeDeleteFileEvent(server.el,server.aof_pipe_read_ack_from_child,AE_READABLE);
     aeDeleteFileEvent(server.el,server.aof_pipe_write_data_to_child,AE_WRITABLE);
     close(server.aof_pipe_write_data_to_child);
@@ -1255,7 +2947,13 @@ int rewriteAppendOnlyFileBackground(void) {
     long long start;
 
     if (server.aof_child_pid != -1) return C_ERR;
-    if (aofCreatePipes() != C_OK) return C_ERR;
+    if (server.aof_multi_part) {
+        /* The writes performed from now on go into a new INCR file, so
+         * there is no need to send differences to the child. */
+        if (aofRotateIncrFile() != C_OK) return C_ERR;
+    } else {
+        if (aofCreatePipes() != C_OK) return C_ERR;
+    }
     start = ustime();
     if ((childpid = fork()) == 0) {
         char tmpfile[256];
@@ -1348,6 +3046,7 @@ void aofUpdateCurrentSize(void) {
 void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
     if (!bysignal && exitcode == 0) {
         int newfd, oldfd;
+        uint64_t crc = server.aof_child_diff_crc;
         char tmpfile[256];
         long long now = ustime();
         mstime_t latency;
@@ -1355,11 +3054,26 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
         serverLog(LL_NOTICE,
             "Background AOF rewrite terminated with success");
 
+        snprintf(tmpfile,256,"temp-rewriteaof-bg-%d.aof",
+            (int)server.aof_child_pid);
+
+        /* With a multi part AOF the differences are already in the INCR
+         * files, we just need to install the new BASE file. */
+        if (server.aof_multi_part) {
+            latencyStartMonitor(latency);
+            if (aofMultiPartRewriteDone(tmpfile) == C_ERR) goto cleanup;
+            latencyEndMonitor(latency);
+            latencyAddSampleIfNeeded("aof-rename",latency);
+            server.aof_lastbgrewrite_status = C_OK;
+            serverLog(LL_NOTICE, "Background AOF rewrite finished successfully");
+            if (server.aof_state == AOF_WAIT_REWRITE)
+                server.aof_state = AOF_ON;
+            goto cleanup;
+        }
+
         /* Flush the differences accumulated by the parent to the
          * rewritten AOF. */
         latencyStartMonitor(latency);
-        snprintf(tmpfile,256,"temp-rewriteaof-bg-%d.aof",
-            (int)server.aof_child_pid);
         newfd = open(tmpfile,O_WRONLY|O_APPEND);
         if (newfd == -1) {
             serverLog(LL_WARNING,
@@ -1367,7 +3081,7 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
             goto cleanup;
         }
 
-        if (aofRewriteBufferWrite(newfd) == -1) {
+        if (aofRewriteBufferWrite(newfd,&crc) == -1) {
             serverLog(LL_WARNING,
                 "Error trying to flush the parent diff to the rewritten AOF: %s", strerror(errno));
             close(newfd);
@@ -1439,7 +3153,9 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
              * to this new file, so we can close it. */
             close(newfd);
         } else {
-            /* AOF enabled, replace the old fd with the new one. */
+            /* AOF enabled, replace the old fd with the new one. The writer
+             * thread, if any, must be done with the old one. */
+            if (server.aof_writer_thread) aofWriterDrain();
             oldfd = server.aof_fd;
             server.aof_fd = newfd;
             if (server.aof_fsync == AOF_FSYNC_ALWAYS)
@@ -1449,9 +3165,16 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
             server.aof_selected_db = -1; /* Make sure SELECT is re-issued */
             aofUpdateCurrentSize();
             server.aof_rewrite_base_size = server.aof_current_size;
+            /* The rewritten AOF ends with the checksum trailer written by
+             * the child, followed by the diff sent to the child and by the
+             * residual parent diff. */
+            server.aof_segment_crc = crc;
+            server.aof_segment_bytes = server.aof_child_diff_bytes +
+                                       aofRewriteBufferSize();
 
             /* Clear regular AOF buffer since its contents was just written to
              * the new AOF from the background rewrite buffer. */
+            if (server.aof_writer_thread) aofWriterSkip(sdslen(server.aof_buf));
             sdsfree(server.aof_buf);
             server.aof_buf = sdsempty();
         }
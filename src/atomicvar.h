@@ -1,12 +1,20 @@
 /* This file implements atomic counters using __atomic or __sync macros if
  * available, otherwise synchronizing different threads using a mutex.
  *
- * The exported interaface is composed of three macros:
+ * The exported interaface is composed of the following macros:
  *
  * atomicIncr(var,count,mutex) -- Increment the atomic counter
  * atomicDecr(var,count,mutex) -- Decrement the atomic counter
  * atomicGet(var,dstvar,mutex) -- Fetch the atomic counter value
  *
+ * The following two variants use sequential consistency, so they can be
+ * used to publish data to other threads (all the writes performed before
+ * atomicSetWithSync() are visible to the thread reading the new value with
+ * atomicGetWithSync()):
+ *
+ * atomicSetWithSync(var,value,mutex) -- Set the atomic counter value
+ * atomicGetWithSync(var,dstvar,mutex) -- Fetch the atomic counter value
+ *
  * If atomic primitives are availble (tested in config.h) the mutex
  * is not used.
  *
@@ -59,6 +67,11 @@
 #define atomicGet(var,dstvar,mutex) do { \
     dstvar = __atomic_load_n(&var,__ATOMIC_RELAXED); \
 } while(0)
+#define atomicSetWithSync(var,value,mutex) \
+    __atomic_store_n(&var,(value),__ATOMIC_SEQ_CST)
+#define atomicGetWithSync(var,dstvar,mutex) do { \
+    dstvar = __atomic_load_n(&var,__ATOMIC_SEQ_CST); \
+} while(0)
 
 #elif defined(HAVE_ATOMIC)
 /* Implementation using __sync macros. */
@@ -68,6 +81,12 @@
 #define atomicGet(var,dstvar,mutex) do { \
     dstvar = __sync_sub_and_fetch(&var,0); \
 } while(0)
+#define atomicSetWithSync(var,value,mutex) do { \
+    __sync_synchronize(); \
+    var = (value); \
+    __sync_synchronize(); \
+} while(0)
+#define atomicGetWithSync(var,dstvar,mutex) atomicGet(var,dstvar,mutex)
 
 #else
 /* Implementation using pthread mutex. */
@@ -89,6 +108,13 @@
     dstvar = var; \
     pthread_mutex_unlock(&mutex); \
 } while(0)
+
+#define atomicSetWithSync(var,value,mutex) do { \
+    pthread_mutex_lock(&mutex); \
+    var = (value); \
+    pthread_mutex_unlock(&mutex); \
+} while(0)
+#define atomicGetWithSync(var,dstvar,mutex) atomicGet(var,dstvar,mutex)
 #endif
 
 #endif /* __ATOMIC_VAR_H */
@@ -24,6 +24,12 @@
  * recently inserted to the most recently inserted (older jobs processed
  * first).
  *
+ * The only exception is BIO_LAZY_FREE, that can be served by multiple
+ * workers (see the lazyfree-threads option), each with its own thread and
+ * job queue. Jobs are assigned to the workers in a round robin fashion, so
+ * there is no ordering guarantee between jobs assigned to different workers:
+ * this is fine since lazy freed objects are no longer reachable.
+ *
  * Currently there is no way for the creator of the job to be notified about
  * the completion of the operation, this will only be added when/if needed.
  *
@@ -61,18 +67,31 @@
 #include "server.h"
 #include "bio.h"
 
-static pthread_t bio_threads[BIO_NUM_OPS];
-static pthread_mutex_t bio_mutex[BIO_NUM_OPS];
-static pthread_cond_t bio_newjob_cond[BIO_NUM_OPS];
-static pthread_cond_t bio_step_cond[BIO_NUM_OPS];
-static list *bio_jobs[BIO_NUM_OPS];
+/* Every job type has one worker, with the exception of BIO_LAZY_FREE that
+ * may have up to LAZYFREE_THREADS_MAX workers. */
+#define BIO_MAX_WORKERS LAZYFREE_THREADS_MAX
+
+static int bio_workers[BIO_NUM_OPS];
+static pthread_t bio_threads[BIO_NUM_OPS][BIO_MAX_WORKERS];
+static pthread_mutex_t bio_mutex[BIO_NUM_OPS][BIO_MAX_WORKERS];
+static pthread_cond_t bio_newjob_cond[BIO_NUM_OPS][BIO_MAX_WORKERS];
+static pthread_cond_t bio_step_cond[BIO_NUM_OPS][BIO_MAX_WORKERS];
+static list *bio_jobs[BIO_NUM_OPS][BIO_MAX_WORKERS];
 /* The following array is used to hold the number of pending jobs for every
  * OP type. This allows us to export the bioPendingJobsOfType() API that is
  * useful when the main thread wants to perform some operation that may involve
  * objects shared with the background thread. The main thread will just wait
  * that there are no longer jobs of this type to be executed before performing
  * the sensible operation. This data is also useful for reporting. */
-static unsigned long long bio_pending[BIO_NUM_OPS];
+static unsigned long long bio_pending[BIO_NUM_OPS][BIO_MAX_WORKERS];
+/* Number of jobs processed, and amount of work they did (the job specific
+ * unit, like the number of objects for BIO_LAZY_FREE), for every worker.
+ * Only used for reporting. */
+static unsigned long long bio_processed[BIO_NUM_OPS][BIO_MAX_WORKERS];
+static unsigned long long bio_work_done[BIO_NUM_OPS][BIO_MAX_WORKERS];
+/* Next worker to assign a job of a given type to. Jobs are only created by
+ * the main thread so no locking is needed. */
+static unsigned int bio_next_worker[BIO_NUM_OPS];
 
 /* This structure represents a background Job. It is only used locally to this
  * file as the API does not expose the internals at all. */
@@ -84,28 +103,34 @@ struct bio_job {
 };
 
 void *bioProcessBackgroundJobs(void *arg);
-void lazyfreeFreeObjectFromBioThread(robj *o);
-void lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2);
-void lazyfreeFreeSlotsMapFromBioThread(zskiplist *sl);
+size_t lazyfreeFreeObjectFromBioThread(robj *o);
+size_t lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2);
+size_t lazyfreeFreeBatchFromBioThread(void *batch);
+size_t snapshotWriteFromBioThread(long fd, sds buf);
 
-/* Make sure we have enough stack to perform all the things we do in the
- * main thread. */
-#define REDIS_THREAD_STACK_SIZE (1024*1024*4)
+/* The thread argument encodes both the job type and the worker ID. */
+#define BIO_THREAD_ARG(type,worker) ((type)*BIO_MAX_WORKERS+(worker))
 
-/* Initialize the background system, spawning the thread. */
+/* Initialize the background system, spawning the threads. */
 void bioInit(void) {
     pthread_attr_t attr;
     pthread_t thread;
     size_t stacksize;
-    int j;
+    int j, w;
 
     /* Initialization of state vars and objects */
     for (j = 0; j < BIO_NUM_OPS; j++) {
-        pthread_mutex_init(&bio_mutex[j],NULL);
-        pthread_cond_init(&bio_newjob_cond[j],NULL);
-        pthread_cond_init(&bio_step_cond[j],NULL);
-        bio_jobs[j] = listCreate();
-        bio_pending[j] = 0;
+        bio_workers[j] = (j == BIO_LAZY_FREE) ? server.lazyfree_threads : 1;
+        bio_next_worker[j] = 0;
+        for (w = 0; w < bio_workers[j]; w++) {
+            pthread_mutex_init(&bio_mutex[j][w],NULL);
+            pthread_cond_init(&bio_newjob_cond[j][w],NULL);
+            pthread_cond_init(&bio_step_cond[j][w],NULL);
+            bio_jobs[j][w] = listCreate();
+            bio_pending[j][w] = 0;
+            bio_processed[j][w] = 0;
+            bio_work_done[j][w] = 0;
+        }
     }
 
     /* Set the stack size as by default it may be small in some system */
@@ -116,39 +141,43 @@ void bioInit(void) {
     pthread_attr_setstacksize(&attr, stacksize);
 
     /* Ready to spawn our threads. We use the single argument the thread
-     * function accepts in order to pass the job ID the thread is
-     * responsible of. */
+     * function accepts in order to pass the job ID and the worker the
+     * thread is responsible of. */
     for (j = 0; j < BIO_NUM_OPS; j++) {
-        void *arg = (void*)(unsigned long) j;
-        if (pthread_create(&thread,&attr,bioProcessBackgroundJobs,arg) != 0) {
-            serverLog(LL_WARNING,"Fatal: Can't initialize Background Jobs.");
-            exit(1);
+        for (w = 0; w < bio_workers[j]; w++) {
+            void *arg = (void*)(unsigned long) BIO_THREAD_ARG(j,w);
+            if (pthread_create(&thread,&attr,bioProcessBackgroundJobs,arg) != 0) {
+                serverLog(LL_WARNING,"Fatal: Can't initialize Background Jobs.");
+                exit(1);
+            }
+            bio_threads[j][w] = thread;
         }
-        bio_threads[j] = thread;
     }
 }
 
 void bioCreateBackgroundJob(int type, void *arg1, void *arg2, void *arg3) {
     struct bio_job *job = zmalloc(sizeof(*job));
+    int w = bio_next_worker[type]++ % bio_workers[type];
 
     job->time = time(NULL);
     job->arg1 = arg1;
     job->arg2 = arg2;
     job->arg3 = arg3;
-    pthread_mutex_lock(&bio_mutex[type]);
-    listAddNodeTail(bio_jobs[type],job);
-    bio_pending[type]++;
-    pthread_cond_signal(&bio_newjob_cond[type]);
-    pthread_mutex_unlock(&bio_mutex[type]);
+    pthread_mutex_lock(&bio_mutex[type][w]);
+    listAddNodeTail(bio_jobs[type][w],job);
+    bio_pending[type][w]++;
+    pthread_cond_signal(&bio_newjob_cond[type][w]);
+    pthread_mutex_unlock(&bio_mutex[type][w]);
 }
 
 void *bioProcessBackgroundJobs(void *arg) {
     struct bio_job *job;
-    unsigned long type = (unsigned long) arg;
+    unsigned long type = (unsigned long) arg / BIO_MAX_WORKERS;
+    unsigned long w = (unsigned long) arg % BIO_MAX_WORKERS;
     sigset_t sigset;
 
     /* Check that the type is within the right interval. */
-    if (type >= BIO_NUM_OPS) {
+    if (type >= BIO_NUM_OPS || w >= (unsigned long) bio_workers[type]) {
         serverLog(LL_WARNING,
             "Warning: bio thread started with wrong type %lu",type);
         return NULL;
@@ -159,7 +188,7 @@ void *bioProcessBackgroundJobs(void *arg) {
     pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
     pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
 
-    pthread_mutex_lock(&bio_mutex[type]);
+    pthread_mutex_lock(&bio_mutex[type][w]);
     /* Block SIGALRM so we are sure that only the main thread will
      * receive the watchdog signal. */
     sigemptyset(&sigset);
@@ -170,18 +199,19 @@ void *bioProcessBackgroundJobs(void *arg) {
 
     while(1) {
         listNode *ln;
+        size_t work = 1;
 
         /* The loop always starts with the lock hold. */
-        if (listLength(bio_jobs[type]) == 0) {
-            pthread_cond_wait(&bio_newjob_cond[type],&bio_mutex[type]);
+        if (listLength(bio_jobs[type][w]) == 0) {
+            pthread_cond_wait(&bio_newjob_cond[type][w],&bio_mutex[type][w]);
             continue;
         }
         /* Pop the job from the queue. */
-        ln = listFirst(bio_jobs[type]);
+        ln = listFirst(bio_jobs[type][w]);
         job = ln->value;
         /* It is now possible to unlock the background system as we know have
          * a stand alone job structure to process.*/
-        pthread_mutex_unlock(&bio_mutex[type]);
+        pthread_mutex_unlock(&bio_mutex[type][w]);
 
         /* Process the job accordingly to its type. */
         if (type == BIO_CLOSE_FILE) {
@@ -192,35 +222,45 @@ void *bioProcessBackgroundJobs(void *arg) {
             /* What we free changes depending on what arguments are set:
              * arg1 -> free the object at pointer.
              * arg2 & arg3 -> free two dictionaries (a Redis DB).
-             * only arg3 -> free the skiplist. */
+             * only arg3 -> free a batch of objects. */
             if (job->arg1)
-                lazyfreeFreeObjectFromBioThread(job->arg1);
+                work = lazyfreeFreeObjectFromBioThread(job->arg1);
             else if (job->arg2 && job->arg3)
-                lazyfreeFreeDatabaseFromBioThread(job->arg2,job->arg3);
+                work = lazyfreeFreeDatabaseFromBioThread(job->arg2,job->arg3);
             else if (job->arg3)
-                lazyfreeFreeSlotsMapFromBioThread(job->arg3);
+                work = lazyfreeFreeBatchFromBioThread(job->arg3);
+        } else if (type == BIO_RDB_WRITE) {
+            /* arg1 is the file descriptor of the fork-less BGSAVE temp
+             * file, arg2 the buffer to append to it, or NULL to fsync. */
+            work = snapshotWriteFromBioThread((long)job->arg1,job->arg2);
         } else {
             serverPanic("Wrong job type in bioProcessBackgroundJobs().");
         }
         zfree(job);
 
         /* Unblock threads blocked on bioWaitStepOfType() if any. */
-        pthread_cond_broadcast(&bio_step_cond[type]);
+        pthread_cond_broadcast(&bio_step_cond[type][w]);
 
         /* Lock again before reiterating the loop, if there are no longer
          * jobs to process we'll block again in pthread_cond_wait(). */
-        pthread_mutex_lock(&bio_mutex[type]);
-        listDelNode(bio_jobs[type],ln);
-        bio_pending[type]--;
+        pthread_mutex_lock(&bio_mutex[type][w]);
+        listDelNode(bio_jobs[type][w],ln);
+        bio_pending[type][w]--;
+        bio_processed[type][w]++;
+        bio_work_done[type][w] += work;
     }
 }
 
 /* Return the number of pending jobs of the specified type. */
 unsigned long long bioPendingJobsOfType(int type) {
-    unsigned long long val;
-    pthread_mutex_lock(&bio_mutex[type]);
-    val = bio_pending[type];
-    pthread_mutex_unlock(&bio_mutex[type]);
+    unsigned long long val = 0;
+    int w;
+
+    for (w = 0; w < bio_workers[type]; w++) {
+        pthread_mutex_lock(&bio_mutex[type][w]);
+        val += bio_pending[type][w];
+        pthread_mutex_unlock(&bio_mutex[type][w]);
+    }
     return val;
 }
 
@@ -233,17 +273,41 @@ unsigned long long bioPendingJobsOfType(int type) {
  *
  * This function is useful when from another thread, we want to wait
  * a bio.c thread to do more work in a blocking way.
+ *
+ * When the type has multiple workers, we wait for the first worker that
+ * has pending jobs to make progress.
  */
 unsigned long long bioWaitStepOfType(int type) {
-    unsigned long long val;
-    pthread_mutex_lock(&bio_mutex[type]);
-    val = bio_pending[type];
-    if (val != 0) {
-        pthread_cond_wait(&bio_step_cond[type],&bio_mutex[type]);
-        val = bio_pending[type];
+    int w;
+
+    for (w = 0; w < bio_workers[type]; w++) {
+        pthread_mutex_lock(&bio_mutex[type][w]);
+        if (bio_pending[type][w] != 0) {
+            pthread_cond_wait(&bio_step_cond[type][w],&bio_mutex[type][w]);
+            pthread_mutex_unlock(&bio_mutex[type][w]);
+            break;
+        }
+        pthread_mutex_unlock(&bio_mutex[type][w]);
     }
-    pthread_mutex_unlock(&bio_mutex[type]);
-    return val;
+    return bioPendingJobsOfType(type);
+}
+
+/* Return the number of workers serving the jobs of the specified type. */
+int bioWorkersOfType(int type) {
+    return bio_workers[type];
+}
+
+/* Fetch the reporting counters of the specified worker: the jobs in its
+ * queue, the jobs it processed, and the job specific amount of work done. */
+void bioGetWorkerStats(int type, int worker, unsigned long long *pending,
+                       unsigned long long *processed,
+                       unsigned long long *work_done)
+{
+    pthread_mutex_lock(&bio_mutex[type][worker]);
+    *pending = bio_pending[type][worker];
+    *processed = bio_processed[type][worker];
+    *work_done = bio_work_done[type][worker];
+    pthread_mutex_unlock(&bio_mutex[type][worker]);
 }
 
 /* Kill the running bio threads in an unclean way. This function should be
@@ -251,17 +315,19 @@ unsigned long long bioWaitStepOfType(int type) {
  * Currently Redis does this only on crash (for instance on SIGSEGV) in order
  * to perform a fast memory check without other threads messing with memory. */
 void bioKillThreads(void) {
-    int err, j;
+    int err, j, w;
 
     for (j = 0; j < BIO_NUM_OPS; j++) {
-        if (pthread_cancel(bio_threads[j]) == 0) {
-            if ((err = pthread_join(bio_threads[j],NULL)) != 0) {
-                serverLog(LL_WARNING,
-                    "Bio thread for job type #%d can be joined: %s",
-                        j, strerror(err));
-            } else {
-                serverLog(LL_WARNING,
-                    "Bio thread for job type #%d terminated",j);
+        for (w = 0; w < bio_workers[j]; w++) {
+            if (pthread_cancel(bio_threads[j][w]) == 0) {
+                if ((err = pthread_join(bio_threads[j][w],NULL)) != 0) {
+                    serverLog(LL_WARNING,
+                        "Bio thread for job type #%d can be joined: %s",
+                            j, strerror(err));
+                } else {
+                    serverLog(LL_WARNING,
+                        "Bio thread for job type #%d terminated",j);
+                }
             }
         }
     }
@@ -27,16 +27,25 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+/* Make sure we have enough stack to perform all the things we do in the
+ * main thread. */
+#define REDIS_THREAD_STACK_SIZE (1024*1024*4)
+
 /* Exported API */
 void bioInit(void);
 void bioCreateBackgroundJob(int type, void *arg1, void *arg2, void *arg3);
 unsigned long long bioPendingJobsOfType(int type);
 unsigned long long bioWaitStepOfType(int type);
 time_t bioOlderJobOfType(int type);
+int bioWorkersOfType(int type);
+void bioGetWorkerStats(int type, int worker, unsigned long long *pending,
+                       unsigned long long *processed,
+                       unsigned long long *work_done);
 void bioKillThreads(void);
 
 /* Background job opcodes */
 #define BIO_CLOSE_FILE    0 /* Deferred close(2) syscall. */
 #define BIO_AOF_FSYNC     1 /* Deferred AOF fsync. */
 #define BIO_LAZY_FREE     2 /* Deferred objects freeing. */
-#define BIO_NUM_OPS       3
+#define BIO_RDB_WRITE     3 /* Fork-less BGSAVE writes and fsync. */
+#define BIO_NUM_OPS       4
@@ -76,6 +76,8 @@ void clusterDelNode(clusterNode *delnode);
 sds representClusterNodeFlags(sds ci, uint16_t flags);
 uint64_t clusterGetMaxEpoch(void);
 int clusterBumpConfigEpochWithoutConsensus(void);
+void clusterSlotMigrationCron(void);
+void clusterSlotMigrationStart(client *c, int slot, clusterNode *n);
 
 /* -----------------------------------------------------------------------------
  * Initialization
@@ -426,6 +428,7 @@ void clusterInit(void) {
     server.cluster->stats_bus_messages_sent = 0;
     server.cluster->stats_bus_messages_received = 0;
     memset(server.cluster->slots,0, sizeof(server.cluster->slots));
+    server.cluster->slot_migration = NULL;
     clusterCloseAllSlots();
 
     /* Lock the cluster config file to make sure every node uses
@@ -476,8 +479,8 @@ void clusterInit(void) {
         }
     }
 
-    /* The slots -> keys map is a sorted set. Init it. */
-    server.cluster->slots_to_keys = zslCreate();
+    /* Init the slots -> keys map. */
+    slotToKeyFlush();
 
     /* Set myself->port / cport to my listening ports, we'll just need to
      * discover the IP address via MEET messages. */
@@ -3366,6 +3369,9 @@ void clusterCron(void) {
     /* Abourt a manual failover if the timeout is reached. */
     manualFailoverCheckTimeout();
 
+    /* Check the state of the background slot migration, if any. */
+    clusterSlotMigrationCron();
+
     if (nodeIsSlave(myself)) {
         clusterHandleManualFailover();
         clusterHandleSlaveFailover();
@@ -4131,6 +4137,52 @@ void clusterCommand(client *c) {
         }
         clusterDoBeforeSleep(CLUSTER_TODO_SAVE_CONFIG|CLUSTER_TODO_UPDATE_STATE);
         addReply(c,shared.ok);
+    } else if (!strcasecmp(c->argv[1]->ptr,"migrateslot") && c->argc == 3 &&
+               !strcasecmp(c->argv[2]->ptr,"abort"))
+    {
+        /* CLUSTER MIGRATESLOT ABORT */
+        if (server.cluster->slot_migration == NULL) {
+            addReplyError(c,"No slot migration in progress");
+            return;
+        }
+        clusterSlotMigrationAbort("aborted by the user");
+        addReply(c,shared.ok);
+    } else if (!strcasecmp(c->argv[1]->ptr,"migrateslot") && c->argc == 4) {
+        /* CLUSTER MIGRATESLOT <slot> <node ID> */
+        clusterNode *n;
+        int slot;
+
+        if (nodeIsSlave(myself)) {
+            addReplyError(c,"Please use MIGRATESLOT only with masters.");
+            return;
+        }
+        if ((slot = getSlotOrReply(c,c->argv[2])) == -1) return;
+        if (server.cluster->slots[slot] != myself) {
+            addReplyErrorFormat(c,"I'm not the owner of hash slot %u",slot);
+            return;
+        }
+        if (server.cluster->migrating_slots_to[slot] ||
+            server.cluster->importing_slots_from[slot])
+        {
+            addReplyErrorFormat(c,"Hash slot %d is in migrating or "
+                                  "importing state",slot);
+            return;
+        }
+        if (server.cluster->slot_migration) {
+            addReplyError(c,"A slot migration is already in progress");
+            return;
+        }
+        if ((n = clusterLookupNode(c->argv[3]->ptr)) == NULL) {
+            addReplyErrorFormat(c,"I don't know about node %s",
+                (char*)c->argv[3]->ptr);
+            return;
+        }
+        if (n == myself || !nodeIsMaster(n) || nodeFailed(n)) {
+            addReplyError(c,"The target node must be a different, "
+                            "working master");
+            return;
+        }
+        clusterSlotMigrationStart(c,slot,n);
     } else if (!strcasecmp(c->argv[1]->ptr,"bumpepoch") && c->argc == 2) {
         /* CLUSTER BUMPEPOCH */
         int retval = clusterBumpConfigEpochWithoutConsensus();
@@ -4186,6 +4238,19 @@ void clusterCommand(client *c) {
             server.cluster->stats_bus_messages_sent,
             server.cluster->stats_bus_messages_received
         );
+        if (server.cluster->slot_migration) {
+            clusterSlotMigration *m = server.cluster->slot_migration;
+
+            info = sdscatprintf(info,
+                "cluster_slot_migration_in_progress:1\r\n"
+                "cluster_slot_migration_slot:%d\r\n"
+                "cluster_slot_migration_target:%.40s\r\n"
+                "cluster_slot_migration_keys_sent:%lld\r\n"
+                "cluster_slot_migration_dirty_keys:%lu\r\n",
+                m->slot, m->target, m->keys_sent, dictSize(m->dirty));
+        } else {
+            info = sdscat(info,"cluster_slot_migration_in_progress:0\r\n");
+        }
         addReplySds(c,sdscatprintf(sdsempty(),"$%lu\r\n",
             (unsigned long)sdslen(info)));
         addReplySds(c,info);
@@ -4597,11 +4662,15 @@ void restoreCommand(client *c) {
  * in serverCron() when they are around for more than a few seconds. */
 #define MIGRATE_SOCKET_CACHE_ITEMS 64 /* max num of items in the cache. */
 #define MIGRATE_SOCKET_CACHE_TTL 10 /* close cached sockets after 10 sec. */
+#define MIGRATE_WRITE_CHUNK (64*1024) /* Flush RESTORE commands every 64k. */
+#define MIGRATE_READBUF_LEN (16*1024) /* Buffer used to read the replies. */
 
 typedef struct migrateCachedSocket {
     int fd;
     long last_dbid;
     time_t last_use_time;
+    char readbuf[MIGRATE_READBUF_LEN]; /* Replies read but not consumed. */
+    size_t readbuf_len, readbuf_pos;
 } migrateCachedSocket;
 
 /* Return a migrateCachedSocket containing a TCP socket connected with the
@@ -4666,6 +4735,7 @@ migrateCachedSocket* migrateGetSocket(client *c, robj *host, robj *port, long ti
     cs->fd = fd;
     cs->last_dbid = -1;
     cs->last_use_time = server.unixtime;
+    cs->readbuf_len = cs->readbuf_pos = 0;
     dictAdd(server.migrate_cached_sockets,name,cs);
     return cs;
 }
@@ -4706,6 +4776,63 @@ void migrateCloseTimedoutSockets(void) {
     dictReleaseIterator(di);
 }
 
+/* Write the pending protocol accumulated in 'cmd' to the target instance
+ * in 64k chunks, then reset the buffer so that it can be reused for the
+ * next commands. Returns C_OK on success, C_ERR on I/O error or timeout. */
+int migrateWriteCommands(migrateCachedSocket *cs, rio *cmd, long timeout) {
+    sds buf = cmd->io.buffer.ptr;
+    size_t pos = 0, towrite;
+    ssize_t nwritten;
+
+    while ((towrite = sdslen(buf)-pos) > 0) {
+        towrite = (towrite > MIGRATE_WRITE_CHUNK) ? MIGRATE_WRITE_CHUNK :
+                                                    towrite;
+        nwritten = syncWrite(cs->fd,buf+pos,towrite,timeout);
+        if (nwritten != (signed)towrite) return C_ERR;
+        pos += nwritten;
+    }
+    sdsclear(buf);
+    cmd->io.buffer.pos = 0;
+    return C_OK;
+}
+
+/* Read a single reply line from the target instance, like syncReadLine()
+ * does, but using the read buffer of the cached socket: the replies of the
+ * pipelined RESTORE commands are fetched in chunks instead of issuing a
+ * read(2) call for every byte.
+ *
+ * On success the length of the line is returned, otherwise -1. */
+ssize_t migrateReadLine(migrateCachedSocket *cs, char *ptr, ssize_t size,
+                        long timeout)
+{
+    ssize_t nread = 0;
+
+    size--;
+    while(size) {
+        char c;
+
+        if (cs->readbuf_pos == cs->readbuf_len) {
+            ssize_t n = syncReadSome(cs->fd,cs->readbuf,
+                                     sizeof(cs->readbuf),timeout);
+            if (n <= 0) return -1;
+            cs->readbuf_len = n;
+            cs->readbuf_pos = 0;
+        }
+        c = cs->readbuf[cs->readbuf_pos++];
+        if (c == '\n') {
+            *ptr = '\0';
+            if (nread && *(ptr-1) == '\r') *(ptr-1) = '\0';
+            return nread;
+        } else {
+            *ptr++ = c;
+            *ptr = '\0';
+            nread++;
+        }
+        size--;
+    }
+    return nread;
+}
+
 /* MIGRATE host port key dbid timeout [COPY | REPLACE]
  *
  * On in the multiple keys form:
@@ -4723,6 +4850,10 @@ void migrateCommand(client *c) {
     rio cmd, payload;
     int may_retry = 1;
     int write_error = 0;
+    int sent = 0;      /* Index of the first key not yet written to a target. */
+    int start = 0;     /* Index of the first key sent in this attempt. */
+    int lost = 0;      /* Keys written to a connection lost before the reply. */
+    int flushed = 0;   /* Keys were flushed before the end in this attempt. */
 
     /* To support the KEYS option we need the following additional state. */
     int first_key = 3; /* Argument index of the first key. */
@@ -4787,6 +4918,8 @@ void migrateCommand(client *c) {
 
 try_again:
     write_error = 0;
+    flushed = 0;
+    start = sent;
 
     /* Connect */
     cs = migrateGetSocket(c,c->argv[1],c->argv[2],timeout);
@@ -4805,8 +4938,16 @@ try_again:
         serverAssertWithInfo(c,NULL,rioWriteBulkLongLong(&cmd,dbid));
     }
 
-    /* Create RESTORE payload and generate the protocol to call the command. */
-    for (j = 0; j < num_keys; j++) {
+    /* Create RESTORE payload and generate the protocol to call the command.
+     * Commands are pipelined: the protocol is flushed to the target every
+     * time the buffer grows over MIGRATE_WRITE_CHUNK bytes, so that the
+     * target starts restoring keys while we are still serializing, and the
+     * memory used does not depend on the number of keys migrated.
+     *
+     * After a retry only the keys that were not already written to the
+     * previous connection are sent. */
+    for (j = start; j < num_keys; j++) {
+        ttl = 0;
         expireat = getExpire(c->db,kv[j]);
         if (expireat != -1) {
             ttl = expireat-mstime();
@@ -4835,31 +4976,31 @@ try_again:
          * as a MIGRATE option. */
         if (replace)
             serverAssertWithInfo(c,NULL,rioWriteBulkString(&cmd,"REPLACE",7));
-    }
 
-    /* Transfer the query to the other node in 64K chunks. */
-    errno = 0;
-    {
-        sds buf = cmd.io.buffer.ptr;
-        size_t pos = 0, towrite;
-        int nwritten = 0;
-
-        while ((towrite = sdslen(buf)-pos) > 0) {
-            towrite = (towrite > (64*1024) ? (64*1024) : towrite);
-            nwritten = syncWrite(cs->fd,buf+pos,towrite,timeout);
-            if (nwritten != (signed)towrite) {
+        if (sdslen(cmd.io.buffer.ptr) >= MIGRATE_WRITE_CHUNK) {
+            errno = 0;
+            if (migrateWriteCommands(cs,&cmd,timeout) == C_ERR) {
                 write_error = 1;
                 goto socket_err;
             }
-            pos += nwritten;
+            sent = j+1;
+            flushed = 1;
         }
     }
 
+    /* Transfer what remains of the query to the other node. */
+    errno = 0;
+    if (migrateWriteCommands(cs,&cmd,timeout) == C_ERR) {
+        write_error = 1;
+        goto socket_err;
+    }
+    sent = num_keys;
+
     char buf1[1024]; /* Select reply. */
     char buf2[1024]; /* Restore reply. */
 
     /* Read the SELECT reply if needed. */
-    if (select && syncReadLine(cs->fd, buf1, sizeof(buf1), timeout) <= 0)
+    if (select && migrateReadLine(cs, buf1, sizeof(buf1), timeout) <= 0)
         goto socket_err;
 
     /* Read the RESTORE replies. */
@@ -4869,8 +5010,8 @@ try_again:
 
     if (!copy) newargv = zmalloc(sizeof(robj*)*(num_keys+1));
 
-    for (j = 0; j < num_keys; j++) {
-        if (syncReadLine(cs->fd, buf2, sizeof(buf2), timeout) <= 0) {
+    for (j = start; j < num_keys; j++) {
+        if (migrateReadLine(cs, buf2, sizeof(buf2), timeout) <= 0) {
             socket_error = 1;
             break;
         }
@@ -4897,11 +5038,13 @@ try_again:
     }
 
     /* On socket error, if we want to retry, do it now before rewriting the
-     * command vector. We only retry if we are sure nothing was processed
-     * and we failed to read the first reply (j == 0 test). */
-    if (!error_from_target && socket_error && j == 0 && may_retry &&
-        errno != ETIMEDOUT)
+     * command vector. We only retry if we are sure nothing was processed:
+     * we failed to read the first reply (j == start test), and the commands
+     * were written all at once, so none was flushed while serializing. */
+    if (!error_from_target && socket_error && j == start && !flushed &&
+        may_retry && errno != ETIMEDOUT)
     {
+        sent = start; /* Send the same keys again. */
         goto socket_err; /* A retry is guaranteed because of tested conditions.*/
     }
 
@@ -4926,7 +5069,14 @@ try_again:
         goto socket_err;
     }
 
-    if (!error_from_target) {
+    if (!error_from_target && lost) {
+        /* The keys written to the connection we lost before the retry may
+         * or may not have been restored by the target: they are not deleted
+         * here, and the error is reported to the caller. */
+        cs->last_dbid = dbid;
+        addReplySds(c,
+            sdsnew("-IOERR error or timeout writing to target instance\r\n"));
+    } else if (!error_from_target) {
         /* Success! Update the last_dbid in migrateCachedSocket, so that we can
          * avoid SELECT the next time if the target DB is the same. Reply +OK. */
         cs->last_dbid = dbid;
@@ -4956,6 +5106,7 @@ socket_err:
      * (or the code jumping here did not set may_retry to zero). */
     if (errno != ETIMEDOUT && may_retry) {
         may_retry = 0;
+        if (sent > start) lost = 1;
         goto try_again;
     }
 
@@ -4968,6 +5119,616 @@ socket_err:
     return;
 }
 
+/* -----------------------------------------------------------------------------
+ * Background slot migration
+ *
+ * CLUSTER MIGRATESLOT <slot> <node-id> moves a whole hash slot to another
+ * master without external help, and without the MIGRATING / IMPORTING
+ * states that force clients to follow ASK redirections for the whole time
+ * the keys are moved. This is how it works:
+ *
+ * 1) The target is set in IMPORTING state using a dedicated connection.
+ * 2) The keys of the slot are walked incrementally and copied to the target
+ *    as pipelined RESTORE-ASKING ... REPLACE commands. While this happens
+ *    the slot is still served by this node alone. Writing is driven by the
+ *    writable event of the connection and replies are read asynchronously,
+ *    so the event loop is never blocked waiting for the target. Large
+ *    aggregate values are sent in chunks using native commands, so that
+ *    neither node has to process a huge payload at once.
+ * 3) Keys created, modified or deleted after the copy started are tracked
+ *    in the 'dirty' set and sent again (or deleted in the target) once the
+ *    walk of the slot is completed.
+ * 4) When just a few dirty keys remain, they are sent synchronously together
+ *    with CLUSTER SETSLOT <slot> NODE <target>. Since no client is served in
+ *    the meantime the handover is atomic. Finally the local keys are deleted
+ *    and the slot is assigned to the target.
+ * -------------------------------------------------------------------------- */
+
+#define SLOT_MIGRATION_TIMEOUT 1000 /* Timeout of synchronous operations. */
+#define SLOT_MIGRATION_BUFFER (64*1024) /* Max protocol queued at once. */
+#define SLOT_MIGRATION_FEED_KEYS 100 /* Max keys serialized per event. */
+#define SLOT_MIGRATION_LARGE_ITEMS 1024 /* Send values with more elements
+                                           in chunks. */
+#define SLOT_MIGRATION_CHUNK_ITEMS 128 /* Elements per command in chunks. */
+#define SLOT_MIGRATION_HANDOVER_KEYS 128 /* Max dirty keys to send during the
+                                            synchronous handover. */
+
+void clusterSlotMigrationReadHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+void clusterSlotMigrationWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+
+void slotMigrationRelease(clusterSlotMigration *m) {
+    aeDeleteFileEvent(server.el,m->fd,AE_READABLE|AE_WRITABLE);
+    close(m->fd);
+    dictRelease(m->dirty);
+    sdsfree(m->large_key);
+    sdsfree(m->sndbuf);
+    sdsfree(m->rcvbuf);
+    zfree(m);
+    server.cluster->slot_migration = NULL;
+}
+
+/* Stop the slot migration in progress, if any. The slot is still served by
+ * this node, while the target is left in IMPORTING state with the keys
+ * copied so far, that must be removed before migrating the slot again. */
+void clusterSlotMigrationAbort(char *reason) {
+    clusterSlotMigration *m = server.cluster->slot_migration;
+
+    if (m == NULL) return;
+    serverLog(LL_WARNING,"Migration of slot %d to %.40s aborted: %s",
+        m->slot, m->target, reason);
+    slotMigrationRelease(m);
+}
+
+/* Track a change to 'key': if it belongs to the slot being migrated it is
+ * added to the set of keys to send again. */
+void clusterSlotMigrationKeyChanged(sds key) {
+    clusterSlotMigration *m = server.cluster->slot_migration;
+
+    if ((int)keyHashSlot(key,sdslen(key)) != m->slot) return;
+    if (dictFind(m->dirty,key) == NULL) dictAdd(m->dirty,sdsdup(key),NULL);
+
+    /* A large value that changes while we are sending its chunks will be
+     * sent again from scratch with the other dirty keys. */
+    if (m->large_key && sdscmp(m->large_key,key) == 0) {
+        sdsfree(m->large_key);
+        m->large_key = NULL;
+        m->large_node = NULL;
+    }
+}
+
+/* Called before the entry 'de' is removed from the keys of its slot. */
+void clusterSlotMigrationKeyUnlinked(dictEntry *de) {
+    clusterSlotMigration *m = server.cluster->slot_migration;
+    clusterDictEntryMetadata *meta = (clusterDictEntryMetadata *)dictMetadata(de);
+
+    if (m->cursor == de) m->cursor = meta->next;
+    clusterSlotMigrationKeyChanged(dictGetKey(de));
+}
+
+/* Called when the entry 'old' was reallocated at 'new'. */
+void clusterSlotMigrationEntryMoved(dictEntry *old, dictEntry *new) {
+    clusterSlotMigration *m = server.cluster->slot_migration;
+
+    if (m->cursor == old) m->cursor = new;
+}
+
+/* Called when the quicklist node 'old' was reallocated at 'new'. */
+void clusterSlotMigrationListNodeMoved(quicklistNode *old, quicklistNode *new) {
+    clusterSlotMigration *m = server.cluster->slot_migration;
+
+    if (m->large_node == old) m->large_node = new;
+}
+
+/* Return the number of elements of aggregate values that are not compactly
+ * encoded, or 0 for all the other values. Values with many elements are
+ * migrated in chunks. */
+unsigned long slotMigrationValueItems(robj *o) {
+    if (o->type == OBJ_LIST) return listTypeLength(o);
+    if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_HT)
+        return setTypeSize(o);
+    if (o->type == OBJ_ZSET && o->encoding == OBJ_ENCODING_SKIPLIST)
+        return zsetLength(o);
+    if (o->type == OBJ_HASH && o->encoding == OBJ_ENCODING_HT)
+        return hashTypeLength(o);
+    return 0;
+}
+
+/* Queue 'cmd' prefixed by ASKING, since the target is not yet the owner of
+ * the slot. Two more replies are expected. */
+void slotMigrationQueueAsking(clusterSlotMigration *m, rio *cmd, sds payload) {
+    serverAssert(rioWriteBulkCount(cmd,'*',1));
+    serverAssert(rioWriteBulkString(cmd,"ASKING",6));
+    serverAssert(rioWrite(cmd,payload,sdslen(payload)));
+    m->pending += 2;
+}
+
+/* Queue the commands needed to copy the key 'key', or to delete it from
+ * the target if 'o' is NULL. When 'chunked' is true, large values are not
+ * serialized here: they are set as the current 'large_key' and sent by
+ * slotMigrationQueueLargeValueChunk() a piece at a time. */
+void slotMigrationQueueKey(clusterSlotMigration *m, rio *cmd, sds key,
+                           robj *o, int chunked)
+{
+    rio aux;
+
+    if (o == NULL || (chunked &&
+        slotMigrationValueItems(o) > SLOT_MIGRATION_LARGE_ITEMS))
+    {
+        /* Deleted key, or start of a large value: DEL the old version. */
+        rioInitWithBuffer(&aux,sdsempty());
+        serverAssert(rioWriteBulkCount(&aux,'*',2));
+        serverAssert(rioWriteBulkString(&aux,"DEL",3));
+        serverAssert(rioWriteBulkString(&aux,key,sdslen(key)));
+        slotMigrationQueueAsking(m,cmd,aux.io.buffer.ptr);
+        sdsfree(aux.io.buffer.ptr);
+        if (o) {
+            m->large_key = sdsdup(key);
+            m->large_cursor = 0;
+            m->large_node = NULL;
+        }
+        return;
+    }
+
+    robj keyobj;
+    long long ttl = 0, expireat;
+    rio dump;
+
+    initStaticStringObject(keyobj,key);
+    expireat = getExpire(&server.db[0],&keyobj);
+    if (expireat != -1) {
+        ttl = expireat-mstime();
+        if (ttl < 1) ttl = 1;
+    }
+    createDumpPayload(&dump,o);
+    serverAssert(rioWriteBulkCount(cmd,'*',5));
+    serverAssert(rioWriteBulkString(cmd,"RESTORE-ASKING",14));
+    serverAssert(rioWriteBulkString(cmd,key,sdslen(key)));
+    serverAssert(rioWriteBulkLongLong(cmd,ttl));
+    serverAssert(rioWriteBulkString(cmd,dump.io.buffer.ptr,
+                                    sdslen(dump.io.buffer.ptr)));
+    serverAssert(rioWriteBulkString(cmd,"REPLACE",7));
+    sdsfree(dump.io.buffer.ptr);
+    m->pending++;
+    m->keys_sent++;
+}
+
+typedef struct slotMigrationChunk {
+    rio *args;                  /* Elements serialized as bulk strings. */
+    int type;                   /* Type of the value. */
+    int items;                  /* Number of arguments in 'args'. */
+} slotMigrationChunk;
+
+void slotMigrationScanCallback(void *privdata, const dictEntry *de) {
+    slotMigrationChunk *chunk = privdata;
+    sds field = dictGetKey(de);
+
+    if (chunk->type == OBJ_ZSET) {
+        serverAssert(rioWriteBulkDouble(chunk->args,*(double*)dictGetVal(de)));
+        chunk->items++;
+    }
+    serverAssert(rioWriteBulkString(chunk->args,field,sdslen(field)));
+    chunk->items++;
+    if (chunk->type == OBJ_HASH) {
+        sds value = dictGetVal(de);
+        serverAssert(rioWriteBulkString(chunk->args,value,sdslen(value)));
+        chunk->items++;
+    }
+}
+
+/* Queue the next chunk of the current large value, as a RPUSH, SADD, ZADD
+ * or HMSET command. When the whole value was sent, the expire is set if
+ * needed and 'large_key' is cleared. */
+void slotMigrationQueueLargeValueChunk(clusterSlotMigration *m, rio *cmd) {
+    robj keyobj, *o;
+    slotMigrationChunk chunk;
+    rio args, aux;
+    int done = 0;
+
+    initStaticStringObject(keyobj,m->large_key);
+    o = lookupKey(&server.db[0],&keyobj);
+    serverAssert(o != NULL); /* Deleting it would clear large_key. */
+
+    rioInitWithBuffer(&args,sdsempty());
+    chunk.args = &args;
+    chunk.type = o->type;
+    chunk.items = 0;
+    if (o->type == OBJ_LIST) {
+        /* Resume from the position where the previous chunk stopped, instead
+         * of seeking an index from the head every time. Any write to the
+         * list restarts the transfer of the key, so the position is valid. */
+        quicklistIter *qi = quicklistGetIterator(o->ptr,AL_START_HEAD);
+        quicklistEntry entry;
+
+        if (m->large_node) {
+            qi->current = m->large_node;
+            qi->offset = m->large_offset;
+        }
+        while (chunk.items < SLOT_MIGRATION_CHUNK_ITEMS &&
+               quicklistNext(qi,&entry))
+        {
+            if (entry.value) {
+                serverAssert(rioWriteBulkString(&args,(char*)entry.value,
+                                                entry.sz));
+            } else {
+                serverAssert(rioWriteBulkLongLong(&args,entry.longval));
+            }
+            chunk.items++;
+        }
+        m->large_node = qi->current;
+        m->large_offset = qi->offset+1;
+        done = m->large_node == NULL;
+        quicklistReleaseIterator(qi);
+    } else {
+        dict *d = (o->type == OBJ_ZSET) ? ((zset*)o->ptr)->dict : o->ptr;
+
+        do {
+            m->large_cursor = dictScan(d,m->large_cursor,
+                slotMigrationScanCallback,NULL,&chunk);
+        } while (m->large_cursor && chunk.items < SLOT_MIGRATION_CHUNK_ITEMS);
+        done = m->large_cursor == 0;
+    }
+
+    if (chunk.items) {
+        char *name = (o->type == OBJ_LIST) ? "RPUSH" :
+                     (o->type == OBJ_SET) ? "SADD" :
+                     (o->type == OBJ_ZSET) ? "ZADD" : "HMSET";
+
+        rioInitWithBuffer(&aux,sdsempty());
+        serverAssert(rioWriteBulkCount(&aux,'*',chunk.items+2));
+        serverAssert(rioWriteBulkString(&aux,name,strlen(name)));
+        serverAssert(rioWriteBulkString(&aux,m->large_key,
+                                        sdslen(m->large_key)));
+        serverAssert(rioWrite(&aux,args.io.buffer.ptr,
+                              sdslen(args.io.buffer.ptr)));
+        slotMigrationQueueAsking(m,cmd,aux.io.buffer.ptr);
+        sdsfree(aux.io.buffer.ptr);
+    }
+    sdsfree(args.io.buffer.ptr);
+    if (!done) return;
+
+    long long expireat = getExpire(&server.db[0],&keyobj);
+    if (expireat != -1) {
+        rioInitWithBuffer(&aux,sdsempty());
+        serverAssert(rioWriteBulkCount(&aux,'*',3));
+        serverAssert(rioWriteBulkString(&aux,"PEXPIREAT",9));
+        serverAssert(rioWriteBulkString(&aux,m->large_key,
+                                        sdslen(m->large_key)));
+        serverAssert(rioWriteBulkLongLong(&aux,expireat));
+        slotMigrationQueueAsking(m,cmd,aux.io.buffer.ptr);
+        sdsfree(aux.io.buffer.ptr);
+    }
+    sdsfree(m->large_key);
+    m->large_key = NULL;
+    m->keys_sent++;
+}
+
+/* Pop a random key from the dirty set and queue it for the target. */
+void slotMigrationQueueDirtyKey(clusterSlotMigration *m, rio *cmd, int chunked) {
+    dictEntry *de = dictGetRandomKey(m->dirty);
+    sds key = sdsdup(dictGetKey(de));
+    robj keyobj;
+
+    dictDelete(m->dirty,key);
+    initStaticStringObject(keyobj,key);
+    slotMigrationQueueKey(m,cmd,key,lookupKey(&server.db[0],&keyobj),chunked);
+    sdsfree(key);
+}
+
+/* Return true if there is still something to queue before the handover. */
+int slotMigrationHasWork(clusterSlotMigration *m) {
+    return m->cursor || m->large_key || dictSize(m->dirty);
+}
+
+/* Fill the send buffer with the commands to copy the next keys: first the
+ * keys of the slot in order, then the keys modified in the meantime. */
+void slotMigrationFeed(clusterSlotMigration *m) {
+    int keys = SLOT_MIGRATION_FEED_KEYS;
+    rio cmd;
+
+    rioInitWithBuffer(&cmd,m->sndbuf);
+    while (keys-- && slotMigrationHasWork(m) &&
+           sdslen(cmd.io.buffer.ptr)-m->sndbuf_pos < SLOT_MIGRATION_BUFFER)
+    {
+        if (m->large_key) {
+            slotMigrationQueueLargeValueChunk(m,&cmd);
+        } else if (m->cursor) {
+            dictEntry *de = m->cursor;
+            clusterDictEntryMetadata *meta = (clusterDictEntryMetadata *)dictMetadata(de);
+
+            m->cursor = meta->next;
+            slotMigrationQueueKey(m,&cmd,dictGetKey(de),dictGetVal(de),1);
+        } else {
+            slotMigrationQueueDirtyKey(m,&cmd,1);
+        }
+    }
+    m->sndbuf = cmd.io.buffer.ptr;
+}
+
+/* Consume the replies in the receive buffer. Returns C_ERR, logging the
+ * problem, if the target replied with an error. */
+int slotMigrationProcessReplies(clusterSlotMigration *m) {
+    char *p = m->rcvbuf, *nl;
+    int retval = C_OK;
+
+    while ((nl = memchr(p,'\n',sdslen(m->rcvbuf)-(p-m->rcvbuf))) != NULL) {
+        if (p[0] == '-') {
+            serverLog(LL_WARNING,"Target of the migration of slot %d "
+                "replied with error: %.*s", m->slot, (int)(nl-p), p);
+            retval = C_ERR;
+        }
+        m->pending--;
+        p = nl+1;
+    }
+    sdsrange(m->rcvbuf,p-m->rcvbuf,-1);
+    return retval;
+}
+
+/* Send a command to the target and read its single line reply within
+ * SLOT_MIGRATION_TIMEOUT milliseconds. Used only while setting up the
+ * migration. Returns C_ERR on I/O error. */
+int slotMigrationSyncCommand(int fd, char *buf, size_t buflen, int argc,
+                             char **argv)
+{
+    rio cmd;
+    int j, retval = C_OK;
+
+    rioInitWithBuffer(&cmd,sdsempty());
+    serverAssert(rioWriteBulkCount(&cmd,'*',argc));
+    for (j = 0; j < argc; j++)
+        serverAssert(rioWriteBulkString(&cmd,argv[j],strlen(argv[j])));
+    if (syncWrite(fd,cmd.io.buffer.ptr,sdslen(cmd.io.buffer.ptr),
+                  SLOT_MIGRATION_TIMEOUT) == -1 ||
+        syncReadLine(fd,buf,buflen,SLOT_MIGRATION_TIMEOUT) <= 0)
+    {
+        retval = C_ERR;
+    }
+    sdsfree(cmd.io.buffer.ptr);
+    return retval;
+}
+
+/* Complete the migration: send the remaining dirty keys and assign the slot
+ * to the target, then delete the local copy of the keys. Everything is
+ * performed synchronously, so that no client can write to the slot while
+ * the ownership changes. */
+void slotMigrationHandover(clusterSlotMigration *m) {
+    char slotstr[16];
+    rio cmd;
+
+    rioInitWithBuffer(&cmd,m->sndbuf);
+    while (dictSize(m->dirty)) slotMigrationQueueDirtyKey(m,&cmd,0);
+    ll2string(slotstr,sizeof(slotstr),m->slot);
+    serverAssert(rioWriteBulkCount(&cmd,'*',5));
+    serverAssert(rioWriteBulkString(&cmd,"CLUSTER",7));
+    serverAssert(rioWriteBulkString(&cmd,"SETSLOT",7));
+    serverAssert(rioWriteBulkString(&cmd,slotstr,strlen(slotstr)));
+    serverAssert(rioWriteBulkString(&cmd,"NODE",4));
+    serverAssert(rioWriteBulkString(&cmd,m->target,CLUSTER_NAMELEN));
+    m->sndbuf = cmd.io.buffer.ptr;
+    m->pending++;
+
+    if (syncWrite(m->fd,m->sndbuf+m->sndbuf_pos,
+                  sdslen(m->sndbuf)-m->sndbuf_pos,
+                  SLOT_MIGRATION_TIMEOUT) == -1)
+    {
+        clusterSlotMigrationAbort("error writing to the target");
+        return;
+    }
+    while (m->pending) {
+        char buf[PROTO_IOBUF_LEN];
+        ssize_t nread = syncReadSome(m->fd,buf,sizeof(buf),
+                                     SLOT_MIGRATION_TIMEOUT);
+        if (nread <= 0) {
+            /* We don't know if the target got the ownership of the slot.
+             * If it did, the configuration update will reach us via the
+             * cluster bus. */
+            clusterSlotMigrationAbort("error reading from the target "
+                                      "during the handover");
+            return;
+        }
+        m->rcvbuf = sdscatlen(m->rcvbuf,buf,nread);
+        if (slotMigrationProcessReplies(m) == C_ERR) {
+            clusterSlotMigrationAbort("error from the target during the "
+                                      "handover");
+            return;
+        }
+    }
+
+    /* The target is now the owner of the slot. */
+    int slot = m->slot;
+    long long keys_sent = m->keys_sent;
+    mstime_t elapsed = mstime()-m->start_time;
+    clusterNode *n = clusterLookupNode(m->target);
+    dictEntry *de;
+    slotMigrationRelease(m);
+
+    while ((de = server.cluster->slots_to_keys[slot].head) != NULL) {
+        sds sdskey = dictGetKey(de);
+        robj *argv[2];
+
+        argv[0] = shared.del;
+        argv[1] = createStringObject(sdskey,sdslen(sdskey));
+        propagate(server.delCommand,0,argv,2,PROPAGATE_AOF|PROPAGATE_REPL);
+        dbDelete(&server.db[0],argv[1]);
+        signalModifiedKey(&server.db[0],argv[1]);
+        decrRefCount(argv[1]);
+        server.dirty++;
+    }
+    clusterDelSlot(slot);
+    if (n) clusterAddSlot(n,slot);
+    clusterDoBeforeSleep(CLUSTER_TODO_SAVE_CONFIG|CLUSTER_TODO_UPDATE_STATE);
+    serverLog(LL_NOTICE,"Slot %d migrated to %.40s (%lld keys sent in "
+        "%lld milliseconds)", slot, n ? n->name : "?", keys_sent,
+        (long long)elapsed);
+}
+
+void clusterSlotMigrationWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    clusterSlotMigration *m = server.cluster->slot_migration;
+    ssize_t nwritten;
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    slotMigrationFeed(m);
+    if (m->sndbuf_pos < sdslen(m->sndbuf)) {
+        nwritten = write(fd,m->sndbuf+m->sndbuf_pos,
+                         sdslen(m->sndbuf)-m->sndbuf_pos);
+        if (nwritten <= 0) {
+            if (nwritten == -1 && errno == EAGAIN) return;
+            clusterSlotMigrationAbort("error writing to the target");
+            return;
+        }
+        m->sndbuf_pos += nwritten;
+        m->last_io_time = mstime();
+        if (m->sndbuf_pos == sdslen(m->sndbuf)) {
+            sdsclear(m->sndbuf);
+            m->sndbuf_pos = 0;
+        }
+        return;
+    }
+
+    /* Everything queued was sent. Once the keys of the slot were walked,
+     * complete the migration if just a few keys changed in the meantime. */
+    if (!m->cursor && !m->large_key &&
+        dictSize(m->dirty) <= SLOT_MIGRATION_HANDOVER_KEYS)
+    {
+        slotMigrationHandover(m);
+        return;
+    }
+    if (!slotMigrationHasWork(m)) {
+        aeDeleteFileEvent(el,fd,AE_WRITABLE);
+        m->write_handler = 0;
+    }
+}
+
+void clusterSlotMigrationReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    clusterSlotMigration *m = server.cluster->slot_migration;
+    char buf[PROTO_IOBUF_LEN];
+    ssize_t nread;
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    nread = read(fd,buf,sizeof(buf));
+    if (nread == -1 && errno == EAGAIN) return;
+    if (nread <= 0) {
+        clusterSlotMigrationAbort("connection with the target lost");
+        return;
+    }
+    m->last_io_time = mstime();
+    m->rcvbuf = sdscatlen(m->rcvbuf,buf,nread);
+    if (slotMigrationProcessReplies(m) == C_ERR)
+        clusterSlotMigrationAbort("error from the target");
+}
+
+/* Called from clusterCron(): abort the migration if the conditions changed,
+ * otherwise make sure the write handler is installed when there is
+ * something to do. */
+void clusterSlotMigrationCron(void) {
+    clusterSlotMigration *m = server.cluster->slot_migration;
+    clusterNode *target;
+
+    if (m == NULL) return;
+    target = clusterLookupNode(m->target);
+    if (nodeIsSlave(myself) || server.cluster->slots[m->slot] != myself ||
+        server.cluster->migrating_slots_to[m->slot] ||
+        server.cluster->importing_slots_from[m->slot])
+    {
+        clusterSlotMigrationAbort("the slot configuration changed");
+    } else if (target == NULL || nodeFailed(target) ||
+               !nodeIsMaster(target))
+    {
+        clusterSlotMigrationAbort("the target is no longer a working master");
+    } else if (m->pending &&
+               mstime()-m->last_io_time > server.cluster_node_timeout)
+    {
+        clusterSlotMigrationAbort("timeout waiting for the target");
+    } else if (!m->write_handler) {
+        if (aeCreateFileEvent(server.el,m->fd,AE_WRITABLE,
+            clusterSlotMigrationWriteHandler,NULL) != AE_ERR)
+        {
+            m->write_handler = 1;
+        }
+    }
+}
+
+/* CLUSTER MIGRATESLOT <slot> <node-id> implementation: set the target in
+ * importing state and start the background migration. */
+void clusterSlotMigrationStart(client *c, int slot, clusterNode *n) {
+    char buf[1024], slotstr[16];
+    clusterSlotMigration *m;
+    int fd;
+
+    fd = anetTcpNonBlockConnect(server.neterr,n->ip,n->port);
+    if (fd == -1) {
+        addReplyErrorFormat(c,"Can't connect to target node: %s",
+            server.neterr);
+        return;
+    }
+    anetEnableTcpNoDelay(server.neterr,fd);
+    if ((aeWait(fd,AE_WRITABLE,SLOT_MIGRATION_TIMEOUT) & AE_WRITABLE) == 0) {
+        addReplySds(c,
+            sdsnew("-IOERR error or timeout connecting to the target\r\n"));
+        close(fd);
+        return;
+    }
+
+    ll2string(slotstr,sizeof(slotstr),slot);
+    char *count[] = {"CLUSTER","COUNTKEYSINSLOT",slotstr};
+    char *importing[] = {"CLUSTER","SETSLOT",slotstr,"IMPORTING",myself->name};
+    if (slotMigrationSyncCommand(fd,buf,sizeof(buf),3,count) == C_ERR) {
+        addReplySds(c,sdsnew("-IOERR error or timeout talking with "
+                             "the target\r\n"));
+        close(fd);
+        return;
+    }
+    if (strcmp(buf,":0")) {
+        addReplyErrorFormat(c,"Target node already holds keys for hash "
+                              "slot %d, or replied with: %s", slot, buf);
+        close(fd);
+        return;
+    }
+    if (slotMigrationSyncCommand(fd,buf,sizeof(buf),5,importing) == C_ERR) {
+        addReplySds(c,sdsnew("-IOERR error or timeout talking with "
+                             "the target\r\n"));
+        close(fd);
+        return;
+    }
+    if (buf[0] == '-') {
+        addReplyErrorFormat(c,"Target node replied with error: %s",buf+1);
+        close(fd);
+        return;
+    }
+
+    m = zmalloc(sizeof(*m));
+    m->slot = slot;
+    memcpy(m->target,n->name,CLUSTER_NAMELEN);
+    m->fd = fd;
+    m->write_handler = 0;
+    m->cursor = server.cluster->slots_to_keys[slot].head;
+    m->dirty = dictCreate(&setDictType,NULL);
+    m->large_key = NULL;
+    m->large_cursor = 0;
+    m->large_node = NULL;
+    m->sndbuf = sdsempty();
+    m->sndbuf_pos = 0;
+    m->rcvbuf = sdsempty();
+    m->pending = 0;
+    m->keys_sent = 0;
+    m->start_time = m->last_io_time = mstime();
+    if (aeCreateFileEvent(server.el,fd,AE_READABLE,
+        clusterSlotMigrationReadHandler,NULL) == AE_ERR)
+    {
+        addReplyError(c,"Can't create the readable event for the target");
+        server.cluster->slot_migration = m;
+        slotMigrationRelease(m);
+        return;
+    }
+    server.cluster->slot_migration = m;
+    clusterSlotMigrationCron(); /* Install the write handler. */
+    serverLog(LL_NOTICE,"Migrating slot %d (%llu keys) to %.40s",
+        slot, (unsigned long long)countKeysInSlot(slot), n->name);
+    addReply(c,shared.ok);
+}
+
 /* -----------------------------------------------------------------------------
  * Cluster functions related to serving / redirecting clients
  * -------------------------------------------------------------------------- */
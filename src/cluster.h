@@ -106,6 +106,44 @@ typedef struct clusterNode {
     list *fail_reports;         /* List of nodes signaling this as failing */
 } clusterNode;
 
+/* Keys of the same hash slot are linked together in a doubly linked list,
+ * using the metadata of the entries of the main dictionary, see the
+ * Slot to Key API in db.c. */
+typedef struct slotToKeys {
+    uint64_t count;             /* Number of keys in the slot. */
+    dictEntry *head;            /* The first key-value entry in the slot. */
+} slotToKeys;
+
+/* Dict entry metadata for cluster mode, used for the Slot to Key API to form
+ * a linked list of the entries belonging to the same slot. */
+typedef struct clusterDictEntryMetadata {
+    dictEntry *prev;            /* Prev entry with key in the same slot */
+    dictEntry *next;            /* Next entry with key in the same slot */
+} clusterDictEntryMetadata;
+
+/* State of a background slot migration, see CLUSTER MIGRATESLOT. */
+typedef struct clusterSlotMigration {
+    int slot;                   /* Hash slot we are moving. */
+    char target[CLUSTER_NAMELEN]; /* Name of the node receiving the slot. */
+    int fd;                     /* Dedicated connection with the target. */
+    int write_handler;          /* True if the writable event is installed. */
+    dictEntry *cursor;          /* Next key of the slot to send. NULL once all
+                                   the keys of the slot were sent. */
+    dict *dirty;                /* Keys changed since the copy started. */
+    sds large_key;              /* Key of the large value we are sending in
+                                   chunks, or NULL. */
+    unsigned long large_cursor; /* Iteration state for 'large_key'. */
+    quicklistNode *large_node;  /* Node and offset of the next element to */
+    long large_offset;          /* send when 'large_key' is a list. */
+    sds sndbuf;                 /* Protocol still to send to the target. */
+    size_t sndbuf_pos;          /* Bytes of 'sndbuf' already sent. */
+    sds rcvbuf;                 /* Replies received but not yet parsed. */
+    long long pending;          /* Number of replies we are waiting for. */
+    long long keys_sent;        /* Number of keys sent (including resends). */
+    mstime_t start_time;        /* Migration start time. */
+    mstime_t last_io_time;      /* Last successful read or write. */
+} clusterSlotMigration;
+
 typedef struct clusterState {
     clusterNode *myself;  /* This node */
     uint64_t currentEpoch;
@@ -116,7 +154,8 @@ typedef struct clusterState {
     clusterNode *migrating_slots_to[CLUSTER_SLOTS];
     clusterNode *importing_slots_from[CLUSTER_SLOTS];
     clusterNode *slots[CLUSTER_SLOTS];
-    zskiplist *slots_to_keys;
+    slotToKeys slots_to_keys[CLUSTER_SLOTS];
+    clusterSlotMigration *slot_migration; /* Slot migration or NULL. */
     /* The following fields are used to take the slave state on elections. */
     mstime_t failover_auth_time; /* Time of previous or next election. */
     int failover_auth_count;    /* Number of votes received so far. */
@@ -43,11 +43,17 @@ robj *lookupKey(redisDb *db, robj *key) {
     if (de) {
         robj *val = dictGetVal(de);
 
-        /* Update the access time for the ageing algorithm.
+        /* Update the access time (or the access frequency when an LFU
+         * policy is used) for the ageing algorithm.
          * Don't do it if we have a saving child, as this will trigger
          * a copy on write madness. */
-        if (server.rdb_child_pid == -1 && server.aof_child_pid == -1)
-            val->lru = LRU_CLOCK();
+        if (server.rdb_child_pid == -1 && server.aof_child_pid == -1) {
+            if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
+                updateLFU(val);
+            } else {
+                val->lru = LRU_CLOCK();
+            }
+        }
         return val;
     } else {
         return NULL;
@@ -93,6 +99,7 @@ robj *lookupKeyRead(redisDb *db, robj *key) {
 
 robj *lookupKeyWrite(redisDb *db, robj *key) {
     expireIfNeeded(db,key);
+    if (server.rdb_snapshot) snapshotKeyWillChange(db,key->ptr);
     return lookupKey(db,key);
 }
 
@@ -113,12 +120,13 @@ robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply) {
  *
  * The program is aborted if the key already exists. */
 void dbAdd(redisDb *db, robj *key, robj *val) {
-    sds copy = sdsdup(key->ptr);
-    int retval = dictAdd(db->dict, copy, val);
+    dictEntry *de = dictAddRaw(db->dict, key->ptr);
 
-    serverAssertWithInfo(NULL,key,retval == C_OK);
+    serverAssertWithInfo(NULL,key,de != NULL);
+    dictSetVal(db->dict, de, val);
+    if (server.rdb_snapshot) snapshotKeyAdded(db,key->ptr);
     if (val->type == OBJ_LIST) signalListAsReady(db, key);
-    if (server.cluster_enabled) slotToKeyAdd(key);
+    if (server.cluster_enabled) slotToKeyAddEntry(de);
  }
 
 /* Overwrite an existing key with a new value. Incrementing the reference
@@ -127,10 +135,20 @@ void dbAdd(redisDb *db, robj *key, robj *val) {
  *
  * The program is aborted if the key was not already present. */
 void dbOverwrite(redisDb *db, robj *key, robj *val) {
-    dictEntry *de = dictFind(db->dict,key->ptr);
+    dictEntry *de;
+    robj *old;
 
+    if (server.rdb_snapshot) snapshotKeyWillChange(db,key->ptr);
+    de = dictFind(db->dict,key->ptr);
     serverAssertWithInfo(NULL,key,de != NULL);
-    dictReplace(db->dict, key->ptr, val);
+    old = dictGetVal(de);
+    dictSetVal(db->dict, de, val);
+    /* The old value may be a big aggregate: release it in background if
+     * the server is configured to lazy free its own deletions. */
+    if (server.lazyfree_lazy_server_del)
+        freeObjAsync(old);
+    else
+        decrRefCount(old);
 }
 
 /* High level Set operation. This function can be used in order to set
@@ -170,7 +188,7 @@ robj *dbRandomKey(redisDb *db) {
 
         key = dictGetKey(de);
         keyobj = createStringObject(key,sdslen(key));
-        if (dictFind(db->expires,key)) {
+        if (dbEntryGetExpire(de) != -1) {
             if (expireIfNeeded(db,keyobj)) {
                 decrRefCount(keyobj);
                 continue; /* search for another key. This expired. */
@@ -182,11 +200,16 @@ robj *dbRandomKey(redisDb *db) {
 
 /* Delete a key, value, and associated expiration entry if any, from the DB */
 int dbSyncDelete(redisDb *db, robj *key) {
-    /* Deleting an entry from the expires dict will not free the sds of
-     * the key, because it is shared with the main dictionary. */
-    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
-    if (dictDelete(db->dict,key->ptr) == DICT_OK) {
-        if (server.cluster_enabled) slotToKeyDel(key);
+    dictEntry *de;
+
+    if (server.rdb_snapshot) snapshotKeyWillChange(db,key->ptr);
+    de = dictUnlink(db->dict,key->ptr);
+    if (de) {
+        /* The expires dict just references the entry, that must be unlinked
+         * from it before being released. */
+        if (dbEntryGetExpire(de) != -1) dictDelete(db->expires,key->ptr);
+        if (server.cluster_enabled) slotToKeyDelEntry(de);
+        dictFreeUnlinkedEntry(db->dict,de);
         return 1;
     } else {
         return 0;
@@ -264,6 +287,8 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
     for (j = 0; j < server.dbnum; j++) {
         if (dbnum != -1 && dbnum != j) continue;
         removed += dictSize(server.db[j].dict);
+        /* A fork-less BGSAVE in progress still needs the old data. */
+        if (server.rdb_snapshot) snapshotDetachDb(&server.db[j]);
         if (async) {
             emptyDbAsync(&server.db[j]);
         } else {
@@ -271,14 +296,94 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
             dictEmpty(server.db[j].expires,callback);
         }
     }
+    if (server.cluster_enabled) slotToKeyFlush();
+    return removed;
+}
+
+/* The following functions are used by slaves loading a new data set from
+ * the master socket while still serving the old one (repl-diskless-load
+ * swapdb): the new data is loaded into a set of side databases that replace
+ * the main ones only once the load completed with success.
+ *
+ * In cluster mode the slots -> keys mapping of the old data set is saved
+ * while loading, so that the mapping is populated from scratch with the
+ * loaded keys, and restored if the load fails. */
+static slotToKeys *disklessLoadSlotsBackup = NULL;
+
+/* Create the side databases to load the new data set into. */
+redisDb *disklessLoadCreateDbs(void) {
+    redisDb *dbarray = zcalloc(sizeof(redisDb)*server.dbnum);
+    int j;
+
+    for (j = 0; j < server.dbnum; j++) {
+        dbarray[j].dict = dictCreate(&dbDictType,NULL);
+        dbarray[j].expires = dictCreate(&keyptrDictType,NULL);
+        dbarray[j].blocking_keys = dictCreate(&keylistDictType,NULL);
+        dbarray[j].ready_keys = dictCreate(&objectKeyPointerValueDictType,NULL);
+        dbarray[j].watched_keys = dictCreate(&keylistDictType,NULL);
+        dbarray[j].id = j;
+    }
     if (server.cluster_enabled) {
-        if (async) {
-            slotToKeyFlushAsync();
-        } else {
-            slotToKeyFlush();
-        }
+        disklessLoadSlotsBackup = zmalloc(sizeof(server.cluster->slots_to_keys));
+        memcpy(disklessLoadSlotsBackup,server.cluster->slots_to_keys,
+            sizeof(server.cluster->slots_to_keys));
+        slotToKeyFlush();
+    }
+    return dbarray;
+}
+
+/* Release the side databases and the data they contain. */
+static void disklessLoadReleaseDbs(redisDb *dbarray, int async) {
+    int j;
+
+    for (j = 0; j < server.dbnum; j++) {
+        if (async) emptyDbAsync(&dbarray[j]);
+        dictRelease(dbarray[j].dict);
+        dictRelease(dbarray[j].expires);
+        dictRelease(dbarray[j].blocking_keys);
+        dictRelease(dbarray[j].ready_keys);
+        dictRelease(dbarray[j].watched_keys);
+    }
+    zfree(dbarray);
+}
+
+/* The load failed: discard the partially loaded data set, the old one
+ * is still in place. */
+void disklessLoadDiscardDbs(redisDb *dbarray) {
+    disklessLoadReleaseDbs(dbarray,0);
+    if (server.cluster_enabled) {
+        memcpy(server.cluster->slots_to_keys,disklessLoadSlotsBackup,
+            sizeof(server.cluster->slots_to_keys));
+        zfree(disklessLoadSlotsBackup);
+        disklessLoadSlotsBackup = NULL;
+    }
+}
+
+/* The load succeeded: the loaded data set replaces the old one, that is
+ * released, in a background thread if 'async' is true. */
+void disklessLoadSwapDbs(redisDb *dbarray, int async) {
+    int j;
+
+    for (j = 0; j < server.dbnum; j++) {
+        dict *d, *e;
+
+        if (server.rdb_snapshot) snapshotDetachDb(&server.db[j]);
+        d = server.db[j].dict;
+        e = server.db[j].expires;
+
+        server.db[j].dict = dbarray[j].dict;
+        server.db[j].expires = dbarray[j].expires;
+        server.db[j].avg_ttl = 0;
+        server.db[j].expires_cursor = 0;
+        server.db[j].expired_stale_perc = 0;
+        dbarray[j].dict = d;
+        dbarray[j].expires = e;
+    }
+    disklessLoadReleaseDbs(dbarray,async);
+    if (server.cluster_enabled) {
+        zfree(disklessLoadSlotsBackup);
+        disklessLoadSlotsBackup = NULL;
     }
-    return removed;
 }
 
 int selectDb(client *c, int id) {
@@ -299,6 +404,11 @@ int selectDb(client *c, int id) {
 
 void signalModifiedKey(redisDb *db, robj *key) {
     touchWatchedKey(db,key);
+    if (server.cluster_enabled && server.cluster->slot_migration &&
+        sdsEncodedObject(key))
+    {
+        clusterSlotMigrationKeyChanged(key->ptr);
+    }
 }
 
 void signalFlushedDb(int dbid) {
@@ -357,11 +467,14 @@ void flushallCommand(client *c) {
         kill(server.rdb_child_pid,SIGUSR1);
         rdbRemoveTempFile(server.rdb_child_pid);
     }
+    if (server.rdb_snapshot) snapshotAbort();
     if (server.saveparamslen > 0) {
         /* Normally rdbSave() will reset dirty, but we don't want this here
          * as otherwise FLUSHALL will not be replicated nor put into the AOF. */
         int saved_dirty = server.dirty;
-        rdbSave(server.rdb_filename);
+        rdbSaveInfo rsi, *rsiptr;
+        rsiptr = rdbPopulateSaveInfo(&rsi);
+        rdbSave(server.rdb_filename,rsiptr);
         server.dirty = saved_dirty;
     }
     server.dirty++;
@@ -610,7 +723,7 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
         privdata[0] = keys;
         privdata[1] = o;
         do {
-            cursor = dictScan(ht, cursor, scanCallback, privdata);
+            cursor = dictScan(ht, cursor, scanCallback, NULL, privdata);
         } while (cursor &&
               maxiterations-- &&
               listLength(keys) < (unsigned long)count);
@@ -874,21 +987,84 @@ void moveCommand(client *c) {
  * Expires API
  *----------------------------------------------------------------------------*/
 
+/* The entries of the main dictionary embed the key name, so that a key
+ * costs a single allocation besides its value. The expire time of volatile
+ * keys is stored in the same allocation, between the entry metadata (see
+ * dictEntryMetadataSize()) and the key:
+ *
+ * +-----------+----------+-----------------+------------+----------+
+ * | dictEntry | metadata | expire (if any) | sds header | key name |
+ * +-----------+----------+-----------------+------------+----------+
+ *
+ * The expire field is added, moving the entry, the first time an expire is
+ * set on the key, and it is set to -1 when the key is made persistent. The
+ * db->expires dictionary just references the entries of the keys having an
+ * expire, so that they can be sampled by the active expire cycle and by the
+ * volatile eviction policies: it costs no allocation other than the slot in
+ * its hash table. */
+
+/* Return the address where the entry payload (the expire field, if any,
+ * and the key) starts. */
+static inline char *dbEntryPayload(dictEntry *de) {
+    return (char*)dictMetadata(de) + dictEntryMetadataSize(NULL);
+}
+
+static inline int dbEntryHasExpireField(dictEntry *de) {
+    return sdsAllocPtr(dictGetKey(de)) != dbEntryPayload(de);
+}
+
+/* Return the expire time of the key of the main dictionary entry 'de', or
+ * -1 if the key is non volatile. */
+long long dbEntryGetExpire(dictEntry *de) {
+    if (!dbEntryHasExpireField(de)) return -1;
+    return *(long long*)dbEntryPayload(de);
+}
+
+/* Reallocate the main dictionary entry 'de' with room for the expire
+ * field, initialized to -1. The new entry replaces the old one in the
+ * dictionary (and in the slots to keys mapping), and is returned. */
+static dictEntry *dbEntryAddExpireField(redisDb *db, dictEntry *de) {
+    sds key = dictGetKey(de);
+    size_t headerlen = dbEntryPayload(de) - (char*)de;
+    dictEntry **deref, *newde;
+    char *payload;
+
+    deref = dictFindEntryRefByPtrAndHash(db->dict,key,
+                                         dictGetHash(db->dict,key));
+    serverAssert(deref != NULL && *deref == de);
+    newde = zmalloc(headerlen+sizeof(long long)+sdsembedsize(sdslen(key)));
+    memcpy(newde,de,headerlen);
+    payload = dbEntryPayload(newde);
+    *(long long*)payload = -1;
+    newde->key = sdsembed(payload+sizeof(long long),key,sdslen(key));
+    *deref = newde;
+    if (server.cluster_enabled) slotToKeyReplaceEntry(newde,de);
+    zfree(de);
+    return newde;
+}
+
 int removeExpire(redisDb *db, robj *key) {
     /* An expire may only be removed if there is a corresponding entry in the
      * main dict. Otherwise, the key will never be freed. */
-    serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictDelete(db->expires,key->ptr) == DICT_OK;
+    dictEntry *de = dictFind(db->dict,key->ptr);
+    serverAssertWithInfo(NULL,key,de != NULL);
+    if (dbEntryGetExpire(de) == -1) return 0;
+    if (server.rdb_snapshot) snapshotKeyWillChange(db,key->ptr);
+    serverAssertWithInfo(NULL,key,dictDelete(db->expires,key->ptr) == DICT_OK);
+    *(long long*)dbEntryPayload(de) = -1;
+    return 1;
 }
 
 void setExpire(redisDb *db, robj *key, long long when) {
-    dictEntry *kde, *de;
+    dictEntry *de;
 
-    /* Reuse the sds from the main dict in the expire dict */
-    kde = dictFind(db->dict,key->ptr);
-    serverAssertWithInfo(NULL,key,kde != NULL);
-    de = dictReplaceRaw(db->expires,dictGetKey(kde));
-    dictSetSignedIntegerVal(de,when);
+    if (server.rdb_snapshot) snapshotKeyWillChange(db,key->ptr);
+    de = dictFind(db->dict,key->ptr);
+    serverAssertWithInfo(NULL,key,de != NULL);
+    if (!dbEntryHasExpireField(de)) de = dbEntryAddExpireField(db,de);
+    if (*(long long*)dbEntryPayload(de) == -1)
+        serverAssertWithInfo(NULL,key,dictLinkEntry(db->expires,de) == DICT_OK);
+    *(long long*)dbEntryPayload(de) = when;
 }
 
 /* Return the expire time of the specified key, or -1 if no expire
@@ -898,12 +1074,9 @@ long long getExpire(redisDb *db, robj *key) {
 
     /* No expire? return ASAP */
     if (dictSize(db->expires) == 0 ||
-       (de = dictFind(db->expires,key->ptr)) == NULL) return -1;
+       (de = dictFind(db->dict,key->ptr)) == NULL) return -1;
 
-    /* The entry was found in the expire dict, this means it should also
-     * be present in the main dict (safety check). */
-    serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictGetSignedIntegerVal(de);
+    return dbEntryGetExpire(de);
 }
 
 /* Propagate expires into slaves and the AOF file.
@@ -936,8 +1109,10 @@ int expireIfNeeded(redisDb *db, robj *key) {
 
     if (when < 0) return 0; /* No expire for this key */
 
-    /* Don't expire anything while loading. It will be done later. */
-    if (server.loading) return 0;
+    /* Don't expire anything while loading. It will be done later. While
+     * loading in side databases the old data set is still served, so
+     * expires are still checked. */
+    if (server.loading && !server.async_loading) return 0;
 
     /* If we are in the context of a Lua script, we claim that time is
      * blocked to when the Lua script started. This way a key can expire
@@ -1267,41 +1442,113 @@ int *migrateGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkey
     return keys;
 }
 
+/* Helper function to extract keys from the MEMORY command.
+ * The only subcommand taking a key is MEMORY USAGE <key> [SAMPLES <count>]. */
+int *memoryGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys) {
+    int *keys;
+    UNUSED(cmd);
+
+    if (argc >= 3 && !strcasecmp(argv[1]->ptr,"usage")) {
+        keys = zmalloc(sizeof(int) * 1);
+        keys[0] = 2;
+        *numkeys = 1;
+        return keys;
+    }
+    *numkeys = 0;
+    return NULL;
+}
+
 /* Slot to Key API. This is used by Redis Cluster in order to obtain in
  * a fast way a key that belongs to a specified hash slot. This is useful
- * while rehashing the cluster. */
-void slotToKeyAdd(robj *key) {
-    unsigned int hashslot = keyHashSlot(key->ptr,sdslen(key->ptr));
-
-    sds sdskey = sdsdup(key->ptr);
-    zslInsert(server.cluster->slots_to_keys,hashslot,sdskey);
+ * while rehashing the cluster and in other conditions when we need to
+ * understand if we have keys for a given hash slot.
+ *
+ * The keys of the same slot are linked together in a doubly linked list
+ * that lives in the metadata of the main dictionary entries (see
+ * clusterDictEntryMetadata), so the mapping costs two pointers per key,
+ * without copies of the key names, and O(1) work on additions, removals
+ * and when counting the keys of a slot. */
+
+static inline clusterDictEntryMetadata *slotToKeyMeta(dictEntry *de) {
+    return (clusterDictEntryMetadata *)dictMetadata(de);
+}
+
+static inline slotToKeys *slotToKeyEntrySlot(dictEntry *de) {
+    sds key = dictGetKey(de);
+    unsigned int hashslot = keyHashSlot(key,sdslen(key));
+    return &server.cluster->slots_to_keys[hashslot];
+}
+
+/* Link the dict entry 'entry', just added to the main dictionary, at the
+ * head of the list of keys of its hash slot. */
+void slotToKeyAddEntry(dictEntry *entry) {
+    slotToKeys *slot = slotToKeyEntrySlot(entry);
+    dictEntry *first = slot->head;
+
+    slot->count++;
+    slotToKeyMeta(entry)->next = first;
+    slotToKeyMeta(entry)->prev = NULL;
+    if (first != NULL) slotToKeyMeta(first)->prev = entry;
+    slot->head = entry;
+    if (server.cluster->slot_migration)
+        clusterSlotMigrationKeyChanged(dictGetKey(entry));
+}
+
+/* Unlink the dict entry 'entry' from the list of keys of its hash slot.
+ * Must be called before the entry is released. */
+void slotToKeyDelEntry(dictEntry *entry) {
+    slotToKeys *slot = slotToKeyEntrySlot(entry);
+    dictEntry *next = slotToKeyMeta(entry)->next;
+    dictEntry *prev = slotToKeyMeta(entry)->prev;
+
+    if (server.cluster->slot_migration) clusterSlotMigrationKeyUnlinked(entry);
+    slot->count--;
+    if (next != NULL) slotToKeyMeta(next)->prev = prev;
+    if (prev != NULL) {
+        slotToKeyMeta(prev)->next = next;
+    } else {
+        /* The removed entry was the first in the list. */
+        serverAssert(slot->head == entry);
+        slot->head = next;
+    }
 }
 
-void slotToKeyDel(robj *key) {
-    unsigned int hashslot = keyHashSlot(key->ptr,sdslen(key->ptr));
-    zslDelete(server.cluster->slots_to_keys,hashslot,key->ptr,NULL);
+/* Updates neighbour entries when the entry 'old' has been replaced by
+ * 'entry' (e.g. reallocated during active defragmentation). */
+void slotToKeyReplaceEntry(dictEntry *entry, dictEntry *old) {
+    dictEntry *next = slotToKeyMeta(entry)->next;
+    dictEntry *prev = slotToKeyMeta(entry)->prev;
+
+    if (next != NULL) slotToKeyMeta(next)->prev = entry;
+    if (prev != NULL) {
+        slotToKeyMeta(prev)->next = entry;
+    } else {
+        /* The replaced entry was the first in the list. */
+        slotToKeyEntrySlot(entry)->head = entry;
+    }
+    if (server.cluster->slot_migration)
+        clusterSlotMigrationEntryMoved(old,entry);
 }
 
+/* Reset the slots -> keys mapping. Called when the dictionary holding
+ * the entries was emptied (or is going to be released). */
 void slotToKeyFlush(void) {
-    zslFree(server.cluster->slots_to_keys);
-    server.cluster->slots_to_keys = zslCreate();
+    clusterSlotMigrationAbort("the keyspace was flushed");
+    memset(server.cluster->slots_to_keys,0,
+        sizeof(server.cluster->slots_to_keys));
 }
 
 /* Pupulate the specified array of objects with keys in the specified slot.
  * New objects are returned to represent keys, it's up to the caller to
  * decrement the reference count to release the keys names. */
 unsigned int getKeysInSlot(unsigned int hashslot, robj **keys, unsigned int count) {
-    zskiplistNode *n;
-    zrangespec range;
-    int j = 0;
-
-    range.min = range.max = hashslot;
-    range.minex = range.maxex = 0;
+    dictEntry *de = server.cluster->slots_to_keys[hashslot].head;
+    unsigned int j = 0;
 
-    n = zslFirstInRange(server.cluster->slots_to_keys, &range);
-    while(n && n->score == hashslot && count--) {
-        keys[j++] = createStringObject(n->ele,sdslen(n->ele));
-        n = n->level[0].forward;
+    while(de != NULL && count--) {
+        sds sdskey = dictGetKey(de);
+        keys[j++] = createStringObject(sdskey,sdslen(sdskey));
+        de = slotToKeyMeta(de)->next;
     }
     return j;
 }
@@ -1309,18 +1556,12 @@ unsigned int getKeysInSlot(unsigned int hashslot, robj **keys, unsigned int coun
 /* Remove all the keys in the specified hash slot.
  * The number of removed items is returned. */
 unsigned int delKeysInSlot(unsigned int hashslot) {
-    zskiplistNode *n;
-    zrangespec range;
-    int j = 0;
-
-    range.min = range.max = hashslot;
-    range.minex = range.maxex = 0;
+    dictEntry *de;
+    unsigned int j = 0;
 
-    n = zslFirstInRange(server.cluster->slots_to_keys, &range);
-    while(n && n->score == hashslot) {
-        sds sdskey = n->ele;
+    while ((de = server.cluster->slots_to_keys[hashslot].head) != NULL) {
+        sds sdskey = dictGetKey(de);
         robj *key = createStringObject(sdskey,sdslen(sdskey));
-        n = n->level[0].forward; /* Go to the next item before freeing it. */
         dbDelete(&server.db[0],key);
         decrRefCount(key);
         j++;
@@ -1329,30 +1570,5 @@ unsigned int delKeysInSlot(unsigned int hashslot) {
 }
 
 unsigned int countKeysInSlot(unsigned int hashslot) {
-    zskiplist *zsl = server.cluster->slots_to_keys;
-    zskiplistNode *zn;
-    zrangespec range;
-    int rank, count = 0;
-
-    range.min = range.max = hashslot;
-    range.minex = range.maxex = 0;
-
-    /* Find first element in range */
-    zn = zslFirstInRange(zsl, &range);
-
-    /* Use rank of first element, if any, to determine preliminary count */
-    if (zn != NULL) {
-        rank = zslGetRank(zsl, zn->score, zn->ele);
-        count = (zsl->length - (rank - 1));
-
-        /* Find last element in range */
-        zn = zslLastInRange(zsl, &range);
-
-        /* Use rank of last element, if any, to determine the actual count */
-        if (zn != NULL) {
-            rank = zslGetRank(zsl, zn->score, zn->ele);
-            count -= (zsl->length - rank);
-        }
-    }
-    return count;
+    return server.cluster->slots_to_keys[hashslot].count;
 }
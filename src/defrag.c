@@ -0,0 +1,533 @@
+/*
+ * Active memory defragmentation
+ * Try to find key / value allocations that need to be re-allocated in order
+ * to reduce external fragmentation.
+ * We do that by scanning the keyspace and for each pointer we have, we can try to
+ * ask the allocator if moving it to a new address will help reduce fragmentation.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2016, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "cluster.h"
+#include <time.h>
+#include <assert.h>
+#include <stddef.h>
+
+#ifdef HAVE_DEFRAG
+
+/* This function is exported by our version of jemalloc (deps/jemalloc),
+ * see je_get_defrag_hint() in deps/jemalloc/src/jemalloc.c. */
+int je_get_defrag_hint(void* ptr, int *bin_util, int *run_util);
+
+/* Defrag helper for generic allocations.
+ *
+ * Returns NULL in case the allocation wasn't moved.
+ * When it returns a non-null value, the old pointer was already released
+ * and should NOT be accessed. */
+void* activeDefragAlloc(void *ptr) {
+    int bin_util, run_util;
+    size_t size;
+    void *newptr;
+    if(!je_get_defrag_hint(ptr, &bin_util, &run_util)) {
+        server.stat_active_defrag_misses++;
+        return NULL;
+    }
+    /* If this run is more utilized than the average utilization in this bin
+     * (or it is full), skip it. This will eventually move all the allocations
+     * from relatively empty runs into relatively full runs. */
+    if (run_util > bin_util || run_util == 1<<16) {
+        server.stat_active_defrag_misses++;
+        return NULL;
+    }
+    /* Move this allocation to a new allocation.
+     * Make sure not to use the thread cache, so that we don't get back the
+     * same pointers we try to free. */
+    size = zmalloc_size(ptr);
+    newptr = zmalloc_no_tcache(size);
+    memcpy(newptr, ptr, size);
+    zfree_no_tcache(ptr);
+    server.stat_active_defrag_hits++;
+    return newptr;
+}
+
+/* Defrag helper for sds strings.
+ *
+ * Returns NULL in case the allocation wasn't moved.
+ * When it returns a non-null value, the old pointer was already released
+ * and should NOT be accessed. */
+sds activeDefragSds(sds sdsptr) {
+    void* ptr = sdsAllocPtr(sdsptr);
+    void* newptr = activeDefragAlloc(ptr);
+    if (newptr) {
+        size_t offset = sdsptr - (char*)ptr;
+        sdsptr = (char*)newptr + offset;
+        return sdsptr;
+    }
+    return NULL;
+}
+
+/* Defrag helper for robj and/or string objects.
+ *
+ * Returns NULL in case the allocation wasn't moved.
+ * When it returns a non-null value, the old pointer was already released
+ * and should NOT be accessed. */
+robj *activeDefragStringOb(robj* ob) {
+    robj *ret = NULL;
+    if (ob->refcount!=1)
+        return NULL;
+
+    /* Try to defrag robj (only if not an EMBSTR type, handled below). */
+    if (ob->type!=OBJ_STRING || ob->encoding!=OBJ_ENCODING_EMBSTR) {
+        if ((ret = activeDefragAlloc(ob)))
+            ob = ret;
+    }
+
+    /* Try to defrag string object. */
+    if (ob->type == OBJ_STRING) {
+        if(ob->encoding==OBJ_ENCODING_RAW) {
+            sds newsds = activeDefragSds((sds)ob->ptr);
+            if (newsds)
+                ob->ptr = newsds;
+        } else if (ob->encoding==OBJ_ENCODING_EMBSTR) {
+            /* The sds is embedded in the object allocation, calculate the
+             * offset and update the pointer in the new allocation. */
+            long ofs = (intptr_t)ob->ptr - (intptr_t)ob;
+            if ((ret = activeDefragAlloc(ob)))
+                ret->ptr = (void*)((intptr_t)ret + ofs);
+        } else if (ob->encoding!=OBJ_ENCODING_INT) {
+            serverPanic("Unknown string encoding");
+        }
+    }
+    return ret;
+}
+
+/* Defrag scan bucket callback: try to move the dictEntry referenced by
+ * 'entryref', fixing the bucket slot that references it. Used both for the
+ * keyspace and for the dictionaries of sets, hashes and sorted sets. */
+void defragDictBucketCallback(void *privdata, dictEntry **entryref) {
+    dictEntry *newde;
+    UNUSED(privdata);
+    if ((newde = activeDefragAlloc(*entryref)))
+        *entryref = newde;
+}
+
+/* Defrag scan bucket callback for the main db dictionary. Like
+ * defragDictBucketCallback() but the entry embeds the key name, and it is
+ * also referenced by the expires dict (when the key is volatile) and, in
+ * cluster mode, by the slot to keys lists: all must follow the moved entry. */
+void defragKeyspaceBucketCallback(void *privdata, dictEntry **entryref) {
+    redisDb *db = privdata;
+    dictEntry *de = *entryref, *newde, **expireref = NULL;
+    sds key = dictGetKey(de);
+
+    /* Look up the reference in the expires dict while the entry is still
+     * valid: by pointer, since the dict compares the keys of its entries. */
+    if (dbEntryGetExpire(de) != -1) {
+        expireref = dictFindEntryRefByPtrAndHash(db->expires,key,
+                        dictGetHash(db->expires,key));
+        serverAssert(expireref != NULL);
+    }
+    if ((newde = activeDefragAlloc(de))) {
+        *entryref = newde;
+        newde->key = (char*)newde + (key - (char*)de);
+        if (expireref) *expireref = newde;
+        if (server.cluster_enabled) slotToKeyReplaceEntry(newde,de);
+    }
+}
+
+/* Update the forward and backward pointers of the skiplist nodes that
+ * referenced 'oldnode', that was reallocated at 'newnode'. The 'update'
+ * array holds, for every level, the last node before 'oldnode'. */
+void zslUpdateNode(zskiplist *zsl, zskiplistNode *oldnode, zskiplistNode *newnode, zskiplistNode **update) {
+    int i;
+    for (i = 0; i < zsl->level; i++) {
+        if (update[i]->level[i].forward == oldnode)
+            update[i]->level[i].forward = newnode;
+    }
+    serverAssert(zsl->header!=oldnode);
+    if (newnode->level[0].forward) {
+        serverAssert(newnode->level[0].forward->backward==oldnode);
+        newnode->level[0].forward->backward = newnode;
+    } else {
+        serverAssert(zsl->tail==oldnode);
+        zsl->tail = newnode;
+    }
+}
+
+/* Defrag helper for sorted set.
+ * Update the element pointer, defrag the skiplist node and return the new
+ * score reference. The caller should update the score reference in the dict
+ * value. 'oldele' may be a dead pointer and is only compared by address. */
+double *zslDefrag(zskiplist *zsl, double score, sds oldele, sds newele) {
+    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x, *newx;
+    int i;
+    sds ele = newele? newele: oldele;
+
+    /* Find the skiplist node referring to the element that was moved,
+     * and all the pointers that need to be updated if we'll end up moving
+     * the skiplist node. */
+    x = zsl->header;
+    for (i = zsl->level-1; i >= 0; i--) {
+        while (x->level[i].forward &&
+            x->level[i].forward->ele != oldele && /* Make sure not to access
+                                                     the ele pointer if it
+                                                     matches oldele. */
+            (x->level[i].forward->score < score ||
+                (x->level[i].forward->score == score &&
+                sdscmp(x->level[i].forward->ele,ele) < 0)))
+            x = x->level[i].forward;
+        update[i] = x;
+    }
+
+    /* Update the element pointer, defrag the skiplist node and return the
+     * new score reference. */
+    x = x->level[0].forward;
+    serverAssert(x && score == x->score && x->ele==oldele);
+    if (newele)
+        x->ele = newele;
+
+    newx = activeDefragAlloc(x);
+    if (newx) {
+        zslUpdateNode(zsl, x, newx, update);
+        return &newx->score;
+    }
+    return NULL;
+}
+
+/* Defrag scan callbacks for the dictionaries of aggregate types. */
+void defragSetOrHashEntryCallback(void *privdata, const dictEntry *const_de) {
+    dictEntry *de = (dictEntry*)const_de;
+    int vals_are_sds = *(int*)privdata;
+    sds newsds;
+
+    if ((newsds = activeDefragSds(dictGetKey(de))))
+        de->key = newsds;
+    if (vals_are_sds && (newsds = activeDefragSds(dictGetVal(de))))
+        de->v.val = newsds;
+}
+
+void defragZsetEntryCallback(void *privdata, const dictEntry *const_de) {
+    dictEntry *de = (dictEntry*)const_de;
+    zset *zs = privdata;
+    sds sdsele = dictGetKey(de), newsds;
+    double *newscore;
+
+    if ((newsds = activeDefragSds(sdsele)))
+        de->key = newsds;
+    newscore = zslDefrag(zs->zsl, *(double*)dictGetVal(de), sdsele, newsds);
+    if (newscore)
+        dictSetVal(zs->dict, de, newscore);
+}
+
+/* Walk the whole dictionary 'd', defragging the dictEntry structures and
+ * calling 'fn' on every entry. */
+void activeDefragDict(dict *d, dictScanFunction *fn, void *privdata) {
+    unsigned long cursor = 0;
+    do {
+        cursor = dictScan(d, cursor, fn, defragDictBucketCallback, privdata);
+    } while (cursor);
+}
+
+/* Defrag helper for quicklists: defrag every node and its ziplist. */
+void activeDefragQuicklistNodes(quicklist *ql) {
+    quicklistNode *node = ql->head, *newnode;
+    unsigned char *newzl;
+
+    while (node) {
+        if ((newnode = activeDefragAlloc(node))) {
+            if (server.cluster_enabled && server.cluster->slot_migration)
+                clusterSlotMigrationListNodeMoved(node,newnode);
+            if (newnode->prev)
+                newnode->prev->next = newnode;
+            else
+                ql->head = newnode;
+            if (newnode->next)
+                newnode->next->prev = newnode;
+            else
+                ql->tail = newnode;
+            node = newnode;
+        }
+        if ((newzl = activeDefragAlloc(node->zl)))
+            node->zl = newzl;
+        node = node->next;
+    }
+}
+
+/* Defrag the value of a key, including the object header. Returns the new
+ * object pointer if the robj itself was moved, otherwise NULL. */
+robj *activeDefragObject(robj *ob) {
+    robj *newob;
+    void *newptr;
+
+    /* Try to defrag robj and / or string value. */
+    if ((newob = activeDefragStringOb(ob)))
+        ob = newob;
+    if (ob->refcount != 1) return newob;
+
+    if (ob->type == OBJ_STRING) {
+        /* Already handled in activeDefragStringOb. */
+    } else if (ob->type == OBJ_LIST) {
+        if (ob->encoding == OBJ_ENCODING_QUICKLIST) {
+            quicklist *ql = ob->ptr;
+            if ((newptr = activeDefragAlloc(ql)))
+                ob->ptr = ql = newptr;
+            activeDefragQuicklistNodes(ql);
+        } else if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+            if ((newptr = activeDefragAlloc(ob->ptr)))
+                ob->ptr = newptr;
+        } else {
+            serverPanic("Unknown list encoding");
+        }
+    } else if (ob->type == OBJ_SET) {
+        if (ob->encoding == OBJ_ENCODING_HT) {
+            int vals_are_sds = 0;
+            if ((newptr = activeDefragAlloc(ob->ptr)))
+                ob->ptr = newptr;
+            activeDefragDict(ob->ptr,defragSetOrHashEntryCallback,
+                             &vals_are_sds);
+        } else if (ob->encoding == OBJ_ENCODING_INTSET) {
+            if ((newptr = activeDefragAlloc(ob->ptr)))
+                ob->ptr = newptr;
+        } else {
+            serverPanic("Unknown set encoding");
+        }
+    } else if (ob->type == OBJ_ZSET) {
+        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+            if ((newptr = activeDefragAlloc(ob->ptr)))
+                ob->ptr = newptr;
+        } else if (ob->encoding == OBJ_ENCODING_SKIPLIST) {
+            zset *zs;
+            if ((newptr = activeDefragAlloc(ob->ptr)))
+                ob->ptr = newptr;
+            zs = ob->ptr;
+            if ((newptr = activeDefragAlloc(zs->zsl)))
+                zs->zsl = newptr;
+            if ((newptr = activeDefragAlloc(zs->dict)))
+                zs->dict = newptr;
+            activeDefragDict(zs->dict,defragZsetEntryCallback,zs);
+        } else {
+            serverPanic("Unknown sorted set encoding");
+        }
+    } else if (ob->type == OBJ_HASH) {
+        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+            if ((newptr = activeDefragAlloc(ob->ptr)))
+                ob->ptr = newptr;
+        } else if (ob->encoding == OBJ_ENCODING_HT) {
+            int vals_are_sds = 1;
+            if ((newptr = activeDefragAlloc(ob->ptr)))
+                ob->ptr = newptr;
+            activeDefragDict(ob->ptr,defragSetOrHashEntryCallback,
+                             &vals_are_sds);
+        } else {
+            serverPanic("Unknown hash encoding");
+        }
+    } else {
+        serverPanic("Unknown object type");
+    }
+    return newob;
+}
+
+/* Defrag scan callback for the main db dictionary. The dictEntry itself,
+ * that embeds the key name, was already handled by
+ * defragKeyspaceBucketCallback(). */
+void defragScanCallback(void *privdata, const dictEntry *const_de) {
+    dictEntry *de = (dictEntry*)const_de;
+    long long hits_before = server.stat_active_defrag_hits;
+    robj *newob;
+    UNUSED(privdata);
+
+    /* Try to defrag the value, including the object header. */
+    if ((newob = activeDefragObject(dictGetVal(de))))
+        de->v.val = newob;
+
+    if (server.stat_active_defrag_hits != hits_before)
+        server.stat_active_defrag_key_hits++;
+    else
+        server.stat_active_defrag_key_misses++;
+}
+
+/* Utility function to get the fragmentation ratio from jemalloc.
+ * It is critical to do that by comparing only heap maps that belong to
+ * jemalloc, and skip ones the jemalloc keeps as spare. Since we use this
+ * fragmentation ratio in order to decide if a defrag action should be taken
+ * or not, a false detection can cause the defragmenter to waste a lot of CPU
+ * without the possibility of getting any results. */
+float getAllocatorFragmentation(size_t *out_frag_bytes) {
+    size_t epoch = 1, allocated = 0, resident = 0, active = 0;
+    size_t sz = sizeof(size_t);
+
+    /* Update the statistics cached by mallctl. */
+    je_mallctl("epoch", &epoch, &sz, &epoch, sz);
+    /* Unlike RSS, this does not include RSS from shared libraries and other
+     * non heap mappings. */
+    je_mallctl("stats.resident", &resident, &sz, NULL, 0);
+    /* Unlike resident, this doesn't include the pages jemalloc reserves
+     * for re-use (purge will clean that). */
+    je_mallctl("stats.active", &active, &sz, NULL, 0);
+    /* Unlike zmalloc_used_memory, this matches the stats.resident by taking
+     * into account all allocations done by this process (not only zmalloc). */
+    je_mallctl("stats.allocated", &allocated, &sz, NULL, 0);
+    if (allocated == 0 || active < allocated) {
+        if (out_frag_bytes) *out_frag_bytes = 0;
+        return 0;
+    }
+    float frag_pct = ((float)active / allocated)*100 - 100;
+    size_t frag_bytes = active - allocated;
+    if (out_frag_bytes) *out_frag_bytes = frag_bytes;
+    serverLog(LL_DEBUG,
+        "allocated=%zu, active=%zu, resident=%zu, frag=%.0f%% (%zu bytes)",
+        allocated, active, resident, frag_pct, frag_bytes);
+    return frag_pct;
+}
+
+#define INTERPOLATE(x, x1, x2, y1, y2) ( (y1) + ((x)-(x1)) * ((y2)-(y1)) / ((x2)-(x1)) )
+#define LIMIT(y, min, max) ((y)<(min)? min: ((y)>(max)? max: (y)))
+
+/* Perform incremental defragmentation work from the serverCron.
+ * This works in a similar way to activeExpireCycle, in the sense that
+ * we do incremental work across calls. */
+void activeDefragCycle(void) {
+    static int current_db = -1;
+    static unsigned long cursor = 0;
+    static redisDb *db = NULL;
+    static long long start_scan, start_stat;
+    unsigned int iterations = 0;
+    unsigned long long defragged = server.stat_active_defrag_hits;
+    long long start, timelimit;
+
+    if (!server.active_defrag_enabled) {
+        if (server.active_defrag_running) {
+            /* If active defrag was disabled mid-run, start from fresh next
+             * time. */
+            server.active_defrag_running = 0;
+            db = NULL;
+            cursor = 0;
+            current_db = -1;
+        }
+        return;
+    }
+
+    if (server.aof_child_pid!=-1 || server.rdb_child_pid!=-1)
+        return; /* Defragging memory while there's a fork will just do damage. */
+
+    /* Once a second, check if the fragmentation justifies starting a scan
+     * or making it more aggressive. */
+    run_with_period(1000) {
+        size_t frag_bytes;
+        float frag_pct = getAllocatorFragmentation(&frag_bytes);
+        /* If we're not already running, and below the threshold, exit. */
+        if (!server.active_defrag_running) {
+            if (frag_pct < server.active_defrag_threshold_lower ||
+                frag_bytes < (size_t)server.active_defrag_ignore_bytes)
+                return;
+        }
+
+        /* Calculate the adaptive aggressiveness of the defrag. */
+        int cpu_pct = INTERPOLATE(frag_pct,
+                server.active_defrag_threshold_lower,
+                server.active_defrag_threshold_upper,
+                server.active_defrag_cycle_min,
+                server.active_defrag_cycle_max);
+        cpu_pct = LIMIT(cpu_pct,
+                server.active_defrag_cycle_min,
+                server.active_defrag_cycle_max);
+        /* We allow increasing the aggressiveness during a scan, but don't
+         * reduce it. */
+        if (!server.active_defrag_running ||
+            cpu_pct > server.active_defrag_running)
+        {
+            server.active_defrag_running = cpu_pct;
+            serverLog(LL_VERBOSE,
+                "Starting active defrag, frag=%.0f%%, frag_bytes=%zu, cpu=%d%%",
+                frag_pct, frag_bytes, cpu_pct);
+        }
+    }
+    if (!server.active_defrag_running)
+        return;
+
+    /* See activeExpireCycle for how timelimit is handled. */
+    start = ustime();
+    timelimit = 1000000*server.active_defrag_running/server.hz/100;
+    if (timelimit <= 0) timelimit = 1;
+
+    do {
+        if (!cursor) {
+            /* Move on to next database, and stop if we reached the last one. */
+            if (++current_db >= server.dbnum) {
+                long long now = ustime();
+                size_t frag_bytes;
+                float frag_pct = getAllocatorFragmentation(&frag_bytes);
+                serverLog(LL_VERBOSE,
+                    "Active defrag done in %dms, reallocated=%d, frag=%.0f%%, frag_bytes=%zu",
+                    (int)((now - start_scan)/1000), (int)(server.stat_active_defrag_hits - start_stat), frag_pct, frag_bytes);
+
+                start_scan = now;
+                current_db = -1;
+                cursor = 0;
+                db = NULL;
+                server.active_defrag_running = 0;
+                return;
+            } else if (current_db==0) {
+                /* Start a scan from the first database. */
+                start_scan = ustime();
+                start_stat = server.stat_active_defrag_hits;
+            }
+
+            db = &server.db[current_db];
+            cursor = 0;
+        }
+
+        do {
+            cursor = dictScan(db->dict, cursor, defragScanCallback,
+                              defragKeyspaceBucketCallback, db);
+            /* Once in 16 scan iterations, or 1000 pointer reallocations
+             * (if we have a lot of pointers in one hash bucket), check if we
+             * reached the time limit. */
+            if (cursor && (++iterations > 16 ||
+                server.stat_active_defrag_hits - defragged > 1000))
+            {
+                if ((ustime() - start) > timelimit) {
+                    return;
+                }
+                iterations = 0;
+                defragged = server.stat_active_defrag_hits;
+            }
+        } while(cursor);
+    } while(1);
+}
+
+#else /* HAVE_DEFRAG */
+
+void activeDefragCycle(void) {
+    /* Not implemented: requires our patched jemalloc. */
+}
+
+#endif
@@ -46,6 +46,18 @@
 #include "dict.h"
 #include "zmalloc.h"
 #include "redisassert.h"
+#include "siphash.h"
+
+/* random() only returns 31 bits: bucket indexes of tables with more than
+ * 2^31 buckets are picked combining multiple calls. */
+#if ULONG_MAX > 0xffffffffUL
+#define randomULong() (((unsigned long)random() << 62) ^ \
+                       ((unsigned long)random() << 31) ^ \
+                       (unsigned long)random())
+#else
+#define randomULong() ((unsigned long)random() ^ \
+                       ((unsigned long)random() << 31))
+#endif
 
 /* Using dictEnableResize() / dictDisableResize() we make possible to
  * enable/disable resizing of the hash table as needed. This is very important
@@ -54,7 +66,8 @@
  *
  * Note that even when dict_can_resize is set to 0, not all resizes are
  * prevented: a hash table is still allowed to grow if the ratio between
- * the number of elements and the buckets > dict_force_resize_ratio. */
+ * the number of elements and the buckets > dict_force_resize_ratio times
+ * DICT_BUCKET_FILL. */
 static int dict_can_resize = 1;
 static unsigned int dict_force_resize_ratio = 5;
 
@@ -62,94 +75,32 @@ static unsigned int dict_force_resize_ratio = 5;
 
 static int _dictExpandIfNeeded(dict *ht);
 static unsigned long _dictNextPower(unsigned long size);
-static int _dictKeyIndex(dict *ht, const void *key);
+static long _dictKeyIndex(dict *ht, const void *key, uint64_t *hash);
 static int _dictInit(dict *ht, dictType *type, void *privDataPtr);
 
 /* -------------------------- hash functions -------------------------------- */
 
-/* Thomas Wang's 32 bit Mix Function */
-unsigned int dictIntHashFunction(unsigned int key)
-{
-    key += ~(key << 15);
-    key ^=  (key >> 10);
-    key +=  (key << 3);
-    key ^=  (key >> 6);
-    key += ~(key << 11);
-    key ^=  (key >> 16);
-    return key;
-}
-
-static uint32_t dict_hash_function_seed = 5381;
+static uint8_t dict_hash_function_seed[SIPHASH_KEY_LEN];
 
-void dictSetHashFunctionSeed(uint32_t seed) {
-    dict_hash_function_seed = seed;
+void dictSetHashFunctionSeed(uint8_t *seed) {
+    memcpy(dict_hash_function_seed,seed,sizeof(dict_hash_function_seed));
 }
 
-uint32_t dictGetHashFunctionSeed(void) {
+uint8_t *dictGetHashFunctionSeed(void) {
     return dict_hash_function_seed;
 }
 
-/* MurmurHash2, by Austin Appleby
- * Note - This code makes a few assumptions about how your machine behaves -
- * 1. We can read a 4-byte value from any address without crashing
- * 2. sizeof(int) == 4
- *
- * And it has a few limitations -
- *
- * 1. It will not work incrementally.
- * 2. It will not produce the same results on little-endian and big-endian
- *    machines.
- */
-unsigned int dictGenHashFunction(const void *key, int len) {
-    /* 'm' and 'r' are mixing constants generated offline.
-     They're not really 'magic', they just happen to work well.  */
-    uint32_t seed = dict_hash_function_seed;
-    const uint32_t m = 0x5bd1e995;
-    const int r = 24;
-
-    /* Initialize the hash to a 'random' value */
-    uint32_t h = seed ^ len;
-
-    /* Mix 4 bytes at a time into the hash */
-    const unsigned char *data = (const unsigned char *)key;
-
-    while(len >= 4) {
-        uint32_t k = *(uint32_t*)data;
-
-        k *= m;
-        k ^= k >> r;
-        k *= m;
-
-        h *= m;
-        h ^= k;
-
-        data += 4;
-        len -= 4;
-    }
-
-    /* Handle the last few bytes of the input array  */
-    switch(len) {
-    case 3: h ^= data[2] << 16;
-    case 2: h ^= data[1] << 8;
-    case 1: h ^= data[0]; h *= m;
-    };
-
-    /* Do a few final mixes of the hash to ensure the last few
-     * bytes are well-incorporated. */
-    h ^= h >> 13;
-    h *= m;
-    h ^= h >> 15;
-
-    return (unsigned int)h;
+/* The default hash functions use SipHash (see siphash.c), keyed with the
+ * random seed set at startup, so that the distribution of the keys in the
+ * buckets can't be predicted from outside. The hash is 64 bits wide so
+ * that tables bigger than 2^32 buckets are still well distributed. */
+uint64_t dictGenHashFunction(const void *key, int len) {
+    return siphash(key,len,dict_hash_function_seed);
 }
 
-/* And a case insensitive hash function (based on djb hash) */
-unsigned int dictGenCaseHashFunction(const unsigned char *buf, int len) {
-    unsigned int hash = (unsigned int)dict_hash_function_seed;
-
-    while (len--)
-        hash = ((hash << 5) + hash) + (tolower(*buf++)); /* hash * 33 + c */
-    return hash;
+/* And a case insensitive hash function. */
+uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len) {
+    return siphash_nocase(buf,len,dict_hash_function_seed);
 }
 
 /* ----------------------------- API implementation ------------------------- */
@@ -162,6 +113,7 @@ static void _dictReset(dictht *ht)
     ht->size = 0;
     ht->sizemask = 0;
     ht->used = 0;
+    ht->children = 0;
 }
 
 /* Create a new hash table */
@@ -188,10 +140,10 @@ int _dictInit(dict *d, dictType *type,
 }
 
 /* Resize the table to the minimal size that contains all the elements,
- * but with the invariant of a USED/BUCKETS ratio near to <= 1 */
+ * but with the invariant of a USED/BUCKETS ratio near to <= DICT_BUCKET_FILL */
 int dictResize(dict *d)
 {
-    int minimal;
+    unsigned long minimal;
 
     if (!dict_can_resize || dictIsRehashing(d)) return DICT_ERR;
     minimal = d->ht[0].used;
@@ -200,11 +152,13 @@ int dictResize(dict *d)
     return dictExpand(d, minimal);
 }
 
-/* Expand or create the hash table */
+/* Expand or create the hash table so that it can hold 'size' elements
+ * before the next expansion is needed. */
 int dictExpand(dict *d, unsigned long size)
 {
     dictht n; /* the new hash table */
-    unsigned long realsize = _dictNextPower(size);
+    unsigned long realsize =
+        _dictNextPower((size+DICT_BUCKET_FILL-1)/DICT_BUCKET_FILL);
 
     /* the size is invalid if it is smaller than the number of
      * elements already inside the hash table */
@@ -214,11 +168,12 @@ int dictExpand(dict *d, unsigned long size)
     /* Rehashing to the same table size is not useful. */
     if (realsize == d->ht[0].size) return DICT_ERR;
 
-    /* Allocate the new hash table and initialize all pointers to NULL */
+    /* Allocate the new hash table and initialize all the buckets as empty */
     n.size = realsize;
     n.sizemask = realsize-1;
-    n.table = zcalloc(realsize*sizeof(dictEntry*));
+    n.table = zcalloc(realsize*sizeof(dictBucket));
     n.used = 0;
+    n.children = 0;
 
     /* Is this the first initialization? If so it's not really a rehashing
      * we just set the first hash table so that it can accept keys. */
@@ -233,49 +188,162 @@ int dictExpand(dict *d, unsigned long size)
     return DICT_OK;
 }
 
+/* ------------------------------- Buckets -----------------------------------
+ *
+ * Every bucket of the table holds up to DICT_BUCKET_SLOTS entry pointers,
+ * so a lookup usually touches a single cache line before dereferencing the
+ * entry that holds the key. For every used slot the high byte of the hash
+ * of the key is also stored in the bucket, so that the entries (and the
+ * keys) of the other slots don't need to be accessed at all, except in the
+ * rare case of a fingerprint collision.
+ *
+ * When more than DICT_BUCKET_SLOTS keys hash into the same bucket, a child
+ * bucket is allocated and linked to the full one, and so forth. Entries are
+ * never moved from a slot to another one while they are in the table, so
+ * the dictEntry pointers stay valid until the entry is deleted. */
+
+#define dictHashFingerprint(h) ((uint8_t)((h) >> 56))
+#define dictBucketIsEmpty(b) ((b)->presence == 0 && (b)->child == NULL)
+
+/* Store 'de', whose key hashes to 'hash', in the first free slot of the
+ * bucket 'b' of the table 'ht' or of its children, allocating a new child
+ * if needed. */
+static void _dictBucketInsert(dictht *ht, dictBucket *b, dictEntry *de,
+                              uint64_t hash)
+{
+    int j;
+
+    while (b->presence == (1<<DICT_BUCKET_SLOTS)-1) {
+        if (b->child == NULL) {
+            b->child = zcalloc(sizeof(dictBucket));
+            ht->children++;
+        }
+        b = b->child;
+    }
+    for (j = 0; j < DICT_BUCKET_SLOTS; j++)
+        if (!(b->presence & (1<<j))) break;
+    b->presence |= 1<<j;
+    b->fingerprints[j] = dictHashFingerprint(hash);
+    b->entries[j] = de;
+}
+
+/* Return the reference of the slot holding 'key' in the bucket 'b' or
+ * in its children, or NULL if the key is not there. */
+static dictEntry **_dictBucketFind(dict *d, dictBucket *b, const void *key,
+                                   uint64_t hash)
+{
+    uint8_t fp = dictHashFingerprint(hash);
+    int j;
+
+    do {
+        for (j = 0; j < DICT_BUCKET_SLOTS; j++) {
+            if ((b->presence & (1<<j)) && b->fingerprints[j] == fp &&
+                dictCompareKeys(d, key, b->entries[j]->key))
+                return &b->entries[j];
+        }
+        b = b->child;
+    } while(b);
+    return NULL;
+}
+
+/* Clear the slot 'ref' of the bucket chain starting at 'b', releasing the
+ * child buckets left empty. Children are not released while there are safe
+ * iterators, since they may reference the bucket. */
+static void _dictBucketRemove(dict *d, dictht *ht, dictBucket *b,
+                              dictEntry **ref)
+{
+    dictBucket *parent = NULL;
+
+    while (ref < b->entries || ref >= b->entries+DICT_BUCKET_SLOTS) {
+        parent = b;
+        b = b->child;
+    }
+    b->presence &= ~(1<<(ref - b->entries));
+    if (parent && b->presence == 0 && d->iterators == 0) {
+        parent->child = b->child;
+        zfree(b);
+        ht->children--;
+    }
+}
+
+/* Return the number of entries stored in the bucket 'b' and its children. */
+static int _dictBucketCount(dictBucket *b) {
+    int count = 0, j;
+
+    for (; b; b = b->child)
+        for (j = 0; j < DICT_BUCKET_SLOTS; j++)
+            if (b->presence & (1<<j)) count++;
+    return count;
+}
+
+/* Release the children of the bucket 'b' of the table 'ht' and mark it as
+ * empty. The entries are not touched. */
+static void _dictBucketReset(dictht *ht, dictBucket *b) {
+    dictBucket *child = b->child;
+
+    while (child) {
+        dictBucket *next = child->child;
+        zfree(child);
+        ht->children--;
+        child = next;
+    }
+    b->presence = 0;
+    b->child = NULL;
+}
+
 /* Performs N steps of incremental rehashing. Returns 1 if there are still
  * keys to move from the old to the new hash table, otherwise 0 is returned.
  *
  * Note that a rehashing step consists in moving a bucket (that may have more
- * than one key as we use chaining) from the old to the new hash table, however
- * since part of the hash table may be composed of empty spaces, it is not
- * guaranteed that this function will rehash even a single bucket, since it
- * will visit at max N*10 empty buckets in total, otherwise the amount of
- * work it does would be unbound and the function may block for a long time. */
+ * than one key) from the old to the new hash table, however since part of
+ * the hash table may be composed of empty spaces, it is not guaranteed that
+ * this function will rehash even a single bucket, since it will visit at
+ * max N*10 empty buckets in total, otherwise the amount of work it does
+ * would be unbound and the function may block for a long time. */
 int dictRehash(dict *d, int n) {
     int empty_visits = n*10; /* Max number of empty buckets to visit. */
     if (!dictIsRehashing(d)) return 0;
 
     while(n-- && d->ht[0].used != 0) {
-        dictEntry *de, *nextde;
+        dictBucket *bucket, *b;
+        int j;
 
         /* Note that rehashidx can't overflow as we are sure there are more
          * elements because ht[0].used != 0 */
         assert(d->ht[0].size > (unsigned long)d->rehashidx);
-        while(d->ht[0].table[d->rehashidx] == NULL) {
+        while(dictBucketIsEmpty(&d->ht[0].table[d->rehashidx])) {
             d->rehashidx++;
             if (--empty_visits == 0) return 1;
         }
-        de = d->ht[0].table[d->rehashidx];
+        bucket = &d->ht[0].table[d->rehashidx];
         /* Move all the keys in this bucket from the old to the new hash HT */
-        while(de) {
-            unsigned int h;
-
-            nextde = de->next;
-            /* Get the index in the new hash table */
-            h = dictHashKey(d, de->key) & d->ht[1].sizemask;
-            de->next = d->ht[1].table[h];
-            d->ht[1].table[h] = de;
-            d->ht[0].used--;
-            d->ht[1].used++;
-            de = nextde;
+        for (b = bucket; b; b = b->child) {
+            for (j = 0; j < DICT_BUCKET_SLOTS; j++) {
+                dictEntry *de;
+                uint64_t h;
+
+                if (!(b->presence & (1<<j))) continue;
+                de = b->entries[j];
+                /* Get the index in the new hash table */
+                h = dictHashKey(d, de->key);
+                _dictBucketInsert(&d->ht[1],
+                                  &d->ht[1].table[h & d->ht[1].sizemask],
+                                  de,h);
+                d->ht[0].used--;
+                d->ht[1].used++;
+            }
         }
-        d->ht[0].table[d->rehashidx] = NULL;
+        _dictBucketReset(&d->ht[0],bucket);
         d->rehashidx++;
     }
 
     /* Check if we already rehashed the whole table... */
     if (d->ht[0].used == 0) {
+        unsigned long j;
+
+        /* Buckets emptied by deletions may still have children. */
+        for (j = d->rehashidx; j < d->ht[0].size; j++)
+            _dictBucketReset(&d->ht[0],&d->ht[0].table[j]);
         zfree(d->ht[0].table);
         d->ht[0] = d->ht[1];
         _dictReset(&d->ht[1]);
@@ -299,6 +367,7 @@ int dictRehashMilliseconds(dict *d, int ms) {
     long long start = timeInMilliseconds();
     int rehashes = 0;
 
+    if (d->iterators) return 0;
     while(dictRehash(d,100)) {
         rehashes += 100;
         if (timeInMilliseconds()-start > ms) break;
@@ -345,7 +414,8 @@ int dictAdd(dict *d, void *key, void *val)
  */
 dictEntry *dictAddRaw(dict *d, void *key)
 {
-    int index;
+    long index;
+    uint64_t hash;
     dictEntry *entry;
     dictht *ht;
 
@@ -353,24 +423,51 @@ dictEntry *dictAddRaw(dict *d, void *key)
 
     /* Get the index of the new element, or -1 if
      * the element already exists. */
-    if ((index = _dictKeyIndex(d, key)) == -1)
+    if ((index = _dictKeyIndex(d, key, &hash)) == -1)
         return NULL;
 
-    /* Allocate the memory and store the new entry.
-     * Insert the element in top, with the assumption that in a database
-     * system it is more likely that recently added entries are accessed
-     * more frequently. */
+    /* Allocate the memory and store the new entry in the first free
+     * slot of the bucket. */
     ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
-    entry = zmalloc(sizeof(*entry));
-    entry->next = ht->table[index];
-    ht->table[index] = entry;
+    size_t metasize = dictMetadataSize(d);
+    size_t keysize = d->type->embedKey ? d->type->embeddedKeyBytes(key) : 0;
+    assert(!d->type->sharedEntries);
+    entry = zmalloc(sizeof(*entry) + metasize + keysize);
+    if (metasize > 0) {
+        memset(dictMetadata(entry), 0, metasize);
+    }
+    _dictBucketInsert(ht,&ht->table[index],entry,hash);
     ht->used++;
 
     /* Set the hash entry fields. */
-    dictSetKey(d, entry, key);
+    if (d->type->embedKey)
+        entry->key = d->type->embedKey((char*)dictMetadata(entry)+metasize,key);
+    else
+        dictSetKey(d, entry, key);
     return entry;
 }
 
+/* Add to the dictionary 'd', that must have the sharedEntries flag set in
+ * its type, the entry 'de' that belongs to a different dictionary, without
+ * allocating anything but the bucket slot referencing it. This is useful to
+ * index a subset of the elements of a dictionary by the same key.
+ *
+ * Return DICT_ERR if an entry with the same key is already present. */
+int dictLinkEntry(dict *d, dictEntry *de) {
+    long index;
+    uint64_t hash;
+    dictht *ht;
+
+    assert(d->type->sharedEntries);
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    if ((index = _dictKeyIndex(d, de->key, &hash)) == -1)
+        return DICT_ERR;
+    ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
+    _dictBucketInsert(ht,&ht->table[index],de,hash);
+    ht->used++;
+    return DICT_OK;
+}
+
 /* Add an element, discarding the old if the key already exists.
  * Return 1 if the key was added from scratch, 0 if there was already an
  * element with such key and dictReplace() just performed a value update
@@ -408,71 +505,94 @@ dictEntry *dictReplaceRaw(dict *d, void *key) {
     return entry ? entry : dictAddRaw(d,key);
 }
 
-/* Search and remove an element */
-static int dictGenericDelete(dict *d, const void *key, int nofree)
-{
-    unsigned int h, idx;
-    dictEntry *he, *prevHe;
+/* Search and remove an element. This is an helper function for
+ * dictDelete() and dictUnlink(), please check the top comment
+ * of those functions. */
+static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree) {
+    uint64_t h, idx;
+    dictEntry *he, **ref;
     int table;
 
-    if (d->ht[0].size == 0) return DICT_ERR; /* d->ht[0].table is NULL */
+    if (d->ht[0].size == 0) return NULL; /* d->ht[0].table is NULL */
     if (dictIsRehashing(d)) _dictRehashStep(d);
     h = dictHashKey(d, key);
 
     for (table = 0; table <= 1; table++) {
+        dictBucket *bucket;
+
         idx = h & d->ht[table].sizemask;
-        he = d->ht[table].table[idx];
-        prevHe = NULL;
-        while(he) {
-            if (dictCompareKeys(d, key, he->key)) {
-                /* Unlink the element from the list */
-                if (prevHe)
-                    prevHe->next = he->next;
-                else
-                    d->ht[table].table[idx] = he->next;
-                if (!nofree) {
-                    dictFreeKey(d, he);
-                    dictFreeVal(d, he);
-                }
+        bucket = &d->ht[table].table[idx];
+        if ((ref = _dictBucketFind(d, bucket, key, h)) != NULL) {
+            he = *ref;
+            /* Unlink the element from the bucket */
+            _dictBucketRemove(d, &d->ht[table], bucket, ref);
+            if (!nofree && !d->type->sharedEntries) {
+                dictFreeKey(d, he);
+                dictFreeVal(d, he);
                 zfree(he);
-                d->ht[table].used--;
-                return DICT_OK;
             }
-            prevHe = he;
-            he = he->next;
+            d->ht[table].used--;
+            return he;
         }
         if (!dictIsRehashing(d)) break;
     }
-    return DICT_ERR; /* not found */
+    return NULL; /* not found */
 }
 
+/* Remove an element, returning DICT_OK on success or DICT_ERR if the
+ * element was not found. */
 int dictDelete(dict *ht, const void *key) {
-    return dictGenericDelete(ht,key,0);
+    return dictGenericDelete(ht,key,0) ? DICT_OK : DICT_ERR;
 }
 
-int dictDeleteNoFree(dict *ht, const void *key) {
+/* Remove an element from the table, but without actually releasing
+ * the key, value and dictionary entry. The dictionary entry is returned
+ * if the element was found (and unlinked from the table), and the user
+ * should later call `dictFreeUnlinkedEntry()` with it in order to release it.
+ * Otherwise if the key is not found, NULL is returned.
+ *
+ * This function is useful when we want to remove something from the hash
+ * table but want to use its value (or the entry itself) before actually
+ * deleting the entry. */
+dictEntry *dictUnlink(dict *ht, const void *key) {
     return dictGenericDelete(ht,key,1);
 }
 
+/* You need to call this function to really free the entry after a call
+ * to dictUnlink(). It's safe to call this function with 'he' = NULL. */
+void dictFreeUnlinkedEntry(dict *d, dictEntry *he) {
+    if (he == NULL || d->type->sharedEntries) return;
+    dictFreeKey(d, he);
+    dictFreeVal(d, he);
+    zfree(he);
+}
+
 /* Destroy an entire dictionary */
 int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
     unsigned long i;
 
     /* Free all the elements */
-    for (i = 0; i < ht->size && ht->used > 0; i++) {
-        dictEntry *he, *nextHe;
+    for (i = 0; i < ht->size; i++) {
+        dictBucket *b;
+        int j;
 
         if (callback && (i & 65535) == 0) callback(d->privdata);
 
-        if ((he = ht->table[i]) == NULL) continue;
-        while(he) {
-            nextHe = he->next;
-            dictFreeKey(d, he);
-            dictFreeVal(d, he);
-            zfree(he);
-            ht->used--;
-            he = nextHe;
+        for (b = &ht->table[i]; b && ht->used > 0; b = b->child) {
+            for (j = 0; j < DICT_BUCKET_SLOTS; j++) {
+                dictEntry *he;
+
+                if (!(b->presence & (1<<j))) continue;
+                he = b->entries[j];
+                if (!d->type->sharedEntries) {
+                    dictFreeKey(d, he);
+                    dictFreeVal(d, he);
+                    zfree(he);
+                }
+                ht->used--;
+            }
         }
+        _dictBucketReset(ht,&ht->table[i]);
     }
     /* Free the table and the allocated cache structure */
     zfree(ht->table);
@@ -491,19 +611,48 @@ void dictRelease(dict *d)
 
 dictEntry *dictFind(dict *d, const void *key)
 {
-    dictEntry *he;
-    unsigned int h, idx, table;
+    dictEntry **ref;
+    uint64_t h, idx, table;
 
     if (d->ht[0].size == 0) return NULL; /* We don't have a table at all */
     if (dictIsRehashing(d)) _dictRehashStep(d);
     h = dictHashKey(d, key);
     for (table = 0; table <= 1; table++) {
         idx = h & d->ht[table].sizemask;
-        he = d->ht[table].table[idx];
-        while(he) {
-            if (dictCompareKeys(d, key, he->key))
-                return he;
-            he = he->next;
+        ref = _dictBucketFind(d, &d->ht[table].table[idx], key, h);
+        if (ref) return *ref;
+        if (!dictIsRehashing(d)) return NULL;
+    }
+    return NULL;
+}
+
+/* Return the hash value of 'key' in the dictionary 'd', computed with
+ * the hash function of the dictionary type. */
+uint64_t dictGetHash(dict *d, const void *key) {
+    return dictHashKey(d, key);
+}
+
+/* Finds the dictEntry reference by using pointer and pre-calculated hash.
+ * oldkey is a dead pointer and should not be accessed: only the pointer
+ * value is compared, never the key content. The hash value should be
+ * provided using dictGetHash(). No string / key comparison is performed.
+ * The return value is a reference to the dictEntry if found, or NULL if
+ * not found. */
+dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t hash) {
+    uint8_t fp = dictHashFingerprint(hash);
+    uint64_t idx, table;
+    dictBucket *b;
+    int j;
+
+    if (d->ht[0].size == 0) return NULL; /* We don't have a table at all */
+    for (table = 0; table <= 1; table++) {
+        idx = hash & d->ht[table].sizemask;
+        for (b = &d->ht[table].table[idx]; b; b = b->child) {
+            for (j = 0; j < DICT_BUCKET_SLOTS; j++) {
+                if ((b->presence & (1<<j)) && b->fingerprints[j] == fp &&
+                    b->entries[j]->key == oldptr)
+                    return &b->entries[j];
+            }
         }
         if (!dictIsRehashing(d)) return NULL;
     }
@@ -563,8 +712,8 @@ dictIterator *dictGetIterator(dict *d)
     iter->table = 0;
     iter->index = -1;
     iter->safe = 0;
-    iter->entry = NULL;
-    iter->nextEntry = NULL;
+    iter->bucket = NULL;
+    iter->slot = 0;
     return iter;
 }
 
@@ -578,7 +727,7 @@ dictIterator *dictGetSafeIterator(dict *d) {
 dictEntry *dictNext(dictIterator *iter)
 {
     while (1) {
-        if (iter->entry == NULL) {
+        if (iter->bucket == NULL) {
             dictht *ht = &iter->d->ht[iter->table];
             if (iter->index == -1 && iter->table == 0) {
                 if (iter->safe)
@@ -596,16 +745,18 @@ dictEntry *dictNext(dictIterator *iter)
                     break;
                 }
             }
-            iter->entry = ht->table[iter->index];
-        } else {
-            iter->entry = iter->nextEntry;
+            iter->bucket = &ht->table[iter->index];
+            iter->slot = 0;
         }
-        if (iter->entry) {
-            /* We need to save the 'next' here, the iterator user
-             * may delete the entry we are returning. */
-            iter->nextEntry = iter->entry->next;
-            return iter->entry;
+        /* The slot is advanced before returning the entry, since the
+         * iterator user may delete the entry we are returning. */
+        while (iter->slot < DICT_BUCKET_SLOTS) {
+            int j = iter->slot++;
+            if (iter->bucket->presence & (1<<j))
+                return iter->bucket->entries[j];
         }
+        iter->bucket = iter->bucket->child;
+        iter->slot = 0;
     }
     return NULL;
 }
@@ -625,9 +776,9 @@ void dictReleaseIterator(dictIterator *iter)
  * implement randomized algorithms */
 dictEntry *dictGetRandomKey(dict *d)
 {
-    dictEntry *he, *orighe;
-    unsigned int h;
-    int listlen, listele;
+    dictBucket *bucket, *b;
+    unsigned long h;
+    int listlen, listele, j;
 
     if (dictSize(d) == 0) return NULL;
     if (dictIsRehashing(d)) _dictRehashStep(d);
@@ -635,33 +786,32 @@ dictEntry *dictGetRandomKey(dict *d)
         do {
             /* We are sure there are no elements in indexes from 0
              * to rehashidx-1 */
-            h = d->rehashidx + (random() % (d->ht[0].size +
+            h = d->rehashidx + (randomULong() % (d->ht[0].size +
                                             d->ht[1].size -
                                             d->rehashidx));
-            he = (h >= d->ht[0].size) ? d->ht[1].table[h - d->ht[0].size] :
-                                      d->ht[0].table[h];
-        } while(he == NULL);
+            bucket = (h >= d->ht[0].size) ?
+                     &d->ht[1].table[h - d->ht[0].size] :
+                     &d->ht[0].table[h];
+            listlen = _dictBucketCount(bucket);
+        } while(listlen == 0);
     } else {
         do {
-            h = random() & d->ht[0].sizemask;
-            he = d->ht[0].table[h];
-        } while(he == NULL);
+            h = randomULong() & d->ht[0].sizemask;
+            bucket = &d->ht[0].table[h];
+            listlen = _dictBucketCount(bucket);
+        } while(listlen == 0);
     }
 
-    /* Now we found a non empty bucket, but it is a linked
-     * list and we need to get a random element from the list.
-     * The only sane way to do so is counting the elements and
-     * select a random index. */
-    listlen = 0;
-    orighe = he;
-    while(he) {
-        he = he->next;
-        listlen++;
-    }
+    /* Now we found a non empty bucket, but it may hold multiple entries,
+     * so we select a random one among the used slots. */
     listele = random() % listlen;
-    he = orighe;
-    while(listele--) he = he->next;
-    return he;
+    for (b = bucket; b; b = b->child) {
+        for (j = 0; j < DICT_BUCKET_SLOTS; j++) {
+            if ((b->presence & (1<<j)) && listele-- == 0)
+                return b->entries[j];
+        }
+    }
+    return NULL; /* Not reached. */
 }
 
 /* This function samples the dictionary to return a few keys from random
@@ -709,7 +859,7 @@ unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
         maxsizemask = d->ht[1].sizemask;
 
     /* Pick a random point inside the larger table. */
-    unsigned long i = random() & maxsizemask;
+    unsigned long i = randomULong() & maxsizemask;
     unsigned long emptylen = 0; /* Continuous empty entries so far. */
     while(stored < count && maxsteps--) {
         for (j = 0; j < tables; j++) {
@@ -725,26 +875,30 @@ unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
                 continue;
             }
             if (i >= d->ht[j].size) continue; /* Out of range for this table. */
-            dictEntry *he = d->ht[j].table[i];
+            dictBucket *b = &d->ht[j].table[i];
 
             /* Count contiguous empty buckets, and jump to other
              * locations if they reach 'count' (with a minimum of 5). */
-            if (he == NULL) {
+            if (dictBucketIsEmpty(b)) {
                 emptylen++;
                 if (emptylen >= 5 && emptylen > count) {
-                    i = random() & maxsizemask;
+                    i = randomULong() & maxsizemask;
                     emptylen = 0;
                 }
             } else {
                 emptylen = 0;
-                while (he) {
+                for (; b; b = b->child) {
+                    int k;
+
                     /* Collect all the elements of the buckets found non
                      * empty while iterating. */
-                    *des = he;
-                    des++;
-                    he = he->next;
-                    stored++;
-                    if (stored == count) return stored;
+                    for (k = 0; k < DICT_BUCKET_SLOTS; k++) {
+                        if (!(b->presence & (1<<k))) continue;
+                        *des = b->entries[k];
+                        des++;
+                        stored++;
+                        if (stored == count) return stored;
+                    }
                 }
             }
         }
@@ -782,6 +936,11 @@ static unsigned long rev(unsigned long v) {
  * called with 'privdata' as first argument and the dictionary entry
  * 'de' as second argument.
  *
+ * If 'bucketfn' is not NULL, it is called with a reference to every
+ * entry of a bucket before the entries are emitted, so that the caller can
+ * replace the dictEntry pointers stored in the bucket (this is used by
+ * active defrag in order to reallocate dictEntry structures).
+ *
  * HOW IT WORKS.
  *
  * The iteration algorithm was designed by Pieter Noordhuis.
@@ -793,8 +952,9 @@ static unsigned long rev(unsigned long v) {
  * This strategy is needed because the hash table may be resized between
  * iteration calls.
  *
- * dict.c hash tables are always power of two in size, and they
- * use chaining, so the position of an element in a given table is given
+ * dict.c hash tables are always power of two in size, and the colliding
+ * elements are stored in the same bucket (and its children), so the
+ * position of an element in a given table is given
  * by computing the bitwise AND between Hash(key) and SIZE-1
  * (where SIZE-1 is always the mask that is equivalent to taking the rest
  *  of the division between the Hash of the key and SIZE).
@@ -844,33 +1004,50 @@ static unsigned long rev(unsigned long v) {
  * 1) It is possible we return elements more than once. However this is usually
  *    easy to deal with in the application level.
  * 2) The iterator must return multiple elements per call, as it needs to always
- *    return all the keys chained in a given bucket, and all the expansions, so
+ *    return all the keys stored in a given bucket, and all the expansions, so
  *    we are sure we don't miss keys moving during rehashing.
  * 3) The reverse cursor is somewhat hard to understand at first, but this
  *    comment is supposed to help.
  */
+/* Emit all the entries of the bucket 'b' for dictScan(). */
+static void _dictScanBucket(dictBucket *b, dictScanFunction *fn,
+                            dictScanBucketFunction *bucketfn, void *privdata)
+{
+    dictBucket *c;
+    int j;
+
+    if (bucketfn) {
+        for (c = b; c; c = c->child)
+            for (j = 0; j < DICT_BUCKET_SLOTS; j++)
+                if (c->presence & (1<<j)) bucketfn(privdata, &c->entries[j]);
+    }
+    for (c = b; c; c = c->child)
+        for (j = 0; j < DICT_BUCKET_SLOTS; j++)
+            if (c->presence & (1<<j)) fn(privdata, c->entries[j]);
+}
+
 unsigned long dictScan(dict *d,
                        unsigned long v,
                        dictScanFunction *fn,
+                       dictScanBucketFunction* bucketfn,
                        void *privdata)
 {
     dictht *t0, *t1;
-    const dictEntry *de, *next;
     unsigned long m0, m1;
 
     if (dictSize(d) == 0) return 0;
 
+    /* The callbacks may delete the emitted entries: like safe iterators,
+     * we make sure that the buckets we are scanning are not released nor
+     * rehashed meanwhile. */
+    d->iterators++;
+
     if (!dictIsRehashing(d)) {
         t0 = &(d->ht[0]);
         m0 = t0->sizemask;
 
         /* Emit entries at cursor */
-        de = t0->table[v & m0];
-        while (de) {
-            next = de->next;
-            fn(privdata, de);
-            de = next;
-        }
+        _dictScanBucket(&t0->table[v & m0],fn,bucketfn,privdata);
 
     } else {
         t0 = &d->ht[0];
@@ -886,23 +1063,13 @@ unsigned long dictScan(dict *d,
         m1 = t1->sizemask;
 
         /* Emit entries at cursor */
-        de = t0->table[v & m0];
-        while (de) {
-            next = de->next;
-            fn(privdata, de);
-            de = next;
-        }
+        _dictScanBucket(&t0->table[v & m0],fn,bucketfn,privdata);
 
         /* Iterate over indices in larger table that are the expansion
          * of the index pointed to by the cursor in the smaller table */
         do {
             /* Emit entries at cursor */
-            de = t1->table[v & m1];
-            while (de) {
-                next = de->next;
-                fn(privdata, de);
-                de = next;
-            }
+            _dictScanBucket(&t1->table[v & m1],fn,bucketfn,privdata);
 
             /* Increment bits not covered by the smaller mask */
             v = (((v | m0) + 1) & ~m0) | (v & m0);
@@ -911,6 +1078,8 @@ unsigned long dictScan(dict *d,
         } while (v & (m0 ^ m1));
     }
 
+    d->iterators--;
+
     /* Set unmasked bits so incrementing the reversed cursor
      * operates on the masked bits of the smaller table */
     v |= ~m0;
@@ -923,6 +1092,64 @@ unsigned long dictScan(dict *d,
     return v;
 }
 
+/* The following functions allow to walk a dictionary one bucket at a time
+ * while the caller keeps modifying it, visiting every key that was in the
+ * dictionary when the walk started exactly once.
+ *
+ * While rehashing is paused, keys never move from the bucket they were
+ * inserted into, so a key is identified by the position of its bucket:
+ * positions from 0 to ht[0].size-1 are the buckets of the first table, the
+ * following ones the buckets of the second table, if any. New keys may be
+ * added to both tables (the second table is created if the dictionary
+ * needs to grow), but always after the positions that existed when the
+ * rehashing was paused, or at positions the caller already knows. */
+void dictPauseRehashing(dict *d) {
+    d->iterators++;
+}
+
+void dictResumeRehashing(dict *d) {
+    d->iterators--;
+}
+
+/* Return the number of bucket positions of the dictionary. */
+unsigned long dictBucketPositions(dict *d) {
+    return d->ht[0].size+d->ht[1].size;
+}
+
+/* Like dictFind(), but also store the bucket position of the key in
+ * '*pos' when it is found. Rehashing should be paused, otherwise the
+ * position may change at any time. */
+dictEntry *dictFindPosition(dict *d, const void *key, unsigned long *pos) {
+    dictEntry **ref;
+    uint64_t h, idx, table;
+
+    if (d->ht[0].size == 0) return NULL;
+    h = dictHashKey(d, key);
+    for (table = 0; table <= 1; table++) {
+        idx = h & d->ht[table].sizemask;
+        ref = _dictBucketFind(d, &d->ht[table].table[idx], key, h);
+        if (ref) {
+            *pos = table ? d->ht[0].size+idx : idx;
+            return *ref;
+        }
+        if (!dictIsRehashing(d)) return NULL;
+    }
+    return NULL;
+}
+
+/* Call 'fn' for every entry of the bucket at position 'pos'. */
+void dictScanBucketAt(dict *d, unsigned long pos, dictScanFunction *fn,
+                      void *privdata)
+{
+    dictBucket *b;
+
+    if (pos < d->ht[0].size)
+        b = &d->ht[0].table[pos];
+    else
+        b = &d->ht[1].table[pos-d->ht[0].size];
+    _dictScanBucket(b,fn,NULL,privdata);
+}
+
 /* ------------------------- private functions ------------------------------ */
 
 /* Expand the hash table if needed */
@@ -934,13 +1161,14 @@ static int _dictExpandIfNeeded(dict *d)
     /* If the hash table is empty expand it to the initial size. */
     if (d->ht[0].size == 0) return dictExpand(d, DICT_HT_INITIAL_SIZE);
 
-    /* If we reached the 1:1 ratio, and we are allowed to resize the hash
-     * table (global setting) or we should avoid it but the ratio between
-     * elements/buckets is over the "safe" threshold, we resize doubling
-     * the number of buckets. */
-    if (d->ht[0].used >= d->ht[0].size &&
+    /* If we reached DICT_BUCKET_FILL elements per bucket, and we are allowed
+     * to resize the hash table (global setting) or we should avoid it but
+     * the ratio between elements/buckets is over the "safe" threshold, we
+     * resize doubling the number of buckets. */
+    if (d->ht[0].used >= d->ht[0].size*DICT_BUCKET_FILL &&
         (dict_can_resize ||
-         d->ht[0].used/d->ht[0].size > dict_force_resize_ratio))
+         d->ht[0].used/d->ht[0].size >
+            DICT_BUCKET_FILL*dict_force_resize_ratio))
     {
         return dictExpand(d, d->ht[0].used*2);
     }
@@ -950,9 +1178,9 @@ static int _dictExpandIfNeeded(dict *d)
 /* Our hash table capability is a power of two */
 static unsigned long _dictNextPower(unsigned long size)
 {
-    unsigned long i = DICT_HT_INITIAL_SIZE;
+    unsigned long i = 1;
 
-    if (size >= LONG_MAX) return LONG_MAX;
+    if (size >= LONG_MAX) return LONG_MAX + 1LU;
     while(1) {
         if (i >= size)
             return i;
@@ -960,16 +1188,15 @@ static unsigned long _dictNextPower(unsigned long size)
     }
 }
 
-/* Returns the index of a free slot that can be populated with
- * a hash entry for the given 'key'.
+/* Returns the index of the bucket that can be populated with a hash entry
+ * for the given 'key', storing the hash of the key in '*hash'.
  * If the key already exists, -1 is returned.
  *
  * Note that if we are in the process of rehashing the hash table, the
  * index is always returned in the context of the second (new) hash table. */
-static int _dictKeyIndex(dict *d, const void *key)
+static long _dictKeyIndex(dict *d, const void *key, uint64_t *hash)
 {
-    unsigned int h, idx, table;
-    dictEntry *he;
+    uint64_t h, idx, table;
 
     /* Expand the hash table if needed */
     if (_dictExpandIfNeeded(d) == DICT_ERR)
@@ -978,15 +1205,12 @@ static int _dictKeyIndex(dict *d, const void *key)
     h = dictHashKey(d, key);
     for (table = 0; table <= 1; table++) {
         idx = h & d->ht[table].sizemask;
-        /* Search if this slot does not already contain the given key */
-        he = d->ht[table].table[idx];
-        while(he) {
-            if (dictCompareKeys(d, key, he->key))
-                return -1;
-            he = he->next;
-        }
+        /* Search if this bucket does not already contain the given key */
+        if (_dictBucketFind(d, &d->ht[table].table[idx], key, h))
+            return -1;
         if (!dictIsRehashing(d)) break;
     }
+    *hash = h;
     return idx;
 }
 
@@ -1010,7 +1234,7 @@ void dictDisableResize(void) {
 #define DICT_STATS_VECTLEN 50
 size_t _dictGetStatsHt(char *buf, size_t bufsize, dictht *ht, int tableid) {
     unsigned long i, slots = 0, chainlen, maxchainlen = 0;
-    unsigned long totchainlen = 0;
+    unsigned long totchainlen = 0, chained = 0;
     unsigned long clvector[DICT_STATS_VECTLEN];
     size_t l = 0;
 
@@ -1022,21 +1246,15 @@ size_t _dictGetStatsHt(char *buf, size_t bufsize, dictht *ht, int tableid) {
     /* Compute stats. */
     for (i = 0; i < DICT_STATS_VECTLEN; i++) clvector[i] = 0;
     for (i = 0; i < ht->size; i++) {
-        dictEntry *he;
+        dictBucket *b = &ht->table[i];
 
-        if (ht->table[i] == NULL) {
-            clvector[0]++;
-            continue;
-        }
-        slots++;
-        /* For each hash entry on this slot... */
-        chainlen = 0;
-        he = ht->table[i];
-        while(he) {
-            chainlen++;
-            he = he->next;
-        }
+        /* The chain length is the number of entries in the bucket,
+         * including the ones stored in its children. */
+        chainlen = _dictBucketCount(b);
+        if (b->child) chained++;
         clvector[(chainlen < DICT_STATS_VECTLEN) ? chainlen : (DICT_STATS_VECTLEN-1)]++;
+        if (chainlen == 0) continue;
+        slots++;
         if (chainlen > maxchainlen) maxchainlen = chainlen;
         totchainlen += chainlen;
     }
@@ -1047,15 +1265,16 @@ size_t _dictGetStatsHt(char *buf, size_t bufsize, dictht *ht, int tableid) {
         " table size: %ld\n"
         " number of elements: %ld\n"
         " different slots: %ld\n"
+        " chained buckets: %ld\n"
         " max chain length: %ld\n"
         " avg chain length (counted): %.02f\n"
         " avg chain length (computed): %.02f\n"
         " Chain length distribution:\n",
         tableid, (tableid == 0) ? "main hash table" : "rehashing target",
-        ht->size, ht->used, slots, maxchainlen,
+        ht->size, ht->used, slots, chained, maxchainlen,
         (float)totchainlen/slots, (float)ht->used/slots);
 
-    for (i = 0; i < DICT_STATS_VECTLEN-1; i++) {
+    for (i = 0; i < DICT_STATS_VECTLEN; i++) {
         if (clvector[i] == 0) continue;
         if (l >= bufsize) break;
         l += snprintf(buf+l,bufsize-l,
@@ -1083,3 +1302,140 @@ void dictGetStats(char *buf, size_t bufsize, dict *d) {
     /* Make sure there is a NULL term at the end. */
     if (orig_bufsize) orig_buf[orig_bufsize-1] = '\0';
 }
+
+/* ------------------------------- Benchmark ---------------------------------*/
+
+#ifdef DICT_BENCHMARK_MAIN
+
+#include "sds.h"
+
+void _serverAssert(char *estr, char *file, int line) {
+    fprintf(stderr,"=== ASSERTION FAILED ===\n");
+    fprintf(stderr,"==> %s:%d '%s' is not true\n",file,line,estr);
+}
+
+uint64_t hashCallback(const void *key) {
+    return dictGenHashFunction((unsigned char*)key, sdslen((char*)key));
+}
+
+int compareCallback(void *privdata, const void *key1, const void *key2) {
+    int l1,l2;
+    DICT_NOTUSED(privdata);
+
+    l1 = sdslen((sds)key1);
+    l2 = sdslen((sds)key2);
+    if (l1 != l2) return 0;
+    return memcmp(key1, key2, l1) == 0;
+}
+
+void freeCallback(void *privdata, void *val) {
+    DICT_NOTUSED(privdata);
+
+    sdsfree(val);
+}
+
+dictType BenchmarkDictType = {
+    hashCallback,
+    NULL,
+    NULL,
+    compareCallback,
+    freeCallback,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    0
+};
+
+#define start_benchmark() start = timeInMilliseconds()
+#define end_benchmark(msg) do { \
+    elapsed = timeInMilliseconds()-start; \
+    printf(msg ": %ld items in %lld ms\n", count, elapsed); \
+} while(0);
+
+/* dict-benchmark [count] */
+int main(int argc, char **argv) {
+    long j;
+    long long start, elapsed;
+    dict *dict = dictCreate(&BenchmarkDictType,NULL);
+    long count = 0;
+    uint64_t sum = 0;
+    uint8_t seed[SIPHASH_KEY_LEN];
+    char stats[4096];
+
+    if (argc == 2) {
+        count = strtol(argv[1],NULL,10);
+    } else {
+        count = 5000000;
+    }
+    for (j = 0; j < SIPHASH_KEY_LEN; j++) seed[j] = random();
+    dictSetHashFunctionSeed(seed);
+
+    /* Hashing alone, with short keys similar to the typical Redis keys. */
+    start_benchmark();
+    for (j = 0; j < count; j++) {
+        char buf[32];
+        int len = snprintf(buf,sizeof(buf),"key:%ld",j);
+        sum += dictGenHashFunction(buf,len);
+    }
+    end_benchmark("Hashing short keys");
+    if (sum == 0) printf("(unlikely zero checksum)\n");
+
+    start_benchmark();
+    for (j = 0; j < count; j++) {
+        int retval = dictAdd(dict,sdsfromlonglong(j),(void*)j);
+        assert(retval == DICT_OK);
+    }
+    end_benchmark("Inserting");
+    assert((long)dictSize(dict) == count);
+
+    /* Wait for rehashing. */
+    while (dictIsRehashing(dict)) {
+        dictRehashMilliseconds(dict,100);
+    }
+
+    start_benchmark();
+    for (j = 0; j < count; j++) {
+        sds key = sdsfromlonglong(j);
+        dictEntry *de = dictFind(dict,key);
+        assert(de != NULL);
+        sdsfree(key);
+    }
+    end_benchmark("Linear access of existing elements");
+
+    start_benchmark();
+    for (j = 0; j < count; j++) {
+        sds key = sdsfromlonglong(rand() % count);
+        dictEntry *de = dictFind(dict,key);
+        assert(de != NULL);
+        sdsfree(key);
+    }
+    end_benchmark("Random access of existing elements");
+
+    start_benchmark();
+    for (j = 0; j < count; j++) {
+        sds key = sdsfromlonglong(rand() % count);
+        key[0] = 'X';
+        dictEntry *de = dictFind(dict,key);
+        assert(de == NULL);
+        sdsfree(key);
+    }
+    end_benchmark("Accessing missing");
+
+    start_benchmark();
+    for (j = 0; j < count; j++) {
+        sds key = sdsfromlonglong(j);
+        int retval = dictDelete(dict,key);
+        assert(retval == DICT_OK);
+        key[0] += 17; /* Change first number to letter. */
+        retval = dictAdd(dict,key,(void*)j);
+        assert(retval == DICT_OK);
+    }
+    end_benchmark("Removing and adding");
+
+    dictGetStats(stats,sizeof(stats),dict);
+    printf("%s",stats);
+    dictRelease(dict);
+    return 0;
+}
+#endif
@@ -3,7 +3,8 @@
  * This file implements in-memory hash tables with insert/del/replace/find/
  * get-random-element operations. Hash tables will auto-resize if needed
  * tables of power of two in size are used, collisions are handled by
- * chaining. See the source code for more information... :)
+ * storing multiple entries per bucket. See the source code for more
+ * information... :)
  *
  * Copyright (c) 2006-2012, Salvatore Sanfilippo <antirez at gmail dot com>
  * All rights reserved.
@@ -52,34 +53,69 @@ typedef struct dictEntry {
         int64_t s64;
         double d;
     } v;
-    struct dictEntry *next;
+    void *metadata[];           /* An arbitrary number of bytes (starting at a
+                                 * pointer-aligned address) of size as returned
+                                 * by dictType's dictEntryMetadataBytes(). */
 } dictEntry;
 
+struct dict;
+typedef struct dict dict;
+
 typedef struct dictType {
-    unsigned int (*hashFunction)(const void *key);
+    uint64_t (*hashFunction)(const void *key);
     void *(*keyDup)(void *privdata, const void *key);
     void *(*valDup)(void *privdata, const void *obj);
     int (*keyCompare)(void *privdata, const void *key1, const void *key2);
     void (*keyDestructor)(void *privdata, void *key);
     void (*valDestructor)(void *privdata, void *obj);
+    /* Allow a dictEntry to carry extra caller-defined metadata. The
+     * extra memory is initialized to 0 when a dictEntry is allocated. */
+    size_t (*dictEntryMetadataBytes)(dict *d);
+    /* Allow the key to be stored inside the dictEntry allocation, right
+     * after the metadata, instead of being referenced or duplicated with
+     * keyDup(). embeddedKeyBytes() returns the bytes needed to embed the
+     * key, embedKey() copies it into 'buf' and returns the pointer to use
+     * as the entry key. Embedded keys go away with their entry, so such
+     * dictionaries should not have a key destructor. */
+    size_t (*embeddedKeyBytes)(const void *key);
+    void *(*embedKey)(void *buf, const void *key);
+    /* When set, the dictionary only references entries owned by another
+     * dictionary, linked with dictLinkEntry(): they are never allocated
+     * or released here, and dictDelete() just unlinks them. */
+    int sharedEntries;
 } dictType;
 
+/* Number of entries a bucket can hold. A bucket is sized to fit a 64 bytes
+ * cache line on 64 bit systems: one byte with the bitmap of the used slots,
+ * one byte of hash fingerprint for every slot, the entry pointers, and the
+ * pointer to the child bucket used when more entries than DICT_BUCKET_SLOTS
+ * collide into the same bucket. */
+#define DICT_BUCKET_SLOTS 6
+
+typedef struct dictBucket {
+    uint8_t presence;                       /* Bitmap of the used slots. */
+    uint8_t fingerprints[DICT_BUCKET_SLOTS]; /* Hash high byte per slot. */
+    dictEntry *entries[DICT_BUCKET_SLOTS];
+    struct dictBucket *child;               /* Overflow bucket, or NULL. */
+} dictBucket;
+
 /* This is our hash table structure. Every dictionary has two of this as we
  * implement incremental rehashing, for the old to the new table. */
 typedef struct dictht {
-    dictEntry **table;
+    dictBucket *table;
     unsigned long size;
     unsigned long sizemask;
     unsigned long used;
+    unsigned long children; /* Number of child buckets allocated. */
 } dictht;
 
-typedef struct dict {
+struct dict {
     dictType *type;
     void *privdata;
     dictht ht[2];
     long rehashidx; /* rehashing not in progress if rehashidx == -1 */
     unsigned long iterators; /* number of iterators currently running */
-} dict;
+};
 
 /* If safe is set to 1 this is a safe iterator, that means, you can call
  * dictAdd, dictFind, and other functions against the dictionary even while
@@ -89,16 +125,22 @@ typedef struct dictIterator {
     dict *d;
     long index;
     int table, safe;
-    dictEntry *entry, *nextEntry;
+    dictBucket *bucket;
+    int slot;
     /* unsafe iterator fingerprint for misuse detection. */
     long long fingerprint;
 } dictIterator;
 
 typedef void (dictScanFunction)(void *privdata, const dictEntry *de);
+typedef void (dictScanBucketFunction)(void *privdata, dictEntry **entryref);
 
 /* This is the initial size of every hash table */
 #define DICT_HT_INITIAL_SIZE     4
 
+/* Average number of entries per bucket that triggers the expansion of the
+ * table, when resizing is allowed. */
+#define DICT_BUCKET_FILL         4
+
 /* ------------------------------- Macros ------------------------------------*/
 #define dictFreeVal(d, entry) \
     if ((d)->type->valDestructor) \
@@ -111,6 +153,10 @@ typedef void (dictScanFunction)(void *privdata, const dictEntry *de);
         entry->v.val = (_val_); \
 } while(0)
 
+#define dictMetadata(entry) (&(entry)->metadata)
+#define dictMetadataSize(d) ((d)->type->dictEntryMetadataBytes \
+                             ? (d)->type->dictEntryMetadataBytes(d) : 0)
+
 #define dictSetSignedIntegerVal(entry, _val_) \
     do { entry->v.s64 = _val_; } while(0)
 
@@ -142,7 +188,10 @@ typedef void (dictScanFunction)(void *privdata, const dictEntry *de);
 #define dictGetSignedIntegerVal(he) ((he)->v.s64)
 #define dictGetUnsignedIntegerVal(he) ((he)->v.u64)
 #define dictGetDoubleVal(he) ((he)->v.d)
-#define dictSlots(d) ((d)->ht[0].size+(d)->ht[1].size)
+#define dictSlots(d) (((d)->ht[0].size+(d)->ht[1].size)*DICT_BUCKET_SLOTS)
+#define dictTablesMemUsage(d) (((d)->ht[0].size+(d)->ht[1].size+ \
+                                (d)->ht[0].children+(d)->ht[1].children)* \
+                               sizeof(dictBucket))
 #define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
 #define dictIsRehashing(d) ((d)->rehashidx != -1)
 
@@ -151,10 +200,12 @@ dict *dictCreate(dictType *type, void *privDataPtr);
 int dictExpand(dict *d, unsigned long size);
 int dictAdd(dict *d, void *key, void *val);
 dictEntry *dictAddRaw(dict *d, void *key);
+int dictLinkEntry(dict *d, dictEntry *de);
 int dictReplace(dict *d, void *key, void *val);
 dictEntry *dictReplaceRaw(dict *d, void *key);
 int dictDelete(dict *d, const void *key);
-int dictDeleteNoFree(dict *d, const void *key);
+dictEntry *dictUnlink(dict *ht, const void *key);
+void dictFreeUnlinkedEntry(dict *d, dictEntry *he);
 void dictRelease(dict *d);
 dictEntry * dictFind(dict *d, const void *key);
 void *dictFetchValue(dict *d, const void *key);
@@ -166,16 +217,24 @@ void dictReleaseIterator(dictIterator *iter);
 dictEntry *dictGetRandomKey(dict *d);
 unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count);
 void dictGetStats(char *buf, size_t bufsize, dict *d);
-unsigned int dictGenHashFunction(const void *key, int len);
-unsigned int dictGenCaseHashFunction(const unsigned char *buf, int len);
+uint64_t dictGenHashFunction(const void *key, int len);
+uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len);
 void dictEmpty(dict *d, void(callback)(void*));
 void dictEnableResize(void);
 void dictDisableResize(void);
 int dictRehash(dict *d, int n);
 int dictRehashMilliseconds(dict *d, int ms);
-void dictSetHashFunctionSeed(unsigned int initval);
-unsigned int dictGetHashFunctionSeed(void);
-unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn, void *privdata);
+void dictPauseRehashing(dict *d);
+void dictResumeRehashing(dict *d);
+unsigned long dictBucketPositions(dict *d);
+dictEntry *dictFindPosition(dict *d, const void *key, unsigned long *pos);
+void dictScanBucketAt(dict *d, unsigned long pos, dictScanFunction *fn,
+                      void *privdata);
+void dictSetHashFunctionSeed(uint8_t *seed);
+uint8_t *dictGetHashFunctionSeed(void);
+unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn, dictScanBucketFunction *bucketfn, void *privdata);
+uint64_t dictGetHash(dict *d, const void *key);
+dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t hash);
 
 /* Hash table types */
 extern dictType dictTypeHeapStringCopyKey;
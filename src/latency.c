@@ -41,7 +41,7 @@ int dictStringKeyCompare(void *privdata, const void *key1, const void *key2) {
     return strcmp(key1,key2) == 0;
 }
 
-unsigned int dictStringHash(const void *key) {
+uint64_t dictStringHash(const void *key) {
     return dictGenHashFunction(key, strlen(key));
 }
 
@@ -53,7 +53,11 @@ dictType latencyTimeSeriesDictType = {
     NULL,                       /* val dup */
     dictStringKeyCompare,       /* key compare */
     dictVanillaFree,            /* key destructor */
-    dictVanillaFree             /* val destructor */
+    dictVanillaFree,            /* val destructor */
+    NULL,                       /* entry metadata size */
+    NULL,                       /* embedded key size */
+    NULL,                       /* embed key */
+    0                           /* shared entries */
 };
 
 /* ------------------------- Utility functions ------------------------------ */
@@ -229,6 +233,8 @@ sds createLatencyReport(void) {
     int advise_hz = 0;              /* Use higher HZ. */
     int advise_large_objects = 0;   /* Deletion of large objects. */
     int advise_mass_eviction = 0;   /* Avoid mass eviction of keys. */
+    int advise_eviction_tenacity = 0; /* Lower eviction tenacity. */
+    int advise_eviction_lazyfree = 0; /* Waiting for the lazyfree thread. */
     int advise_relax_fsync_policy = 0; /* appendfsync always is slow. */
     int advise_disable_thp = 0;     /* AnonHugePages detected. */
     int advices = 0;
@@ -373,6 +379,15 @@ sds createLatencyReport(void) {
         if (!strcasecmp(event,"eviction-cycle")) {
             advise_mass_eviction = 1;
             advices++;
+            if (server.maxmemory_eviction_tenacity > 10) {
+                advise_eviction_tenacity = 1;
+                advices++;
+            }
+        }
+
+        if (!strcasecmp(event,"eviction-lazyfree")) {
+            advise_eviction_lazyfree = 1;
+            advices++;
         }
 
         report = sdscatlen(report,"\n",1);
@@ -462,6 +477,14 @@ sds createLatencyReport(void) {
             report = sdscat(report,"- Sudden changes to the 'maxmemory' setting via 'CONFIG SET', or allocation of large objects via sets or sorted sets intersections, STORE option of SORT, Redis Cluster large keys migrations (RESTORE command), may create sudden memory pressure forcing the server to block trying to evict keys. \n");
         }
 
+        if (advise_eviction_tenacity) {
+            report = sdscatprintf(report,"- Your 'maxmemory-eviction-tenacity' is set to %d: every eviction cycle is allowed to run for a long time before the remaining work is continued in background. Consider lowering it to the default of 10.\n", server.maxmemory_eviction_tenacity);
+        }
+
+        if (advise_eviction_lazyfree) {
+            report = sdscat(report,"- The server was not able to evict enough keys and had to wait for the lazyfree thread to release memory. Consider raising 'maxmemory' or using a policy that can evict more keys.\n");
+        }
+
         if (advise_disable_thp) {
             report = sdscat(report,"- I detected a non zero amount of anonymous huge pages used by your process. This creates very serious latency events in different conditions, especially when Redis is persisting on disk. To disable THP support use the command 'echo never > /sys/kernel/mm/transparent_hugepage/enabled', make sure to also add it into /etc/rc.local so that the command will be executed again after a reboot. Note that even if you have already disabled THP, you still need to restart the Redis process to get rid of the huge pages already created.\n");
         }
@@ -4,11 +4,22 @@
 #include "cluster.h"
 
 static size_t lazyfree_objects = 0;
+static size_t lazyfreed_objects = 0;
 pthread_mutex_t lazyfree_objects_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /* Return the number of currently pending objects to free. */
 size_t lazyfreeGetPendingObjectsCount(void) {
-    return lazyfree_objects;
+    size_t aux;
+    atomicGet(lazyfree_objects,aux,&lazyfree_objects_mutex);
+    return aux;
+}
+
+/* Return the number of objects that have been freed by the lazyfree
+ * thread since the server started. */
+size_t lazyfreeGetFreedObjectsCount(void) {
+    size_t aux;
+    atomicGet(lazyfreed_objects,aux,&lazyfree_objects_mutex);
+    return aux;
 }
 
 /* Return the amount of work needed in order to free an object.
@@ -44,43 +55,107 @@ size_t lazyfreeGetFreeEffort(robj *obj) {
     }
 }
 
+/* Objects that take more than LAZYFREE_THRESHOLD allocations to release are
+ * freed in background. The ones up to LAZYFREE_BATCH_MAX_EFFORT are not
+ * worth a bio.c job each: they are accumulated into a batch that is handed
+ * to the lazyfree workers as a single job once it is full, or at the latest
+ * before the event loop goes to sleep again (see lazyfreeFlushBatch()).
+ * Bigger objects get their own job, so that they spread among the workers
+ * when there are multiple lazyfree threads. */
+#define LAZYFREE_THRESHOLD 64
+#define LAZYFREE_BATCH_MAX_EFFORT 1024
+#define LAZYFREE_BATCH_SIZE 64
+
+typedef struct lazyfreeBatch {
+    size_t count;
+    size_t effort;      /* Sum of the free effort of the batched objects. */
+    robj *objs[LAZYFREE_BATCH_SIZE];
+} lazyfreeBatch;
+
+static lazyfreeBatch *lazyfree_batch = NULL; /* Only used by main thread. */
+
+/* Hand the current batch, if any, to the lazyfree workers. */
+void lazyfreeFlushBatch(void) {
+    if (lazyfree_batch == NULL) return;
+    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,NULL,lazyfree_batch);
+    lazyfree_batch = NULL;
+}
+
+/* Schedule the release of an object with the specified free effort, that
+ * must be greater than LAZYFREE_THRESHOLD, in background. */
+static void lazyfreeSubmitObject(robj *o, size_t free_effort) {
+    atomicIncr(lazyfree_objects,1,&lazyfree_objects_mutex);
+    if (free_effort > LAZYFREE_BATCH_MAX_EFFORT) {
+        bioCreateBackgroundJob(BIO_LAZY_FREE,o,NULL,NULL);
+        return;
+    }
+    if (lazyfree_batch == NULL) {
+        lazyfree_batch = zmalloc(sizeof(*lazyfree_batch));
+        lazyfree_batch->count = 0;
+        lazyfree_batch->effort = 0;
+    }
+    lazyfree_batch->objs[lazyfree_batch->count++] = o;
+    lazyfree_batch->effort += free_effort;
+    if (lazyfree_batch->count == LAZYFREE_BATCH_SIZE ||
+        lazyfree_batch->effort > LAZYFREE_BATCH_MAX_EFFORT)
+    {
+        lazyfreeFlushBatch();
+    }
+}
+
 /* Delete a key, value, and associated expiration entry if any, from the DB.
  * If there are enough allocations to free the value object may be put into
  * a lazy free list instead of being freed synchronously. The lazy free list
  * will be reclaimed in a different bio.c thread. */
-#define LAZYFREE_THRESHOLD 64
 int dbAsyncDelete(redisDb *db, robj *key) {
-    /* Deleting an entry from the expires dict will not free the sds of
-     * the key, because it is shared with the main dictionary. */
-    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
-
     /* If the value is composed of a few allocations, to free in a lazy way
      * is actually just slower... So under a certain limit we just free
      * the object synchronously. */
-    dictEntry *de = dictFind(db->dict,key->ptr);
+    dictEntry *de;
+
+    if (server.rdb_snapshot) snapshotKeyWillChange(db,key->ptr);
+    de = dictUnlink(db->dict,key->ptr);
     if (de) {
         robj *val = dictGetVal(de);
+
+        /* The expires dict just references the entry, that must be
+         * unlinked from it before being released. */
+        if (dbEntryGetExpire(de) != -1) dictDelete(db->expires,key->ptr);
         size_t free_effort = lazyfreeGetFreeEffort(val);
 
         /* If releasing the object is too much work, let's put it into the
-         * lazy free list. */
-        if (free_effort > LAZYFREE_THRESHOLD) {
-            atomicIncr(lazyfree_objects,1,&lazyfree_objects_mutex);
-            bioCreateBackgroundJob(BIO_LAZY_FREE,val,NULL,NULL);
+         * lazy free list. Objects referenced elsewhere can't be released
+         * by another thread, since their refcount is not atomic. */
+        if (free_effort > LAZYFREE_THRESHOLD && val->refcount == 1) {
+            lazyfreeSubmitObject(val,free_effort);
             dictSetVal(db->dict,de,NULL);
         }
     }
 
     /* Release the key-val pair, or just the key if we set the val
      * field to NULL in order to lazy free it later. */
-    if (dictDelete(db->dict,key->ptr) == DICT_OK) {
-        if (server.cluster_enabled) slotToKeyDel(key);
+    if (de) {
+        if (server.cluster_enabled) slotToKeyDelEntry(de);
+        dictFreeUnlinkedEntry(db->dict,de);
         return 1;
     } else {
         return 0;
     }
 }
 
+/* Release a value object that was already removed from the keyspace, for
+ * instance because it was replaced by a new value. Like dbAsyncDelete()
+ * the object is only handed to the lazyfree thread if it is big enough to
+ * be worth it, otherwise it is released synchronously. */
+void freeObjAsync(robj *o) {
+    size_t free_effort = lazyfreeGetFreeEffort(o);
+    if (free_effort > LAZYFREE_THRESHOLD && o->refcount == 1) {
+        lazyfreeSubmitObject(o,free_effort);
+    } else {
+        decrRefCount(o);
+    }
+}
+
 /* Empty a Redis DB asynchronously. What the function does actually is to
  * create a new empty set of hash tables and scheduling the old ones for
  * lazy freeing. */
@@ -88,44 +163,52 @@ void emptyDbAsync(redisDb *db) {
     dict *oldht1 = db->dict, *oldht2 = db->expires;
     db->dict = dictCreate(&dbDictType,NULL);
     db->expires = dictCreate(&keyptrDictType,NULL);
-    atomicIncr(lazyfree_objects,dictSize(oldht1),
-        &lazyfree_objects_mutex);
-    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,oldht1,oldht2);
+    freeDbDictsAsync(oldht1,oldht2);
 }
 
-/* Empty the slots-keys map of Redis CLuster by creating a new empty one
- * and scheduiling the old for lazy freeing. */
-void slotToKeyFlushAsync(void) {
-    zskiplist *oldsl = server.cluster->slots_to_keys;
-    server.cluster->slots_to_keys = zslCreate();
-    atomicIncr(lazyfree_objects,oldsl->length,
-        &lazyfree_objects_mutex);
-    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,NULL,oldsl);
+/* Release in the lazyfree thread the main and expires dictionaries of a
+ * database that are no longer referenced by the keyspace. The values still
+ * referenced by the clients output buffers are copied there first, since
+ * the refcount is not atomic and the lazyfree thread would race with the
+ * main thread releasing the reply. */
+void freeDbDictsAsync(dict *d, dict *expires) {
+    copyObjectReplyBlocks();
+    atomicIncr(lazyfree_objects,dictSize(d),&lazyfree_objects_mutex);
+    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,d,expires);
 }
 
 /* Release objects from the lazyfree thread. It's just decrRefCount()
- * updating the count of objects to release. */
-void lazyfreeFreeObjectFromBioThread(robj *o) {
+ * updating the count of objects to release. Like the other functions
+ * called by bio.c, it returns the number of objects released. */
+size_t lazyfreeFreeObjectFromBioThread(robj *o) {
     decrRefCount(o);
     atomicDecr(lazyfree_objects,1,&lazyfree_objects_mutex);
+    atomicIncr(lazyfreed_objects,1,&lazyfree_objects_mutex);
+    return 1;
+}
+
+/* Release a batch of objects created by lazyfreeSubmitObject(). */
+size_t lazyfreeFreeBatchFromBioThread(void *ptr) {
+    lazyfreeBatch *batch = ptr;
+    size_t j, count = batch->count;
+
+    for (j = 0; j < count; j++) decrRefCount(batch->objs[j]);
+    zfree(batch);
+    atomicDecr(lazyfree_objects,count,&lazyfree_objects_mutex);
+    atomicIncr(lazyfreed_objects,count,&lazyfree_objects_mutex);
+    return count;
 }
 
 /* Release a database from the lazyfree thread. The 'db' pointer is the
  * database which was substitutied with a fresh one in the main thread
- * when the database was logically deleted. 'sl' is a skiplist used by
- * Redis Cluster in order to take the hash slots -> keys mapping. This
- * may be NULL if Redis Cluster is disabled. */
-void lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2) {
+ * when the database was logically deleted. The Redis Cluster slots -> keys
+ * mapping is stored in the metadata of the dictionary entries, so it goes
+ * away together with the main dictionary. */
+size_t lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2) {
     size_t numkeys = dictSize(ht1);
     dictRelease(ht1);
     dictRelease(ht2);
     atomicDecr(lazyfree_objects,numkeys,&lazyfree_objects_mutex);
-}
-
-/* Release the skiplist mapping Redis Cluster keys to slots in the
- * lazyfree thread. */
-void lazyfreeFreeSlotsMapFromBioThread(zskiplist *sl) {
-    size_t len = sl->length;
-    zslFree(sl);
-    atomicDecr(lazyfree_objects,len,&lazyfree_objects_mutex);
+    atomicIncr(lazyfreed_objects,numkeys,&lazyfree_objects_mutex);
+    return numkeys;
 }
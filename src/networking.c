@@ -28,11 +28,29 @@
  */
 
 #include "server.h"
+#include "atomicvar.h"
 #include <sys/uio.h>
 #include <math.h>
 
 static void setProtocolError(client *c, int pos);
 
+/* State of the threaded I/O subsystem, see the "Threaded I/O" section at
+ * the end of this file. It is declared here since the read and write
+ * handlers need to know if they are running in the context of the I/O
+ * threads. */
+#define IO_THREADS_OP_IDLE 0
+#define IO_THREADS_OP_READ 1
+#define IO_THREADS_OP_WRITE 2
+static int io_threads_op = IO_THREADS_OP_IDLE;
+
+/* Mutex used by atomicIncr() for the network stats updated by the I/O
+ * threads when the __atomic / __sync builtins are not available. */
+pthread_mutex_t net_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Set to true while processEventsWhileBlocked() is running: in this context
+ * we can't postpone reads to the I/O threads. */
+static int processing_events_while_blocked = 0;
+
 /* Return the size consumed from the allocator, for the specified SDS string,
  * including internal fragmentation. This function is used in order to compute
  * the client output buffer size. */
@@ -52,13 +70,146 @@ size_t getStringObjectSdsUsedMemory(robj *o) {
     }
 }
 
+/* -----------------------------------------------------------------------------
+ * Reply blocks
+ * -------------------------------------------------------------------------- */
+
+/* Blocks of the default size are not released once written to the socket,
+ * but kept in a pool in order to serve the next replies: this saves most of
+ * the allocator work when the replies of many clients don't fit the static
+ * client buffer. The pool is only accessed by the main thread. */
+static clientReplyBlock *reply_block_pool[PROTO_REPLY_POOL_BLOCKS];
+static int reply_block_pool_len = 0;
+
+/* Blocks referencing an object can't be released by the I/O threads, since
+ * the object refcount is not atomic: they are queued here and released by
+ * the main thread once the threads are done, see
+ * releaseReplyBlocksWrittenByThreads(). */
+static list *reply_blocks_to_release;
+static pthread_mutex_t reply_blocks_to_release_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Number of reply blocks referencing an object, see
+ * copyObjectReplyBlocks(). Only updated by the main thread. */
+static size_t reply_object_blocks = 0;
+
+/* Create a reply block with room for at least 'len' bytes. */
+static clientReplyBlock *createReplyBlock(size_t len) {
+    clientReplyBlock *b;
+    size_t size = len > PROTO_REPLY_CHUNK_BYTES ? len : PROTO_REPLY_CHUNK_BYTES;
+
+    if (size == PROTO_REPLY_CHUNK_BYTES && reply_block_pool_len)
+        b = reply_block_pool[--reply_block_pool_len];
+    else
+        b = zmalloc(sizeof(*b)+size);
+    b->size = size;
+    b->used = 0;
+    b->obj = NULL;
+    return b;
+}
+
+/* Create a reply block referencing the sds string of the object 'o'. */
+static clientReplyBlock *createObjectReplyBlock(robj *o) {
+    clientReplyBlock *b = zmalloc(sizeof(*b));
+
+    b->size = 0;
+    b->used = sdslen(o->ptr);
+    b->obj = o;
+    incrRefCount(o);
+    reply_object_blocks++;
+    return b;
+}
+
 /* Client.reply list dup and free methods. */
 void *dupClientReplyValue(void *o) {
-    return sdsdup(o);
+    clientReplyBlock *b = o, *copy;
+
+    if (b == NULL) return NULL;
+    if (b->obj) {
+        copy = createObjectReplyBlock(b->obj);
+    } else {
+        copy = zmalloc(sizeof(*copy)+b->size);
+        memcpy(copy,b,sizeof(*b)+b->used);
+    }
+    return copy;
 }
 
 void freeClientReplyValue(void *o) {
-    sdsfree(o);
+    clientReplyBlock *b = o;
+
+    if (b == NULL) return; /* addDeferredMultiBulkLength() placeholder. */
+    if (io_threads_op != IO_THREADS_OP_IDLE) {
+        /* Called by the I/O threads (or by the main thread while they are
+         * running): neither the pool nor the refcount can be touched. */
+        if (b->obj) {
+            pthread_mutex_lock(&reply_blocks_to_release_mutex);
+            listAddNodeTail(reply_blocks_to_release,b);
+            pthread_mutex_unlock(&reply_blocks_to_release_mutex);
+        } else {
+            zfree(b);
+        }
+        return;
+    }
+
+    if (b->obj) {
+        decrRefCount(b->obj);
+        zfree(b);
+        reply_object_blocks--;
+    } else if (b->size == PROTO_REPLY_CHUNK_BYTES &&
+               reply_block_pool_len < PROTO_REPLY_POOL_BLOCKS)
+    {
+        reply_block_pool[reply_block_pool_len++] = b;
+    } else {
+        zfree(b);
+    }
+}
+
+/* Release the blocks queued by freeClientReplyValue() while the I/O threads
+ * were running. Called by the main thread after the threads are done. */
+static void releaseReplyBlocksWrittenByThreads(void) {
+    serverAssert(io_threads_op == IO_THREADS_OP_IDLE);
+    pthread_mutex_lock(&reply_blocks_to_release_mutex);
+    while(listLength(reply_blocks_to_release)) {
+        listNode *ln = listFirst(reply_blocks_to_release);
+        freeClientReplyValue(listNodeValue(ln));
+        listDelNode(reply_blocks_to_release,ln);
+    }
+    pthread_mutex_unlock(&reply_blocks_to_release_mutex);
+}
+
+/* Replace the reply blocks referencing an object with plain copies of the
+ * referenced bytes, in the output buffers of all the clients. This is called
+ * before handing a whole database to the lazyfree threads: they release the
+ * values with a plain decrRefCount(), so no value they free can be shared
+ * with the reply blocks, that are released by the main thread. */
+void copyObjectReplyBlocks(void) {
+    listIter li;
+    listNode *ln;
+
+    if (reply_object_blocks == 0) return;
+    if (reply_blocks_to_release) releaseReplyBlocksWrittenByThreads();
+
+    listRewind(server.clients,&li);
+    while((ln = listNext(&li)) != NULL) {
+        client *c = listNodeValue(ln);
+        listIter ri;
+        listNode *rn;
+
+        listRewind(c->reply,&ri);
+        while((rn = listNext(&ri)) != NULL) {
+            clientReplyBlock *b = listNodeValue(rn), *copy;
+
+            if (b == NULL || b->obj == NULL) continue;
+            /* The copy accounts the same bytes in c->reply_bytes, but
+             * they are now owned by the client. */
+            copy = zmalloc(sizeof(*copy)+b->used);
+            copy->size = copy->used = b->used;
+            copy->obj = NULL;
+            memcpy(copy->buf,b->obj->ptr,b->used);
+            rn->value = copy;
+            c->reply_obj_bytes -= b->used;
+            freeClientReplyValue(b);
+        }
+    }
 }
 
 int listMatchObjects(void *a, void *b) {
@@ -92,6 +243,7 @@ client *createClient(int fd) {
     c->name = NULL;
     c->bufpos = 0;
     c->querybuf = sdsempty();
+    c->pending_querybuf = sdsempty();
     c->querybuf_peak = 0;
     c->reqtype = 0;
     c->argc = 0;
@@ -106,12 +258,14 @@ client *createClient(int fd) {
     c->replstate = REPL_STATE_NONE;
     c->repl_put_online_on_ack = 0;
     c->reploff = 0;
+    c->read_reploff = 0;
     c->repl_ack_off = 0;
     c->repl_ack_time = 0;
     c->slave_listening_port = 0;
     c->slave_capa = SLAVE_CAPA_NONE;
     c->reply = listCreate();
     c->reply_bytes = 0;
+    c->reply_obj_bytes = 0;
     c->obuf_soft_limit_reached_time = 0;
     listSetFreeMethod(c->reply,freeClientReplyValue);
     listSetDupMethod(c->reply,dupClientReplyValue);
@@ -122,6 +276,7 @@ client *createClient(int fd) {
     c->bpop.numreplicas = 0;
     c->bpop.reploffset = 0;
     c->woff = 0;
+    c->aof_wait_offset = 0;
     c->watched_keys = listCreate();
     c->pubsub_channels = dictCreate(&objectKeyPointerValueDictType,NULL);
     c->pubsub_patterns = listCreate();
@@ -170,12 +325,16 @@ int prepareClientToWrite(client *c) {
 
     if (c->fd <= 0) return C_ERR; /* Fake client for AOF loading. */
 
+    /* The reply may have to wait for the AOF writer thread. */
+    aofUpdateClientWaitOffset(c);
+
     /* Schedule the client to write the output buffers to the socket only
      * if not already done (there were no pending writes already and the client
      * was yet not flagged), and, for slaves, if the slave can actually
      * receive writes at this stage. */
     if (!clientHasPendingReplies(c) &&
         !(c->flags & CLIENT_PENDING_WRITE) &&
+        !(c->flags & CLIENT_PENDING_READ) &&
         (c->replstate == REPL_STATE_NONE ||
          (c->replstate == SLAVE_STATE_ONLINE && !c->repl_put_online_on_ack)))
     {
@@ -214,86 +373,60 @@ int _addReplyToBuffer(client *c, const char *s, size_t len) {
     return C_OK;
 }
 
-void _addReplyObjectToList(client *c, robj *o) {
+void _addReplyStringToList(client *c, const char *s, size_t len) {
+    listNode *ln;
+    clientReplyBlock *tail = NULL;
+
     if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return;
 
-    if (listLength(c->reply) == 0) {
-        sds s = sdsdup(o->ptr);
-        listAddNodeTail(c->reply,s);
-        c->reply_bytes += sdslen(s);
-    } else {
-        listNode *ln = listLast(c->reply);
-        sds tail = listNodeValue(ln);
-
-        /* Append to this object when possible. If tail == NULL it was
-         * set via addDeferredMultiBulkLength(). */
-        if (tail && sdslen(tail)+sdslen(o->ptr) <= PROTO_REPLY_CHUNK_BYTES) {
-            tail = sdscatsds(tail,o->ptr);
-            listNodeValue(ln) = tail;
-            c->reply_bytes += sdslen(o->ptr);
-        } else {
-            sds s = sdsdup(o->ptr);
-            listAddNodeTail(c->reply,s);
-            c->reply_bytes += sdslen(s);
-        }
+    /* Append to the tail block as much as possible. If the tail node value
+     * is NULL it was set via addDeferredMultiBulkLength(), and blocks
+     * referencing an object can't be appended to. */
+    if ((ln = listLast(c->reply)) != NULL) tail = listNodeValue(ln);
+    if (tail && tail->obj == NULL) {
+        size_t avail = tail->size - tail->used;
+        size_t copy = avail >= len ? len : avail;
+
+        memcpy(tail->buf+tail->used,s,copy);
+        tail->used += copy;
+        s += copy;
+        len -= copy;
+    }
+
+    /* Create a new block for the remaining part. */
+    if (len) {
+        tail = createReplyBlock(len);
+        memcpy(tail->buf,s,len);
+        tail->used = len;
+        listAddNodeTail(c->reply,tail);
+        c->reply_bytes += tail->size;
     }
     asyncCloseClientOnOutputBufferLimitReached(c);
 }
 
-/* This method takes responsibility over the sds. When it is no longer
- * needed it will be free'd, otherwise it ends up in a robj. */
+/* This method takes responsibility over the sds. */
 void _addReplySdsToList(client *c, sds s) {
-    if (c->flags & CLIENT_CLOSE_AFTER_REPLY) {
-        sdsfree(s);
-        return;
-    }
-
-    if (listLength(c->reply) == 0) {
-        listAddNodeTail(c->reply,s);
-        c->reply_bytes += sdslen(s);
-    } else {
-        listNode *ln = listLast(c->reply);
-        sds tail = listNodeValue(ln);
-
-        /* Append to this object when possible. If tail == NULL it was
-         * set via addDeferredMultiBulkLength(). */
-        if (tail && sdslen(tail)+sdslen(s) <= PROTO_REPLY_CHUNK_BYTES) {
-            tail = sdscatsds(tail,s);
-            listNodeValue(ln) = tail;
-            c->reply_bytes += sdslen(s);
-            sdsfree(s);
-        } else {
-            listAddNodeTail(c->reply,s);
-            c->reply_bytes += sdslen(s);
-        }
-    }
-    asyncCloseClientOnOutputBufferLimitReached(c);
+    _addReplyStringToList(c,s,sdslen(s));
+    sdsfree(s);
 }
 
-void _addReplyStringToList(client *c, const char *s, size_t len) {
+void _addReplyObjectToList(client *c, robj *o) {
     if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return;
 
-    if (listLength(c->reply) == 0) {
-        sds node = sdsnewlen(s,len);
-        listAddNodeTail(c->reply,node);
-        c->reply_bytes += len;
+    /* Big values are not copied: the client just references the object
+     * until it is written to the socket. Note that the refcount update
+     * may copy a page of memory if there is a saving child, but this is
+     * nothing compared to copying the whole value. */
+    if (sdslen(o->ptr) >= PROTO_REPLY_ZERO_COPY_BYTES) {
+        clientReplyBlock *b = createObjectReplyBlock(o);
+
+        listAddNodeTail(c->reply,b);
+        c->reply_bytes += b->used;
+        c->reply_obj_bytes += b->used;
+        asyncCloseClientOnOutputBufferLimitReached(c);
     } else {
-        listNode *ln = listLast(c->reply);
-        sds tail = listNodeValue(ln);
-
-        /* Append to this object when possible. If tail == NULL it was
-         * set via addDeferredMultiBulkLength(). */
-        if (tail && sdslen(tail)+len <= PROTO_REPLY_CHUNK_BYTES) {
-            tail = sdscatlen(tail,s,len);
-            listNodeValue(ln) = tail;
-            c->reply_bytes += len;
-        } else {
-            sds node = sdsnewlen(s,len);
-            listAddNodeTail(c->reply,node);
-            c->reply_bytes += len;
-        }
+        _addReplyStringToList(c,o->ptr,sdslen(o->ptr));
     }
-    asyncCloseClientOnOutputBufferLimitReached(c);
 }
 
 /* -----------------------------------------------------------------------------
@@ -402,6 +535,23 @@ void addReplyStatusFormat(client *c, const char *fmt, ...) {
     sdsfree(s);
 }
 
+/* Shrink the tail block of the reply list to the bytes it actually uses,
+ * when most of it is unused. Nothing is appended to a block after a
+ * placeholder, so without this a client receiving many small deferred
+ * replies would take a whole PROTO_REPLY_CHUNK_BYTES block for each one. */
+static void trimReplyTailBlock(client *c) {
+    listNode *ln = listLast(c->reply);
+    clientReplyBlock *tail = ln ? listNodeValue(ln) : NULL;
+
+    if (tail == NULL || tail->obj != NULL) return;
+    if (tail->size - tail->used <= tail->size/4) return;
+
+    c->reply_bytes -= tail->size - tail->used;
+    tail = zrealloc(tail,sizeof(*tail)+tail->used);
+    tail->size = tail->used;
+    listNodeValue(ln) = tail;
+}
+
 /* Adds an empty object to the reply list that will contain the multi bulk
  * length, which is not known when this function is called. */
 void *addDeferredMultiBulkLength(client *c) {
@@ -409,6 +559,7 @@ void *addDeferredMultiBulkLength(client *c) {
      * ready to be sent, since we are sure that before returning to the
      * event loop setDeferredMultiBulkLength() will be called. */
     if (prepareClientToWrite(c) != C_OK) return NULL;
+    trimReplyTailBlock(c);
     listAddNodeTail(c->reply,NULL); /* NULL is our placeholder. */
     return listLast(c->reply);
 }
@@ -416,27 +567,37 @@ void *addDeferredMultiBulkLength(client *c) {
 /* Populate the length object and try gluing it to the next chunk. */
 void setDeferredMultiBulkLength(client *c, void *node, long length) {
     listNode *ln = (listNode*)node;
-    sds len, next;
+    clientReplyBlock *next, *b;
+    char lenstr[128];
+    size_t lenlen;
 
     /* Abort when *node is NULL: when the client should not accept writes
      * we return NULL in addDeferredMultiBulkLength() */
     if (node == NULL) return;
 
-    len = sdscatprintf(sdsnewlen("*",1),"%ld\r\n",length);
-    listNodeValue(ln) = len;
-    c->reply_bytes += sdslen(len);
-    if (ln->next != NULL) {
-        next = listNodeValue(ln->next);
-
-        /* Only glue when the next node is non-NULL (an sds in this case) */
-        if (next != NULL) {
-            len = sdscatsds(len,next);
-            listDelNode(c->reply,ln->next);
-            listNodeValue(ln) = len;
-            /* No need to update c->reply_bytes: we are just moving the same
-             * amount of bytes from one node to another. */
-        }
+    lenlen = snprintf(lenstr,sizeof(lenstr),"*%ld\r\n",length);
+
+    /* Prepend the length to the next block when it has room for it: only
+     * when it is a block with its own buffer, that is, not NULL (another
+     * placeholder) nor a block referencing an object. */
+    if (ln->next != NULL && (next = listNodeValue(ln->next)) != NULL &&
+        next->obj == NULL && next->size - next->used >= lenlen)
+    {
+        memmove(next->buf+lenlen,next->buf,next->used);
+        memcpy(next->buf,lenstr,lenlen);
+        next->used += lenlen;
+        listDelNode(c->reply,ln);
+        return;
     }
+
+    /* Otherwise the placeholder becomes a block of the exact size. */
+    b = zmalloc(sizeof(*b)+lenlen);
+    b->size = lenlen;
+    b->used = lenlen;
+    b->obj = NULL;
+    memcpy(b->buf,lenstr,lenlen);
+    listNodeValue(ln) = b;
+    c->reply_bytes += b->size;
     asyncCloseClientOnOutputBufferLimitReached(c);
 }
 
@@ -579,6 +740,7 @@ void copyClientOutputBuffer(client *dst, client *src) {
     memcpy(dst->buf,src->buf,src->bufpos);
     dst->bufpos = src->bufpos;
     dst->reply_bytes = src->reply_bytes;
+    dst->reply_obj_bytes = src->reply_obj_bytes;
 }
 
 /* Return true if the specified client has pending reply buffers to write to
@@ -748,6 +910,22 @@ void unlinkClient(client *c) {
         c->flags &= ~CLIENT_PENDING_WRITE;
     }
 
+    /* Remove from the list of clients waiting for the AOF if needed. */
+    if (c->flags & CLIENT_PENDING_AOF_FSYNC) {
+        ln = listSearchKey(server.clients_waiting_aof,c);
+        serverAssert(ln != NULL);
+        listDelNode(server.clients_waiting_aof,ln);
+        c->flags &= ~CLIENT_PENDING_AOF_FSYNC;
+    }
+
+    /* Remove from the list of pending reads if needed. */
+    if (c->flags & CLIENT_PENDING_READ) {
+        ln = listSearchKey(server.clients_pending_read,c);
+        serverAssert(ln != NULL);
+        listDelNode(server.clients_pending_read,ln);
+        c->flags &= ~CLIENT_PENDING_READ;
+    }
+
     /* When client was just unblocked because of a blocking operation,
      * remove it from the list of unblocked clients. */
     if (c->flags & CLIENT_UNBLOCKED) {
@@ -786,6 +964,7 @@ void freeClient(client *c) {
 
     /* Free the query buffer */
     sdsfree(c->querybuf);
+    sdsfree(c->pending_querybuf);
     c->querybuf = NULL;
 
     /* Deallocate structures used to block on blocking ops. */
@@ -856,9 +1035,34 @@ void freeClient(client *c) {
  * a context where calling freeClient() is not possible, because the client
  * should be valid for the continuation of the flow of the program. */
 void freeClientAsync(client *c) {
+    /* We need to handle concurrent access to the server.clients_to_close list
+     * only in the freeClientAsync() function, since it's the only function
+     * that may access the list while Redis uses I/O threads. All the other
+     * accesses are in the context of the main thread while the other threads
+     * are idle. */
+    static pthread_mutex_t async_free_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+
     if (c->flags & CLIENT_CLOSE_ASAP || c->flags & CLIENT_LUA) return;
     c->flags |= CLIENT_CLOSE_ASAP;
+    if (server.io_threads_num == 1) {
+        /* No need to bother with locking if there is just the main thread. */
+        listAddNodeTail(server.clients_to_close,c);
+        return;
+    }
+    pthread_mutex_lock(&async_free_queue_mutex);
     listAddNodeTail(server.clients_to_close,c);
+    pthread_mutex_unlock(&async_free_queue_mutex);
+}
+
+/* Free the client from the read / write handlers. While the I/O threads are
+ * working (this includes the main thread serving its own slice of clients)
+ * the global state can't be touched, so the client is just scheduled for
+ * asynchronous release. */
+static void freeClientFromIOHandler(client *c) {
+    if (io_threads_op == IO_THREADS_OP_IDLE)
+        freeClient(c);
+    else
+        freeClientAsync(c);
 }
 
 void freeClientsInAsyncFreeQueue(void) {
@@ -873,46 +1077,79 @@ void freeClientsInAsyncFreeQueue(void) {
 }
 
 /* Write data in output buffers to client. Return C_OK if the client
- * is still valid after the call, C_ERR if it was freed. */
+ * is still valid after the call, C_ERR if it was freed.
+ *
+ * The static buffer and up to NET_MAX_WRITEV_IOV-1 reply blocks are sent
+ * with a single writev() call, so that blocks referencing big objects are
+ * written straight from the object memory, and many small blocks don't
+ * need a system call each. */
 int writeToClient(int fd, client *c, int handler_installed) {
     ssize_t nwritten = 0, totwritten = 0;
-    size_t objlen;
-    sds o;
 
     while(clientHasPendingReplies(c)) {
+        struct iovec iov[NET_MAX_WRITEV_IOV];
+        int iovcnt = 0;
+        size_t offset = c->sentlen, remaining;
+        listIter li;
+        listNode *ln;
+
+        /* The static buffer is always sent before the reply list, and
+         * c->sentlen refers to it if it is not empty, otherwise to the
+         * first block of the list. */
+        if (c->bufpos > 0) {
+            iov[iovcnt].iov_base = c->buf+offset;
+            iov[iovcnt].iov_len = c->bufpos-offset;
+            iovcnt++;
+            offset = 0;
+        }
+        listRewind(c->reply,&li);
+        while(iovcnt < NET_MAX_WRITEV_IOV && (ln = listNext(&li))) {
+            clientReplyBlock *b = listNodeValue(ln);
+
+            iov[iovcnt].iov_base = replyBlockData(b)+offset;
+            iov[iovcnt].iov_len = b->used-offset;
+            iovcnt++;
+            offset = 0;
+        }
+
+        nwritten = writev(fd,iov,iovcnt);
+        if (nwritten <= 0) break;
+        totwritten += nwritten;
+
+        /* Consume what was written: release the fully sent blocks and
+         * remember how much of the first pending one was sent. */
+        remaining = nwritten;
         if (c->bufpos > 0) {
-            nwritten = write(fd,c->buf+c->sentlen,c->bufpos-c->sentlen);
-            if (nwritten <= 0) break;
-            c->sentlen += nwritten;
-            totwritten += nwritten;
-
-            /* If the buffer was sent, set bufpos to zero to continue with
-             * the remainder of the reply. */
-            if ((int)c->sentlen == c->bufpos) {
+            size_t left = c->bufpos-c->sentlen;
+
+            if (remaining < left) {
+                c->sentlen += remaining;
+                remaining = 0;
+            } else {
+                /* If the buffer was sent, set bufpos to zero to continue
+                 * with the remainder of the reply. */
                 c->bufpos = 0;
                 c->sentlen = 0;
+                remaining -= left;
             }
-        } else {
-            o = listNodeValue(listFirst(c->reply));
-            objlen = sdslen(o);
-
-            if (objlen == 0) {
-                listDelNode(c->reply,listFirst(c->reply));
-                continue;
-            }
-
-            nwritten = write(fd, o + c->sentlen, objlen - c->sentlen);
-            if (nwritten <= 0) break;
-            c->sentlen += nwritten;
-            totwritten += nwritten;
+        }
+        while(remaining && listLength(c->reply)) {
+            clientReplyBlock *b = listNodeValue(listFirst(c->reply));
+            size_t left = b->used-c->sentlen;
 
-            /* If we fully sent the object on head go to the next one */
-            if (c->sentlen == objlen) {
+            if (remaining < left) {
+                c->sentlen += remaining;
+                remaining = 0;
+            } else {
+                /* The block on head was fully sent, go to the next one. */
+                c->reply_bytes -= replyBlockBytes(b);
+                if (b->obj) c->reply_obj_bytes -= b->used;
                 listDelNode(c->reply,listFirst(c->reply));
                 c->sentlen = 0;
-                c->reply_bytes -= objlen;
+                remaining -= left;
             }
         }
+
         /* Note that we avoid to send more than NET_MAX_WRITES_PER_EVENT
          * bytes, in a single threaded server it's a good idea to serve
          * other clients as well, even if a very large request comes from
@@ -921,18 +1158,18 @@ int writeToClient(int fd, client *c, int handler_installed) {
          *
          * However if we are over the maxmemory limit we ignore that and
          * just deliver as much data as it is possible to deliver. */
-        server.stat_net_output_bytes += totwritten;
         if (totwritten > NET_MAX_WRITES_PER_EVENT &&
             (server.maxmemory == 0 ||
              zmalloc_used_memory() < server.maxmemory)) break;
     }
+    atomicIncr(server.stat_net_output_bytes,totwritten,net_stats_mutex);
     if (nwritten == -1) {
         if (errno == EAGAIN) {
             nwritten = 0;
         } else {
             serverLog(LL_VERBOSE,
                 "Error writing to client: %s", strerror(errno));
-            freeClient(c);
+            freeClientFromIOHandler(c);
             return C_ERR;
         }
     }
@@ -949,7 +1186,7 @@ int writeToClient(int fd, client *c, int handler_installed) {
 
         /* Close connection after entire reply has been sent. */
         if (c->flags & CLIENT_CLOSE_AFTER_REPLY) {
-            freeClient(c);
+            freeClientFromIOHandler(c);
             return C_ERR;
         }
     }
@@ -958,9 +1195,17 @@ int writeToClient(int fd, client *c, int handler_installed) {
 
 /* Write event handler. Just send data to the client. */
 void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
+    client *c = privdata;
     UNUSED(el);
     UNUSED(mask);
-    writeToClient(fd,privdata,1);
+
+    /* More replies were appended after the write handler was installed:
+     * they may have to wait for the AOF writer thread. */
+    if (c->aof_wait_offset > server.aof_durable_offset) {
+        aofParkClient(c);
+        return;
+    }
+    writeToClient(fd,c,1);
 }
 
 /* This function is called just before entering the event loop, in the hope
@@ -970,7 +1215,10 @@ void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
 int handleClientsWithPendingWrites(void) {
     listIter li;
     listNode *ln;
-    int processed = listLength(server.clients_pending_write);
+    int processed;
+
+    if (server.aof_writer_thread) aofParkClientsWaitingFsync();
+    processed = listLength(server.clients_pending_write);
 
     listRewind(server.clients_pending_write,&li);
     while((ln = listNext(&li))) {
@@ -1229,12 +1477,23 @@ int processMultibulkBuffer(client *c) {
     return C_ERR;
 }
 
+/* Parse the query buffer of the client and execute the commands it
+ * contains. When called from the I/O threads (the client is flagged with
+ * CLIENT_PENDING_READ) only the parsing happens: the first complete command
+ * is left in c->argv and the client is flagged as CLIENT_PENDING_COMMAND,
+ * so that the main thread will execute it later calling this function
+ * again. */
 void processInputBuffer(client *c) {
-    server.current_client = c;
+    int threaded = c->flags & CLIENT_PENDING_READ;
+
+    if (!threaded) server.current_client = c;
     /* Keep processing while there is something in the input buffer */
-    while(sdslen(c->querybuf)) {
-        /* Return if clients are paused. */
-        if (!(c->flags & CLIENT_SLAVE) && clientsArePaused()) break;
+    while(sdslen(c->querybuf) || c->flags & CLIENT_PENDING_COMMAND) {
+        /* Return if clients are paused. Pauses are handled by the main
+         * thread, that will check this condition again before executing
+         * the command. */
+        if (!(c->flags & CLIENT_SLAVE) && !threaded && clientsArePaused())
+            break;
 
         /* Immediately abort if the client is in the middle of something. */
         if (c->flags & CLIENT_BLOCKED) break;
@@ -1244,33 +1503,87 @@ void processInputBuffer(client *c) {
          * this flag has been set (i.e. don't process more commands). */
         if (c->flags & CLIENT_CLOSE_AFTER_REPLY) break;
 
-        /* Determine request type when unknown. */
-        if (!c->reqtype) {
-            if (c->querybuf[0] == '*') {
-                c->reqtype = PROTO_REQ_MULTIBULK;
-            } else {
-                c->reqtype = PROTO_REQ_INLINE;
+        /* Parse a new command, unless the I/O threads already did it. */
+        if (!(c->flags & CLIENT_PENDING_COMMAND)) {
+            /* Determine request type when unknown. */
+            if (!c->reqtype) {
+                if (c->querybuf[0] == '*') {
+                    c->reqtype = PROTO_REQ_MULTIBULK;
+                } else {
+                    c->reqtype = PROTO_REQ_INLINE;
+                }
             }
-        }
 
-        if (c->reqtype == PROTO_REQ_INLINE) {
-            if (processInlineBuffer(c) != C_OK) break;
-        } else if (c->reqtype == PROTO_REQ_MULTIBULK) {
-            if (processMultibulkBuffer(c) != C_OK) break;
-        } else {
-            serverPanic("Unknown request type");
+            if (c->reqtype == PROTO_REQ_INLINE) {
+                if (processInlineBuffer(c) != C_OK) break;
+            } else if (c->reqtype == PROTO_REQ_MULTIBULK) {
+                if (processMultibulkBuffer(c) != C_OK) break;
+            } else {
+                serverPanic("Unknown request type");
+            }
         }
 
         /* Multibulk processing could see a <= 0 length. */
         if (c->argc == 0) {
             resetClient(c);
         } else {
+            /* If we are in the context of an I/O thread, we can't really
+             * execute the command here. All we can do is to flag the client
+             * as one that needs to process the command. */
+            if (threaded) {
+                c->flags |= CLIENT_PENDING_COMMAND;
+                break;
+            }
+            c->flags &= ~CLIENT_PENDING_COMMAND;
+
             /* Only reset the client when the command was executed. */
-            if (processCommand(c) == C_OK)
+            if (processCommand(c) == C_OK) {
+                if (c->flags & CLIENT_MASTER && !(c->flags & CLIENT_MULTI)) {
+                    /* Update the applied replication offset of our master. */
+                    c->reploff = c->read_reploff - sdslen(c->querybuf);
+                }
                 resetClient(c);
+            }
+        }
+    }
+    if (!threaded) server.current_client = NULL;
+}
+
+/* This is a wrapper for processInputBuffer() that also takes care of
+ * proxying the replication stream to our sub-slaves when the client 'c'
+ * is our master: only the part of the stream that was actually applied is
+ * forwarded, so that the sub-slaves see exactly the same offsets we see. */
+void processInputBufferAndReplicate(client *c) {
+    if (!(c->flags & CLIENT_MASTER)) {
+        processInputBuffer(c);
+    } else {
+        size_t prev_offset = c->reploff;
+        processInputBuffer(c);
+        size_t applied = c->reploff - prev_offset;
+        if (applied) {
+            replicationFeedSlavesFromMasterStream(server.slaves,
+                    c->pending_querybuf, applied);
+            sdsrange(c->pending_querybuf,applied,-1);
         }
     }
-    server.current_client = NULL;
+}
+
+/* Return 1 if we want to handle the client read later using threaded I/O.
+ * This is called by the readable handler of the event loop.
+ * As a side effect of calling this function the client is put in the
+ * pending read clients and flagged as such. */
+static int postponeClientRead(client *c) {
+    if (server.io_threads_active &&
+        server.io_threads_do_reads &&
+        !processing_events_while_blocked &&
+        !(c->flags & (CLIENT_MASTER|CLIENT_SLAVE|CLIENT_PENDING_READ)))
+    {
+        c->flags |= CLIENT_PENDING_READ;
+        listAddNodeHead(server.clients_pending_read,c);
+        return 1;
+    } else {
+        return 0;
+    }
 }
 
 void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
@@ -1280,6 +1593,10 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
     UNUSED(el);
     UNUSED(mask);
 
+    /* Check if we want to read from the client later when exiting from
+     * the event loop. This is the case if threaded I/O is enabled. */
+    if (postponeClientRead(c)) return;
+
     readlen = PROTO_IOBUF_LEN;
     /* If this is a multi bulk request, and we are processing a bulk reply
      * that is large enough, try to maximize the probability that the query
@@ -1304,19 +1621,23 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
             return;
         } else {
             serverLog(LL_VERBOSE, "Reading from client: %s",strerror(errno));
-            freeClient(c);
+            freeClientFromIOHandler(c);
             return;
         }
     } else if (nread == 0) {
         serverLog(LL_VERBOSE, "Client closed connection");
-        freeClient(c);
+        freeClientFromIOHandler(c);
         return;
     }
 
     sdsIncrLen(c->querybuf,nread);
     c->lastinteraction = server.unixtime;
-    if (c->flags & CLIENT_MASTER) c->reploff += nread;
-    server.stat_net_input_bytes += nread;
+    if (c->flags & CLIENT_MASTER) {
+        c->read_reploff += nread;
+        c->pending_querybuf = sdscatlen(c->pending_querybuf,
+                                        c->querybuf+qblen,nread);
+    }
+    atomicIncr(server.stat_net_input_bytes,nread,net_stats_mutex);
     if (sdslen(c->querybuf) > server.client_max_querybuf_len) {
         sds ci = catClientInfoString(sdsempty(),c), bytes = sdsempty();
 
@@ -1324,10 +1645,10 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
         serverLog(LL_WARNING,"Closing client that reached max query buffer length: %s (qbuf initial bytes: %s)", ci, bytes);
         sdsfree(ci);
         sdsfree(bytes);
-        freeClient(c);
+        freeClientFromIOHandler(c);
         return;
     }
-    processInputBuffer(c);
+    processInputBufferAndReplicate(c);
 }
 
 void getClientsMaxBuffers(unsigned long *longest_output_list,
@@ -1692,9 +2013,7 @@ void rewriteClientCommandArgument(client *c, int i, robj *newval) {
  * the caller wishes. The main usage of this function currently is
  * enforcing the client output length limits. */
 unsigned long getClientOutputBufferMemoryUsage(client *c) {
-    unsigned long list_item_size = sizeof(listNode)+5;
-    /* The +5 above means we assume an sds16 hdr, may not be true
-     * but is not going to be a problem. */
+    unsigned long list_item_size = sizeof(listNode)+sizeof(clientReplyBlock);
 
     return c->reply_bytes + (list_item_size*listLength(c->reply));
 }
@@ -1892,6 +2211,11 @@ int clientsArePaused(void) {
 int processEventsWhileBlocked(void) {
     int iterations = 4; /* See the function top-comment. */
     int count = 0;
+
+    /* Note: when we are processing events while blocked (for instance during
+     * busy Lua scripts) we don't want to postpone reads to the I/O threads,
+     * since clients must be served directly from here. */
+    processing_events_while_blocked = 1;
     while (iterations--) {
         int events = 0;
         events += aeProcessEvents(server.el, AE_FILE_EVENTS|AE_DONT_WAIT);
@@ -1899,5 +2223,344 @@ int processEventsWhileBlocked(void) {
         if (!events) break;
         count += events;
     }
+    processing_events_while_blocked = 0;
+    return count;
+}
+
+/* ==========================================================================
+ * Threaded I/O
+ * ========================================================================== */
+
+/* When io-threads is greater than one, socket reads (optionally, see
+ * io-threads-do-reads), query parsing and socket writes are performed by a
+ * pool of threads, while commands are always executed by the main thread.
+ *
+ * The main thread distributes the clients with pending reads or writes across
+ * the lists of the different threads (slot 0 is the main thread itself), sets
+ * the number of pending jobs for each thread, processes its own slice, and
+ * busy waits for the other threads to finish. This way the I/O threads never
+ * run concurrently with the main thread touching the global state.
+ *
+ * Threads are only activated when there are enough clients to serve, see
+ * stopThreadedIOIfNeeded(). When not active they are parked on their mutex,
+ * that is held by the main thread. */
+
+static pthread_t io_threads[IO_THREADS_MAX_NUM];
+static pthread_mutex_t io_threads_mutex[IO_THREADS_MAX_NUM];
+static unsigned long io_threads_pending[IO_THREADS_MAX_NUM];
+static pthread_mutex_t io_threads_pending_mutex[IO_THREADS_MAX_NUM];
+static list *io_threads_list[IO_THREADS_MAX_NUM];
+
+static unsigned long getIOPendingCount(int i) {
+    unsigned long count;
+    atomicGetWithSync(io_threads_pending[i],count,io_threads_pending_mutex[i]);
     return count;
 }
+
+static void setIOPendingCount(int i, unsigned long count) {
+    atomicSetWithSync(io_threads_pending[i],count,io_threads_pending_mutex[i]);
+}
+
+void *IOThreadMain(void *myid) {
+    /* The ID is the thread number (from 0 to server.io_threads_num-1), and is
+     * used by the thread to just manipulate a single sub-array of clients. */
+    long id = (unsigned long)myid;
+    sigset_t sigset;
+    listIter li;
+    listNode *ln;
+    int j;
+
+    /* Make the thread killable at any time, so that killIOThreads()
+     * can work reliably. */
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+    /* Block SIGALRM so we are sure that only the main thread will
+     * receive the watchdog signal. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    if (pthread_sigmask(SIG_BLOCK, &sigset, NULL))
+        serverLog(LL_WARNING,
+            "Warning: can't mask SIGALRM in I/O thread: %s", strerror(errno));
+
+    while(1) {
+        /* Wait for start */
+        for (j = 0; j < 1000000; j++) {
+            if (getIOPendingCount(id) != 0) break;
+        }
+
+        /* Give the main thread a chance to stop this thread. */
+        if (getIOPendingCount(id) == 0) {
+            pthread_mutex_lock(&io_threads_mutex[id]);
+            pthread_mutex_unlock(&io_threads_mutex[id]);
+            continue;
+        }
+
+        /* Process: note that the main thread will never touch our list
+         * before we drop the pending count to 0. */
+        listRewind(io_threads_list[id],&li);
+        while((ln = listNext(&li))) {
+            client *c = listNodeValue(ln);
+            if (io_threads_op == IO_THREADS_OP_WRITE) {
+                writeToClient(c->fd,c,0);
+            } else if (io_threads_op == IO_THREADS_OP_READ) {
+                readQueryFromClient(NULL,c->fd,c,0);
+            } else {
+                serverPanic("io_threads_op value is unknown");
+            }
+        }
+        listEmpty(io_threads_list[id]);
+        setIOPendingCount(id,0);
+    }
+    return NULL;
+}
+
+/* Initialize the data structures needed for threaded I/O, spawning the
+ * threads if io-threads is greater than one. */
+void initThreadedIO(void) {
+    int j;
+
+    server.io_threads_active = 0; /* We start with threads not active. */
+
+    /* Don't spawn any thread if the user selected a single thread:
+     * we'll handle I/O directly from the main thread. */
+    if (server.io_threads_num == 1) return;
+
+    /* The threads busy wait for new jobs and the main thread busy waits for
+     * the threads to complete: with less cores than threads this is going
+     * to be much slower than the single threaded mode. */
+    if (server.io_threads_num > sysconf(_SC_NPROCESSORS_ONLN)) {
+        serverLog(LL_WARNING,
+            "WARNING: io-threads is set to %d but only %ld CPUs are online. "
+            "Threaded I/O will likely make Redis slower.",
+            server.io_threads_num, (long) sysconf(_SC_NPROCESSORS_ONLN));
+    }
+
+    reply_blocks_to_release = listCreate();
+
+    /* Spawn and initialize the I/O threads. */
+    for (j = 0; j < server.io_threads_num; j++) {
+        pthread_t tid;
+
+        /* Things we do for all the threads including the main thread. */
+        io_threads_list[j] = listCreate();
+        if (j == 0) continue; /* Thread 0 is the main thread. */
+
+        /* Things we do only for the additional threads. */
+        pthread_mutex_init(&io_threads_mutex[j],NULL);
+        pthread_mutex_init(&io_threads_pending_mutex[j],NULL);
+        setIOPendingCount(j,0);
+        pthread_mutex_lock(&io_threads_mutex[j]); /* Thread will be stopped. */
+        if (pthread_create(&tid,NULL,IOThreadMain,(void*)(long)j) != 0) {
+            serverLog(LL_WARNING,"Fatal: Can't initialize I/O threads.");
+            exit(1);
+        }
+        io_threads[j] = tid;
+    }
+}
+
+/* Kill the I/O threads in an unclean way. Like bioKillThreads() this is only
+ * used on crash, in order to perform the memory test. */
+void killIOThreads(void) {
+    int err, j;
+
+    for (j = 1; j < server.io_threads_num; j++) {
+        if (pthread_cancel(io_threads[j]) == 0) {
+            if ((err = pthread_join(io_threads[j],NULL)) != 0) {
+                serverLog(LL_WARNING,
+                    "I/O thread #%d can not be joined: %s",
+                        j, strerror(err));
+            } else {
+                serverLog(LL_WARNING,
+                    "I/O thread #%d terminated",j);
+            }
+        }
+    }
+}
+
+static void startThreadedIO(void) {
+    int j;
+
+    serverAssert(server.io_threads_active == 0);
+    for (j = 1; j < server.io_threads_num; j++)
+        pthread_mutex_unlock(&io_threads_mutex[j]);
+    server.io_threads_active = 1;
+}
+
+static void stopThreadedIO(void) {
+    int j;
+
+    /* We may have still clients with pending reads when this function
+     * is called: handle them before stopping the threads. */
+    handleClientsWithPendingReadsUsingThreads();
+    serverAssert(server.io_threads_active == 1);
+    for (j = 1; j < server.io_threads_num; j++)
+        pthread_mutex_lock(&io_threads_mutex[j]);
+    server.io_threads_active = 0;
+}
+
+/* This function checks if there are not enough pending clients to justify
+ * taking the I/O threads active: in that case I/O threads are stopped if
+ * currently active. We track the pending writes as a measure of clients
+ * we need to handle in parallel, however the I/O threading is disabled
+ * globally for reads as well if we have too little pending clients.
+ *
+ * The function returns 0 if the I/O threading should be used because there
+ * are enough active threads, otherwise 1 is returned and the I/O threads
+ * could be possibly stopped (if already active) as a side effect. */
+int stopThreadedIOIfNeeded(void) {
+    int pending = listLength(server.clients_pending_write);
+
+    /* Return ASAP if I/O threads are disabled (single threaded mode). */
+    if (server.io_threads_num == 1) return 1;
+
+    if (pending < (server.io_threads_num*2)) {
+        if (server.io_threads_active) stopThreadedIO();
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+/* Distribute the clients of 'clients' across the I/O threads lists, run
+ * the operation 'op' in parallel, and wait for all the threads to finish. */
+static void processClientsUsingThreads(list *clients, int op) {
+    listIter li;
+    listNode *ln;
+    int j, item_id = 0;
+
+    listRewind(clients,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+        int target_id = item_id % server.io_threads_num;
+        listAddNodeTail(io_threads_list[target_id],c);
+        item_id++;
+    }
+
+    /* Give the start condition to the waiting threads, by setting the
+     * start condition atomic var. */
+    io_threads_op = op;
+    for (j = 1; j < server.io_threads_num; j++) {
+        unsigned long count = listLength(io_threads_list[j]);
+        setIOPendingCount(j,count);
+    }
+
+    /* Also use the main thread to process a slice of clients. */
+    listRewind(io_threads_list[0],&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+        if (op == IO_THREADS_OP_WRITE)
+            writeToClient(c->fd,c,0);
+        else
+            readQueryFromClient(NULL,c->fd,c,0);
+    }
+    listEmpty(io_threads_list[0]);
+
+    /* Wait for all the other threads to end their work. */
+    while(1) {
+        unsigned long pending = 0;
+        for (j = 1; j < server.io_threads_num; j++)
+            pending += getIOPendingCount(j);
+        if (pending == 0) break;
+    }
+    io_threads_op = IO_THREADS_OP_IDLE;
+}
+
+/* Threaded version of handleClientsWithPendingWrites(), called in
+ * beforeSleep(). When the I/O threads are disabled, or there are too few
+ * clients to serve, it just calls the single threaded implementation. */
+int handleClientsWithPendingWritesUsingThreads(void) {
+    listIter li;
+    listNode *ln;
+    int processed;
+
+    if (server.aof_writer_thread) aofParkClientsWaitingFsync();
+    processed = listLength(server.clients_pending_write);
+
+    if (processed == 0) return 0; /* Return ASAP if there are no clients. */
+
+    /* If I/O threads are disabled or we have few clients to serve, don't
+     * use I/O threads, but the boring synchronous code. */
+    if (stopThreadedIOIfNeeded()) return handleClientsWithPendingWrites();
+
+    /* Start threads if needed. */
+    if (!server.io_threads_active) startThreadedIO();
+
+    /* Clients scheduled to be closed ASAP don't need their replies. */
+    listRewind(server.clients_pending_write,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+        c->flags &= ~CLIENT_PENDING_WRITE;
+        if (c->flags & CLIENT_CLOSE_ASAP)
+            listDelNode(server.clients_pending_write,ln);
+    }
+
+    processClientsUsingThreads(server.clients_pending_write,
+                               IO_THREADS_OP_WRITE);
+    releaseReplyBlocksWrittenByThreads();
+
+    /* Run the list of clients again to install the write handler where
+     * needed. */
+    listRewind(server.clients_pending_write,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+
+        if (c->flags & CLIENT_CLOSE_ASAP) continue;
+        if (clientHasPendingReplies(c) &&
+            aeCreateFileEvent(server.el, c->fd, AE_WRITABLE,
+                sendReplyToClient, c) == AE_ERR)
+        {
+            freeClientAsync(c);
+        }
+    }
+    listEmpty(server.clients_pending_write);
+    server.stat_io_writes_processed += processed;
+
+    /* Clients that the threads could not write to, or that asked to be
+     * closed after the reply, were scheduled for async release: do it now
+     * instead of waiting for the next serverCron() call. */
+    freeClientsInAsyncFreeQueue();
+    return processed;
+}
+
+/* When threaded I/O is also enabled for the reading + parsing side, the
+ * readable handler will just put normal clients into a queue of clients to
+ * process (instead of serving them synchronously). This function runs the
+ * queue using the I/O threads, and process them in order to accumulate
+ * the reads in the buffers, and also parse the first command available
+ * rendering it in the client structures. Commands are then executed by
+ * the main thread. */
+int handleClientsWithPendingReadsUsingThreads(void) {
+    int processed = listLength(server.clients_pending_read);
+
+    if (!server.io_threads_active || !server.io_threads_do_reads) return 0;
+    if (processed == 0) return 0;
+
+    processClientsUsingThreads(server.clients_pending_read,
+                               IO_THREADS_OP_READ);
+
+    /* Run the list of clients again to process the new buffers. */
+    while(listLength(server.clients_pending_read)) {
+        listNode *ln = listFirst(server.clients_pending_read);
+        client *c = listNodeValue(ln);
+
+        c->flags &= ~CLIENT_PENDING_READ;
+        listDelNode(server.clients_pending_read,ln);
+        if (c->flags & CLIENT_CLOSE_ASAP) continue;
+
+        /* Execute the command parsed by the thread, and process the rest
+         * of the query buffer if any. */
+        processInputBuffer(c);
+
+        /* We may have pending replies if a thread readQueryFromClient()
+         * produced replies (protocol errors) and could not schedule the
+         * client for writing. */
+        if (!(c->flags & CLIENT_PENDING_WRITE) && clientHasPendingReplies(c)) {
+            c->flags |= CLIENT_PENDING_WRITE;
+            listAddNodeHead(server.clients_pending_write,c);
+        }
+    }
+    server.stat_io_reads_processed += processed;
+    freeClientsInAsyncFreeQueue();
+    return processed;
+}
@@ -29,6 +29,8 @@
 
 #include "server.h"
 #include "lzf.h"    /* LZF compression library */
+#define ZSTD_STATIC_LINKING_ONLY /* For the custom allocator. */
+#include "zstd.h"   /* zstd compression library */
 #include "zipmap.h"
 #include "endianconv.h"
 
@@ -95,7 +97,7 @@ long long rdbLoadMillisecondTime(rio *rdb) {
 /* Saves an encoded length. The first two bits in the first byte are used to
  * hold the encoding type. See the RDB_* definitions for more information
  * on the types of encoding. */
-int rdbSaveLen(rio *rdb, uint32_t len) {
+int rdbSaveLen(rio *rdb, uint64_t len) {
     unsigned char buf[2];
     size_t nwritten;
 
@@ -110,44 +112,77 @@ int rdbSaveLen(rio *rdb, uint32_t len) {
         buf[1] = len&0xFF;
         if (rdbWriteRaw(rdb,buf,2) == -1) return -1;
         nwritten = 2;
-    } else {
+    } else if (len <= UINT32_MAX) {
         /* Save a 32 bit len */
-        buf[0] = (RDB_32BITLEN<<6);
+        buf[0] = RDB_32BITLEN;
         if (rdbWriteRaw(rdb,buf,1) == -1) return -1;
-        len = htonl(len);
-        if (rdbWriteRaw(rdb,&len,4) == -1) return -1;
+        uint32_t len32 = htonl(len);
+        if (rdbWriteRaw(rdb,&len32,4) == -1) return -1;
         nwritten = 1+4;
+    } else {
+        /* Save a 64 bit len */
+        buf[0] = RDB_64BITLEN;
+        if (rdbWriteRaw(rdb,buf,1) == -1) return -1;
+        len = htonu64(len);
+        if (rdbWriteRaw(rdb,&len,8) == -1) return -1;
+        nwritten = 1+8;
     }
     return nwritten;
 }
 
-/* Load an encoded length. The "isencoded" argument is set to 1 if the length
- * is not actually a length but an "encoding type". See the RDB_ENC_*
- * definitions in rdb.h for more information. */
-uint32_t rdbLoadLen(rio *rdb, int *isencoded) {
+/* Load an encoded length. If the loaded length is a normal length as stored
+ * with rdbSaveLen(), the read length is set to '*lenptr'. If instead the
+ * loaded length describes a special encoding that follows, then '*isencoded'
+ * is set to 1 and the encoding format is stored at '*lenptr'.
+ *
+ * See the RDB_ENC_* definitions in rdb.h for more information on special
+ * encodings.
+ *
+ * The function returns -1 on error, 0 on success. */
+int rdbLoadLenByRef(rio *rdb, int *isencoded, uint64_t *lenptr) {
     unsigned char buf[2];
-    uint32_t len;
     int type;
 
     if (isencoded) *isencoded = 0;
-    if (rioRead(rdb,buf,1) == 0) return RDB_LENERR;
+    if (rioRead(rdb,buf,1) == 0) return -1;
     type = (buf[0]&0xC0)>>6;
     if (type == RDB_ENCVAL) {
         /* Read a 6 bit encoding type. */
         if (isencoded) *isencoded = 1;
-        return buf[0]&0x3F;
+        *lenptr = buf[0]&0x3F;
     } else if (type == RDB_6BITLEN) {
         /* Read a 6 bit len. */
-        return buf[0]&0x3F;
+        *lenptr = buf[0]&0x3F;
     } else if (type == RDB_14BITLEN) {
         /* Read a 14 bit len. */
-        if (rioRead(rdb,buf+1,1) == 0) return RDB_LENERR;
-        return ((buf[0]&0x3F)<<8)|buf[1];
-    } else {
+        if (rioRead(rdb,buf+1,1) == 0) return -1;
+        *lenptr = ((buf[0]&0x3F)<<8)|buf[1];
+    } else if (buf[0] == RDB_32BITLEN) {
         /* Read a 32 bit len. */
-        if (rioRead(rdb,&len,4) == 0) return RDB_LENERR;
-        return ntohl(len);
+        uint32_t len;
+        if (rioRead(rdb,&len,4) == 0) return -1;
+        *lenptr = ntohl(len);
+    } else if (buf[0] == RDB_64BITLEN) {
+        /* Read a 64 bit len. */
+        uint64_t len;
+        if (rioRead(rdb,&len,8) == 0) return -1;
+        *lenptr = ntohu64(len);
+    } else {
+        rdbExitReportCorruptRDB("Unknown RDB length encoding");
+        return -1; /* Never reached. */
     }
+    return 0;
+}
+
+/* This is like rdbLoadLenByRef() but directly returns the value read
+ * from the RDB stream, signaling an error by returning RDB_LENERR
+ * (since it is a too large count to be applicable in any Redis data
+ * structure). */
+uint64_t rdbLoadLen(rio *rdb, int *isencoded) {
+    uint64_t len;
+
+    if (rdbLoadLenByRef(rdb,isencoded,&len) == -1) return RDB_LENERR;
+    return len;
 }
 
 /* Encodes the "value" argument as integer when it fits in the supported ranges
@@ -235,13 +270,15 @@ int rdbTryIntegerEncoding(char *s, size_t len, unsigned char *enc) {
     return rdbEncodeInteger(value,enc);
 }
 
-ssize_t rdbSaveLzfBlob(rio *rdb, void *data, size_t compress_len,
-                       size_t original_len) {
+/* Save a compressed string as [enctype][compress_len][original_len][data].
+ * 'enctype' is the RDB_ENC_* type of the compression codec used. */
+ssize_t rdbSaveCompressedBlob(rio *rdb, int enctype, void *data,
+                              size_t compress_len, size_t original_len) {
     unsigned char byte;
     ssize_t n, nwritten = 0;
 
     /* Data compressed! Let's save it on disk */
-    byte = (RDB_ENCVAL<<6)|RDB_ENC_LZF;
+    byte = (RDB_ENCVAL<<6)|enctype;
     if ((n = rdbWriteRaw(rdb,&byte,1)) == -1) goto writeerr;
     nwritten += n;
 
@@ -260,6 +297,12 @@ writeerr:
     return -1;
 }
 
+ssize_t rdbSaveLzfBlob(rio *rdb, void *data, size_t compress_len,
+                       size_t original_len) {
+    return rdbSaveCompressedBlob(rdb,RDB_ENC_LZF,data,compress_len,
+                                 original_len);
+}
+
 ssize_t rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
     size_t comprlen, outlen;
     void *out;
@@ -278,13 +321,115 @@ ssize_t rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
     return nwritten;
 }
 
-/* Load an LZF compressed string in RDB format. The returned value
- * changes according to 'flags'. For more info check the
- * rdbGenericLoadStringObject() function. */
-void *rdbLoadLzfStringObject(rio *rdb, int flags) {
+/* zstd compression levels used by the zstd-fast and zstd codecs. Negative
+ * levels trade ratio for speed, reaching LZ4 like speeds. Building the
+ * entropy tables has a fixed cost that dominates on short strings, that are
+ * still compressed with LZF: the minimum lengths are the points where zstd
+ * starts to be convenient in terms of speed and ratio respectively. */
+#define RDB_ZSTD_FAST_LEVEL -1
+#define RDB_ZSTD_FAST_MIN_LEN 1024
+#define RDB_ZSTD_LEVEL 3
+#define RDB_ZSTD_MIN_LEN 256
+
+/* The zstd contexts are expensive to create, so every thread saving or
+ * loading an RDB file reuses its own. Their memory is allocated with
+ * zmalloc() so that it is accounted in used_memory.
+ *
+ * Values are often small, so the frames are written without the magic
+ * number and the content size, that are redundant in the RDB encoding:
+ * this saves up to 12 bytes per value. */
+static __thread ZSTD_CCtx *rdbZstdCCtx = NULL;
+static __thread ZSTD_DCtx *rdbZstdDCtx = NULL;
+
+static void *rdbZstdAlloc(void *opaque, size_t size) {
+    UNUSED(opaque);
+    return zmalloc(size);
+}
+
+static void rdbZstdFree(void *opaque, void *ptr) {
+    UNUSED(opaque);
+    zfree(ptr);
+}
+
+static ZSTD_customMem rdbZstdMem = {rdbZstdAlloc, rdbZstdFree, NULL};
+
+/* Release the zstd contexts of the calling thread. Threads that load or save
+ * RDB payloads should call it before exiting. */
+void rdbFreeCompressionContexts(void) {
+    ZSTD_freeCCtx(rdbZstdCCtx);
+    ZSTD_freeDCtx(rdbZstdDCtx);
+    rdbZstdCCtx = NULL;
+    rdbZstdDCtx = NULL;
+}
+
+ssize_t rdbSaveZstdStringObject(rio *rdb, unsigned char *s, size_t len,
+                                int level) {
+    size_t comprlen, outlen;
+    void *out;
+
+    /* Like for LZF we require at least four bytes of compression. */
+    if (len <= 4) return 0;
+    if (rdbZstdCCtx == NULL) {
+        if ((rdbZstdCCtx = ZSTD_createCCtx_advanced(rdbZstdMem)) == NULL)
+            return 0;
+        ZSTD_CCtx_setParameter(rdbZstdCCtx,ZSTD_c_format,
+                               ZSTD_f_zstd1_magicless);
+        ZSTD_CCtx_setParameter(rdbZstdCCtx,ZSTD_c_contentSizeFlag,0);
+        ZSTD_CCtx_setParameter(rdbZstdCCtx,ZSTD_c_dictIDFlag,0);
+    }
+    ZSTD_CCtx_setParameter(rdbZstdCCtx,ZSTD_c_compressionLevel,level);
+    outlen = len-4;
+    out = zmalloc(outlen);
+    comprlen = ZSTD_compress2(rdbZstdCCtx,out,outlen,s,len);
+    if (ZSTD_isError(comprlen)) {
+        zfree(out);
+        return 0;
+    }
+    ssize_t nwritten = rdbSaveCompressedBlob(rdb,RDB_ENC_ZSTD,out,comprlen,
+                                             len);
+    zfree(out);
+    return nwritten;
+}
+
+/* Compress the string with the codec selected by the rdbcompression option.
+ * Like the codec specific functions, returns the number of bytes written,
+ * 0 if the string can't be compressed, or -1 on write errors. */
+ssize_t rdbSaveCompressedStringObject(rio *rdb, unsigned char *s, size_t len) {
+    if (server.rdb_compression == RDB_COMPRESSION_ZSTD_FAST &&
+        len >= RDB_ZSTD_FAST_MIN_LEN)
+        return rdbSaveZstdStringObject(rdb,s,len,RDB_ZSTD_FAST_LEVEL);
+    if (server.rdb_compression == RDB_COMPRESSION_ZSTD &&
+        len >= RDB_ZSTD_MIN_LEN)
+        return rdbSaveZstdStringObject(rdb,s,len,RDB_ZSTD_LEVEL);
+    return rdbSaveLzfStringObject(rdb,s,len);
+}
+
+/* Decompress 'clen' bytes at 'c' compressed with the RDB_ENC_* codec
+ * 'enctype' into exactly 'len' bytes at 'dst'. Returns 0 on error. */
+int rdbDecompress(int enctype, void *c, size_t clen, void *dst, size_t len) {
+    if (enctype == RDB_ENC_LZF) {
+        return lzf_decompress(c,clen,dst,len) != 0;
+    } else {
+        size_t retval;
+
+        if (rdbZstdDCtx == NULL) {
+            if ((rdbZstdDCtx = ZSTD_createDCtx_advanced(rdbZstdMem)) == NULL)
+                return 0;
+            ZSTD_DCtx_setParameter(rdbZstdDCtx,ZSTD_d_format,
+                                   ZSTD_f_zstd1_magicless);
+        }
+        retval = ZSTD_decompressDCtx(rdbZstdDCtx,dst,len,c,clen);
+        return !ZSTD_isError(retval) && retval == len;
+    }
+}
+
+/* Load a string compressed with the RDB_ENC_* codec 'enctype' in RDB
+ * format. The returned value changes according to 'flags'. For more info
+ * check the rdbGenericLoadStringObject() function. */
+void *rdbLoadCompressedStringObject(rio *rdb, int enctype, int flags) {
     int plain = flags & RDB_LOAD_PLAIN;
     int sds = flags & RDB_LOAD_SDS;
-    unsigned int len, clen;
+    uint64_t len, clen;
     unsigned char *c = NULL;
     char *val = NULL;
 
@@ -301,7 +446,7 @@ void *rdbLoadLzfStringObject(rio *rdb, int flags) {
 
     /* Load the compressed representation and uncompress it to target. */
     if (rioRead(rdb,c,clen) == 0) goto err;
-    if (lzf_decompress(c,clen,val,len) == 0) goto err;
+    if (!rdbDecompress(enctype,c,clen,val,len)) goto err;
     zfree(c);
 
     if (plain || sds) {
@@ -333,10 +478,10 @@ ssize_t rdbSaveRawString(rio *rdb, unsigned char *s, size_t len) {
         }
     }
 
-    /* Try LZF compression - under 20 bytes it's unable to compress even
+    /* Try compression - under 20 bytes it's unable to compress even
      * aaaaaaaaaaaaaaaaaa so skip it */
-    if (server.rdb_compression && len > 20) {
-        n = rdbSaveLzfStringObject(rdb,s,len);
+    if (server.rdb_compression != RDB_COMPRESSION_NONE && len > 20) {
+        n = rdbSaveCompressedStringObject(rdb,s,len);
         if (n == -1) return -1;
         if (n > 0) return n;
         /* Return value of 0 means data can't be compressed, save the old way */
@@ -399,7 +544,7 @@ void *rdbGenericLoadStringObject(rio *rdb, int flags) {
     int plain = flags & RDB_LOAD_PLAIN;
     int sds = flags & RDB_LOAD_SDS;
     int isencoded;
-    uint32_t len;
+    uint64_t len;
 
     len = rdbLoadLen(rdb,&isencoded);
     if (isencoded) {
@@ -409,7 +554,8 @@ void *rdbGenericLoadStringObject(rio *rdb, int flags) {
         case RDB_ENC_INT32:
             return rdbLoadIntegerObject(rdb,len,flags);
         case RDB_ENC_LZF:
-            return rdbLoadLzfStringObject(rdb,flags);
+        case RDB_ENC_ZSTD:
+            return rdbLoadCompressedStringObject(rdb,len,flags);
         default:
             rdbExitReportCorruptRDB("Unknown RDB encoding type");
         }
@@ -698,6 +844,19 @@ int rdbSaveKeyValuePair(rio *rdb, robj *key, robj *val,
         if (rdbSaveMillisecondTime(rdb,expiretime) == -1) return -1;
     }
 
+    /* Save the LRU idle time (in seconds) or the LFU counter of the key,
+     * depending on the eviction policy, so that the loading server does
+     * not see every key as equally hot after a restart. */
+    if (server.maxmemory_policy & MAXMEMORY_FLAG_LRU) {
+        uint64_t idletime = estimateObjectIdleTime(val)/1000;
+        if (rdbSaveType(rdb,RDB_OPCODE_IDLE) == -1) return -1;
+        if (rdbSaveLen(rdb,idletime) == -1) return -1;
+    } else if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
+        unsigned char freq = LFUDecrAndReturn(val);
+        if (rdbSaveType(rdb,RDB_OPCODE_FREQ) == -1) return -1;
+        if (rdbWriteRaw(rdb,&freq,1) == -1) return -1;
+    }
+
     /* Save type, key, value */
     if (rdbSaveObjectType(rdb,val) == -1) return -1;
     if (rdbSaveStringObject(rdb,key) == -1) return -1;
@@ -727,14 +886,26 @@ int rdbSaveAuxFieldStrInt(rio *rdb, char *key, long long val) {
 }
 
 /* Save a few default AUX fields with information about the RDB generated. */
-int rdbSaveInfoAuxFields(rio *rdb) {
+int rdbSaveInfoAuxFields(rio *rdb, int flags, rdbSaveInfo *rsi) {
     int redis_bits = (sizeof(void*) == 8) ? 64 : 32;
+    int aof_preamble = (flags & RDB_SAVE_AOF_PREAMBLE) != 0;
 
     /* Add a few fields about the state when the RDB was created. */
     if (rdbSaveAuxFieldStrStr(rdb,"redis-ver",REDIS_VERSION) == -1) return -1;
     if (rdbSaveAuxFieldStrInt(rdb,"redis-bits",redis_bits) == -1) return -1;
     if (rdbSaveAuxFieldStrInt(rdb,"ctime",time(NULL)) == -1) return -1;
     if (rdbSaveAuxFieldStrInt(rdb,"used-mem",zmalloc_used_memory()) == -1) return -1;
+    if (rdbSaveAuxFieldStrInt(rdb,"aof-preamble",aof_preamble) == -1) return -1;
+
+    /* Handle saving options that generate aux fields. */
+    if (rsi) {
+        if (rdbSaveAuxFieldStrInt(rdb,"repl-stream-db",rsi->repl_stream_db)
+            == -1) return -1;
+        if (rdbSaveAuxFieldStrStr(rdb,"repl-id",server.replid)
+            == -1) return -1;
+        if (rdbSaveAuxFieldStrInt(rdb,"repl-offset",server.master_repl_offset)
+            == -1) return -1;
+    }
     return 1;
 }
 
@@ -745,20 +916,25 @@ int rdbSaveInfoAuxFields(rio *rdb) {
  *
  * When the function returns C_ERR and if 'error' is not NULL, the
  * integer pointed by 'error' is set to the value of errno just after the I/O
- * error. */
-int rdbSaveRio(rio *rdb, int *error) {
+ * error.
+ *
+ * If 'flags' has RDB_SAVE_AOF_PREAMBLE set, the payload is the preamble of
+ * an AOF rewrite: it is marked as such, and the differences accumulated
+ * by the parent are read from time to time while saving. */
+int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
     dictIterator *di = NULL;
     dictEntry *de;
     char magic[10];
     int j;
     long long now = mstime();
     uint64_t cksum;
+    size_t processed = 0;
 
     if (server.rdb_checksum)
         rdb->update_cksum = rioGenericUpdateChecksum;
     snprintf(magic,sizeof(magic),"REDIS%04d",RDB_VERSION);
     if (rdbWriteRaw(rdb,magic,9) == -1) goto werr;
-    if (rdbSaveInfoAuxFields(rdb) == -1) goto werr;
+    if (rdbSaveInfoAuxFields(rdb,flags,rsi) == -1) goto werr;
 
     for (j = 0; j < server.dbnum; j++) {
         redisDb *db = server.db+j;
@@ -771,20 +947,12 @@ int rdbSaveRio(rio *rdb, int *error) {
         if (rdbSaveType(rdb,RDB_OPCODE_SELECTDB) == -1) goto werr;
         if (rdbSaveLen(rdb,j) == -1) goto werr;
 
-        /* Write the RESIZE DB opcode. We trim the size to UINT32_MAX, which
-         * is currently the largest type we are able to represent in RDB sizes.
-         * However this does not limit the actual size of the DB to load since
-         * these sizes are just hints to resize the hash tables. */
-        uint32_t db_size, expires_size;
-        db_size = (dictSize(db->dict) <= UINT32_MAX) ?
-                                dictSize(db->dict) :
-                                UINT32_MAX;
-        expires_size = (dictSize(db->dict) <= UINT32_MAX) ?
-                                dictSize(db->expires) :
-                                UINT32_MAX;
+        /* Write the RESIZE DB opcode. The sizes are just hints used by the
+         * loader to resize the hash tables once, instead of rehashing them
+         * many times while the keys are added. */
         if (rdbSaveType(rdb,RDB_OPCODE_RESIZEDB) == -1) goto werr;
-        if (rdbSaveLen(rdb,db_size) == -1) goto werr;
-        if (rdbSaveLen(rdb,expires_size) == -1) goto werr;
+        if (rdbSaveLen(rdb,dictSize(db->dict)) == -1) goto werr;
+        if (rdbSaveLen(rdb,dictSize(db->expires)) == -1) goto werr;
 
         /* Iterate this DB writing every entry */
         while((de = dictNext(di)) != NULL) {
@@ -793,8 +961,33 @@ int rdbSaveRio(rio *rdb, int *error) {
             long long expire;
 
             initStaticStringObject(key,keystr);
-            expire = getExpire(db,&key);
+            expire = dbEntryGetExpire(de);
             if (rdbSaveKeyValuePair(rdb,&key,o,expire,now) == -1) goto werr;
+
+            /* When this RDB is produced as part of an AOF rewrite, move
+             * accumulated diff from parent to child while rewriting in
+             * order to have a smaller final write. */
+            if (flags & RDB_SAVE_AOF_PREAMBLE &&
+                rdb->processed_bytes > processed+AOF_READ_DIFF_INTERVAL_BYTES)
+            {
+                processed = rdb->processed_bytes;
+                aofReadDiffFromParent();
+            }
+        }
+        dictReleaseIterator(di);
+    }
+    di = NULL; /* So that we don't release it again on error. */
+
+    /* If we are storing the replication information on disk, persist
+     * the script cache as well: on successful PSYNC after a restart, we need
+     * to be able to process any EVALSHA inside the replication backlog the
+     * master will send us. */
+    if (rsi && dictSize(server.lua_scripts)) {
+        di = dictGetIterator(server.lua_scripts);
+        while((de = dictNext(di)) != NULL) {
+            robj *body = dictGetVal(de);
+            if (rdbSaveAuxField(rdb,"lua",3,body->ptr,sdslen(body->ptr)) == -1)
+                goto werr;
         }
         dictReleaseIterator(di);
     }
@@ -824,7 +1017,7 @@ werr:
  * While the suffix is the 40 bytes hex string we announced in the prefix.
  * This way processes receiving the payload can understand when it ends
  * without doing any processing of the content. */
-int rdbSaveRioWithEOFMark(rio *rdb, int *error) {
+int rdbSaveRioWithEOFMark(rio *rdb, int *error, rdbSaveInfo *rsi) {
     char eofmark[RDB_EOF_MARK_SIZE];
 
     getRandomHexChars(eofmark,RDB_EOF_MARK_SIZE);
@@ -832,7 +1025,7 @@ int rdbSaveRioWithEOFMark(rio *rdb, int *error) {
     if (rioWrite(rdb,"$EOF:",5) == 0) goto werr;
     if (rioWrite(rdb,eofmark,RDB_EOF_MARK_SIZE) == 0) goto werr;
     if (rioWrite(rdb,"\r\n",2) == 0) goto werr;
-    if (rdbSaveRio(rdb,error) == C_ERR) goto werr;
+    if (rdbSaveRio(rdb,error,RDB_SAVE_NONE,rsi) == C_ERR) goto werr;
     if (rioWrite(rdb,eofmark,RDB_EOF_MARK_SIZE) == 0) goto werr;
     return C_OK;
 
@@ -843,7 +1036,7 @@ werr: /* Write error. */
 }
 
 /* Save the DB on disk. Return C_ERR on error, C_OK on success. */
-int rdbSave(char *filename) {
+int rdbSave(char *filename, rdbSaveInfo *rsi) {
     char tmpfile[256];
     char cwd[MAXPATHLEN]; /* Current working dir path for error messages. */
     FILE *fp;
@@ -864,7 +1057,7 @@ int rdbSave(char *filename) {
     }
 
     rioInitWithFile(&rdb,fp);
-    if (rdbSaveRio(&rdb,&error) == C_ERR) {
+    if (rdbSaveRio(&rdb,&error,RDB_SAVE_NONE,rsi) == C_ERR) {
         errno = error;
         goto werr;
     }
@@ -902,11 +1095,11 @@ werr:
     return C_ERR;
 }
 
-int rdbSaveBackground(char *filename) {
+int rdbSaveBackground(char *filename, rdbSaveInfo *rsi) {
     pid_t childpid;
     long long start;
 
-    if (server.rdb_child_pid != -1) return C_ERR;
+    if (server.rdb_child_pid != -1 || server.rdb_snapshot) return C_ERR;
 
     server.dirty_before_bgsave = server.dirty;
     server.lastbgsave_try = time(NULL);
@@ -918,7 +1111,7 @@ int rdbSaveBackground(char *filename) {
         /* Child */
         closeListeningSockets(0);
         redisSetProcTitle("redis-rdb-bgsave");
-        retval = rdbSave(filename);
+        retval = rdbSave(filename,rsi);
         if (retval == C_OK) {
             size_t private_dirty = zmalloc_get_private_dirty();
 
@@ -950,6 +1143,15 @@ int rdbSaveBackground(char *filename) {
     return C_OK; /* unreached */
 }
 
+/* Start the BGSAVE requested by the user or by the save points: it is
+ * performed without forking when rdb-forkless-bgsave is enabled, see
+ * snapshot.c. Returns C_ERR if a BGSAVE is already in progress. */
+int rdbStartBackgroundSave(char *filename, rdbSaveInfo *rsi) {
+    if (server.rdb_child_pid != -1 || server.rdb_snapshot) return C_ERR;
+    if (server.rdb_forkless_bgsave) return snapshotStart(filename,rsi);
+    return rdbSaveBackground(filename,rsi);
+}
+
 void rdbRemoveTempFile(pid_t childpid) {
     char tmpfile[256];
 
@@ -961,8 +1163,8 @@ void rdbRemoveTempFile(pid_t childpid) {
  * On success a newly allocated object is returned, otherwise NULL. */
 robj *rdbLoadObject(int rdbtype, rio *rdb) {
     robj *o = NULL, *ele, *dec;
-    size_t len;
-    unsigned int i;
+    uint64_t len;
+    uint64_t i;
 
     if (rdbtype == RDB_TYPE_STRING) {
         /* Read string value */
@@ -1028,7 +1230,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
         }
     } else if (rdbtype == RDB_TYPE_ZSET) {
         /* Read list/set value. */
-        size_t zsetlen;
+        uint64_t zsetlen;
         size_t maxelelen = 0;
         zset *zs;
 
@@ -1058,7 +1260,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
             maxelelen <= server.zset_max_ziplist_value)
                 zsetConvert(o,OBJ_ENCODING_ZIPLIST);
     } else if (rdbtype == RDB_TYPE_HASH) {
-        size_t len;
+        uint64_t len;
         int ret;
         sds field, value;
 
@@ -1208,19 +1410,25 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
 }
 
 /* Mark that we are loading in the global state and setup the fields
- * needed to provide loading stats. */
-void startLoading(FILE *fp) {
-    struct stat sb;
-
+ * needed to provide loading stats. 'size' is the total number of bytes
+ * to load if known, otherwise zero. */
+void startLoading(size_t size) {
     /* Load the DB */
     server.loading = 1;
     server.loading_start_time = time(NULL);
     server.loading_loaded_bytes = 0;
-    if (fstat(fileno(fp), &sb) == -1) {
-        server.loading_total_bytes = 0;
-    } else {
-        server.loading_total_bytes = sb.st_size;
-    }
+    server.loading_read_keys = 0;
+    server.loading_loaded_keys = 0;
+    server.loading_total_bytes = size;
+}
+
+/* Like startLoading() but the total size is obtained from the file we
+ * are going to load. */
+void startLoadingFile(FILE *fp) {
+    struct stat sb;
+
+    if (fstat(fileno(fp), &sb) == -1) sb.st_size = 0;
+    startLoading(sb.st_size);
 }
 
 /* Refresh the loading progress info */
@@ -1254,67 +1462,350 @@ void rdbLoadProgressCallback(rio *r, const void *buf, size_t len) {
     }
 }
 
-int rdbLoad(char *filename) {
-    uint32_t dbid;
+/* ---------------------------------------------------------------------------
+ * Threaded loading
+ *
+ * When rdb-load-threads is greater than one, decoding the values, that is
+ * the most expensive part of loading (LZF decompression, creation of dicts
+ * and skiplists, conversions between encodings), is performed by a pool of
+ * decoding threads, while the main thread keeps doing everything else:
+ *
+ * 1) It reads the file, and slices the serialized value of every key
+ *    without decoding it, just following the length prefixes. The keys are
+ *    grouped in batches, and every batch is queued for the decoders.
+ * 2) The decoders turn the serialized values into objects calling
+ *    rdbLoadObject() against an in memory rio.
+ * 3) The main thread adds the decoded keys to the keyspace in the same
+ *    order they appear in the file, one batch after the other.
+ *
+ * The decoders only allocate new objects and never touch the global state,
+ * so no other synchronization is needed.
+ * ------------------------------------------------------------------------- */
+
+#define RDB_LOAD_BATCH_KEYS 1024 /* Max keys in a batch. */
+#define RDB_LOAD_BATCH_BYTES (1024*1024) /* Max serialized bytes in a batch. */
+#define RDB_LOAD_BATCHES_PER_THREAD 4 /* Batches in flight per decoder. */
+
+typedef struct rdbLoadRecord {
+    robj *key;                  /* Key name, loaded by the main thread. */
+    robj *val;                  /* Value, decoded by a decoding thread. */
+    int type;                   /* RDB type of the value. */
+    redisDb *db;                /* DB the key belongs to. */
+    long long expiretime;       /* Expire time or -1. */
+    long long lru_idle;         /* Saved LRU idle time in seconds or -1. */
+    long long lfu_freq;         /* Saved LFU counter or -1. */
+    size_t offset;              /* Serialized value offset in the batch. */
+} rdbLoadRecord;
+
+typedef struct rdbLoadBatch {
+    rdbLoadRecord records[RDB_LOAD_BATCH_KEYS];
+    int count;                  /* Number of records in the batch. */
+    sds raw;                    /* Serialized values of all the records. */
+    int decoded;                /* True once the values were decoded. */
+} rdbLoadBatch;
+
+static struct rdbLoader {
+    pthread_t threads[RDB_LOAD_THREADS_MAX];
+    int numthreads;             /* Number of decoding threads. */
+    rdbLoadBatch *batches;      /* Ring of batches. */
+    int numbatches;             /* Size of the ring. */
+    long long submitted;        /* Batches queued for decoding so far. */
+    long long taken;            /* Batches taken by the decoders so far. */
+    long long added;            /* Batches added to the keyspace so far. */
+    int shutdown;               /* Ask the decoders to exit. */
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;   /* Signaled when a batch is queued. */
+    pthread_cond_t done_cond;   /* Signaled when a batch is decoded. */
+    long long wait_time;        /* Microseconds spent waiting the decoders. */
+    long long add_time;         /* Microseconds spent adding keys. */
+} loader;
+
+void *rdbLoadThreadMain(void *arg) {
+    UNUSED(arg);
+
+    while(1) {
+        rdbLoadBatch *b;
+        rio r;
+        int j;
+
+        pthread_mutex_lock(&loader.mutex);
+        while (!loader.shutdown && loader.taken == loader.submitted)
+            pthread_cond_wait(&loader.work_cond,&loader.mutex);
+        if (loader.taken == loader.submitted) {
+            pthread_mutex_unlock(&loader.mutex);
+            break;
+        }
+        b = loader.batches+(loader.taken % loader.numbatches);
+        loader.taken++;
+        pthread_mutex_unlock(&loader.mutex);
+
+        rioInitWithBuffer(&r,b->raw);
+        for (j = 0; j < b->count; j++) {
+            r.io.buffer.pos = b->records[j].offset;
+            b->records[j].val = rdbLoadObject(b->records[j].type,&r);
+            if (b->records[j].val == NULL)
+                rdbExitReportCorruptRDB("Short read decoding a value");
+        }
+
+        pthread_mutex_lock(&loader.mutex);
+        b->decoded = 1;
+        pthread_cond_broadcast(&loader.done_cond);
+        pthread_mutex_unlock(&loader.mutex);
+    }
+    rdbFreeCompressionContexts();
+    return NULL;
+}
+
+void rdbLoaderStart(int numthreads) {
+    int j;
+
+    loader.numthreads = numthreads;
+    loader.numbatches = numthreads*RDB_LOAD_BATCHES_PER_THREAD;
+    loader.batches = zcalloc(sizeof(rdbLoadBatch)*loader.numbatches);
+    for (j = 0; j < loader.numbatches; j++)
+        loader.batches[j].raw = sdsempty();
+    loader.submitted = loader.taken = loader.added = 0;
+    loader.shutdown = 0;
+    loader.wait_time = loader.add_time = 0;
+    pthread_mutex_init(&loader.mutex,NULL);
+    pthread_cond_init(&loader.work_cond,NULL);
+    pthread_cond_init(&loader.done_cond,NULL);
+    for (j = 0; j < numthreads; j++) {
+        if (pthread_create(&loader.threads[j],NULL,rdbLoadThreadMain,NULL)) {
+            serverLog(LL_WARNING,"Fatal: Can't initialize RDB loading "
+                                 "threads.");
+            exit(1);
+        }
+    }
+}
+
+/* Wait for the oldest batch to be decoded, and add its keys to the
+ * keyspace. */
+void rdbLoaderAddBatch(void) {
+    rdbLoadBatch *b = loader.batches+(loader.added % loader.numbatches);
+    long long start = ustime();
+    int j;
+
+    pthread_mutex_lock(&loader.mutex);
+    while (!b->decoded) pthread_cond_wait(&loader.done_cond,&loader.mutex);
+    pthread_mutex_unlock(&loader.mutex);
+    loader.wait_time += ustime()-start;
+
+    start = ustime();
+    for (j = 0; j < b->count; j++) {
+        rdbLoadRecord *rec = b->records+j;
+
+        objectSetLRUOrLFU(rec->val,rec->lfu_freq,rec->lru_idle);
+        dbAdd(rec->db,rec->key,rec->val);
+        if (rec->expiretime != -1) setExpire(rec->db,rec->key,rec->expiretime);
+        decrRefCount(rec->key);
+    }
+    loader.add_time += ustime()-start;
+    server.loading_loaded_keys += b->count;
+    b->count = 0;
+    b->decoded = 0;
+    sdsclear(b->raw);
+    loader.added++;
+}
+
+/* Return the batch being filled, making room in the ring if needed. */
+rdbLoadBatch *rdbLoaderCurrentBatch(void) {
+    if (loader.submitted-loader.added == loader.numbatches)
+        rdbLoaderAddBatch();
+    return loader.batches+(loader.submitted % loader.numbatches);
+}
+
+/* Queue the batch being filled for decoding, if not empty. */
+void rdbLoaderSubmit(void) {
+    rdbLoadBatch *b = loader.batches+(loader.submitted % loader.numbatches);
+
+    if (b->count == 0) return;
+    pthread_mutex_lock(&loader.mutex);
+    loader.submitted++;
+    pthread_cond_signal(&loader.work_cond);
+    pthread_mutex_unlock(&loader.mutex);
+}
+
+/* Add all the pending keys to the keyspace, then stop the decoders. */
+void rdbLoaderStop(void) {
+    int j;
+
+    rdbLoaderSubmit();
+    while (loader.added < loader.submitted) rdbLoaderAddBatch();
+
+    pthread_mutex_lock(&loader.mutex);
+    loader.shutdown = 1;
+    pthread_cond_broadcast(&loader.work_cond);
+    pthread_mutex_unlock(&loader.mutex);
+    for (j = 0; j < loader.numthreads; j++)
+        pthread_join(loader.threads[j],NULL);
+
+    for (j = 0; j < loader.numbatches; j++) sdsfree(loader.batches[j].raw);
+    zfree(loader.batches);
+    pthread_mutex_destroy(&loader.mutex);
+    pthread_cond_destroy(&loader.work_cond);
+    pthread_cond_destroy(&loader.done_cond);
+}
+
+/* The following functions copy the serialized representation of a value
+ * from the RDB stream to 'dst' without decoding it, so that it can be
+ * decoded later by rdbLoadObject(). They return -1 on read errors. */
+int rdbSliceRaw(rio *rdb, sds *dst, size_t len) {
+    *dst = sdsMakeRoomFor(*dst,len);
+    if (len && rioRead(rdb,*dst+sdslen(*dst),len) == 0) return -1;
+    sdsIncrLen(*dst,len);
+    return 0;
+}
+
+int rdbSliceLen(rio *rdb, sds *dst, uint64_t *lenptr, int *isencoded) {
+    size_t start = sdslen(*dst);
+    unsigned char first;
+    rio r;
+
+    /* Copy the first byte, then decode the length from the copy, reading
+     * the remaining bytes if any. */
+    if (rdbSliceRaw(rdb,dst,1) == -1) return -1;
+    first = (*dst)[start];
+    if (((first&0xC0)>>6) == RDB_14BITLEN &&
+        rdbSliceRaw(rdb,dst,1) == -1) return -1;
+    if (first == RDB_32BITLEN && rdbSliceRaw(rdb,dst,4) == -1) return -1;
+    if (first == RDB_64BITLEN && rdbSliceRaw(rdb,dst,8) == -1) return -1;
+    rioInitWithBuffer(&r,*dst);
+    r.io.buffer.pos = start;
+    *lenptr = rdbLoadLen(&r,isencoded);
+    return 0;
+}
+
+int rdbSliceString(rio *rdb, sds *dst) {
+    uint64_t len, clen;
+    int isencoded;
+
+    if (rdbSliceLen(rdb,dst,&len,&isencoded) == -1) return -1;
+    if (isencoded) {
+        switch(len) {
+        case RDB_ENC_INT8: return rdbSliceRaw(rdb,dst,1);
+        case RDB_ENC_INT16: return rdbSliceRaw(rdb,dst,2);
+        case RDB_ENC_INT32: return rdbSliceRaw(rdb,dst,4);
+        case RDB_ENC_LZF:
+        case RDB_ENC_ZSTD:
+            if (rdbSliceLen(rdb,dst,&clen,NULL) == -1) return -1;
+            if (rdbSliceLen(rdb,dst,&len,NULL) == -1) return -1;
+            return rdbSliceRaw(rdb,dst,clen);
+        default:
+            rdbExitReportCorruptRDB("Unknown RDB string encoding type");
+        }
+    }
+    return rdbSliceRaw(rdb,dst,len);
+}
+
+int rdbSliceObject(int rdbtype, rio *rdb, sds *dst) {
+    uint64_t len, j;
+
+    if (rdbtype == RDB_TYPE_LIST || rdbtype == RDB_TYPE_SET ||
+        rdbtype == RDB_TYPE_ZSET || rdbtype == RDB_TYPE_HASH ||
+        rdbtype == RDB_TYPE_LIST_QUICKLIST)
+    {
+        if (rdbSliceLen(rdb,dst,&len,NULL) == -1) return -1;
+        if (len == RDB_LENERR) return -1;
+        for (j = 0; j < len; j++) {
+            if (rdbSliceString(rdb,dst) == -1) return -1;
+            if (rdbtype == RDB_TYPE_HASH && rdbSliceString(rdb,dst) == -1)
+                return -1;
+            if (rdbtype == RDB_TYPE_ZSET) {
+                unsigned char dlen;
+
+                /* See rdbLoadDoubleValue(). */
+                if (rdbSliceRaw(rdb,dst,1) == -1) return -1;
+                dlen = (*dst)[sdslen(*dst)-1];
+                if (dlen < 253 && rdbSliceRaw(rdb,dst,dlen) == -1) return -1;
+            }
+        }
+        return 0;
+    } else if (rdbIsObjectType(rdbtype)) {
+        /* Strings and all the types serialized as a single blob. */
+        return rdbSliceString(rdb,dst);
+    }
+    rdbExitReportCorruptRDB("Unknown object type");
+    return -1; /* Just to avoid warning. */
+}
+
+/* Load an RDB file from the rio stream 'rdb' into the array of databases
+ * 'dbarray' (normally server.db). If 'rsi' is not NULL, the replication
+ * information stored as AUX fields (if any) is loaded into it.
+ *
+ * On success C_OK is returned. C_ERR is returned if the RDB signature or
+ * version are not valid (errno is set to EINVAL), or when the backend
+ * reported a read error (RIO_FLAG_READ_ERROR, for instance a socket we are
+ * loading from was closed). Other errors are unrecoverable and abort the
+ * server. */
+int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi, redisDb *dbarray) {
+    uint64_t dbid;
     int type, rdbver;
-    redisDb *db = server.db+0;
+    redisDb *db = dbarray+0;
     char buf[1024];
-    long long expiretime, now = mstime();
-    FILE *fp;
-    rio rdb;
+    long long expiretime = -1, now = mstime();
+    long long lru_idle = -1, lfu_freq = -1;
+    int threaded = server.rdb_load_threads > 1;
 
-    if ((fp = fopen(filename,"r")) == NULL) return C_ERR;
-
-    rioInitWithFile(&rdb,fp);
-    rdb.update_cksum = rdbLoadProgressCallback;
-    rdb.max_processing_chunk = server.loading_process_events_interval_bytes;
-    if (rioRead(&rdb,buf,9) == 0) goto eoferr;
+    if (rioRead(rdb,buf,9) == 0) {
+        threaded = 0; /* No decoding threads to stop yet. */
+        goto eoferr;
+    }
     buf[9] = '\0';
     if (memcmp(buf,"REDIS",5) != 0) {
-        fclose(fp);
         serverLog(LL_WARNING,"Wrong signature trying to load DB from file");
         errno = EINVAL;
         return C_ERR;
     }
     rdbver = atoi(buf+5);
     if (rdbver < 1 || rdbver > RDB_VERSION) {
-        fclose(fp);
         serverLog(LL_WARNING,"Can't handle RDB format version %d",rdbver);
         errno = EINVAL;
         return C_ERR;
     }
 
-    startLoading(fp);
+    if (threaded) rdbLoaderStart(server.rdb_load_threads-1);
     while(1) {
         robj *key, *val;
-        expiretime = -1;
 
         /* Read type. */
-        if ((type = rdbLoadType(&rdb)) == -1) goto eoferr;
+        if ((type = rdbLoadType(rdb)) == -1) goto eoferr;
 
         /* Handle special types. */
         if (type == RDB_OPCODE_EXPIRETIME) {
             /* EXPIRETIME: load an expire associated with the next key
              * to load. Note that after loading an expire we need to
              * load the actual type, and continue. */
-            if ((expiretime = rdbLoadTime(&rdb)) == -1) goto eoferr;
-            /* We read the time so we need to read the object type again. */
-            if ((type = rdbLoadType(&rdb)) == -1) goto eoferr;
+            if ((expiretime = rdbLoadTime(rdb)) == -1) goto eoferr;
             /* the EXPIRETIME opcode specifies time in seconds, so convert
              * into milliseconds. */
             expiretime *= 1000;
+            continue; /* Read type again. */
         } else if (type == RDB_OPCODE_EXPIRETIME_MS) {
             /* EXPIRETIME_MS: milliseconds precision expire times introduced
              * with RDB v3. Like EXPIRETIME but no with more precision. */
-            if ((expiretime = rdbLoadMillisecondTime(&rdb)) == -1) goto eoferr;
-            /* We read the time so we need to read the object type again. */
-            if ((type = rdbLoadType(&rdb)) == -1) goto eoferr;
+            if ((expiretime = rdbLoadMillisecondTime(rdb)) == -1) goto eoferr;
+            continue; /* Read type again. */
+        } else if (type == RDB_OPCODE_IDLE) {
+            /* IDLE: LRU idle time in seconds of the next key to load,
+             * introduced with RDB v8. */
+            uint64_t idle;
+            if ((idle = rdbLoadLen(rdb,NULL)) == RDB_LENERR) goto eoferr;
+            lru_idle = (idle > LLONG_MAX) ? LLONG_MAX : (long long)idle;
+            continue; /* Read type again. */
+        } else if (type == RDB_OPCODE_FREQ) {
+            /* FREQ: LFU counter of the next key to load, introduced with
+             * RDB v8. */
+            unsigned char byte;
+            if (rioRead(rdb,&byte,1) == 0) goto eoferr;
+            lfu_freq = byte;
+            continue; /* Read type again. */
         } else if (type == RDB_OPCODE_EOF) {
             /* EOF: End of file, exit the main loop. */
             break;
         } else if (type == RDB_OPCODE_SELECTDB) {
             /* SELECTDB: Select the specified database. */
-            if ((dbid = rdbLoadLen(&rdb,NULL)) == RDB_LENERR)
+            if ((dbid = rdbLoadLen(rdb,NULL)) == RDB_LENERR)
                 goto eoferr;
             if (dbid >= (unsigned)server.dbnum) {
                 serverLog(LL_WARNING,
@@ -1323,15 +1814,15 @@ int rdbLoad(char *filename) {
                     "databases. Exiting\n", server.dbnum);
                 exit(1);
             }
-            db = server.db+dbid;
+            db = dbarray+dbid;
             continue; /* Read type again. */
         } else if (type == RDB_OPCODE_RESIZEDB) {
             /* RESIZEDB: Hint about the size of the keys in the currently
              * selected data base, in order to avoid useless rehashing. */
-            uint32_t db_size, expires_size;
-            if ((db_size = rdbLoadLen(&rdb,NULL)) == RDB_LENERR)
+            uint64_t db_size, expires_size;
+            if ((db_size = rdbLoadLen(rdb,NULL)) == RDB_LENERR)
                 goto eoferr;
-            if ((expires_size = rdbLoadLen(&rdb,NULL)) == RDB_LENERR)
+            if ((expires_size = rdbLoadLen(rdb,NULL)) == RDB_LENERR)
                 goto eoferr;
             dictExpand(db->dict,db_size);
             dictExpand(db->expires,expires_size);
@@ -1343,8 +1834,8 @@ int rdbLoad(char *filename) {
              *
              * An AUX field is composed of two strings: key and value. */
             robj *auxkey, *auxval;
-            if ((auxkey = rdbLoadStringObject(&rdb)) == NULL) goto eoferr;
-            if ((auxval = rdbLoadStringObject(&rdb)) == NULL) goto eoferr;
+            if ((auxkey = rdbLoadStringObject(rdb)) == NULL) goto eoferr;
+            if ((auxval = rdbLoadStringObject(rdb)) == NULL) goto eoferr;
 
             if (((char*)auxkey->ptr)[0] == '%') {
                 /* All the fields with a name staring with '%' are considered
@@ -1353,6 +1844,35 @@ int rdbLoad(char *filename) {
                 serverLog(LL_NOTICE,"RDB '%s': %s",
                     (char*)auxkey->ptr,
                     (char*)auxval->ptr);
+            } else if (!strcasecmp(auxkey->ptr,"repl-stream-db")) {
+                if (rsi) rsi->repl_stream_db = atoi(auxval->ptr);
+            } else if (!strcasecmp(auxkey->ptr,"repl-id")) {
+                if (rsi && sdslen(auxval->ptr) == CONFIG_RUN_ID_SIZE) {
+                    memcpy(rsi->repl_id,auxval->ptr,CONFIG_RUN_ID_SIZE+1);
+                    rsi->repl_id_is_set = 1;
+                }
+            } else if (!strcasecmp(auxkey->ptr,"repl-offset")) {
+                if (rsi) rsi->repl_offset = strtoll(auxval->ptr,NULL,10);
+            } else if (!strcasecmp(auxkey->ptr,"lua")) {
+                /* Load the script back in memory, unless it is already
+                 * there (DEBUG RELOAD does not flush the scripts cache). */
+                char funcname[43];
+                sds sha;
+
+                funcname[0] = 'f';
+                funcname[1] = '_';
+                sha1hex(funcname+2,auxval->ptr,sdslen(auxval->ptr));
+                sha = sdsnewlen(funcname+2,40);
+                if (dictFind(server.lua_scripts,sha) == NULL &&
+                    luaCreateFunction(NULL,server.lua,funcname,auxval)
+                    == C_ERR)
+                {
+                    serverLog(LL_WARNING,"Can't load Lua script from RDB "
+                                         "file! BODY: %s",
+                                         (char*)auxval->ptr);
+                    rdbExitReportCorruptRDB("Invalid Lua script");
+                }
+                sdsfree(sha);
             } else {
                 /* We ignore fields we don't understand, as by AUX field
                  * contract. */
@@ -1366,9 +1886,42 @@ int rdbLoad(char *filename) {
         }
 
         /* Read key */
-        if ((key = rdbLoadStringObject(&rdb)) == NULL) goto eoferr;
+        if ((key = rdbLoadStringObject(rdb)) == NULL) goto eoferr;
+        server.loading_read_keys++;
+
+        /* In threaded mode just copy the serialized value in the current
+         * batch: it will be decoded and added to the keyspace later. */
+        if (threaded) {
+            rdbLoadBatch *b = rdbLoaderCurrentBatch();
+            rdbLoadRecord *rec = b->records+b->count;
+
+            rec->offset = sdslen(b->raw);
+            if (rdbSliceObject(type,rdb,&b->raw) == -1) goto eoferr;
+            /* Already expired keys are discarded, see below. */
+            if (server.masterhost == NULL && expiretime != -1 &&
+                expiretime < now)
+            {
+                sdssetlen(b->raw,rec->offset);
+                b->raw[rec->offset] = '\0';
+                decrRefCount(key);
+                expiretime = lru_idle = lfu_freq = -1;
+                continue;
+            }
+            rec->key = key;
+            rec->type = type;
+            rec->db = db;
+            rec->expiretime = expiretime;
+            rec->lru_idle = lru_idle;
+            rec->lfu_freq = lfu_freq;
+            expiretime = lru_idle = lfu_freq = -1;
+            b->count++;
+            if (b->count == RDB_LOAD_BATCH_KEYS ||
+                sdslen(b->raw) >= RDB_LOAD_BATCH_BYTES) rdbLoaderSubmit();
+            continue;
+        }
+
         /* Read value */
-        if ((val = rdbLoadObject(type,&rdb)) == NULL) goto eoferr;
+        if ((val = rdbLoadObject(type,rdb)) == NULL) goto eoferr;
         /* Check if the key already expired. This function is used when loading
          * an RDB file from disk, either at startup, or when an RDB was
          * received from the master. In the latter case, the master is
@@ -1377,8 +1930,12 @@ int rdbLoad(char *filename) {
         if (server.masterhost == NULL && expiretime != -1 && expiretime < now) {
             decrRefCount(key);
             decrRefCount(val);
+            expiretime = lru_idle = lfu_freq = -1;
             continue;
         }
+        /* Restore the LRU idle time or the LFU counter saved with the key. */
+        objectSetLRUOrLFU(val,lfu_freq,lru_idle);
+
         /* Add the new object in the hash table */
         dbAdd(db,key,val);
 
@@ -1386,31 +1943,70 @@ int rdbLoad(char *filename) {
         if (expiretime != -1) setExpire(db,key,expiretime);
 
         decrRefCount(key);
+        server.loading_loaded_keys++;
+        expiretime = lru_idle = lfu_freq = -1;
+    }
+    if (threaded) {
+        rdbLoaderStop();
+        serverLog(LL_VERBOSE,"RDB loaded with %d decoding threads: "
+            "%lld keys, %.3f seconds adding keys, %.3f seconds waiting "
+            "for the decoders", loader.numthreads,
+            server.loading_loaded_keys, (double)loader.add_time/1000000,
+            (double)loader.wait_time/1000000);
+        threaded = 0; /* Already stopped: don't stop again on errors. */
     }
-    /* Verify the checksum if RDB version is >= 5 */
-    if (rdbver >= 5 && server.rdb_checksum) {
-        uint64_t cksum, expected = rdb.cksum;
-
-        if (rioRead(&rdb,&cksum,8) == 0) goto eoferr;
-        memrev64ifbe(&cksum);
-        if (cksum == 0) {
-            serverLog(LL_WARNING,"RDB file was saved with checksum disabled: no check performed.");
-        } else if (cksum != expected) {
-            serverLog(LL_WARNING,"Wrong RDB checksum. Aborting now.");
-            rdbExitReportCorruptRDB("RDB CRC error");
+    /* Verify the checksum if RDB version is >= 5. The checksum is consumed
+     * even when the check is disabled, since the stream may continue after
+     * the RDB payload. */
+    if (rdbver >= 5) {
+        uint64_t cksum, expected = rdb->cksum;
+
+        if (rioRead(rdb,&cksum,8) == 0) goto eoferr;
+        if (server.rdb_checksum) {
+            memrev64ifbe(&cksum);
+            if (cksum == 0) {
+                serverLog(LL_WARNING,"RDB file was saved with checksum disabled: no check performed.");
+            } else if (cksum != expected) {
+                serverLog(LL_WARNING,"Wrong RDB checksum. Aborting now.");
+                rdbExitReportCorruptRDB("RDB CRC error");
+            }
         }
     }
-
-    fclose(fp);
-    stopLoading();
     return C_OK;
 
 eoferr: /* unexpected end of file is handled here with a fatal exit */
+    if (rdb->flags & RIO_FLAG_READ_ERROR) {
+        /* The backend failed (for instance the connection with the master
+         * we were loading from was lost): this is not a corruption of the
+         * data, so report the error to the caller instead of exiting. */
+        if (threaded) rdbLoaderStop();
+        serverLog(LL_WARNING,"Error reading the RDB payload: %s",
+            strerror(errno));
+        return C_ERR;
+    }
     serverLog(LL_WARNING,"Short read or OOM loading DB. Unrecoverable error, aborting now.");
     rdbExitReportCorruptRDB("Unexpected EOF reading RDB file");
     return C_ERR; /* Just to avoid warning */
 }
 
+/* Load the RDB file 'filename' into server.db. If 'rsi' is not NULL, the
+ * replication information stored as AUX fields (if any) is loaded into it. */
+int rdbLoad(char *filename, rdbSaveInfo *rsi) {
+    FILE *fp;
+    rio rdb;
+    int retval;
+
+    if ((fp = fopen(filename,"r")) == NULL) return C_ERR;
+    startLoadingFile(fp);
+    rioInitWithFile(&rdb,fp);
+    rdb.update_cksum = rdbLoadProgressCallback;
+    rdb.max_processing_chunk = server.loading_process_events_interval_bytes;
+    retval = rdbLoadRio(&rdb,rsi,server.db);
+    fclose(fp);
+    stopLoading();
+    return retval;
+}
+
 /* A background saving child (BGSAVE) terminated its work. Handle this.
  * This function covers the case of actual BGSAVEs. */
 void backgroundSaveDoneHandlerDisk(int exitcode, int bysignal) {
@@ -1558,7 +2154,7 @@ void backgroundSaveDoneHandler(int exitcode, int bysignal) {
 
 /* Spawn an RDB child that writes the RDB to the sockets of the slaves
  * that are currently in SLAVE_STATE_WAIT_BGSAVE_START state. */
-int rdbSaveToSlavesSockets(void) {
+int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
     int *fds;
     uint64_t *clientids;
     int numfds;
@@ -1568,7 +2164,7 @@ int rdbSaveToSlavesSockets(void) {
     long long start;
     int pipefds[2];
 
-    if (server.rdb_child_pid != -1) return C_ERR;
+    if (server.rdb_child_pid != -1 || server.rdb_snapshot) return C_ERR;
 
     /* Before to fork, create a pipe that will be used in order to
      * send back to the parent the IDs of the slaves that successfully
@@ -1615,7 +2211,7 @@ int rdbSaveToSlavesSockets(void) {
         closeListeningSockets(0);
         redisSetProcTitle("redis-rdb-to-slaves");
 
-        retval = rdbSaveRioWithEOFMark(&slave_sockets,NULL);
+        retval = rdbSaveRioWithEOFMark(&slave_sockets,NULL,rsi);
         if (retval == C_OK && rioFlush(&slave_sockets) == 0)
             retval = C_ERR;
 
@@ -1711,11 +2307,13 @@ int rdbSaveToSlavesSockets(void) {
 }
 
 void saveCommand(client *c) {
-    if (server.rdb_child_pid != -1) {
+    if (server.rdb_child_pid != -1 || server.rdb_snapshot) {
         addReplyError(c,"Background save already in progress");
         return;
     }
-    if (rdbSave(server.rdb_filename) == C_OK) {
+    rdbSaveInfo rsi, *rsiptr;
+    rsiptr = rdbPopulateSaveInfo(&rsi);
+    if (rdbSave(server.rdb_filename,rsiptr) == C_OK) {
         addReply(c,shared.ok);
     } else {
         addReply(c,shared.err);
@@ -1723,13 +2321,65 @@ void saveCommand(client *c) {
 }
 
 void bgsaveCommand(client *c) {
-    if (server.rdb_child_pid != -1) {
+    rdbSaveInfo rsi, *rsiptr;
+    rsiptr = rdbPopulateSaveInfo(&rsi);
+
+    if (server.rdb_child_pid != -1 || server.rdb_snapshot) {
         addReplyError(c,"Background save already in progress");
-    } else if (server.aof_child_pid != -1) {
+    } else if (server.aof_child_pid != -1 && !server.rdb_forkless_bgsave) {
         addReplyError(c,"Can't BGSAVE while AOF log rewriting is in progress");
-    } else if (rdbSaveBackground(server.rdb_filename) == C_OK) {
+    } else if (rdbStartBackgroundSave(server.rdb_filename,rsiptr) == C_OK) {
         addReplyStatus(c,"Background saving started");
     } else {
         addReply(c,shared.err);
     }
 }
+
+/* Populate the rdbSaveInfo structure used to persist the replication
+ * information inside the RDB file. Currently the structure explicitly
+ * contains just the currently selected DB from the master stream, however
+ * if the rdbSave*() family functions receive a NULL rsi structure also
+ * the Replication ID/offset is not saved. The function populates 'rsi'
+ * that is normally stack-allocated in the caller, returns the populated
+ * pointer if the instance has a valid master client, otherwise NULL
+ * is returned, and the RDB saving will not persist any replication related
+ * information. */
+rdbSaveInfo *rdbPopulateSaveInfo(rdbSaveInfo *rsi) {
+    rdbSaveInfo rsi_init = RDB_SAVE_INFO_INIT;
+    *rsi = rsi_init;
+
+    /* If the instance is a master, we can populate the replication info
+     * only when repl_backlog is not NULL. If the repl_backlog is NULL,
+     * it means that the instance isn't in any replication chains. In this
+     * scenario the replication info is useless, because when a slave
+     * connects to us, the NULL repl_backlog will trigger a full
+     * synchronization, at the same time we will use a new replid and
+     * clear replid2. */
+    if (!server.masterhost && server.repl_backlog) {
+        /* Note that when server.slaveseldb is -1, it means that this master
+         * didn't apply any write commands after a full synchronization.
+         * So we can let repl_stream_db be 0, this allows a restarted slave
+         * to reload replication ID/offset, it's safe because the next write
+         * command must generate a SELECT statement. */
+        rsi->repl_stream_db = server.slaveseldb == -1 ? 0 : server.slaveseldb;
+        return rsi;
+    }
+
+    /* If the instance is a slave we need a connected master in order to
+     * fetch the currently selected DB. */
+    if (server.master) {
+        rsi->repl_stream_db = server.master->db->id;
+        return rsi;
+    }
+
+    /* If we have a cached master we can use it in order to populate the
+     * replication selected DB info inside the RDB file: the slave can
+     * increment the master_repl_offset only from data arriving from the
+     * master, so if we are disconnected the offset in the cached master
+     * is valid. */
+    if (server.cached_master) {
+        rsi->repl_stream_db = server.cached_master->db->id;
+        return rsi;
+    }
+    return NULL;
+}
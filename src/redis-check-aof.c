@@ -35,6 +35,9 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include "config.h"
+#include "crc64.h"
+
+#define AOF_CHECKSUM_PREFIX "#CRC64:"
 
 #define ERROR(...) { \
     char __buf[1024]; \
@@ -102,14 +105,64 @@ int readArgc(FILE *fp, long *target) {
     return readLong(fp,'*',target);
 }
 
+/* Read the checksum trailer at the current position, and verify it against
+ * the checksum of the file content from '*segment_start' to the trailer.
+ * On success 1 is returned and '*segment_start' is set to the start of the
+ * next segment. 0 is returned if the trailer is not valid, and -1 if the
+ * checksum does not match. */
+int readChecksum(FILE *fp, off_t *segment_start) {
+    char buf[128], data[4096];
+    unsigned long long expected;
+    uint64_t crc = 0;
+    off_t pos;
+
+    epos = ftello(fp);
+    if (fgets(buf,sizeof(buf),fp) == NULL) return 0;
+    if (strncmp(buf,AOF_CHECKSUM_PREFIX,strlen(AOF_CHECKSUM_PREFIX)) != 0 ||
+        sscanf(buf+strlen(AOF_CHECKSUM_PREFIX),"%16llx",&expected) != 1 ||
+        strlen(buf) != strlen(AOF_CHECKSUM_PREFIX)+18) {
+        ERROR("Invalid checksum trailer");
+        return 0;
+    }
+    for (pos = *segment_start; pos < epos; ) {
+        size_t toread = sizeof(data);
+        if (epos-pos < (off_t)toread) toread = epos-pos;
+        ssize_t nread = pread(fileno(fp),data,toread,pos);
+        if (nread <= 0) {
+            ERROR("Error reading the segment starting at 0x%16llx",
+                (long long)*segment_start);
+            return 0;
+        }
+        crc = crc64(crc,(unsigned char*)data,nread);
+        pos += nread;
+    }
+    if (crc != expected) {
+        ERROR("Checksum mismatch for the segment starting at 0x%16llx",
+            (long long)*segment_start);
+        return -1;
+    }
+    *segment_start = ftello(fp);
+    return 1;
+}
+
 off_t process(FILE *fp) {
     long argc;
-    off_t pos = 0;
-    int i, multi = 0;
+    off_t pos = 0, segment_start = 0;
+    int c, i, multi = 0;
     char *str;
 
     while(1) {
         if (!multi) pos = ftello(fp);
+
+        /* Checksum trailers can be found between any two commands. When
+         * the checksum does not match, the whole segment is not valid. */
+        if ((c = fgetc(fp)) != EOF) ungetc(c,fp);
+        if (c == '#') {
+            int retval = readChecksum(fp,&segment_start);
+            if (retval == -1 && segment_start < pos) pos = segment_start;
+            if (retval != 1) break;
+            continue;
+        }
         if (!readArgc(fp, &argc)) break;
 
         for (i = 0; i < argc; i++) {
@@ -185,6 +238,20 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
+    /* AOF files rewritten with aof-use-rdb-preamble enabled start with an
+     * RDB payload we are not able to parse: never try to fix them, since
+     * we could only truncate the file at offset zero. */
+    char sig[5];
+    if (fread(sig,1,5,fp) == 5 && memcmp(sig,"REDIS",5) == 0) {
+        printf("The AOF starts with an RDB preamble, that can't be checked "
+               "by this tool: %s\n", filename);
+        exit(1);
+    }
+    if (fseek(fp,0,SEEK_SET) == -1) {
+        printf("Cannot seek file: %s\n", filename);
+        exit(1);
+    }
+
     off_t pos = process(fp);
     off_t diff = size-pos;
     printf("AOF analyzed: size=%lld, ok_up_to=%lld, diff=%lld\n",
@@ -37,7 +37,6 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
-#include "lzf.h"
 #include "crc64.h"
 
 #define ERROR(...) { \
@@ -88,9 +87,9 @@ static int rdbCheckType(unsigned char t) {
     /* In case a new object type is added, update the following
      * condition as necessary. */
     return
-        (t >= RDB_TYPE_HASH_ZIPMAP && t <= RDB_TYPE_HASH_ZIPLIST) ||
+        (t >= RDB_TYPE_HASH_ZIPMAP && t <= RDB_TYPE_LIST_QUICKLIST) ||
         t <= RDB_TYPE_HASH ||
-        t >= RDB_OPCODE_EXPIRETIME_MS;
+        t >= RDB_OPCODE_FREQ;
 }
 
 /* when number of bytes to read is negative, do a peek */
@@ -122,7 +121,7 @@ int processHeader(void) {
     }
 
     dump_version = (int)strtol(buf + 5, NULL, 10);
-    if (dump_version < 1 || dump_version > 6) {
+    if (dump_version < 1 || dump_version > RDB_VERSION) {
         ERROR("Unknown RDB format version: %d", dump_version);
     }
     return dump_version;
@@ -171,9 +170,8 @@ static int processTime(int type) {
     return 0;
 }
 
-static uint32_t loadLength(int *isencoded) {
+static uint64_t loadLength(int *isencoded) {
     unsigned char buf[2];
-    uint32_t len;
     int type;
 
     if (isencoded) *isencoded = 0;
@@ -190,13 +188,39 @@ static uint32_t loadLength(int *isencoded) {
         /* Read a 14 bit len */
         if (!readBytes(buf+1,1)) return RDB_LENERR;
         return ((buf[0] & 0x3F) << 8) | buf[1];
-    } else {
+    } else if (buf[0] == RDB_32BITLEN) {
         /* Read a 32 bit len */
+        uint32_t len;
         if (!readBytes(&len, 4)) return RDB_LENERR;
-        return (unsigned int)ntohl(len);
+        return ntohl(len);
+    } else if (buf[0] == RDB_64BITLEN) {
+        /* Read a 64 bit len */
+        uint64_t len;
+        if (!readBytes(&len, 8)) return RDB_LENERR;
+        return ntohu64(len);
+    } else {
+        /* Unknown length encoding */
+        return RDB_LENERR;
     }
 }
 
+/* discard LRU idle time or LFU counter, just consume the bytes */
+static int processLRUOrLFU(int type) {
+    uint32_t offset = CURR_OFFSET;
+    unsigned char freq;
+
+    if (type == RDB_OPCODE_IDLE) {
+        if (loadLength(NULL) != RDB_LENERR) return 1;
+        SHIFT_ERROR(offset, "Could not read LRU idle time");
+    } else {
+        if (readBytes(&freq, 1)) return 1;
+        SHIFT_ERROR(offset, "Could not read LFU counter");
+    }
+
+    /* failure */
+    return 0;
+}
+
 static char *loadIntegerObject(int enctype) {
     uint32_t offset = CURR_OFFSET;
     unsigned char enc[4];
@@ -229,8 +253,8 @@ static char *loadIntegerObject(int enctype) {
     return buf;
 }
 
-static char* loadLzfStringObject() {
-    unsigned int slen, clen;
+static char* loadCompressedStringObject(int enctype) {
+    uint64_t slen, clen;
     char *c, *s;
 
     if ((clen = loadLength(NULL)) == RDB_LENERR) return NULL;
@@ -243,7 +267,7 @@ static char* loadLzfStringObject() {
     }
 
     s = zmalloc(slen+1);
-    if (lzf_decompress(c,clen,s,slen) == 0) {
+    if (!rdbDecompress(enctype,c,clen,s,slen)) {
         zfree(c); zfree(s);
         return NULL;
     }
@@ -256,7 +280,7 @@ static char* loadLzfStringObject() {
 static char* loadStringObject() {
     uint32_t offset = CURR_OFFSET;
     int isencoded;
-    uint32_t len;
+    uint64_t len;
 
     len = loadLength(&isencoded);
     if (isencoded) {
@@ -266,10 +290,11 @@ static char* loadStringObject() {
         case RDB_ENC_INT32:
             return loadIntegerObject(len);
         case RDB_ENC_LZF:
-            return loadLzfStringObject();
+        case RDB_ENC_ZSTD:
+            return loadCompressedStringObject(len);
         default:
             /* unknown encoding */
-            SHIFT_ERROR(offset, "Unknown string encoding (0x%02x)", len);
+            SHIFT_ERROR(offset, "Unknown string encoding (0x%02x)", (int)len);
             return NULL;
         }
     }
@@ -345,7 +370,7 @@ static int processDoubleValue(double** store) {
 
 static int loadPair(entry *e) {
     uint32_t offset = CURR_OFFSET;
-    uint32_t i;
+    uint64_t i;
 
     /* read key first */
     char *key;
@@ -356,11 +381,12 @@ static int loadPair(entry *e) {
         return 0;
     }
 
-    uint32_t length = 0;
+    uint64_t length = 0;
     if (e->type == RDB_TYPE_LIST ||
         e->type == RDB_TYPE_SET  ||
         e->type == RDB_TYPE_ZSET ||
-        e->type == RDB_TYPE_HASH) {
+        e->type == RDB_TYPE_HASH ||
+        e->type == RDB_TYPE_LIST_QUICKLIST) {
         if ((length = loadLength(NULL)) == RDB_LENERR) {
             SHIFT_ERROR(offset, "Error reading %s length", types[e->type]);
             return 0;
@@ -381,10 +407,12 @@ static int loadPair(entry *e) {
     break;
     case RDB_TYPE_LIST:
     case RDB_TYPE_SET:
+    case RDB_TYPE_LIST_QUICKLIST:
         for (i = 0; i < length; i++) {
             offset = CURR_OFFSET;
             if (!processStringObject(NULL)) {
-                SHIFT_ERROR(offset, "Error reading element at index %d (length: %d)", i, length);
+                SHIFT_ERROR(offset, "Error reading element at index %llu (length: %llu)",
+                    (unsigned long long) i, (unsigned long long) length);
                 return 0;
             }
         }
@@ -393,12 +421,14 @@ static int loadPair(entry *e) {
         for (i = 0; i < length; i++) {
             offset = CURR_OFFSET;
             if (!processStringObject(NULL)) {
-                SHIFT_ERROR(offset, "Error reading element key at index %d (length: %d)", i, length);
+                SHIFT_ERROR(offset, "Error reading element key at index %llu (length: %llu)",
+                    (unsigned long long) i, (unsigned long long) length);
                 return 0;
             }
             offset = CURR_OFFSET;
             if (!processDoubleValue(NULL)) {
-                SHIFT_ERROR(offset, "Error reading element value at index %d (length: %d)", i, length);
+                SHIFT_ERROR(offset, "Error reading element value at index %llu (length: %llu)",
+                    (unsigned long long) i, (unsigned long long) length);
                 return 0;
             }
         }
@@ -407,12 +437,14 @@ static int loadPair(entry *e) {
         for (i = 0; i < length; i++) {
             offset = CURR_OFFSET;
             if (!processStringObject(NULL)) {
-                SHIFT_ERROR(offset, "Error reading element key at index %d (length: %d)", i, length);
+                SHIFT_ERROR(offset, "Error reading element key at index %llu (length: %llu)",
+                    (unsigned long long) i, (unsigned long long) length);
                 return 0;
             }
             offset = CURR_OFFSET;
             if (!processStringObject(NULL)) {
-                SHIFT_ERROR(offset, "Error reading element value at index %d (length: %d)", i, length);
+                SHIFT_ERROR(offset, "Error reading element value at index %llu (length: %llu)",
+                    (unsigned long long) i, (unsigned long long) length);
                 return 0;
             }
         }
@@ -428,7 +460,8 @@ static int loadPair(entry *e) {
 
 static entry loadEntry() {
     entry e = { NULL, -1, 0 };
-    uint32_t length, offset[4];
+    uint64_t length;
+    uint32_t offset[4];
 
     /* reset error container */
     errors.level = 0;
@@ -445,7 +478,20 @@ static entry loadEntry() {
             return e;
         }
         if (length > 63) {
-            SHIFT_ERROR(offset[1], "Database number out of range (%d)", length);
+            SHIFT_ERROR(offset[1], "Database number out of range (%llu)",
+                (unsigned long long) length);
+            return e;
+        }
+    } else if (e.type == RDB_OPCODE_AUX) {
+        if (!processStringObject(NULL) || !processStringObject(NULL)) {
+            SHIFT_ERROR(offset[1], "Error reading AUX field");
+            return e;
+        }
+    } else if (e.type == RDB_OPCODE_RESIZEDB) {
+        if (loadLength(NULL) == RDB_LENERR ||
+            loadLength(NULL) == RDB_LENERR)
+        {
+            SHIFT_ERROR(offset[1], "Error reading RESIZEDB sizes");
             return e;
         }
     } else if (e.type == RDB_OPCODE_EOF) {
@@ -463,6 +509,13 @@ static entry loadEntry() {
             if (!loadType(&e)) return e;
         }
 
+        /* optionally consume LRU idle time or LFU counter */
+        if (e.type == RDB_OPCODE_IDLE ||
+            e.type == RDB_OPCODE_FREQ) {
+            if (!processLRUOrLFU(e.type)) return e;
+            if (!loadType(&e)) return e;
+        }
+
         offset[1] = CURR_OFFSET;
         if (!loadPair(&e)) {
             SHIFT_ERROR(offset[1], "Error for type %s", types[e.type]);
@@ -684,8 +737,13 @@ int redis_check_rdb(char *rdbfilename) {
     sprintf(types[RDB_TYPE_SET], "SET");
     sprintf(types[RDB_TYPE_ZSET], "ZSET");
     sprintf(types[RDB_TYPE_HASH], "HASH");
+    sprintf(types[RDB_TYPE_LIST_QUICKLIST], "QUICKLIST");
 
     /* Object types only used for dumping to disk */
+    sprintf(types[RDB_OPCODE_FREQ], "FREQ");
+    sprintf(types[RDB_OPCODE_IDLE], "IDLE");
+    sprintf(types[RDB_OPCODE_AUX], "AUX");
+    sprintf(types[RDB_OPCODE_RESIZEDB], "RESIZEDB");
     sprintf(types[RDB_OPCODE_EXPIRETIME], "EXPIRETIME");
     sprintf(types[RDB_OPCODE_SELECTDB], "SELECTDB");
     sprintf(types[RDB_OPCODE_EOF], "EOF");
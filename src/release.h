@@ -0,0 +1,3 @@
+#define REDIS_GIT_SHA1 "a08fb3f6"
+#define REDIS_GIT_DIRTY "283"
+#define REDIS_BUILD_ID "vm-1792159910"
@@ -94,6 +94,7 @@ static const rio rioBufferIO = {
     0,              /* current checksum */
     0,              /* bytes read or written */
     0,              /* read/write chunk size */
+    0,              /* flags */
     { { NULL, 0 } } /* union for io-specific vars */
 };
 
@@ -147,6 +148,7 @@ static const rio rioFileIO = {
     0,              /* current checksum */
     0,              /* bytes read or written */
     0,              /* read/write chunk size */
+    0,              /* flags */
     { { NULL, 0 } } /* union for io-specific vars */
 };
 
@@ -260,6 +262,7 @@ static const rio rioFdsetIO = {
     0,              /* current checksum */
     0,              /* bytes read or written */
     0,              /* read/write chunk size */
+    0,              /* flags */
     { { NULL, 0 } } /* union for io-specific vars */
 };
 
@@ -282,6 +285,104 @@ void rioFreeFdset(rio *r) {
     sdsfree(r->io.fdset.buf);
 }
 
+/* ------------------------ Socket (read only) implementation ---------------- */
+
+/* Returns 1 or 0 for success/failure.
+ *
+ * Data is read from the socket in chunks of at least PROTO_IOBUF_LEN bytes
+ * and buffered, so that the many small reads performed by the RDB loading
+ * code don't turn into as many system calls. When a read limit is set we
+ * never read past it, so that the bytes following the payload (for instance
+ * the replication stream) are left in the socket. */
+static size_t rioSocketRead(rio *r, void *buf, size_t len) {
+    size_t avail = sdslen(r->io.socket.buf) - r->io.socket.pos;
+
+    while (avail < len) {
+        size_t toread = PROTO_IOBUF_LEN;
+        ssize_t nread;
+
+        /* Discard what was already consumed before reading more. */
+        if (r->io.socket.pos) {
+            sdsrange(r->io.socket.buf,r->io.socket.pos,-1);
+            r->io.socket.pos = 0;
+        }
+        if (toread < len-avail) toread = len-avail;
+        if (r->io.socket.read_limit) {
+            size_t left = r->io.socket.read_limit - r->io.socket.read_so_far;
+
+            if (left < len-avail) {
+                errno = EOVERFLOW;
+                r->flags |= RIO_FLAG_READ_ERROR;
+                return 0;
+            }
+            if (toread > left) toread = left;
+        }
+        r->io.socket.buf = sdsMakeRoomFor(r->io.socket.buf,toread);
+        nread = read(r->io.socket.fd,
+                     r->io.socket.buf+sdslen(r->io.socket.buf),toread);
+        if (nread <= 0) {
+            if (nread == -1 && errno == EINTR) continue;
+            if (nread == 0) errno = ECONNRESET;
+            r->flags |= RIO_FLAG_READ_ERROR;
+            return 0;
+        }
+        sdsIncrLen(r->io.socket.buf,nread);
+        r->io.socket.read_so_far += nread;
+        avail += nread;
+    }
+    memcpy(buf,r->io.socket.buf+r->io.socket.pos,len);
+    r->io.socket.pos += len;
+    return 1;
+}
+
+/* Writing is not supported by the socket backend. */
+static size_t rioSocketWrite(rio *r, const void *buf, size_t len) {
+    UNUSED(r);
+    UNUSED(buf);
+    UNUSED(len);
+    return 0;
+}
+
+/* Returns the number of bytes consumed so far. */
+static off_t rioSocketTell(rio *r) {
+    return r->io.socket.read_so_far -
+           (sdslen(r->io.socket.buf) - r->io.socket.pos);
+}
+
+/* Nothing to flush for a read only stream. */
+static int rioSocketFlush(rio *r) {
+    UNUSED(r);
+    return 1;
+}
+
+static const rio rioSocketIO = {
+    rioSocketRead,
+    rioSocketWrite,
+    rioSocketTell,
+    rioSocketFlush,
+    NULL,           /* update_checksum */
+    0,              /* current checksum */
+    0,              /* bytes read or written */
+    0,              /* read/write chunk size */
+    0,              /* flags */
+    { { NULL, 0 } } /* union for io-specific vars */
+};
+
+/* Create a rio reading from the (blocking) socket 'fd'. If 'read_limit' is
+ * not zero, no more than 'read_limit' bytes are read from the socket. */
+void rioInitWithSocket(rio *r, int fd, size_t read_limit) {
+    *r = rioSocketIO;
+    r->io.socket.fd = fd;
+    r->io.socket.buf = sdsempty();
+    r->io.socket.pos = 0;
+    r->io.socket.read_limit = read_limit;
+    r->io.socket.read_so_far = 0;
+}
+
+void rioFreeSocket(rio *r) {
+    sdsfree(r->io.socket.buf);
+}
+
 /* ---------------------------- Generic functions ---------------------------- */
 
 /* This function can be installed both in memory and file streams when checksum
@@ -36,6 +36,8 @@
 #include <stdint.h>
 #include "sds.h"
 
+#define RIO_FLAG_READ_ERROR (1<<0) /* The backend failed reading data. */
+
 struct _rio {
     /* Backend functions.
      * Since this functions do not tolerate short writes or reads the return
@@ -60,6 +62,9 @@ struct _rio {
     /* maximum single read or write chunk size */
     size_t max_processing_chunk;
 
+    /* RIO_FLAG_* flags describing the state of the stream. */
+    int flags;
+
     /* Backend-specific vars. */
     union {
         /* In-memory buffer target. */
@@ -81,6 +86,14 @@ struct _rio {
             off_t pos;
             sds buf;
         } fdset;
+        /* Socket source (read only, used for diskless loading). */
+        struct {
+            int fd;             /* Socket to read from. */
+            sds buf;            /* Data read from the socket. */
+            size_t pos;         /* Bytes of 'buf' already consumed. */
+            size_t read_limit;  /* Max bytes to read from 'fd', 0 = no limit. */
+            size_t read_so_far; /* Bytes read from 'fd' so far. */
+        } socket;
     } io;
 };
 
@@ -127,6 +140,8 @@ static inline int rioFlush(rio *r) {
 void rioInitWithFile(rio *r, FILE *fp);
 void rioInitWithBuffer(rio *r, sds s);
 void rioInitWithFdset(rio *r, int *fds, int numfds);
+void rioInitWithSocket(rio *r, int fd, size_t read_limit);
+void rioFreeSocket(rio *r);
 
 size_t rioWriteBulkCount(rio *r, char prefix, int count);
 size_t rioWriteBulkString(rio *r, const char *buf, size_t len);
@@ -564,11 +564,13 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
         reply = sdsnewlen(c->buf,c->bufpos);
         c->bufpos = 0;
         while(listLength(c->reply)) {
-            sds o = listNodeValue(listFirst(c->reply));
+            clientReplyBlock *o = listNodeValue(listFirst(c->reply));
 
-            reply = sdscatsds(reply,o);
+            reply = sdscatlen(reply,replyBlockData(o),o->used);
             listDelNode(c->reply,listFirst(c->reply));
         }
+        c->reply_bytes = 0;
+        c->reply_obj_bytes = 0;
     }
     if (raise_error && reply[0] != '-') raise_error = 0;
     redisProtocolToLuaType(lua,reply);
@@ -586,6 +588,7 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
     }
     if (reply != c->buf) sdsfree(reply);
     c->reply_bytes = 0;
+    c->reply_obj_bytes = 0;
 
 cleanup:
     /* Clean up. Command code may have changed argv/argc so we use the
@@ -1137,7 +1140,8 @@ int redis_math_randomseed (lua_State *L) {
  *
  * On success C_OK is returned, and nothing is left on the Lua stack.
  * On error C_ERR is returned and an appropriate error is set in the
- * client context. */
+ * client context. If 'c' is NULL (scripts loaded from the RDB file) the
+ * error is logged instead. */
 int luaCreateFunction(client *c, lua_State *lua, char *funcname, robj *body) {
     sds funcdef = sdsempty();
 
@@ -1148,16 +1152,30 @@ int luaCreateFunction(client *c, lua_State *lua, char *funcname, robj *body) {
     funcdef = sdscatlen(funcdef,"\nend",4);
 
     if (luaL_loadbuffer(lua,funcdef,sdslen(funcdef),"@user_script")) {
-        addReplyErrorFormat(c,"Error compiling script (new function): %s\n",
-            lua_tostring(lua,-1));
+        if (c != NULL) {
+            addReplyErrorFormat(c,
+                "Error compiling script (new function): %s\n",
+                lua_tostring(lua,-1));
+        } else {
+            serverLog(LL_WARNING,
+                "Error compiling script (new function): %s",
+                lua_tostring(lua,-1));
+        }
         lua_pop(lua,1);
         sdsfree(funcdef);
         return C_ERR;
     }
     sdsfree(funcdef);
     if (lua_pcall(lua,0,0,0)) {
-        addReplyErrorFormat(c,"Error running script (new function): %s\n",
-            lua_tostring(lua,-1));
+        if (c != NULL) {
+            addReplyErrorFormat(c,
+                "Error running script (new function): %s\n",
+                lua_tostring(lua,-1));
+        } else {
+            serverLog(LL_WARNING,
+                "Error running script (new function): %s",
+                lua_tostring(lua,-1));
+        }
         lua_pop(lua,1);
         return C_ERR;
     }
@@ -66,34 +66,12 @@ static inline char sdsReqType(size_t string_size) {
     return SDS_TYPE_64;
 }
 
-/* Create a new sds string with the content specified by the 'init' pointer
- * and 'initlen'.
- * If NULL is used for 'init' the string is initialized with zero bytes.
- *
- * The string is always null-termined (all the sds strings are, always) so
- * even if you create an sds string with:
- *
- * mystring = sdsnewlen("abc",3);
- *
- * You can print the string with printf() as there is an implicit \0 at the
- * end of the string. However the string is binary safe and can contain
- * \0 characters in the middle, as the length is stored in the sds header. */
-sds sdsnewlen(const void *init, size_t initlen) {
-    void *sh;
-    sds s;
-    char type = sdsReqType(initlen);
-    /* Empty strings are usually created in order to append. Use type 8
-     * since type 5 is not good at this. */
-    if (type == SDS_TYPE_5 && initlen == 0) type = SDS_TYPE_8;
-    int hdrlen = sdsHdrSize(type);
-    unsigned char *fp; /* flags pointer. */
+/* Set up the header of a 'type' sds string of 'initlen' bytes at 'sh',
+ * copying 'init' (if not NULL) and the null term. Returns the string. */
+static sds sdsInitHeader(void *sh, char type, const void *init, size_t initlen) {
+    sds s = (char*)sh+sdsHdrSize(type);
+    unsigned char *fp = ((unsigned char*)s)-1; /* flags pointer. */
 
-    sh = s_malloc(hdrlen+initlen+1);
-    if (!init)
-        memset(sh, 0, hdrlen+initlen+1);
-    if (sh == NULL) return NULL;
-    s = (char*)sh+hdrlen;
-    fp = ((unsigned char*)s)-1;
     switch(type) {
         case SDS_TYPE_5: {
             *fp = type | (initlen << SDS_TYPE_BITS);
@@ -134,6 +112,49 @@ sds sdsnewlen(const void *init, size_t initlen) {
     return s;
 }
 
+/* Create a new sds string with the content specified by the 'init' pointer
+ * and 'initlen'.
+ * If NULL is used for 'init' the string is initialized with zero bytes.
+ *
+ * The string is always null-termined (all the sds strings are, always) so
+ * even if you create an sds string with:
+ *
+ * mystring = sdsnewlen("abc",3);
+ *
+ * You can print the string with printf() as there is an implicit \0 at the
+ * end of the string. However the string is binary safe and can contain
+ * \0 characters in the middle, as the length is stored in the sds header. */
+sds sdsnewlen(const void *init, size_t initlen) {
+    void *sh;
+    char type = sdsReqType(initlen);
+    /* Empty strings are usually created in order to append. Use type 8
+     * since type 5 is not good at this. */
+    if (type == SDS_TYPE_5 && initlen == 0) type = SDS_TYPE_8;
+    int hdrlen = sdsHdrSize(type);
+
+    sh = s_malloc(hdrlen+initlen+1);
+    if (!init)
+        memset(sh, 0, hdrlen+initlen+1);
+    if (sh == NULL) return NULL;
+    return sdsInitHeader(sh, type, init, initlen);
+}
+
+/* Return the number of bytes sdsembed() needs in order to store a string
+ * of 'initlen' bytes. */
+size_t sdsembedsize(size_t initlen) {
+    return sdsHdrSize(sdsReqType(initlen))+initlen+1;
+}
+
+/* Create a new sds string with the content specified by the 'init' pointer
+ * and 'initlen' inside the memory at 'buf', that must be at least
+ * sdsembedsize(initlen) bytes. This is useful to store a string in the
+ * same allocation of some other structure: the resulting string is exactly
+ * as big as needed and is owned by the caller, so it must never be passed
+ * to sdsfree() or to functions that may reallocate it (sdscat() & co). */
+sds sdsembed(void *buf, const void *init, size_t initlen) {
+    return sdsInitHeader(buf, sdsReqType(initlen), init, initlen);
+}
+
 /* Create an empty (zero length) sds string. Even in this case the string
  * always has an implicit null term. */
 sds sdsempty(void) {
@@ -379,7 +379,7 @@ void sentinelSimFailureCrash(void);
 
 /* ========================= Dictionary types =============================== */
 
-unsigned int dictSdsHash(const void *key);
+uint64_t dictSdsHash(const void *key);
 int dictSdsKeyCompare(void *privdata, const void *key1, const void *key2);
 void releaseSentinelRedisInstance(sentinelRedisInstance *ri);
 
@@ -398,7 +398,11 @@ dictType instancesDictType = {
     NULL,                      /* val dup */
     dictSdsKeyCompare,         /* key compare */
     NULL,                      /* key destructor */
-    dictInstancesValDestructor /* val destructor */
+    dictInstancesValDestructor,/* val destructor */
+    NULL,                      /* entry metadata size */
+    NULL,                      /* embedded key size */
+    NULL,                      /* embed key */
+    0                          /* shared entries */
 };
 
 /* Instance runid (sds) -> votes (long casted to void*)
@@ -411,7 +415,11 @@ dictType leaderVotesDictType = {
     NULL,                      /* val dup */
     dictSdsKeyCompare,         /* key compare */
     NULL,                      /* key destructor */
-    NULL                       /* val destructor */
+    NULL,                      /* val destructor */
+    NULL,                      /* entry metadata size */
+    NULL,                      /* embedded key size */
+    NULL,                      /* embed key */
+    0                          /* shared entries */
 };
 
 /* =========================== Initialization =============================== */
@@ -273,6 +273,7 @@ struct redisCommand redisCommandTable[] = {
     {"readwrite",readwriteCommand,1,"rF",0,NULL,0,0,0,0,0},
     {"dump",dumpCommand,2,"r",0,NULL,1,1,1,0,0},
     {"object",objectCommand,3,"r",0,NULL,2,2,2,0,0},
+    {"memory",memoryCommand,-2,"r",0,memoryGetKeys,0,0,0,0,0},
     {"client",clientCommand,-2,"rs",0,NULL,0,0,0,0,0},
     {"eval",evalCommand,-3,"s",0,evalGetKeys,0,0,0,0,0},
     {"evalsha",evalShaCommand,-3,"s",0,evalGetKeys,0,0,0,0,0},
@@ -472,6 +473,14 @@ void dictSdsDestructor(void *privdata, void *val)
     sdsfree(val);
 }
 
+size_t dictSdsEmbeddedKeyBytes(const void *key) {
+    return sdsembedsize(sdslen((sds)key));
+}
+
+void *dictSdsEmbedKey(void *buf, const void *key) {
+    return sdsembed(buf,key,sdslen((sds)key));
+}
+
 int dictObjKeyCompare(void *privdata, const void *key1,
         const void *key2)
 {
@@ -479,16 +488,16 @@ int dictObjKeyCompare(void *privdata, const void *key1,
     return dictSdsKeyCompare(privdata,o1->ptr,o2->ptr);
 }
 
-unsigned int dictObjHash(const void *key) {
+uint64_t dictObjHash(const void *key) {
     const robj *o = key;
     return dictGenHashFunction(o->ptr, sdslen((sds)o->ptr));
 }
 
-unsigned int dictSdsHash(const void *key) {
+uint64_t dictSdsHash(const void *key) {
     return dictGenHashFunction((unsigned char*)key, sdslen((char*)key));
 }
 
-unsigned int dictSdsCaseHash(const void *key) {
+uint64_t dictSdsCaseHash(const void *key) {
     return dictGenCaseHashFunction((unsigned char*)key, sdslen((char*)key));
 }
 
@@ -510,7 +519,7 @@ int dictEncObjKeyCompare(void *privdata, const void *key1,
     return cmp;
 }
 
-unsigned int dictEncObjHash(const void *key) {
+uint64_t dictEncObjHash(const void *key) {
     robj *o = (robj*) key;
 
     if (sdsEncodedObject(o)) {
@@ -523,7 +532,7 @@ unsigned int dictEncObjHash(const void *key) {
             len = ll2string(buf,32,(long)o->ptr);
             return dictGenHashFunction((unsigned char*)buf, len);
         } else {
-            unsigned int hash;
+            uint64_t hash;
 
             o = getDecodedObject(o);
             hash = dictGenHashFunction(o->ptr, sdslen((sds)o->ptr));
@@ -541,7 +550,11 @@ dictType objectKeyPointerValueDictType = {
     NULL,                      /* val dup */
     dictEncObjKeyCompare,      /* key compare */
     dictObjectDestructor, /* key destructor */
-    NULL                       /* val destructor */
+    NULL,                      /* val destructor */
+    NULL,                      /* entry metadata size */
+    NULL,                      /* embedded key size */
+    NULL,                      /* embed key */
+    0                          /* shared entries */
 };
 
 /* Set dictionary type. Keys are SDS strings, values are ot used. */
@@ -551,7 +564,11 @@ dictType setDictType = {
     NULL,                      /* val dup */
     dictSdsKeyCompare,         /* key compare */
     dictSdsDestructor,         /* key destructor */
-    NULL                       /* val destructor */
+    NULL,                      /* val destructor */
+    NULL,                      /* entry metadata size */
+    NULL,                      /* embedded key size */
+    NULL,                      /* embed key */
+    0                          /* shared entries */
 };
 
 /* Sorted sets hash (note: a skiplist is used in addition to the hash table) */
@@ -561,17 +578,36 @@ dictType zsetDictType = {
     NULL,                      /* val dup */
     dictSdsKeyCompare,         /* key compare */
     NULL,                      /* Note: SDS string shared & freed by skiplist */
-    NULL                       /* val destructor */
+    NULL,                      /* val destructor */
+    NULL,                      /* entry metadata size */
+    NULL,                      /* embedded key size */
+    NULL,                      /* embed key */
+    0                          /* shared entries */
 };
 
-/* Db->dict, keys are sds strings, vals are Redis objects. */
+/* Returns the size of the DB dict entry metadata in bytes. In cluster mode,
+ * the metadata is used for constructing a doubly linked list of the dict
+ * entries belonging to the same cluster slot. See the Slot to Key API in
+ * db.c. */
+size_t dictEntryMetadataSize(dict *d) {
+    UNUSED(d);
+    return server.cluster_enabled ? sizeof(clusterDictEntryMetadata) : 0;
+}
+
+/* Db->dict, keys are sds strings, vals are Redis objects. The key names are
+ * stored inside the dict entries (see the Expires API in db.c for the
+ * layout of the entries). */
 dictType dbDictType = {
     dictSdsHash,                /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
-    dictSdsDestructor,          /* key destructor */
-    dictObjectDestructor   /* val destructor */
+    NULL,                       /* key destructor */
+    dictObjectDestructor,       /* val destructor */
+    dictEntryMetadataSize,      /* size of entry metadata in bytes */
+    dictSdsEmbeddedKeyBytes,    /* embedded key size */
+    dictSdsEmbedKey,            /* embed key */
+    0                           /* shared entries */
 };
 
 /* server.lua_scripts sha (as sds string) -> scripts (as robj) cache. */
@@ -581,17 +617,25 @@ dictType shaScriptObjectDictType = {
     NULL,                       /* val dup */
     dictSdsKeyCaseCompare,      /* key compare */
     dictSdsDestructor,          /* key destructor */
-    dictObjectDestructor        /* val destructor */
+    dictObjectDestructor,       /* val destructor */
+    NULL,                       /* entry metadata size */
+    NULL,                       /* embedded key size */
+    NULL,                       /* embed key */
+    0                           /* shared entries */
 };
 
-/* Db->expires */
+/* Db->expires, references the Db->dict entries of the volatile keys. */
 dictType keyptrDictType = {
     dictSdsHash,                /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
     NULL,                       /* key destructor */
-    NULL                        /* val destructor */
+    NULL,                       /* val destructor */
+    NULL,                       /* entry metadata size */
+    NULL,                       /* embedded key size */
+    NULL,                       /* embed key */
+    1                           /* shared entries (owned by Db->dict) */
 };
 
 /* Command table. sds string -> command struct pointer. */
@@ -601,7 +645,11 @@ dictType commandTableDictType = {
     NULL,                       /* val dup */
     dictSdsKeyCaseCompare,      /* key compare */
     dictSdsDestructor,          /* key destructor */
-    NULL                        /* val destructor */
+    NULL,                       /* val destructor */
+    NULL,                       /* entry metadata size */
+    NULL,                       /* embedded key size */
+    NULL,                       /* embed key */
+    0                           /* shared entries */
 };
 
 /* Hash type hash table (note that small hashes are represented with ziplists) */
@@ -611,7 +659,11 @@ dictType hashDictType = {
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
     dictSdsDestructor,          /* key destructor */
-    dictSdsDestructor           /* val destructor */
+    dictSdsDestructor,          /* val destructor */
+    NULL,                       /* entry metadata size */
+    NULL,                       /* embedded key size */
+    NULL,                       /* embed key */
+    0                           /* shared entries */
 };
 
 /* Keylist hash table type has unencoded redis objects as keys and
@@ -623,7 +675,11 @@ dictType keylistDictType = {
     NULL,                       /* val dup */
     dictObjKeyCompare,          /* key compare */
     dictObjectDestructor,       /* key destructor */
-    dictListDestructor          /* val destructor */
+    dictListDestructor,         /* val destructor */
+    NULL,                       /* entry metadata size */
+    NULL,                       /* embedded key size */
+    NULL,                       /* embed key */
+    0                           /* shared entries */
 };
 
 /* Cluster nodes hash table, mapping nodes addresses 1.2.3.4:6379 to
@@ -634,7 +690,11 @@ dictType clusterNodesDictType = {
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
     dictSdsDestructor,          /* key destructor */
-    NULL                        /* val destructor */
+    NULL,                       /* val destructor */
+    NULL,                       /* entry metadata size */
+    NULL,                       /* embedded key size */
+    NULL,                       /* embed key */
+    0                           /* shared entries */
 };
 
 /* Cluster re-addition blacklist. This maps node IDs to the time
@@ -646,7 +706,11 @@ dictType clusterNodesBlackListDictType = {
     NULL,                       /* val dup */
     dictSdsKeyCaseCompare,      /* key compare */
     dictSdsDestructor,          /* key destructor */
-    NULL                        /* val destructor */
+    NULL,                       /* val destructor */
+    NULL,                       /* entry metadata size */
+    NULL,                       /* embedded key size */
+    NULL,                       /* embed key */
+    0                           /* shared entries */
 };
 
 /* Cluster re-addition blacklist. This maps node IDs to the time
@@ -658,7 +722,11 @@ dictType modulesDictType = {
     NULL,                       /* val dup */
     dictSdsKeyCaseCompare,      /* key compare */
     dictSdsDestructor,          /* key destructor */
-    NULL                        /* val destructor */
+    NULL,                       /* val destructor */
+    NULL,                       /* entry metadata size */
+    NULL,                       /* embedded key size */
+    NULL,                       /* embed key */
+    0                           /* shared entries */
 };
 
 /* Migrate cache dict type. */
@@ -668,7 +736,11 @@ dictType migrateCacheDictType = {
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
     dictSdsDestructor,          /* key destructor */
-    NULL                        /* val destructor */
+    NULL,                       /* val destructor */
+    NULL,                       /* entry metadata size */
+    NULL,                       /* embedded key size */
+    NULL,                       /* embed key */
+    0                           /* shared entries */
 };
 
 /* Replication cached script dict (server.repl_scriptcache_dict).
@@ -680,7 +752,11 @@ dictType replScriptCacheDictType = {
     NULL,                       /* val dup */
     dictSdsKeyCaseCompare,      /* key compare */
     dictSdsDestructor,          /* key destructor */
-    NULL                        /* val destructor */
+    NULL,                       /* val destructor */
+    NULL,                       /* entry metadata size */
+    NULL,                       /* embedded key size */
+    NULL,                       /* embed key */
+    0                           /* shared entries */
 };
 
 int htNeedsResize(dict *dict) {
@@ -749,7 +825,7 @@ void updateDictResizePolicy(void) {
  * The parameter 'now' is the current time in milliseconds as is passed
  * to the function to avoid too many gettimeofday() syscalls. */
 int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
-    long long t = dictGetSignedIntegerVal(de);
+    long long t = dbEntryGetExpire(de);
     if (now > t) {
         sds key = dictGetKey(de);
         robj *keyobj = createStringObject(key,sdslen(key));
@@ -769,28 +845,68 @@ int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
     }
 }
 
+/* State shared between activeExpireCycle() and the dictScan() callback it
+ * uses to visit the keys with an expire set. */
+typedef struct expireScanData {
+    redisDb *db;
+    long long now;
+    unsigned long sampled;  /* Keys visited in the current loop. */
+    unsigned long expired;  /* Keys expired in the current loop. */
+    long long ttl_sum;      /* Sum of the TTLs of the keys not yet expired. */
+    int ttl_samples;        /* Keys contributing to ttl_sum. */
+} expireScanData;
+
+void activeExpireCycleScanCallback(void *privdata, const dictEntry *const_de) {
+    expireScanData *data = privdata;
+    dictEntry *de = (dictEntry*)const_de;
+    long long ttl = dbEntryGetExpire(de)-data->now;
+
+    if (activeExpireCycleTryExpire(data->db,de,data->now)) data->expired++;
+    if (ttl > 0) {
+        /* We want the average TTL of keys yet not expired. */
+        data->ttl_sum += ttl;
+        data->ttl_samples++;
+    }
+    data->sampled++;
+}
+
 /* Try to expire a few timed out keys. The algorithm used is adaptive and
  * will use few CPU cycles if there are few expiring keys, otherwise
  * it will get more aggressive to avoid that too much memory is used by
  * keys that can be removed from the keyspace.
  *
+ * Every database with volatile keys is visited with a dictScan() cursor
+ * that is kept across calls, so that all the keys with an expire set are
+ * eventually checked, instead of sampling random keys that tend to find
+ * the same already-alive keys again and again. For every database we keep
+ * a running estimate of the percentage of logically expired keys still in
+ * memory ('expired_stale_perc'), and we keep working on it until the
+ * estimate goes under an acceptable value.
+ *
  * No more than CRON_DBS_PER_CALL databases are tested at every
  * iteration.
  *
- * This kind of call is used when Redis detects that timelimit_exit is
- * true, so there is more work to do, and we do it more incrementally from
- * the beforeSleep() function of the event loop.
- *
  * Expire cycle type:
  *
  * If type is ACTIVE_EXPIRE_CYCLE_FAST the function will try to run a
- * "fast" expire cycle that takes no longer than EXPIRE_FAST_CYCLE_DURATION
+ * "fast" expire cycle that takes no longer than ACTIVE_EXPIRE_CYCLE_FAST_DURATION
  * microseconds, and is not repeated again before the same amount of time.
+ * The cycle is only attempted if the previous one exited for time limit or
+ * the estimated amount of stale keys is still not acceptable, and only the
+ * databases above the acceptable stale percentage are visited.
  *
  * If type is ACTIVE_EXPIRE_CYCLE_SLOW, that normal expire cycle is
  * executed, where the time limit is a percentage of the REDIS_HZ period
- * as specified by the REDIS_EXPIRELOOKUPS_TIME_PERC define. */
-
+ * as specified by the ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC define.
+ *
+ * The amount of work done is controlled by the "active-expire-effort"
+ * option: the keys visited per loop, the fast cycle duration and the CPU
+ * percentage of the slow cycle grow with the effort, while the stale
+ * percentage we are happy with shrinks. When maxmemory is set and the used
+ * memory is above ACTIVE_EXPIRE_CYCLE_MEMORY_PRESSURE percent of it, the
+ * maximum effort is used regardless of the configuration, since every
+ * reclaimed key is memory the eviction would otherwise have to free by
+ * removing keys the user still wants. */
 void activeExpireCycle(int type) {
     /* This function has some global state in order to continue the work
      * incrementally across calls. */
@@ -798,16 +914,39 @@ void activeExpireCycle(int type) {
     static int timelimit_exit = 0;      /* Time limit hit in previous call? */
     static long long last_fast_cycle = 0; /* When last fast cycle ran. */
 
+    /* Adjust the running parameters according to the configured effort.
+     * The default effort is 1, and the maximum configurable effort is 10. */
+    unsigned long effort = server.active_expire_effort-1; /* 0..9 */
+    if (server.maxmemory && zmalloc_used_memory() >=
+        server.maxmemory/100*ACTIVE_EXPIRE_CYCLE_MEMORY_PRESSURE)
+    {
+        effort = 9;
+    }
+    unsigned long config_keys_per_loop = ACTIVE_EXPIRE_CYCLE_KEYS_PER_LOOP +
+                        ACTIVE_EXPIRE_CYCLE_KEYS_PER_LOOP/4*effort;
+    unsigned long config_cycle_fast_duration = ACTIVE_EXPIRE_CYCLE_FAST_DURATION +
+                        ACTIVE_EXPIRE_CYCLE_FAST_DURATION/4*effort;
+    unsigned long config_cycle_slow_time_perc = ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC +
+                        2*effort;
+    unsigned long config_cycle_acceptable_stale = ACTIVE_EXPIRE_CYCLE_ACCEPTABLE_STALE-
+                        effort;
+
     int j, iteration = 0;
     int dbs_per_call = CRON_DBS_PER_CALL;
-    long long start = ustime(), timelimit;
+    long long start = ustime(), timelimit, elapsed;
 
     if (type == ACTIVE_EXPIRE_CYCLE_FAST) {
-        /* Don't start a fast cycle if the previous cycle did not exited
-         * for time limt. Also don't repeat a fast cycle for the same period
+        /* Don't start a fast cycle if the previous cycle did not exit
+         * for time limit, unless the percentage of estimated stale keys is
+         * too high. Also never repeat a fast cycle for the same period
          * as the fast cycle total duration itself. */
-        if (!timelimit_exit) return;
-        if (start < last_fast_cycle + ACTIVE_EXPIRE_CYCLE_FAST_DURATION*2) return;
+        if (!timelimit_exit &&
+            server.stat_expired_stale_perc*100 < config_cycle_acceptable_stale)
+            return;
+
+        if (start < last_fast_cycle + (long long)config_cycle_fast_duration*2)
+            return;
+
         last_fast_cycle = start;
     }
 
@@ -821,19 +960,25 @@ void activeExpireCycle(int type) {
     if (dbs_per_call > server.dbnum || timelimit_exit)
         dbs_per_call = server.dbnum;
 
-    /* We can use at max ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC percentage of CPU time
-     * per iteration. Since this function gets called with a frequency of
+    /* We can use at max 'config_cycle_slow_time_perc' percentage of CPU
+     * time per iteration. Since this function gets called with a frequency of
      * server.hz times per second, the following is the max amount of
      * microseconds we can spend in this function. */
-    timelimit = 1000000*ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC/server.hz/100;
+    timelimit = config_cycle_slow_time_perc*1000000/server.hz/100;
     timelimit_exit = 0;
     if (timelimit <= 0) timelimit = 1;
 
     if (type == ACTIVE_EXPIRE_CYCLE_FAST)
-        timelimit = ACTIVE_EXPIRE_CYCLE_FAST_DURATION; /* in microseconds. */
+        timelimit = config_cycle_fast_duration; /* in microseconds. */
 
-    for (j = 0; j < dbs_per_call; j++) {
-        int expired;
+    /* Accumulate some global stats as we expire keys, to have some idea
+     * about the number of keys that are already logically expired, but still
+     * existing inside the database. */
+    long total_sampled = 0;
+    long total_expired = 0;
+
+    for (j = 0; j < dbs_per_call && timelimit_exit == 0; j++) {
+        expireScanData data;
         redisDb *db = server.db+(current_db % server.dbnum);
 
         /* Increment the DB now so we are sure if we run out of time
@@ -841,53 +986,54 @@ void activeExpireCycle(int type) {
          * distribute the time evenly across DBs. */
         current_db++;
 
-        /* Continue to expire if at the end of the cycle more than 25%
-         * of the keys were expired. */
+        /* The fast cycle only cares about the databases where we estimate
+         * there is still a significant amount of work to do. */
+        if (type == ACTIVE_EXPIRE_CYCLE_FAST &&
+            db->expired_stale_perc*100 < config_cycle_acceptable_stale)
+            continue;
+
+        data.db = db;
+
+        /* Continue to expire if at the end of the cycle there are still
+         * too many stale keys in the current DB. */
         do {
-            unsigned long num, slots;
-            long long now, ttl_sum;
-            int ttl_samples;
+            unsigned long num, max_buckets;
 
             /* If there is nothing to expire try next DB ASAP. */
             if ((num = dictSize(db->expires)) == 0) {
                 db->avg_ttl = 0;
+                db->expired_stale_perc = 0;
                 break;
             }
-            slots = dictSlots(db->expires);
-            now = mstime();
+            data.now = mstime();
 
-            /* When there are less than 1% filled slots getting random
-             * keys is expensive, so stop here waiting for better times...
-             * The dictionary will be resized asap. */
-            if (num && slots > DICT_HT_INITIAL_SIZE &&
-                (num*100/slots < 1)) break;
-
-            /* The main collection cycle. Sample random keys among keys
+            /* The main collection cycle. Scan through keys among keys
              * with an expire set, checking for expired ones. */
-            expired = 0;
-            ttl_sum = 0;
-            ttl_samples = 0;
-
-            if (num > ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP)
-                num = ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP;
-
-            while (num--) {
-                dictEntry *de;
-                long long ttl;
-
-                if ((de = dictGetRandomKey(db->expires)) == NULL) break;
-                ttl = dictGetSignedIntegerVal(de)-now;
-                if (activeExpireCycleTryExpire(db,de,now)) expired++;
-                if (ttl > 0) {
-                    /* We want the average TTL of keys yet not expired. */
-                    ttl_sum += ttl;
-                    ttl_samples++;
-                }
-            }
+            data.sampled = 0;
+            data.expired = 0;
+            data.ttl_sum = 0;
+            data.ttl_samples = 0;
+
+            if (num > config_keys_per_loop)
+                num = config_keys_per_loop;
+
+            /* Every dictScan() call visits a single bucket of the table.
+             * Certain buckets may be empty, so we also want a stop condition
+             * about the number of buckets that we scanned. However checking
+             * an empty bucket is very fast: it is a single cache line, so we
+             * can afford to scan a lot more buckets than keys in the same
+             * time. We also stop when the cursor wraps, so that a small
+             * table is not visited multiple times in the same loop. */
+            max_buckets = num*20;
+            do {
+                db->expires_cursor = dictScan(db->expires,db->expires_cursor,
+                    activeExpireCycleScanCallback,NULL,&data);
+            } while (db->expires_cursor != 0 && data.sampled < num &&
+                     --max_buckets);
 
             /* Update the average TTL stats for this database. */
-            if (ttl_samples) {
-                long long avg_ttl = ttl_sum/ttl_samples;
+            if (data.ttl_samples) {
+                long long avg_ttl = data.ttl_sum/data.ttl_samples;
 
                 /* Do a simple running average with a few samples.
                  * We just use the current estimate with a weight of 2%
@@ -896,21 +1042,49 @@ void activeExpireCycle(int type) {
                 db->avg_ttl = (db->avg_ttl/50)*49 + (avg_ttl/50);
             }
 
+            /* Update the estimate of stale keys of this database, with
+             * a faster running average than the TTL since it drives the
+             * amount of work we do. */
+            if (data.sampled) {
+                double current_perc = (double)data.expired/data.sampled;
+                db->expired_stale_perc = current_perc*0.2 +
+                                         db->expired_stale_perc*0.8;
+            }
+            total_sampled += data.sampled;
+            total_expired += data.expired;
+
             /* We can't block forever here even if there are many keys to
              * expire. So after a given amount of milliseconds return to the
              * caller waiting for the other active expire cycle. */
             iteration++;
             if ((iteration & 0xf) == 0) { /* check once every 16 iterations. */
-                long long elapsed = ustime()-start;
-
-                latencyAddSampleIfNeeded("expire-cycle",elapsed/1000);
-                if (elapsed > timelimit) timelimit_exit = 1;
+                elapsed = ustime()-start;
+                if (elapsed > timelimit) {
+                    timelimit_exit = 1;
+                    server.stat_expired_time_cap_reached_count++;
+                    break;
+                }
             }
-            if (timelimit_exit) return;
-            /* We don't repeat the cycle if there are less than 25% of keys
-             * found expired in the current DB. */
-        } while (expired > ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP/4);
+            /* We don't repeat the cycle for the same DB if there are
+             * an acceptable amount of stale keys (logically expired but yet
+             * not reclaimed). */
+        } while (data.sampled &&
+                 (data.expired*100/data.sampled) > config_cycle_acceptable_stale);
     }
+
+    elapsed = ustime()-start;
+    server.stat_expire_cycle_time_used += elapsed;
+    latencyAddSampleIfNeeded("expire-cycle",elapsed/1000);
+
+    /* Update our estimate of keys existing but yet to be expired.
+     * Running average with this sample accounting for 5%. */
+    double current_perc;
+    if (total_sampled) {
+        current_perc = (double)total_expired/total_sampled;
+    } else
+        current_perc = 0;
+    server.stat_expired_stale_perc = (current_perc*0.05)+
+                                     (server.stat_expired_stale_perc*0.95);
 }
 
 unsigned int getLRUClock(void) {
@@ -1050,10 +1224,16 @@ void databasesCron(void) {
     if (server.active_expire_enabled && server.masterhost == NULL)
         activeExpireCycle(ACTIVE_EXPIRE_CYCLE_SLOW);
 
+    /* Defrag keys gradually. */
+    activeDefragCycle();
+
     /* Perform hash tables rehashing if needed, but only if there are no
      * other processes saving the DB on disk. Otherwise rehashing is bad
-     * as will cause a lot of copy-on-write of memory pages. */
-    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1) {
+     * as will cause a lot of copy-on-write of memory pages. A fork-less
+     * BGSAVE pauses the rehashing, so the tables are not resized either. */
+    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1 &&
+        server.rdb_snapshot == NULL)
+    {
         /* We use global counters so if we stop the computation at a given
          * DB we'll be able to start from the successive in the next
          * cron loop iteration. */
@@ -1246,6 +1426,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
              * successful or if, in case of an error, at least
              * CONFIG_BGSAVE_RETRY_DELAY seconds already elapsed. */
             if (server.dirty >= sp->changes &&
+                server.rdb_snapshot == NULL &&
                 server.unixtime-server.lastsave > sp->seconds &&
                 (server.unixtime-server.lastbgsave_try >
                  CONFIG_BGSAVE_RETRY_DELAY ||
@@ -1253,7 +1434,9 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
             {
                 serverLog(LL_NOTICE,"%d changes in %d seconds. Saving...",
                     sp->changes, (int)sp->seconds);
-                rdbSaveBackground(server.rdb_filename);
+                rdbSaveInfo rsi, *rsiptr;
+                rsiptr = rdbPopulateSaveInfo(&rsi);
+                rdbStartBackgroundSave(server.rdb_filename,rsiptr);
                 break;
             }
          }
@@ -1288,6 +1471,10 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
             flushAppendOnlyFile(0);
     }
 
+    /* Collect the state of the AOF writer thread, that notifies us
+     * directly only for group commit and write errors. */
+    if (server.aof_writer_thread) aofWriterCollect();
+
     /* Close clients that need to be closed asynchronous */
     freeClientsInAsyncFreeQueue();
 
@@ -1323,6 +1510,10 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
 void beforeSleep(struct aeEventLoop *eventLoop) {
     UNUSED(eventLoop);
 
+    /* Handle reads postponed to the I/O threads, executing the commands
+     * they parsed. */
+    handleClientsWithPendingReadsUsingThreads();
+
     /* Call the Redis Cluster before sleep function. Note that this function
      * may change the state of Redis Cluster (from ok to fail or vice versa),
      * so it's a good idea to call it before serving the unblocked clients
@@ -1358,11 +1549,14 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     if (listLength(server.unblocked_clients))
         processUnblockedClients();
 
+    /* Hand the objects batched for lazy freeing to the bio.c workers. */
+    lazyfreeFlushBatch();
+
     /* Write the AOF buffer on disk */
     flushAppendOnlyFile(0);
 
     /* Handle writes with pending output buffers. */
-    handleClientsWithPendingWrites();
+    handleClientsWithPendingWritesUsingThreads();
 }
 
 /* =========================== Server initialization ======================== */
@@ -1481,9 +1675,17 @@ void initServerConfig(void) {
     server.maxidletime = CONFIG_DEFAULT_CLIENT_TIMEOUT;
     server.tcpkeepalive = CONFIG_DEFAULT_TCP_KEEPALIVE;
     server.active_expire_enabled = 1;
+    server.active_expire_effort = CONFIG_DEFAULT_ACTIVE_EXPIRE_EFFORT;
+    server.active_defrag_enabled = CONFIG_DEFAULT_ACTIVE_DEFRAG;
+    server.active_defrag_ignore_bytes = CONFIG_DEFAULT_DEFRAG_IGNORE_BYTES;
+    server.active_defrag_threshold_lower = CONFIG_DEFAULT_DEFRAG_THRESHOLD_LOWER;
+    server.active_defrag_threshold_upper = CONFIG_DEFAULT_DEFRAG_THRESHOLD_UPPER;
+    server.active_defrag_cycle_min = CONFIG_DEFAULT_DEFRAG_CYCLE_MIN;
+    server.active_defrag_cycle_max = CONFIG_DEFAULT_DEFRAG_CYCLE_MAX;
     server.client_max_querybuf_len = PROTO_MAX_QUERYBUF_LEN;
     server.saveparams = NULL;
     server.loading = 0;
+    server.async_loading = 0;
     server.logfile = zstrdup(CONFIG_DEFAULT_LOGFILE);
     server.syslog_enabled = CONFIG_DEFAULT_SYSLOG_ENABLED;
     server.syslog_ident = zstrdup(CONFIG_DEFAULT_SYSLOG_IDENT);
@@ -1508,12 +1710,26 @@ void initServerConfig(void) {
     server.aof_flush_postponed_start = 0;
     server.aof_rewrite_incremental_fsync = CONFIG_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC;
     server.aof_load_truncated = CONFIG_DEFAULT_AOF_LOAD_TRUNCATED;
+    server.aof_use_rdb_preamble = CONFIG_DEFAULT_AOF_USE_RDB_PREAMBLE;
+    server.aof_writer_thread = CONFIG_DEFAULT_AOF_WRITER_THREAD;
+    server.aof_enqueued_offset = 0;
+    server.aof_durable_offset = 0;
+    server.aof_multi_part = CONFIG_DEFAULT_AOF_MULTI_PART;
+    server.aof_manifest = NULL;
+    server.aof_rewrite_incr_seq = 0;
+    server.aof_rewrite_base_rdb = 0;
+    server.aof_segment_crc = 0;
+    server.aof_segment_bytes = 0;
+    server.aof_load_reader_thread = CONFIG_DEFAULT_AOF_LOAD_READER_THREAD;
+    server.aof_checksum = CONFIG_DEFAULT_AOF_CHECKSUM;
     server.pidfile = NULL;
     server.rdb_filename = zstrdup(CONFIG_DEFAULT_RDB_FILENAME);
     server.aof_filename = zstrdup(CONFIG_DEFAULT_AOF_FILENAME);
+    server.aof_dirname = zstrdup(CONFIG_DEFAULT_AOF_DIRNAME);
     server.requirepass = NULL;
     server.rdb_compression = CONFIG_DEFAULT_RDB_COMPRESSION;
     server.rdb_checksum = CONFIG_DEFAULT_RDB_CHECKSUM;
+    server.rdb_forkless_bgsave = CONFIG_DEFAULT_RDB_FORKLESS_BGSAVE;
     server.stop_writes_on_bgsave_err = CONFIG_DEFAULT_STOP_WRITES_ON_BGSAVE_ERROR;
     server.activerehashing = CONFIG_DEFAULT_ACTIVE_REHASHING;
     server.notify_keyspace_events = 0;
@@ -1522,6 +1738,9 @@ void initServerConfig(void) {
     server.maxmemory = CONFIG_DEFAULT_MAXMEMORY;
     server.maxmemory_policy = CONFIG_DEFAULT_MAXMEMORY_POLICY;
     server.maxmemory_samples = CONFIG_DEFAULT_MAXMEMORY_SAMPLES;
+    server.lfu_log_factor = CONFIG_DEFAULT_LFU_LOG_FACTOR;
+    server.lfu_decay_time = CONFIG_DEFAULT_LFU_DECAY_TIME;
+    server.maxmemory_eviction_tenacity = CONFIG_DEFAULT_MAXMEMORY_EVICTION_TENACITY;
     server.hash_max_ziplist_entries = OBJ_HASH_MAX_ZIPLIST_ENTRIES;
     server.hash_max_ziplist_value = OBJ_HASH_MAX_ZIPLIST_VALUE;
     server.list_max_ziplist_size = OBJ_LIST_MAX_ZIPLIST_SIZE;
@@ -1546,6 +1765,10 @@ void initServerConfig(void) {
     server.lazyfree_lazy_eviction = CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION;
     server.lazyfree_lazy_expire = CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE;
     server.lazyfree_lazy_server_del = CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL;
+    server.lazyfree_threads = CONFIG_DEFAULT_LAZYFREE_THREADS;
+    server.io_threads_num = CONFIG_DEFAULT_IO_THREADS_NUM;
+    server.io_threads_do_reads = CONFIG_DEFAULT_IO_THREADS_DO_READS;
+    server.rdb_load_threads = CONFIG_DEFAULT_RDB_LOAD_THREADS;
 
     server.lruclock = getLRUClock();
     resetServerSaveParams();
@@ -1560,7 +1783,7 @@ void initServerConfig(void) {
     server.masterport = 6379;
     server.master = NULL;
     server.cached_master = NULL;
-    server.repl_master_initial_offset = -1;
+    server.master_initial_offset = -1;
     server.repl_state = REPL_STATE_NONE;
     server.repl_syncio_timeout = CONFIG_REPL_SYNCIO_TIMEOUT;
     server.repl_serve_stale_data = CONFIG_DEFAULT_SLAVE_SERVE_STALE_DATA;
@@ -1570,12 +1793,15 @@ void initServerConfig(void) {
     server.repl_disable_tcp_nodelay = CONFIG_DEFAULT_REPL_DISABLE_TCP_NODELAY;
     server.repl_diskless_sync = CONFIG_DEFAULT_REPL_DISKLESS_SYNC;
     server.repl_diskless_sync_delay = CONFIG_DEFAULT_REPL_DISKLESS_SYNC_DELAY;
+    server.repl_diskless_load = CONFIG_DEFAULT_REPL_DISKLESS_LOAD;
     server.repl_ping_slave_period = CONFIG_DEFAULT_REPL_PING_SLAVE_PERIOD;
     server.repl_timeout = CONFIG_DEFAULT_REPL_TIMEOUT;
     server.repl_min_slaves_to_write = CONFIG_DEFAULT_MIN_SLAVES_TO_WRITE;
     server.repl_min_slaves_max_lag = CONFIG_DEFAULT_MIN_SLAVES_MAX_LAG;
     server.slave_priority = CONFIG_DEFAULT_SLAVE_PRIORITY;
     server.master_repl_offset = 0;
+    changeReplicationId();
+    clearReplicationId2();
 
     /* Replication partial resync backlog */
     server.repl_backlog = NULL;
@@ -1844,11 +2070,15 @@ void resetServerStats(void) {
     server.stat_numcommands = 0;
     server.stat_numconnections = 0;
     server.stat_expiredkeys = 0;
+    server.stat_expired_stale_perc = 0;
+    server.stat_expired_time_cap_reached_count = 0;
+    server.stat_expire_cycle_time_used = 0;
     server.stat_evictedkeys = 0;
     server.stat_keyspace_misses = 0;
     server.stat_keyspace_hits = 0;
     server.stat_fork_time = 0;
     server.stat_fork_rate = 0;
+    server.stat_rdb_saved_on_write = 0;
     server.stat_rejected_conn = 0;
     server.stat_sync_full = 0;
     server.stat_sync_partial_ok = 0;
@@ -1862,6 +2092,13 @@ void resetServerStats(void) {
     }
     server.stat_net_input_bytes = 0;
     server.stat_net_output_bytes = 0;
+    server.stat_io_reads_processed = 0;
+    server.stat_io_writes_processed = 0;
+    server.stat_aof_group_commit_clients = 0;
+    server.stat_active_defrag_hits = 0;
+    server.stat_active_defrag_misses = 0;
+    server.stat_active_defrag_key_hits = 0;
+    server.stat_active_defrag_key_misses = 0;
     server.aof_delayed_fsync = 0;
 }
 
@@ -1884,6 +2121,8 @@ void initServer(void) {
     server.slaves = listCreate();
     server.monitors = listCreate();
     server.clients_pending_write = listCreate();
+    server.clients_waiting_aof = listCreate();
+    server.clients_pending_read = listCreate();
     server.slaveseldb = -1; /* Force to emit the first SELECT command. */
     server.unblocked_clients = listCreate();
     server.ready_keys = listCreate();
@@ -1930,6 +2169,8 @@ void initServer(void) {
         server.db[j].eviction_pool = evictionPoolAlloc();
         server.db[j].id = j;
         server.db[j].avg_ttl = 0;
+        server.db[j].expires_cursor = 0;
+        server.db[j].expired_stale_perc = 0;
     }
     server.pubsub_channels = dictCreate(&keylistDictType,NULL);
     server.pubsub_patterns = listCreate();
@@ -1937,6 +2178,7 @@ void initServer(void) {
     listSetMatchMethod(server.pubsub_patterns,listMatchPubsubPattern);
     server.cronloops = 0;
     server.rdb_child_pid = -1;
+    server.rdb_snapshot = NULL;
     server.aof_child_pid = -1;
     server.rdb_child_type = RDB_CHILD_TYPE_NONE;
     aofRewriteBufferReset();
@@ -1950,6 +2192,7 @@ void initServer(void) {
     /* A few stats we don't want to reset: server startup time, and peak mem. */
     server.stat_starttime = time(NULL);
     server.stat_peak_memory = 0;
+    server.active_defrag_running = 0;
     server.resident_set_size = 0;
     server.lastbgsave_status = C_OK;
     server.aof_last_write_status = C_OK;
@@ -1978,7 +2221,9 @@ void initServer(void) {
         acceptUnixHandler,NULL) == AE_ERR) serverPanic("Unrecoverable error creating server.sofd file event.");
 
     /* Open the AOF file if needed. */
-    if (server.aof_state == AOF_ON) {
+    if (server.aof_multi_part) {
+        aofOpenIfNeededOnServerStart();
+    } else if (server.aof_state == AOF_ON) {
         server.aof_fd = open(server.aof_filename,
                                O_WRONLY|O_APPEND|O_CREAT,0644);
         if (server.aof_fd == -1) {
@@ -2004,6 +2249,9 @@ void initServer(void) {
     slowlogInit();
     latencyMonitorInit();
     bioInit();
+    initThreadedIO();
+    if (server.aof_writer_thread) aofWriterInit();
+    server.initial_memory_usage = zmalloc_used_memory();
 }
 
 /* Populates the Redis Command Table starting from the hard coded list
@@ -2346,6 +2594,11 @@ void call(client *c, int flags) {
         redisOpArrayFree(&server.also_propagate);
     }
     server.also_propagate = prev_also_propagate;
+
+    /* The reply, if any, must also wait for the AOF data just propagated
+     * to be durable. */
+    if (clientHasPendingReplies(c) || c->flags & CLIENT_PENDING_WRITE)
+        aofUpdateClientWaitOffset(c);
     server.stat_numcommands++;
 }
 
@@ -2423,8 +2676,14 @@ int processCommand(client *c) {
      *
      * First we try to free some memory if possible (if there are volatile
      * keys in the dataset). If there are not the only thing we can do
-     * is returning an error. */
-    if (server.maxmemory) {
+     * is returning an error.
+     *
+     * While loading the new data set in side databases (repl-diskless-load
+     * swapdb) nothing is evicted: the keys of the old data set are about
+     * to be released anyway, and deleting them would touch the cluster
+     * slots to keys map of the new one, and propagate DELs of keys that
+     * don't belong to the data set being loaded. */
+    if (server.maxmemory && !server.async_loading) {
         int retval = freeMemoryIfNeeded();
         /* freeMemoryIfNeeded may flush slave output buffers. This may result
          * into a slave, that may be the active client, to be freed. */
@@ -2506,8 +2765,12 @@ int processCommand(client *c) {
     }
 
     /* Loading DB? Return an error if the command has not the
-     * CMD_LOADING flag. */
-    if (server.loading && !(c->cmd->flags & CMD_LOADING)) {
+     * CMD_LOADING flag. While a slave loads the new data set in side
+     * databases (repl-diskless-load swapdb) read only commands are served
+     * using the old data set. */
+    if (server.loading && !(c->cmd->flags & CMD_LOADING) &&
+        !(server.async_loading && c->cmd->flags & CMD_READONLY))
+    {
         addReply(c, shared.loadingerr);
         return C_OK;
     }
@@ -2578,6 +2841,10 @@ int prepareForShutdown(int flags) {
         kill(server.rdb_child_pid,SIGUSR1);
         rdbRemoveTempFile(server.rdb_child_pid);
     }
+    if (server.rdb_snapshot) {
+        serverLog(LL_WARNING,"There is a BGSAVE without fork in progress. Stopping it!");
+        snapshotAbort();
+    }
 
     if (server.aof_state != AOF_OFF) {
         /* Kill the AOF saving child as the AOF we already have may be longer
@@ -2602,7 +2869,9 @@ int prepareForShutdown(int flags) {
     if ((server.saveparamslen > 0 && !nosave) || save) {
         serverLog(LL_NOTICE,"Saving the final RDB snapshot before exiting.");
         /* Snapshotting. Perform a SYNC SAVE and exit */
-        if (rdbSave(server.rdb_filename) != C_OK) {
+        rdbSaveInfo rsi, *rsiptr;
+        rsiptr = rdbPopulateSaveInfo(&rsi);
+        if (rdbSave(server.rdb_filename,rsiptr) != C_OK) {
             /* Ooops.. error saving! The best we can do is to continue
              * operating. Note that if there was a background saving process,
              * in the next cron() Redis will be notified that the background
@@ -2956,6 +3225,7 @@ sds genRedisInfoString(char *section) {
         size_t total_system_mem = server.system_memory_size;
         const char *evict_policy = maxmemoryToString();
         long long memory_lua = (long long)lua_gc(server.lua,LUA_GCCOUNT,0)*1024;
+        struct redisMemOverhead *mh = getMemoryOverheadData();
 
         /* Peak memory is updated from time to time by serverCron() so it
          * may happen that the instantaneous value is slightly bigger than
@@ -2980,6 +3250,11 @@ sds genRedisInfoString(char *section) {
             "used_memory_rss_human:%s\r\n"
             "used_memory_peak:%zu\r\n"
             "used_memory_peak_human:%s\r\n"
+            "used_memory_peak_perc:%.2f%%\r\n"
+            "used_memory_overhead:%zu\r\n"
+            "used_memory_startup:%zu\r\n"
+            "used_memory_dataset:%zu\r\n"
+            "used_memory_dataset_perc:%.2f%%\r\n"
             "total_system_memory:%lu\r\n"
             "total_system_memory_human:%s\r\n"
             "used_memory_lua:%lld\r\n"
@@ -2989,13 +3264,20 @@ sds genRedisInfoString(char *section) {
             "maxmemory_policy:%s\r\n"
             "mem_fragmentation_ratio:%.2f\r\n"
             "mem_allocator:%s\r\n"
-            "lazyfree_pending_objects:%zu\r\n",
+            "active_defrag_running:%d\r\n"
+            "lazyfree_pending_objects:%zu\r\n"
+            "lazyfreed_objects:%zu\r\n",
             zmalloc_used,
             hmem,
             server.resident_set_size,
             used_memory_rss_hmem,
             server.stat_peak_memory,
             peak_hmem,
+            mh->peak_perc,
+            mh->overhead_total,
+            mh->startup_allocated,
+            mh->dataset,
+            mh->dataset_perc,
             (unsigned long)total_system_mem,
             total_system_hmem,
             memory_lua,
@@ -3005,8 +3287,22 @@ sds genRedisInfoString(char *section) {
             evict_policy,
             zmalloc_get_fragmentation_ratio(server.resident_set_size),
             ZMALLOC_LIB,
-            lazyfreeGetPendingObjectsCount()
+            server.active_defrag_running,
+            lazyfreeGetPendingObjectsCount(),
+            lazyfreeGetFreedObjectsCount()
             );
+        freeMemoryOverheadData(mh);
+
+        /* Per lazyfree worker queue depth and throughput. */
+        for (j = 0; j < bioWorkersOfType(BIO_LAZY_FREE); j++) {
+            unsigned long long pending, processed, freed;
+
+            bioGetWorkerStats(BIO_LAZY_FREE,j,&pending,&processed,&freed);
+            info = sdscatprintf(info,
+                "lazyfree_thread_%d:pending_jobs=%llu,processed_jobs=%llu,"
+                "freed_objects=%llu\r\n",
+                j, pending, processed, freed);
+        }
     }
 
     /* Persistence */
@@ -3015,12 +3311,14 @@ sds genRedisInfoString(char *section) {
         info = sdscatprintf(info,
             "# Persistence\r\n"
             "loading:%d\r\n"
+            "async_loading:%d\r\n"
             "rdb_changes_since_last_save:%lld\r\n"
             "rdb_bgsave_in_progress:%d\r\n"
             "rdb_last_save_time:%jd\r\n"
             "rdb_last_bgsave_status:%s\r\n"
             "rdb_last_bgsave_time_sec:%jd\r\n"
             "rdb_current_bgsave_time_sec:%jd\r\n"
+            "rdb_forkless_saved_on_write:%lld\r\n"
             "aof_enabled:%d\r\n"
             "aof_rewrite_in_progress:%d\r\n"
             "aof_rewrite_scheduled:%d\r\n"
@@ -3029,13 +3327,16 @@ sds genRedisInfoString(char *section) {
             "aof_last_bgrewrite_status:%s\r\n"
             "aof_last_write_status:%s\r\n",
             server.loading,
+            server.async_loading,
             server.dirty,
-            server.rdb_child_pid != -1,
+            server.rdb_child_pid != -1 || server.rdb_snapshot != NULL,
             (intmax_t)server.lastsave,
             (server.lastbgsave_status == C_OK) ? "ok" : "err",
             (intmax_t)server.rdb_save_time_last,
-            (intmax_t)((server.rdb_child_pid == -1) ?
+            (intmax_t)((server.rdb_child_pid == -1 &&
+                        server.rdb_snapshot == NULL) ?
                 -1 : time(NULL)-server.rdb_save_time_start),
+            server.stat_rdb_saved_on_write,
             server.aof_state != AOF_OFF,
             server.aof_child_pid != -1,
             server.aof_rewrite_scheduled,
@@ -3061,6 +3362,8 @@ sds genRedisInfoString(char *section) {
                 aofRewriteBufferSize(),
                 bioPendingJobsOfType(BIO_AOF_FSYNC),
                 server.aof_delayed_fsync);
+            if (server.aof_writer_thread)
+                info = genAofWriterInfoString(info);
         }
 
         if (server.loading) {
@@ -3085,12 +3388,20 @@ sds genRedisInfoString(char *section) {
                 "loading_total_bytes:%llu\r\n"
                 "loading_loaded_bytes:%llu\r\n"
                 "loading_loaded_perc:%.2f\r\n"
-                "loading_eta_seconds:%jd\r\n",
+                "loading_eta_seconds:%jd\r\n"
+                "loading_loaded_keys:%lld\r\n"
+                "loading_decoding_keys:%lld\r\n"
+                "loading_bytes_per_sec:%lld\r\n"
+                "loading_keys_per_sec:%lld\r\n",
                 (intmax_t) server.loading_start_time,
                 (unsigned long long) server.loading_total_bytes,
                 (unsigned long long) server.loading_loaded_bytes,
                 perc,
-                (intmax_t)eta
+                (intmax_t)eta,
+                server.loading_loaded_keys,
+                server.loading_read_keys-server.loading_loaded_keys,
+                (long long)server.loading_loaded_bytes/(elapsed ? elapsed : 1),
+                server.loading_loaded_keys/(elapsed ? elapsed : 1)
             );
         }
     }
@@ -3112,13 +3423,23 @@ sds genRedisInfoString(char *section) {
             "sync_partial_ok:%lld\r\n"
             "sync_partial_err:%lld\r\n"
             "expired_keys:%lld\r\n"
+            "expired_stale_perc:%.2f\r\n"
+            "expired_time_cap_reached_count:%lld\r\n"
+            "expire_cycle_cpu_milliseconds:%lld\r\n"
             "evicted_keys:%lld\r\n"
             "keyspace_hits:%lld\r\n"
             "keyspace_misses:%lld\r\n"
             "pubsub_channels:%ld\r\n"
             "pubsub_patterns:%lu\r\n"
             "latest_fork_usec:%lld\r\n"
-            "migrate_cached_sockets:%ld\r\n",
+            "migrate_cached_sockets:%ld\r\n"
+            "io_threads_active:%d\r\n"
+            "io_threaded_reads_processed:%lld\r\n"
+            "io_threaded_writes_processed:%lld\r\n"
+            "active_defrag_hits:%lld\r\n"
+            "active_defrag_misses:%lld\r\n"
+            "active_defrag_key_hits:%lld\r\n"
+            "active_defrag_key_misses:%lld\r\n",
             server.stat_numconnections,
             server.stat_numcommands,
             getInstantaneousMetric(STATS_METRIC_COMMAND),
@@ -3131,13 +3452,23 @@ sds genRedisInfoString(char *section) {
             server.stat_sync_partial_ok,
             server.stat_sync_partial_err,
             server.stat_expiredkeys,
+            server.stat_expired_stale_perc*100,
+            server.stat_expired_time_cap_reached_count,
+            server.stat_expire_cycle_time_used/1000,
             server.stat_evictedkeys,
             server.stat_keyspace_hits,
             server.stat_keyspace_misses,
             dictSize(server.pubsub_channels),
             listLength(server.pubsub_patterns),
             server.stat_fork_time,
-            dictSize(server.migrate_cached_sockets));
+            dictSize(server.migrate_cached_sockets),
+            server.io_threads_active,
+            server.stat_io_reads_processed,
+            server.stat_io_writes_processed,
+            server.stat_active_defrag_hits,
+            server.stat_active_defrag_misses,
+            server.stat_active_defrag_key_hits,
+            server.stat_active_defrag_key_misses);
     }
 
     /* Replication */
@@ -3246,12 +3577,18 @@ sds genRedisInfoString(char *section) {
             }
         }
         info = sdscatprintf(info,
+            "master_replid:%s\r\n"
+            "master_replid2:%s\r\n"
             "master_repl_offset:%lld\r\n"
+            "second_repl_offset:%lld\r\n"
             "repl_backlog_active:%d\r\n"
             "repl_backlog_size:%lld\r\n"
             "repl_backlog_first_byte_offset:%lld\r\n"
             "repl_backlog_histlen:%lld\r\n",
+            server.replid,
+            server.replid2,
             server.master_repl_offset,
+            server.second_replid_offset,
             server.repl_backlog != NULL,
             server.repl_backlog_size,
             server.repl_backlog_off,
@@ -3354,6 +3691,13 @@ void monitorCommand(client *c) {
  * should block the execution of commands that will result in more memory
  * used by the server.
  *
+ * The time spent evicting keys in a single call is bounded according to
+ * the maxmemory-eviction-tenacity configuration, so that a single command
+ * (or a CONFIG SET maxmemory) can't stall the server evicting thousands of
+ * keys. When the time limit is reached the function returns C_OK, since
+ * progress is being made, and the remaining work is performed incrementally
+ * by a time event, see startEvictionTimeProc().
+ *
  * ------------------------------------------------------------------------
  *
  * LRU approximation algorithm
@@ -3376,6 +3720,78 @@ void monitorCommand(client *c) {
  * one key that can be evicted, if there is at least one key that can be
  * evicted in the whole database. */
 
+/* ----------------------------------------------------------------------------
+ * LFU (Least Frequently Used) implementation.
+ *
+ * We have 24 total bits of space in each object in order to implement
+ * an LFU (Least Frequently Used) eviction policy, since we re-use the
+ * LRU field for this purpose: the 16 most significant bits are the time
+ * (in minutes) of the last counter decrement, and the 8 least significant
+ * bits are a logarithmic access counter (see LFU_INIT_VAL in server.h).
+ *
+ * The counter is not decremented while the object is accessed: instead
+ * the decay is computed lazily, when the object is accessed or sampled for
+ * eviction, according to the time elapsed since the last decrement.
+ * --------------------------------------------------------------------------*/
+
+/* Return the current time in minutes, just taking the least significant
+ * 16 bits. The returned time is suitable to be stored as LDT (last decrement
+ * time) for the LFU implementation. */
+unsigned long LFUGetTimeInMinutes(void) {
+    return (server.unixtime/60) & 65535;
+}
+
+/* Given an object last decrement time, compute the minimum number of minutes
+ * that elapsed since the last decrement. Handle overflow (ldt greater than
+ * the current 16 bits minutes time) considering the time as wrapping
+ * exactly once. */
+static unsigned long LFUTimeElapsed(unsigned long ldt) {
+    unsigned long now = LFUGetTimeInMinutes();
+    if (now >= ldt) return now-ldt;
+    return 65535-ldt+now;
+}
+
+/* Logarithmically increment a counter. The greater is the current counter
+ * value the less likely is that it gets really implemented. Saturate it
+ * at 255. */
+uint8_t LFULogIncr(uint8_t counter) {
+    double r, baseval, p;
+
+    if (counter == 255) return 255;
+    r = (double)rand()/RAND_MAX;
+    baseval = counter - LFU_INIT_VAL;
+    if (baseval < 0) baseval = 0;
+    p = 1.0/(baseval*server.lfu_log_factor+1);
+    if (r < p) counter++;
+    return counter;
+}
+
+/* Return the object frequency counter, decremented by one for every
+ * server.lfu_decay_time minutes elapsed since the last decrement time.
+ * The LFU fields of the object are not modified: they are updated in an
+ * explicit way by updateLFU() when the object is really accessed.
+ *
+ * This function is used in order to scan the dataset for the best object
+ * to evict, and by OBJECT FREQ. */
+unsigned long LFUDecrAndReturn(robj *o) {
+    unsigned long ldt = o->lru >> 8;
+    unsigned long counter = o->lru & 255;
+    unsigned long num_periods = server.lfu_decay_time ?
+        LFUTimeElapsed(ldt) / server.lfu_decay_time : 0;
+    if (num_periods)
+        counter = (num_periods > counter) ? 0 : counter - num_periods;
+    return counter;
+}
+
+/* Update the LFU fields of an object that was just accessed: first apply
+ * the decay, then increment the counter, and set the last decrement time
+ * to the current time. */
+void updateLFU(robj *val) {
+    unsigned long counter = LFUDecrAndReturn(val);
+    counter = LFULogIncr(counter);
+    val->lru = (LFUGetTimeInMinutes()<<8) | counter;
+}
+
 /* Create a new eviction pool. */
 struct evictionPoolEntry *evictionPoolAlloc(void) {
     struct evictionPoolEntry *ep;
@@ -3396,10 +3812,14 @@ struct evictionPoolEntry *evictionPoolAlloc(void) {
  *
  * We insert keys on place in ascending order, so keys with the smaller
  * idle time are on the left, and keys with the higher idle time on the
- * right. */
+ * right.
+ *
+ * With the LFU policies the "idle" score is the inverse of the access
+ * frequency (255 minus the LFU counter), so that the same pool logic
+ * evicts the least frequently used keys first. */
 
 #define EVICTION_SAMPLES_ARRAY_SIZE 16
-void evictionPoolPopulate(dict *sampledict, dict *keydict, struct evictionPoolEntry *pool) {
+void evictionPoolPopulate(dict *sampledict, struct evictionPoolEntry *pool) {
     int j, k, count;
     dictEntry *_samples[EVICTION_SAMPLES_ARRAY_SIZE];
     dictEntry **samples;
@@ -3421,12 +3841,25 @@ void evictionPoolPopulate(dict *sampledict, dict *keydict, struct evictionPoolEn
 
         de = samples[j];
         key = dictGetKey(de);
-        /* If the dictionary we are sampling from is not the main
-         * dictionary (but the expires one) we need to lookup the key
-         * again in the key dictionary to obtain the value object. */
-        if (sampledict != keydict) de = dictFind(keydict, key);
+        /* The expires dictionary references the entries of the main
+         * dictionary, so the value object is available in both cases. */
         o = dictGetVal(de);
-        idle = estimateObjectIdleTime(o);
+
+        /* Calculate the idle time according to the policy. This is called
+         * idle just because the code initially handled LRU, but is in fact
+         * just a score where an higher score means better candidate. */
+        if (server.maxmemory_policy & MAXMEMORY_FLAG_LRU) {
+            idle = estimateObjectIdleTime(o);
+        } else {
+            /* When we use an LRU policy, we sort the keys by idle time
+             * so that we expire keys starting from greater idle time.
+             * However when the policy is an LFU one, we have a frequency
+             * estimation, and we want to evict keys with lower frequency
+             * first. So inside the pool we put objects using the inverted
+             * frequency subtracting the actual frequency to the maximum
+             * frequency of 255. */
+            idle = 255-LFUDecrAndReturn(o);
+        }
 
         /* Insert the element inside the pool.
          * First, find the first empty bucket or the first populated
@@ -3464,15 +3897,39 @@ void evictionPoolPopulate(dict *sampledict, dict *keydict, struct evictionPoolEn
     if (samples != _samples) zfree(samples);
 }
 
-int freeMemoryIfNeeded(void) {
-    size_t mem_reported, mem_used, mem_tofree, mem_freed;
+/* True if the last freeMemoryIfNeeded() call was interrupted because of the
+ * time limit, and there is more memory to reclaim. */
+static int eviction_timed_out = 0;
+
+/* True if the eviction time event is registered. */
+static int eviction_proc_running = 0;
+
+/* Get the memory status from the point of view of the maxmemory directive:
+ * if the memory used is under the maxmemory setting then C_OK is returned.
+ * Otherwise, if we are over the memory limit, the function returns
+ * C_ERR.
+ *
+ * The function may return additional info via reference, only if the
+ * pointers to the respective arguments is not NULL. Certain fields are
+ * populated only when C_ERR is returned:
+ *
+ *  'total'     total amount of bytes used.
+ *              (Populated both for C_ERR and C_OK)
+ *
+ *  'logical'   the amount of memory used minus the slaves/AOF buffers.
+ *              (Populated when C_ERR is returned)
+ *
+ *  'tofree'    the amount of memory that should be released
+ *              in order to return back into the memory limits.
+ *              (Populated when C_ERR is returned) */
+static int getMaxmemoryState(size_t *total, size_t *logical, size_t *tofree) {
+    size_t mem_reported, mem_used;
     int slaves = listLength(server.slaves);
-    mstime_t latency, eviction_latency;
-    long long delta;
 
     /* Check if we are over the memory usage limit. If we are not, no need
      * to subtract the slaves output buffers. We can just return ASAP. */
     mem_reported = zmalloc_used_memory();
+    if (total) *total = mem_reported;
     if (mem_reported <= server.maxmemory) return C_OK;
 
     /* Remove the size of slaves output buffers and AOF buffer from the
@@ -3485,7 +3942,10 @@ int freeMemoryIfNeeded(void) {
         listRewind(server.slaves,&li);
         while((ln = listNext(&li))) {
             client *slave = listNodeValue(ln);
-            unsigned long obuf_bytes = getClientOutputBufferMemoryUsage(slave);
+            /* The bytes of the objects referenced by the reply blocks are
+             * not allocated by the output buffer. */
+            unsigned long obuf_bytes = getClientOutputBufferMemoryUsage(slave) -
+                                       slave->reply_obj_bytes;
             if (obuf_bytes > mem_used)
                 mem_used = 0;
             else
@@ -3501,26 +3961,78 @@ int freeMemoryIfNeeded(void) {
     if (mem_used <= server.maxmemory) return C_OK;
 
     /* Compute how much memory we need to free. */
-    mem_tofree = mem_used - server.maxmemory;
+    if (logical) *logical = mem_used;
+    if (tofree) *tofree = mem_used - server.maxmemory;
+    return C_ERR;
+}
+
+/* Return the time limit, in microseconds, of a single freeMemoryIfNeeded()
+ * call, according to maxmemory-eviction-tenacity: from 0 to 10 the limit
+ * grows linearly from 0 to 500 microseconds, then it grows geometrically
+ * by 15% every step, and 100 means no time limit at all. */
+static long long evictionTimeLimitUs(void) {
+    int tenacity = server.maxmemory_eviction_tenacity;
+
+    if (tenacity <= 10) return 50LL*tenacity;
+    if (tenacity < 100) return (long long) (500.0*pow(1.15,tenacity-10.0));
+    return LLONG_MAX;
+}
+
+/* Time event used to continue the eviction of keys when a freeMemoryIfNeeded()
+ * call was not able to reclaim all the memory because of the time limit.
+ * The event is rescheduled with a zero period, so that the event loop does
+ * not sleep while the server is over the memory limit, but other events
+ * (clients included) are served between eviction cycles. */
+static int evictionTimeProc(struct aeEventLoop *eventLoop, long long id,
+                            void *clientData)
+{
+    UNUSED(eventLoop);
+    UNUSED(id);
+    UNUSED(clientData);
+
+    if (server.maxmemory && !server.loading && !server.async_loading) {
+        freeMemoryIfNeeded();
+        if (eviction_timed_out) return 0; /* More work to do ASAP. */
+    }
+    eviction_proc_running = 0;
+    return AE_NOMORE;
+}
+
+static void startEvictionTimeProc(void) {
+    if (eviction_proc_running) return;
+    if (aeCreateTimeEvent(server.el,0,evictionTimeProc,NULL,NULL) == AE_ERR)
+        return;
+    eviction_proc_running = 1;
+}
+
+int freeMemoryIfNeeded(void) {
+    size_t mem_reported, mem_tofree, mem_freed;
+    int slaves = listLength(server.slaves);
+    mstime_t latency, eviction_latency;
+    long long delta, start, time_limit;
+
+    eviction_timed_out = 0;
+    if (getMaxmemoryState(&mem_reported,NULL,&mem_tofree) == C_OK)
+        return C_OK;
     mem_freed = 0;
 
     if (server.maxmemory_policy == MAXMEMORY_NO_EVICTION)
         goto cant_free; /* We need to free memory, but policy forbids. */
 
+    start = ustime();
+    time_limit = evictionTimeLimitUs();
     latencyStartMonitor(latency);
     while (mem_freed < mem_tofree) {
         int j, k, keys_freed = 0;
 
         for (j = 0; j < server.dbnum; j++) {
-            long bestval = 0; /* just to prevent warning */
+            long long bestval = 0; /* just to prevent warning */
             sds bestkey = NULL;
             dictEntry *de;
             redisDb *db = server.db+j;
             dict *dict;
 
-            if (server.maxmemory_policy == MAXMEMORY_ALLKEYS_LRU ||
-                server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM)
-            {
+            if (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) {
                 dict = server.db[j].dict;
             } else {
                 dict = server.db[j].expires;
@@ -3535,14 +4047,14 @@ int freeMemoryIfNeeded(void) {
                 bestkey = dictGetKey(de);
             }
 
-            /* volatile-lru and allkeys-lru policy */
-            else if (server.maxmemory_policy == MAXMEMORY_ALLKEYS_LRU ||
-                server.maxmemory_policy == MAXMEMORY_VOLATILE_LRU)
+            /* volatile-lru, allkeys-lru, volatile-lfu and allkeys-lfu */
+            else if (server.maxmemory_policy &
+                     (MAXMEMORY_FLAG_LRU|MAXMEMORY_FLAG_LFU))
             {
                 struct evictionPoolEntry *pool = db->eviction_pool;
 
                 while(bestkey == NULL) {
-                    evictionPoolPopulate(dict, db->dict, db->eviction_pool);
+                    evictionPoolPopulate(dict, db->eviction_pool);
                     /* Go backward from best to worst element to evict. */
                     for (k = MAXMEMORY_EVICTION_POOL_SIZE-1; k >= 0; k--) {
                         if (pool[k].key == NULL) continue;
@@ -3575,11 +4087,11 @@ int freeMemoryIfNeeded(void) {
             else if (server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL) {
                 for (k = 0; k < server.maxmemory_samples; k++) {
                     sds thiskey;
-                    long thisval;
+                    long long thisval;
 
                     de = dictGetRandomKey(dict);
                     thiskey = dictGetKey(de);
-                    thisval = (long) dictGetVal(de);
+                    thisval = dbEntryGetExpire(de);
 
                     /* Expire sooner (minor expire unix timestamp) is better
                      * candidate for deletion */
@@ -3631,6 +4143,23 @@ int freeMemoryIfNeeded(void) {
             latencyAddSampleIfNeeded("eviction-cycle",latency);
             goto cant_free; /* nothing to free... */
         }
+
+        /* After every pass over the databases check if we are done. When
+         * the values are freed in background the memory computed above
+         * does not account for them, so we check the real memory usage
+         * instead. */
+        if (server.lazyfree_lazy_eviction &&
+            getMaxmemoryState(NULL,NULL,NULL) == C_OK) break;
+
+        /* Stop if we reached the time limit for this call: the remaining
+         * work is performed incrementally by the eviction time event. */
+        if (mem_freed < mem_tofree && ustime()-start > time_limit) {
+            latencyEndMonitor(latency);
+            latencyAddSampleIfNeeded("eviction-cycle",latency);
+            eviction_timed_out = 1;
+            startEvictionTimeProc();
+            return C_OK;
+        }
     }
     latencyEndMonitor(latency);
     latencyAddSampleIfNeeded("eviction-cycle",latency);
@@ -3640,11 +4169,15 @@ cant_free:
     /* We are here if we are not able to reclaim memory. There is only one
      * last thing we can try: check if the lazyfree thread has jobs in queue
      * and wait... */
+    latencyStartMonitor(latency);
+    lazyfreeFlushBatch();
     while(bioPendingJobsOfType(BIO_LAZY_FREE)) {
         if (((mem_reported - zmalloc_used_memory()) + mem_freed) >= mem_tofree)
             break;
         usleep(1000);
     }
+    latencyEndMonitor(latency);
+    latencyAddSampleIfNeeded("eviction-lazyfree",latency);
     return C_ERR;
 }
 
@@ -3836,12 +4369,34 @@ int checkForSentinelMode(int argc, char **argv) {
 void loadDataFromDisk(void) {
     long long start = ustime();
     if (server.aof_state == AOF_ON) {
-        if (loadAppendOnlyFile(server.aof_filename) == C_OK)
+        if (loadAppendOnlyFiles() == C_OK)
             serverLog(LL_NOTICE,"DB loaded from append only file: %.3f seconds",(float)(ustime()-start)/1000000);
     } else {
-        if (rdbLoad(server.rdb_filename) == C_OK) {
+        rdbSaveInfo rsi = RDB_SAVE_INFO_INIT;
+        if (rdbLoad(server.rdb_filename,&rsi) == C_OK) {
             serverLog(LL_NOTICE,"DB loaded from disk: %.3f seconds",
                 (float)(ustime()-start)/1000000);
+
+            /* Restore the replication ID / offset from the RDB file, so
+             * that a restarted slave can attempt a partial resynchronization
+             * with its master. */
+            if ((server.masterhost ||
+                (server.cluster_enabled &&
+                 nodeIsSlave(server.cluster->myself))) &&
+                rsi.repl_id_is_set &&
+                rsi.repl_offset != -1 &&
+                /* Note that older implementations may save a repl_stream_db
+                 * of -1 inside the RDB file in a wrong way. */
+                rsi.repl_stream_db != -1)
+            {
+                memcpy(server.replid,rsi.repl_id,sizeof(server.replid));
+                server.master_repl_offset = rsi.repl_offset;
+                /* If we are a slave, create a cached master from this
+                 * information, in order to allow partial resynchronizations
+                 * with masters. */
+                replicationCacheMasterUsingMyself();
+                selectDb(server.cached_master,rsi.repl_stream_db);
+            }
         } else if (errno != ENOENT) {
             serverLog(LL_WARNING,"Fatal error loading the DB: %s. Exiting.",strerror(errno));
             exit(1);
@@ -3968,7 +4523,7 @@ int redisIsSupervised(int mode) {
 
 
 int main(int argc, char **argv) {
-    struct timeval tv;
+    uint8_t hashseed[SIPHASH_KEY_LEN];
     int j;
 
 #ifdef REDIS_TEST
@@ -3991,6 +4546,8 @@ int main(int argc, char **argv) {
             return endianconvTest(argc, argv);
         } else if (!strcasecmp(argv[2], "crc64")) {
             return crc64Test(argc, argv);
+        } else if (!strcasecmp(argv[2], "siphash")) {
+            return siphashTest(argc, argv);
         }
 
         return -1; /* test not found */
@@ -4005,8 +4562,8 @@ int main(int argc, char **argv) {
     zmalloc_enable_thread_safeness();
     zmalloc_set_oom_handler(redisOutOfMemoryHandler);
     srand(time(NULL)^getpid());
-    gettimeofday(&tv,NULL);
-    dictSetHashFunctionSeed(tv.tv_sec^tv.tv_usec^getpid());
+    getRandomBytes(hashseed,sizeof(hashseed));
+    dictSetHashFunctionSeed(hashseed);
     server.sentinel_mode = checkForSentinelMode(argc,argv);
     initServerConfig();
     moduleInitModulesSystem();
@@ -69,6 +69,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #include "sha1.h"
 #include "endianconv.h"
 #include "crc64.h"
+#include "siphash.h"
 
 /* Error codes */
 #define C_OK                    0
@@ -85,6 +86,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_MAX_LINE    1024
 #define CRON_DBS_PER_CALL 16
 #define NET_MAX_WRITES_PER_EVENT (1024*64)
+#define NET_MAX_WRITEV_IOV 16 /* Max reply blocks sent in a single writev(). */
 #define PROTO_SHARED_SELECT_CMDS 10
 #define OBJ_SHARED_INTEGERS 10000
 #define OBJ_SHARED_BULKHDR_LEN 32
@@ -118,11 +120,13 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_DEFAULT_LOGFILE ""
 #define CONFIG_DEFAULT_SYSLOG_ENABLED 0
 #define CONFIG_DEFAULT_STOP_WRITES_ON_BGSAVE_ERROR 1
-#define CONFIG_DEFAULT_RDB_COMPRESSION 1
+#define CONFIG_DEFAULT_RDB_COMPRESSION RDB_COMPRESSION_LZF
 #define CONFIG_DEFAULT_RDB_CHECKSUM 1
+#define CONFIG_DEFAULT_RDB_FORKLESS_BGSAVE 0
 #define CONFIG_DEFAULT_RDB_FILENAME "dump.rdb"
 #define CONFIG_DEFAULT_REPL_DISKLESS_SYNC 0
 #define CONFIG_DEFAULT_REPL_DISKLESS_SYNC_DELAY 5
+#define CONFIG_DEFAULT_REPL_DISKLESS_LOAD REPL_DISKLESS_LOAD_DISABLED
 #define CONFIG_DEFAULT_SLAVE_SERVE_STALE_DATA 1
 #define CONFIG_DEFAULT_SLAVE_READ_ONLY 1
 #define CONFIG_DEFAULT_REPL_DISABLE_TCP_NODELAY 0
@@ -131,6 +135,12 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_DEFAULT_AOF_FILENAME "appendonly.aof"
 #define CONFIG_DEFAULT_AOF_NO_FSYNC_ON_REWRITE 0
 #define CONFIG_DEFAULT_AOF_LOAD_TRUNCATED 1
+#define CONFIG_DEFAULT_AOF_USE_RDB_PREAMBLE 0
+#define CONFIG_DEFAULT_AOF_WRITER_THREAD 0
+#define CONFIG_DEFAULT_AOF_MULTI_PART 0
+#define CONFIG_DEFAULT_AOF_LOAD_READER_THREAD 0
+#define CONFIG_DEFAULT_AOF_CHECKSUM 0
+#define CONFIG_DEFAULT_AOF_DIRNAME "appendonlydir"
 #define CONFIG_DEFAULT_ACTIVE_REHASHING 1
 #define CONFIG_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC 1
 #define CONFIG_DEFAULT_MIN_SLAVES_TO_WRITE 0
@@ -144,12 +154,31 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION 0
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE 0
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL 0
-
-#define ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP 20 /* Loopkups per loop. */
+#define CONFIG_DEFAULT_LAZYFREE_THREADS 1
+#define LAZYFREE_THREADS_MAX 16
+#define CONFIG_DEFAULT_IO_THREADS_NUM 1 /* Single threaded by default */
+#define CONFIG_DEFAULT_IO_THREADS_DO_READS 0 /* Read + parse from threads? */
+#define IO_THREADS_MAX_NUM 128
+#define CONFIG_DEFAULT_RDB_LOAD_THREADS 1 /* Load in the main thread. */
+#define RDB_LOAD_THREADS_MAX 64
+#define CONFIG_DEFAULT_ACTIVE_DEFRAG 0
+#define CONFIG_DEFAULT_DEFRAG_THRESHOLD_LOWER 10 /* Min fragmentation pct to start defrag */
+#define CONFIG_DEFAULT_DEFRAG_THRESHOLD_UPPER 100 /* Pct at which we use max effort */
+#define CONFIG_DEFAULT_DEFRAG_IGNORE_BYTES (100<<20) /* Don't defrag below 100mb of waste */
+#define CONFIG_DEFAULT_DEFRAG_CYCLE_MIN 25 /* 25% CPU min (at lower threshold) */
+#define CONFIG_DEFAULT_DEFRAG_CYCLE_MAX 75 /* 75% CPU max (at upper threshold) */
+
+/* Active expire cycle tuning, for the lowest effort. Every step of the
+ * active-expire-effort option increases the work done, see
+ * activeExpireCycle(). */
+#define ACTIVE_EXPIRE_CYCLE_KEYS_PER_LOOP 20 /* Keys sampled per DB loop. */
 #define ACTIVE_EXPIRE_CYCLE_FAST_DURATION 1000 /* Microseconds */
 #define ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC 25 /* CPU max % for keys collection */
+#define ACTIVE_EXPIRE_CYCLE_ACCEPTABLE_STALE 10 /* % of stale keys we tolerate. */
+#define ACTIVE_EXPIRE_CYCLE_MEMORY_PRESSURE 90 /* % of maxmemory for max effort. */
 #define ACTIVE_EXPIRE_CYCLE_SLOW 0
 #define ACTIVE_EXPIRE_CYCLE_FAST 1
+#define CONFIG_DEFAULT_ACTIVE_EXPIRE_EFFORT 1 /* From 1 to 10. */
 
 /* Instantaneous metrics tracking. */
 #define STATS_METRIC_SAMPLES 16     /* Number of samples per metric. */
@@ -162,10 +191,16 @@ typedef long long mstime_t; /* millisecond time type. */
 #define PROTO_MAX_QUERYBUF_LEN  (1024*1024*1024) /* 1GB max query buffer. */
 #define PROTO_IOBUF_LEN         (1024*16)  /* Generic I/O buffer size */
 #define PROTO_REPLY_CHUNK_BYTES (16*1024) /* 16k output buffer */
+#define PROTO_REPLY_ZERO_COPY_BYTES (16*1024) /* Min bulk sent without copy */
+#define PROTO_REPLY_POOL_BLOCKS 128 /* Max free reply blocks kept for reuse */
 #define PROTO_INLINE_MAX_SIZE   (1024*64) /* Max size of inline reads */
 #define PROTO_MBULK_BIG_ARG     (1024*32)
 #define LONG_STR_SIZE      21          /* Bytes needed for long -> str */
 #define AOF_AUTOSYNC_BYTES (1024*1024*32) /* fdatasync every 32MB */
+#define AOF_READ_DIFF_INTERVAL_BYTES (1024*10) /* Read parent diff every 10KB */
+#define AOF_CHECKSUM_SEGMENT_BYTES (1024*64) /* Checksum trailer every 64KB */
+#define AOF_CHECKSUM_PREFIX "#CRC64:"
+#define AOF_CHECKSUM_PREFIX_LEN 7
 
 /* When configuring the server eventloop, we setup it so that the total number
  * of file descriptors we can handle are server.maxclients + RESERVED_FDS +
@@ -199,10 +234,11 @@ typedef long long mstime_t; /* millisecond time type. */
  * keys requires a lot of space, so we check the most significant 2 bits of
  * the first byte to interpreter the length:
  *
- * 00|000000 => if the two MSB are 00 the len is the 6 bits of this byte
- * 01|000000 00000000 =>  01, the len is 14 byes, 6 bits + 8 bits of next byte
- * 10|000000 [32 bit integer] => if it's 10, a full 32 bit len will follow
- * 11|000000 this means: specially encoded object will follow. The six bits
+ * 00|XXXXXX => if the two MSB are 00 the len is the 6 bits of this byte
+ * 01|XXXXXX XXXXXXXX =>  01, the len is 14 byes, 6 bits + 8 bits of next byte
+ * 10|000000 [32 bit integer] => A full 32 bit len in net byte order will follow
+ * 10|000001 [64 bit integer] => A full 64 bit len in net byte order will follow
+ * 11|OBKIND this means: specially encoded object will follow. The six bits
  *           number specify the kind of object that follows.
  *           See the RDB_ENC_* defines.
  *
@@ -210,9 +246,10 @@ typedef long long mstime_t; /* millisecond time type. */
  * values, will fit inside. */
 #define RDB_6BITLEN 0
 #define RDB_14BITLEN 1
-#define RDB_32BITLEN 2
+#define RDB_32BITLEN 0x80
+#define RDB_64BITLEN 0x81
 #define RDB_ENCVAL 3
-#define RDB_LENERR UINT_MAX
+#define RDB_LENERR UINT64_MAX
 
 /* When a length of a string object stored on disk has the first two bits
  * set, the remaining two bits specify a special encoding for the object
@@ -227,6 +264,10 @@ typedef long long mstime_t; /* millisecond time type. */
 #define AOF_ON 1              /* AOF is on */
 #define AOF_WAIT_REWRITE 2    /* AOF waits rewrite to start appending */
 
+/* Multi part AOF file types, as stored in the manifest. */
+#define AOF_FILE_TYPE_BASE 'b' /* Output of the latest rewrite. */
+#define AOF_FILE_TYPE_INCR 'i' /* Commands executed after the rewrite. */
+
 /* Client flags */
 #define CLIENT_SLAVE (1<<0)   /* This client is a slave server */
 #define CLIENT_MASTER (1<<1)  /* This client is a master server */
@@ -259,6 +300,15 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CLIENT_LUA_DEBUG (1<<25)  /* Run EVAL in debug mode. */
 #define CLIENT_LUA_DEBUG_SYNC (1<<26)  /* EVAL debugging without fork() */
 #define CLIENT_MODULE (1<<27) /* Non connected client used by some module. */
+#define CLIENT_PENDING_READ (1<<28) /* The client has pending reads and was put
+                                       in the list of clients we can read
+                                       from. */
+#define CLIENT_PENDING_COMMAND (1<<29) /* Used in threaded I/O to signal after
+                                          we return single threaded that the
+                                          client has already pending commands
+                                          to be executed. */
+#define CLIENT_PENDING_AOF_FSYNC (1<<30) /* The reply waits for the AOF writer
+                                            thread to fsync the AOF. */
 
 /* Client block type (btype field in client structure)
  * if CLIENT_BLOCKED flag is set. */
@@ -311,6 +361,7 @@ typedef long long mstime_t; /* millisecond time type. */
 /* Slave capabilities. */
 #define SLAVE_CAPA_NONE 0
 #define SLAVE_CAPA_EOF (1<<0)   /* Can parse the RDB EOF streaming format. */
+#define SLAVE_CAPA_PSYNC2 (1<<1) /* Supports PSYNC2 protocol. */
 
 /* Synchronous read timeout - slave side */
 #define CONFIG_REPL_SYNCIO_TIMEOUT 5
@@ -367,15 +418,44 @@ typedef long long mstime_t; /* millisecond time type. */
 #define SET_OP_DIFF 1
 #define SET_OP_INTER 2
 
-/* Redis maxmemory strategies */
-#define MAXMEMORY_VOLATILE_LRU 0
-#define MAXMEMORY_VOLATILE_TTL 1
-#define MAXMEMORY_VOLATILE_RANDOM 2
-#define MAXMEMORY_ALLKEYS_LRU 3
-#define MAXMEMORY_ALLKEYS_RANDOM 4
-#define MAXMEMORY_NO_EVICTION 5
+/* Redis maxmemory strategies. Instead of using just incremental number
+ * for this defines, we use a set of flags so that testing for certain
+ * properties common to multiple policies is faster. */
+#define MAXMEMORY_FLAG_LRU (1<<0)
+#define MAXMEMORY_FLAG_LFU (1<<1)
+#define MAXMEMORY_FLAG_ALLKEYS (1<<2)
+#define MAXMEMORY_FLAG_NO_SHARED_INTEGERS \
+    (MAXMEMORY_FLAG_LRU|MAXMEMORY_FLAG_LFU)
+
+#define MAXMEMORY_VOLATILE_LRU ((0<<8)|MAXMEMORY_FLAG_LRU)
+#define MAXMEMORY_VOLATILE_LFU ((1<<8)|MAXMEMORY_FLAG_LFU)
+#define MAXMEMORY_VOLATILE_TTL (2<<8)
+#define MAXMEMORY_VOLATILE_RANDOM (3<<8)
+#define MAXMEMORY_ALLKEYS_LRU ((4<<8)|MAXMEMORY_FLAG_LRU|MAXMEMORY_FLAG_ALLKEYS)
+#define MAXMEMORY_ALLKEYS_LFU ((5<<8)|MAXMEMORY_FLAG_LFU|MAXMEMORY_FLAG_ALLKEYS)
+#define MAXMEMORY_ALLKEYS_RANDOM ((6<<8)|MAXMEMORY_FLAG_ALLKEYS)
+#define MAXMEMORY_NO_EVICTION (7<<8)
 #define CONFIG_DEFAULT_MAXMEMORY_POLICY MAXMEMORY_NO_EVICTION
 
+/* LFU (Least Frequently Used) eviction. When an LFU policy is selected
+ * the 24 bits of robj->lru are split into two fields:
+ *
+ *          16 bits      8 bits
+ *     +----------------+--------+
+ *     + Last decr time | LOG_C  |
+ *     +----------------+--------+
+ *
+ * LOG_C is a logarithmic access counter, incremented with a probability
+ * that decreases as the counter grows (see lfu-log-factor). The last
+ * decrement time is a timestamp in minutes (least significant 16 bits):
+ * the counter is decremented by one for every lfu-decay-time minutes
+ * elapsed since this time. New objects start with LFU_INIT_VAL so that they
+ * have a chance to accumulate hits before being evicted. */
+#define LFU_INIT_VAL 5
+#define CONFIG_DEFAULT_LFU_LOG_FACTOR 10
+#define CONFIG_DEFAULT_LFU_DECAY_TIME 1
+#define CONFIG_DEFAULT_MAXMEMORY_EVICTION_TENACITY 10 /* 500 usec per call */
+
 /* Scripting */
 #define LUA_SCRIPT_TIME_LIMIT 5000 /* milliseconds */
 
@@ -408,6 +488,17 @@ typedef long long mstime_t; /* millisecond time type. */
 #define RDB_CHILD_TYPE_DISK 1     /* RDB is written to disk. */
 #define RDB_CHILD_TYPE_SOCKET 2   /* RDB is written to slave socket. */
 
+/* RDB string compression codecs, see the rdbcompression option. */
+#define RDB_COMPRESSION_NONE 0
+#define RDB_COMPRESSION_LZF 1
+#define RDB_COMPRESSION_ZSTD_FAST 2 /* zstd tuned for speed. */
+#define RDB_COMPRESSION_ZSTD 3      /* zstd tuned for ratio. */
+
+/* Slave RDB loading modes, see the repl-diskless-load option. */
+#define REPL_DISKLESS_LOAD_DISABLED 0   /* Store the RDB on disk, then load. */
+#define REPL_DISKLESS_LOAD_WHEN_DB_EMPTY 1 /* Load from socket if no data. */
+#define REPL_DISKLESS_LOAD_SWAPDB 2     /* Load from socket in side DBs. */
+
 /* Keyspace changes notification classes. Every class is associated with a
  * character for configuration purposes. */
 #define NOTIFY_KEYSPACE (1<<0)    /* K */
@@ -517,6 +608,8 @@ typedef struct redisDb {
     struct evictionPoolEntry *eviction_pool;    /* Eviction pool of keys */
     int id;                     /* Database ID */
     long long avg_ttl;          /* Average TTL, just for stats */
+    unsigned long expires_cursor; /* Active expire cycle dictScan() cursor. */
+    double expired_stale_perc;  /* Estimated % of expired keys in 'expires'. */
 } redisDb;
 
 /* Client MULTI/EXEC state */
@@ -567,6 +660,21 @@ typedef struct readyList {
     robj *key;
 } readyList;
 
+/* The client reply list is composed of blocks. Most of them are buffers the
+ * protocol is copied into, while big bulk values are not copied at all: the
+ * block just holds a reference to the string object, that is written to the
+ * socket straight from its own sds buffer. */
+typedef struct clientReplyBlock {
+    size_t size, used;      /* Allocated and used bytes of 'buf', or size 0
+                               and the object length when 'obj' is set. */
+    robj *obj;              /* Referenced string object, or NULL. */
+    char buf[];
+} clientReplyBlock;
+
+#define replyBlockData(b) ((b)->obj ? (char*)(b)->obj->ptr : (b)->buf)
+/* Bytes accounted in client->reply_bytes for the block. */
+#define replyBlockBytes(b) ((b)->obj ? (b)->used : (b)->size)
+
 /* With multiplexing we need to take per-client state.
  * Clients are taken in a linked list. */
 typedef struct client {
@@ -575,6 +683,9 @@ typedef struct client {
     redisDb *db;            /* Pointer to currently SELECTed DB. */
     robj *name;             /* As set by CLIENT SETNAME. */
     sds querybuf;           /* Buffer we use to accumulate client queries. */
+    sds pending_querybuf;   /* If this is a master, this buffer represents the
+                               yet not applied replication stream that we
+                               are receiving from the master. */
     size_t querybuf_peak;   /* Recent (100ms or more) peak of querybuf size. */
     int argc;               /* Num of arguments of current command. */
     robj **argv;            /* Arguments of current command. */
@@ -582,8 +693,10 @@ typedef struct client {
     int reqtype;            /* Request protocol type: PROTO_REQ_* */
     int multibulklen;       /* Number of multi bulk arguments left to read. */
     long bulklen;           /* Length of bulk argument in multi bulk request. */
-    list *reply;            /* List of reply objects to send to the client. */
-    unsigned long long reply_bytes; /* Tot bytes of objects in reply list. */
+    list *reply;            /* List of clientReplyBlock to send to the client. */
+    unsigned long long reply_bytes; /* Tot bytes of blocks in reply list. */
+    unsigned long long reply_obj_bytes; /* Part of reply_bytes referenced by
+                                           blocks from objects. */
     size_t sentlen;         /* Amount of bytes already sent in the current
                                buffer or object being sent. */
     time_t ctime;           /* Client creation time. */
@@ -597,19 +710,21 @@ typedef struct client {
     off_t repldboff;        /* Replication DB file offset. */
     off_t repldbsize;       /* Replication DB file size. */
     sds replpreamble;       /* Replication DB preamble. */
-    long long reploff;      /* Replication offset if this is our master. */
+    long long read_reploff; /* Read replication offset if this is a master. */
+    long long reploff;      /* Applied replication offset if this is a master. */
     long long repl_ack_off; /* Replication ack offset, if this is a slave. */
     long long repl_ack_time;/* Replication ack time, if this is a slave. */
     long long psync_initial_offset; /* FULLRESYNC reply offset other slaves
                                        copying this slave output buffer
                                        should use. */
-    char replrunid[CONFIG_RUN_ID_SIZE+1]; /* Master run id if is a master. */
+    char replid[CONFIG_RUN_ID_SIZE+1]; /* Master replication ID (if master). */
     int slave_listening_port; /* As configured with: SLAVECONF listening-port */
     int slave_capa;         /* Slave capabilities: SLAVE_CAPA_* bitwise OR. */
     multiState mstate;      /* MULTI/EXEC state */
     int btype;              /* Type of blocking op if CLIENT_BLOCKED. */
     blockingState bpop;     /* blocking state */
     long long woff;         /* Last write global replication offset. */
+    long long aof_wait_offset; /* AOF offset to fsync before replying. */
     list *watched_keys;     /* Keys WATCHED for MULTI/EXEC CAS */
     dict *pubsub_channels;  /* channels a client is interested in (SUBSCRIBE) */
     list *pubsub_patterns;  /* patterns a client is interested in (SUBSCRIBE) */
@@ -671,6 +786,52 @@ typedef struct clientBufferLimitsConfig {
 
 extern clientBufferLimitsConfig clientBufferLimitsDefaults[CLIENT_TYPE_OBUF_COUNT];
 
+/* This structure can be optionally passed to RDB save/load functions in
+ * order to implement additional functionalities, by storing and loading
+ * metadata to the RDB file.
+ *
+ * Currently the only use is to select a DB at load time, useful in
+ * replication in order to make sure that chained slaves (slaves of slaves)
+ * select the correct DB and are able to accept the stream coming from the
+ * top-level master. */
+typedef struct rdbSaveInfo {
+    /* Used saving and loading. */
+    int repl_stream_db;  /* DB to select in server.master client. */
+
+    /* Used only loading. */
+    int repl_id_is_set;  /* True if repl_id field is set. */
+    char repl_id[CONFIG_RUN_ID_SIZE+1];     /* Replication ID. */
+    long long repl_offset;                  /* Replication offset. */
+} rdbSaveInfo;
+
+#define RDB_SAVE_INFO_INIT {-1,0,"0000000000000000000000000000000000000000",-1}
+
+/* Memory overhead breakdown, as computed by getMemoryOverheadData() and
+ * reported by MEMORY STATS and MEMORY DOCTOR. */
+struct redisMemOverhead {
+    size_t peak_allocated;
+    size_t total_allocated;
+    size_t startup_allocated;
+    size_t repl_backlog;
+    size_t clients_slaves;
+    size_t clients_normal;
+    size_t aof_buffer;
+    size_t lua_caches;
+    size_t overhead_total;
+    size_t dataset;
+    size_t total_keys;
+    size_t bytes_per_key;
+    float dataset_perc;
+    float peak_perc;
+    float fragmentation;
+    size_t num_dbs;
+    struct {
+        size_t dbid;
+        size_t overhead_ht_main;
+        size_t overhead_ht_expires;
+    } *db;
+};
+
 /* The redisOp structure defines a Redis Operation, that is an instance of
  * a command with an argument vector, database ID, propagation target
  * (PROPAGATE_*), and command pointer.
@@ -695,6 +856,21 @@ typedef struct redisOpArray {
     int numops;
 } redisOpArray;
 
+/* A multi part AOF is made of a BASE file and a list of INCR files, stored
+ * in the AOF directory and listed in the manifest. See aof.c. */
+typedef struct aofFile {
+    sds name;                       /* File name, relative to the AOF dir. */
+    long long seq;                  /* Sequence number of the file. */
+    int type;                       /* AOF_FILE_TYPE_(BASE|INCR) */
+} aofFile;
+
+typedef struct aofManifest {
+    aofFile *base;                  /* BASE file, or NULL if none yet. */
+    list *incr_list;                /* INCR files, in replay order. */
+    long long curr_base_seq;        /* Latest BASE sequence number used. */
+    long long curr_incr_seq;        /* Latest INCR sequence number used. */
+} aofManifest;
+
 /*-----------------------------------------------------------------------------
  * Global server state
  *----------------------------------------------------------------------------*/
@@ -721,6 +897,7 @@ struct redisServer {
     unsigned lruclock:LRU_BITS; /* Clock for LRU eviction */
     int shutdown_asap;          /* SHUTDOWN needed ASAP */
     int activerehashing;        /* Incremental rehash in serverCron() */
+    int active_defrag_running;  /* Active defragmentation running (holds current scan aggressiveness) */
     char *requirepass;          /* Pass for AUTH command, or NULL */
     char *pidfile;              /* PID file path */
     int arch_bits;              /* 32 or 64 depending on sizeof(long) */
@@ -745,6 +922,8 @@ struct redisServer {
     list *clients;              /* List of active clients */
     list *clients_to_close;     /* Clients to close asynchronously */
     list *clients_pending_write; /* There is to write or install handler. */
+    list *clients_waiting_aof;   /* Replies waiting for the AOF fsync. */
+    list *clients_pending_read;  /* Client has pending read socket buffers. */
     list *slaves, *monitors;    /* List of slaves and MONITORs */
     client *current_client; /* Current client, only used on crash report */
     int clients_paused;         /* True if clients are currently paused */
@@ -753,10 +932,19 @@ struct redisServer {
     dict *migrate_cached_sockets;/* MIGRATE cached sockets */
     uint64_t next_client_id;    /* Next client unique ID. Incremental. */
     int protected_mode;         /* Don't accept external connections. */
+    /* Threaded I/O */
+    int io_threads_num;         /* Number of IO threads to use. */
+    int io_threads_do_reads;    /* Read and parse from IO threads? */
+    int io_threads_active;      /* Is IO threads currently active? */
+    int rdb_load_threads;       /* Threads used to load RDB files. */
     /* RDB / AOF loading information */
     int loading;                /* We are loading data from disk if true */
+    int async_loading;          /* Loading in side DBs while serving reads
+                                   from the old data set. */
     off_t loading_total_bytes;
     off_t loading_loaded_bytes;
+    long long loading_read_keys;  /* Keys read from the file. */
+    long long loading_loaded_keys; /* Keys added to the keyspace. */
     time_t loading_start_time;
     off_t loading_process_events_interval_bytes;
     /* Fast pointers to often looked up command */
@@ -767,10 +955,14 @@ struct redisServer {
     long long stat_numcommands;     /* Number of processed commands */
     long long stat_numconnections;  /* Number of connections received */
     long long stat_expiredkeys;     /* Number of expired keys */
+    double stat_expired_stale_perc; /* Estimated % of logically expired keys */
+    long long stat_expired_time_cap_reached_count; /* Early expire cycle stops. */
+    long long stat_expire_cycle_time_used; /* Microseconds of active expire. */
     long long stat_evictedkeys;     /* Number of evicted keys (maxmemory) */
     long long stat_keyspace_hits;   /* Number of successful lookups of keys */
     long long stat_keyspace_misses; /* Number of failed lookups of keys */
     size_t stat_peak_memory;        /* Max used memory record */
+    size_t initial_memory_usage;    /* Bytes used after initialization. */
     long long stat_fork_time;       /* Time needed to perform latest fork() */
     double stat_fork_rate;          /* Fork rate in GB/sec. */
     long long stat_rejected_conn;   /* Clients rejected because of maxclients */
@@ -784,6 +976,13 @@ struct redisServer {
     size_t resident_set_size;       /* RSS sampled in serverCron(). */
     long long stat_net_input_bytes; /* Bytes read from network. */
     long long stat_net_output_bytes; /* Bytes written to network. */
+    long long stat_io_reads_processed; /* Number of read events processed by IO threads */
+    long long stat_io_writes_processed; /* Number of write events processed by IO threads */
+    long long stat_aof_group_commit_clients; /* Replies released by AOF fsyncs */
+    long long stat_active_defrag_hits;      /* Number of allocations moved */
+    long long stat_active_defrag_misses;    /* Number of allocations scanned but not moved */
+    long long stat_active_defrag_key_hits;  /* Number of keys with moved allocations */
+    long long stat_active_defrag_key_misses;/* Number of keys scanned and not moved */
     /* The following two are used to track instantaneous metrics, like
      * number of operations per second, network traffic. */
     struct {
@@ -797,6 +996,13 @@ struct redisServer {
     int maxidletime;                /* Client timeout in seconds */
     int tcpkeepalive;               /* Set SO_KEEPALIVE if non-zero. */
     int active_expire_enabled;      /* Can be disabled for testing purposes. */
+    int active_expire_effort;       /* From 1 (default) to 10, active effort. */
+    int active_defrag_enabled;
+    long long active_defrag_ignore_bytes; /* Minimum amount of fragmentation waste to start active defrag */
+    int active_defrag_threshold_lower; /* Minimum percentage of fragmentation to start active defrag */
+    int active_defrag_threshold_upper; /* Maximum percentage of fragmentation at which we use maximum effort */
+    int active_defrag_cycle_min;       /* Minimal effort for defrag in CPU percentage */
+    int active_defrag_cycle_max;       /* Maximal effort for defrag in CPU percentage */
     size_t client_max_querybuf_len; /* Limit for client query buffer length */
     int dbnum;                      /* Total number of configured DBs */
     int supervised;                 /* 1 if supervised, 0 otherwise. */
@@ -828,6 +1034,19 @@ struct redisServer {
     int aof_last_write_status;      /* C_OK or C_ERR */
     int aof_last_write_errno;       /* Valid if aof_last_write_status is ERR */
     int aof_load_truncated;         /* Don't stop on unexpected AOF EOF. */
+    int aof_use_rdb_preamble;       /* Use RDB preamble on AOF rewrites. */
+    int aof_writer_thread;          /* Write and fsync the AOF in a thread. */
+    long long aof_enqueued_offset;  /* AOF bytes handed to the writer thread. */
+    long long aof_durable_offset;   /* AOF bytes the writer made durable. */
+    int aof_multi_part;             /* Use a BASE file plus INCR files. */
+    char *aof_dirname;              /* Directory of the multi part AOF. */
+    aofManifest *aof_manifest;      /* Files making the multi part AOF. */
+    long long aof_rewrite_incr_seq; /* First INCR file not in the rewrite. */
+    int aof_rewrite_base_rdb;       /* Rewrite in progress writes RDB. */
+    uint64_t aof_segment_crc;       /* CRC64 of the open AOF segment. */
+    size_t aof_segment_bytes;       /* Length of the open AOF segment. */
+    int aof_load_reader_thread;     /* Parse the AOF in a thread on load. */
+    int aof_checksum;               /* Append checksum trailers to the AOF. */
     /* AOF pipes used to communicate between parent and child during rewrite. */
     int aof_pipe_write_data_to_child;
     int aof_pipe_read_data_from_parent;
@@ -837,6 +1056,8 @@ struct redisServer {
     int aof_pipe_read_ack_from_parent;
     int aof_stop_sending_diff;     /* If true stop sending accumulated diffs
                                       to child process. */
+    uint64_t aof_child_diff_crc;    /* CRC64 of the diff sent to the child. */
+    size_t aof_child_diff_bytes;    /* Length of the diff sent to the child. */
     sds aof_child_diff;             /* AOF diff accumulator child side. */
     /* RDB persistence */
     long long dirty;                /* Changes to DB from the last save */
@@ -845,8 +1066,12 @@ struct redisServer {
     struct saveparam *saveparams;   /* Save points array for RDB */
     int saveparamslen;              /* Number of saving points */
     char *rdb_filename;             /* Name of RDB file */
-    int rdb_compression;            /* Use compression in RDB? */
+    int rdb_compression;            /* RDB_COMPRESSION_* codec to use. */
     int rdb_checksum;               /* Use RDB checksum? */
+    int rdb_forkless_bgsave;        /* BGSAVE without fork(), see snapshot.c */
+    struct snapshot *rdb_snapshot;  /* Fork-less BGSAVE in progress, or NULL */
+    long long stat_rdb_saved_on_write; /* Keys saved by fork-less BGSAVEs
+                                          before being modified. */
     time_t lastsave;                /* Unix time of last successful save */
     time_t lastbgsave_try;          /* Unix time of last attempted bgsave */
     time_t rdb_save_time_last;      /* Time used by last RDB save run. */
@@ -864,8 +1089,11 @@ struct redisServer {
     char *syslog_ident;             /* Syslog ident */
     int syslog_facility;            /* Syslog facility */
     /* Replication (master) */
+    char replid[CONFIG_RUN_ID_SIZE+1];  /* My current replication ID. */
+    char replid2[CONFIG_RUN_ID_SIZE+1]; /* replid inherited from master. */
+    long long master_repl_offset;   /* My current replication offset */
+    long long second_replid_offset; /* Accept offsets up to this for replid2. */
     int slaveseldb;                 /* Last SELECTed DB in replication output */
-    long long master_repl_offset;   /* Global replication offset */
     int repl_ping_slave_period;     /* Master pings the slave every N seconds */
     char *repl_backlog;             /* Replication backlog for partial syncs */
     long long repl_backlog_size;    /* Backlog circular buffer size */
@@ -882,6 +1110,8 @@ struct redisServer {
     int repl_good_slaves_count;     /* Number of slaves with lag <= max_lag. */
     int repl_diskless_sync;         /* Send RDB to slaves sockets directly. */
     int repl_diskless_sync_delay;   /* Delay to start a diskless repl BGSAVE. */
+    int repl_diskless_load;         /* Slave RDB loading mode, see the
+                                       REPL_DISKLESS_LOAD_* defines. */
     /* Replication (slave) */
     char *masterauth;               /* AUTH with this password with master */
     char *masterhost;               /* Hostname of master */
@@ -897,14 +1127,18 @@ struct redisServer {
     int repl_transfer_s;     /* Slave -> Master SYNC socket */
     int repl_transfer_fd;    /* Slave -> Master SYNC temp file descriptor */
     char *repl_transfer_tmpfile; /* Slave-> master SYNC temp file name */
+    int repl_transfer_diskless; /* Load the SYNC payload from the socket. */
     time_t repl_transfer_lastio; /* Unix time of the latest read, for timeout */
     int repl_serve_stale_data; /* Serve stale data when link is down? */
     int repl_slave_ro;          /* Slave is read only? */
     time_t repl_down_since; /* Unix time at which link with master went down */
     int repl_disable_tcp_nodelay;   /* Disable TCP_NODELAY after SYNC? */
     int slave_priority;             /* Reported in INFO and used by Sentinel. */
-    char repl_master_runid[CONFIG_RUN_ID_SIZE+1];  /* Master run id for PSYNC. */
-    long long repl_master_initial_offset;         /* Master PSYNC offset. */
+    /* The following two fields is where we store master PSYNC replid/offset
+     * while the PSYNC is in progress. At the end we'll copy the fields into
+     * the server->master client structure. */
+    char master_replid[CONFIG_RUN_ID_SIZE+1];  /* Master PSYNC runid. */
+    long long master_initial_offset;           /* Master PSYNC offset. */
     int repl_slave_lazy_flush;          /* Lazy FLUSHALL before loading DB? */
     /* Replication script cache. */
     dict *repl_scriptcache_dict;        /* SHA1 all slaves are aware of. */
@@ -918,6 +1152,9 @@ struct redisServer {
     unsigned long long maxmemory;   /* Max number of memory bytes to use */
     int maxmemory_policy;           /* Policy for key eviction */
     int maxmemory_samples;          /* Pricision of random sampling */
+    int lfu_log_factor;             /* LFU logarithmic counter factor. */
+    int lfu_decay_time;             /* LFU counter decay factor. */
+    int maxmemory_eviction_tenacity;/* Aggressiveness of eviction processing */
     /* Blocked clients */
     unsigned int bpop_blocked_clients; /* Number of clients blocked by lists */
     list *unblocked_clients; /* list of clients to unblock before next loop */
@@ -980,6 +1217,7 @@ struct redisServer {
     int lazyfree_lazy_eviction;
     int lazyfree_lazy_expire;
     int lazyfree_lazy_server_del;
+    int lazyfree_threads;           /* Number of lazy free bio.c workers. */
     /* Latency monitor */
     long long latency_monitor_threshold;
     dict *latency_events;
@@ -1090,7 +1328,9 @@ extern double R_Zero, R_PosInf, R_NegInf, R_Nan;
 extern dictType hashDictType;
 extern dictType replScriptCacheDictType;
 extern dictType keyptrDictType;
+extern dictType keylistDictType;
 extern dictType modulesDictType;
+extern pthread_mutex_t net_stats_mutex;
 
 /*-----------------------------------------------------------------------------
  * Functions prototypes
@@ -1106,6 +1346,7 @@ int *moduleGetCommandKeysViaAPI(struct redisCommand *cmd, robj **argv, int argc,
 long long ustime(void);
 long long mstime(void);
 void getRandomHexChars(char *p, unsigned int len);
+void getRandomBytes(unsigned char *p, size_t len);
 uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l);
 void exitFromChild(int retcode);
 size_t redisPopcount(void *s, long count);
@@ -1121,6 +1362,8 @@ void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask);
 void *addDeferredMultiBulkLength(client *c);
 void setDeferredMultiBulkLength(client *c, void *node, long length);
 void processInputBuffer(client *c);
+void processInputBufferAndReplicate(client *c);
+size_t sdsZmallocSize(sds s);
 void acceptHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void acceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask);
@@ -1128,6 +1371,7 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask);
 void addReplyBulk(client *c, robj *obj);
 void addReplyBulkCString(client *c, const char *s);
 void addReplyBulkCBuffer(client *c, const void *p, size_t len);
+void addReplyString(client *c, const char *s, size_t len);
 void addReplyBulkLongLong(client *c, long long ll);
 void addReply(client *c, robj *obj);
 void addReplySds(client *c, sds s);
@@ -1140,6 +1384,8 @@ void addReplyLongLong(client *c, long long ll);
 void addReplyMultiBulkLen(client *c, long length);
 void copyClientOutputBuffer(client *dst, client *src);
 void *dupClientReplyValue(void *o);
+void freeClientReplyValue(void *o);
+void copyObjectReplyBlocks(void);
 void getClientsMaxBuffers(unsigned long *longest_output_list,
                           unsigned long *biggest_input_buffer);
 void formatPeerId(char *peerid, size_t peerid_len, char *ip, int port);
@@ -1162,6 +1408,11 @@ void pauseClients(mstime_t duration);
 int clientsArePaused(void);
 int processEventsWhileBlocked(void);
 int handleClientsWithPendingWrites(void);
+int handleClientsWithPendingWritesUsingThreads(void);
+int handleClientsWithPendingReadsUsingThreads(void);
+int stopThreadedIOIfNeeded(void);
+void initThreadedIO(void);
+void killIOThreads(void);
 int clientHasPendingReplies(client *c);
 void unlinkClient(client *c);
 int writeToClient(int fd, client *c, int handler_installed);
@@ -1248,15 +1499,21 @@ int compareStringObjects(robj *a, robj *b);
 int collateStringObjects(robj *a, robj *b);
 int equalStringObjects(robj *a, robj *b);
 unsigned long long estimateObjectIdleTime(robj *o);
+int objectSetLRUOrLFU(robj *val, long long lfu_freq, long long lru_idle);
+size_t objectComputeSize(robj *o, size_t sample_size);
+struct redisMemOverhead *getMemoryOverheadData(void);
+void freeMemoryOverheadData(struct redisMemOverhead *mh);
 #define sdsEncodedObject(objptr) (objptr->encoding == OBJ_ENCODING_RAW || objptr->encoding == OBJ_ENCODING_EMBSTR)
 
 /* Synchronous I/O with timeout */
 ssize_t syncWrite(int fd, char *ptr, ssize_t size, long long timeout);
 ssize_t syncRead(int fd, char *ptr, ssize_t size, long long timeout);
+ssize_t syncReadSome(int fd, char *ptr, ssize_t size, long long timeout);
 ssize_t syncReadLine(int fd, char *ptr, ssize_t size, long long timeout);
 
 /* Replication */
 void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc);
+void replicationFeedSlavesFromMasterStream(list *slaves, char *buf, size_t buflen);
 void replicationFeedMonitors(client *c, list *monitors, int dictid, robj **argv, int argc);
 void updateSlavesWaitingBgsave(int bgsaveerr, int type);
 void replicationCron(void);
@@ -1278,21 +1535,59 @@ long long replicationGetSlaveOffset(void);
 char *replicationGetSlaveName(client *c);
 long long getPsyncInitialOffset(void);
 int replicationSetupSlaveForFullResync(client *slave, long long offset);
+void changeReplicationId(void);
+void clearReplicationId2(void);
+void replicationCacheMasterUsingMyself(void);
+void feedReplicationBacklog(void *ptr, size_t len);
 
 /* Generic persistence functions */
-void startLoading(FILE *fp);
+void startLoading(size_t size);
+void startLoadingFile(FILE *fp);
 void loadingProgress(off_t pos);
 void stopLoading(void);
 
 /* RDB persistence */
 #include "rdb.h"
 
+/* Fork-less BGSAVE */
+int snapshotStart(char *filename, rdbSaveInfo *rsi);
+void snapshotAbort(void);
+void snapshotKeyWillChange(redisDb *db, sds key);
+void snapshotKeyAdded(redisDb *db, sds key);
+void snapshotDetachDb(redisDb *db);
+
 /* AOF persistence */
 void flushAppendOnlyFile(int force);
 void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc);
 void aofRemoveTempFile(pid_t childpid);
 int rewriteAppendOnlyFileBackground(void);
+ssize_t aofReadDiffFromParent(void);
+void aofWriterInit(void);
+void aofWriterEnqueue(void);
+void aofWriterDrain(void);
+void aofWriterSkip(size_t len);
+void aofWriterCollect(void);
+void aofWriterNotifyReadable(aeEventLoop *el, int fd, void *privdata, int mask);
+void aofWriterSetPaused(int paused);
+void aofUpdateClientWaitOffset(client *c);
+void aofParkClient(client *c);
+void aofParkClientsWaitingFsync(void);
+void aofReleaseClientsWaitingFsync(void);
+sds genAofWriterInfoString(sds info);
 int loadAppendOnlyFile(char *filename);
+int loadAppendOnlyFiles(void);
+sds catAofChecksumTrailer(sds buf, uint64_t crc);
+int parseAofChecksumTrailer(const char *line, size_t len, uint64_t *crc);
+void aofChecksumSeal(void);
+aofManifest *aofManifestCreate(void);
+void aofManifestFree(aofManifest *am);
+sds aofFilePath(const char *name);
+void aofLoadManifestFromDisk(void);
+int aofPersistManifest(aofManifest *am);
+int aofRotateIncrFile(void);
+void aofOpenIfNeededOnServerStart(void);
+void aofMultiPartUpdateSizes(void);
+int aofMultiPartRewriteDone(char *tmpfile);
 void stopAppendOnly(void);
 int startAppendOnly(void);
 void backgroundRewriteDoneHandler(int exitcode, int bysignal);
@@ -1364,6 +1659,11 @@ int zslLexValueLteMax(sds value, zlexrangespec *spec);
 
 /* Core functions */
 int freeMemoryIfNeeded(void);
+unsigned long LFUGetTimeInMinutes(void);
+uint8_t LFULogIncr(uint8_t value);
+unsigned long LFUDecrAndReturn(robj *o);
+void updateLFU(robj *val);
+void activeDefragCycle(void);
 int processCommand(client *c);
 void setupSignalHandlers(void);
 struct redisCommand *lookupCommand(sds name);
@@ -1388,6 +1688,7 @@ void serverLogFromHandler(int level, const char *msg);
 void usage(void);
 void updateDictResizePolicy(void);
 int htNeedsResize(dict *dict);
+size_t dictEntryMetadataSize(dict *d);
 void oom(const char *msg);
 void populateCommandTable(void);
 void resetCommandTableStats(void);
@@ -1467,6 +1768,7 @@ int removeExpire(redisDb *db, robj *key);
 void propagateExpire(redisDb *db, robj *key, int lazy);
 int expireIfNeeded(redisDb *db, robj *key);
 long long getExpire(redisDb *db, robj *key);
+long long dbEntryGetExpire(dictEntry *de);
 void setExpire(redisDb *db, robj *key, long long when);
 robj *lookupKey(redisDb *db, robj *key);
 robj *lookupKeyRead(redisDb *db, robj *key);
@@ -1485,6 +1787,9 @@ robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o);
 #define EMPTYDB_NO_FLAGS 0      /* No flags. */
 #define EMPTYDB_ASYNC (1<<0)    /* Reclaim memory in another thread. */
 long long emptyDb(int dbnum, int flags, void(callback)(void*));
+redisDb *disklessLoadCreateDbs(void);
+void disklessLoadDiscardDbs(redisDb *dbarray);
+void disklessLoadSwapDbs(redisDb *dbarray, int async);
 
 int selectDb(client *c, int id);
 void signalModifiedKey(redisDb *db, robj *key);
@@ -1495,13 +1800,17 @@ unsigned int delKeysInSlot(unsigned int hashslot);
 int verifyClusterConfigWithData(void);
 void scanGenericCommand(client *c, robj *o, unsigned long cursor);
 int parseScanCursorOrReply(client *c, robj *o, unsigned long *cursor);
-void slotToKeyAdd(robj *key);
-void slotToKeyDel(robj *key);
+void slotToKeyAddEntry(dictEntry *entry);
+void slotToKeyDelEntry(dictEntry *entry);
+void slotToKeyReplaceEntry(dictEntry *entry, dictEntry *old);
 void slotToKeyFlush(void);
 int dbAsyncDelete(redisDb *db, robj *key);
 void emptyDbAsync(redisDb *db);
-void slotToKeyFlushAsync(void);
+void freeDbDictsAsync(dict *d, dict *expires);
+void freeObjAsync(robj *o);
+void lazyfreeFlushBatch(void);
 size_t lazyfreeGetPendingObjectsCount(void);
+size_t lazyfreeGetFreedObjectsCount(void);
 
 /* API to get key arguments from commands */
 int *getKeysFromCommand(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
@@ -1510,6 +1819,7 @@ int *zunionInterGetKeys(struct redisCommand *cmd,robj **argv, int argc, int *num
 int *evalGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 int *sortGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 int *migrateGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
+int *memoryGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 
 /* Cluster */
 void clusterInit(void);
@@ -1519,6 +1829,11 @@ void clusterCron(void);
 void clusterPropagatePublish(robj *channel, robj *message);
 void migrateCloseTimedoutSockets(void);
 void clusterBeforeSleep(void);
+void clusterSlotMigrationKeyChanged(sds key);
+void clusterSlotMigrationKeyUnlinked(dictEntry *de);
+void clusterSlotMigrationEntryMoved(dictEntry *old, dictEntry *new);
+void clusterSlotMigrationListNodeMoved(quicklistNode *old, quicklistNode *new);
+void clusterSlotMigrationAbort(char *reason);
 
 /* Sentinel */
 void initSentinelConfig(void);
@@ -1536,6 +1851,8 @@ void scriptingInit(int setup);
 int ldbRemoveChild(pid_t pid);
 void ldbKillForkedSessions(void);
 int ldbPendingChildren(void);
+void sha1hex(char *digest, char *script, size_t len);
+int luaCreateFunction(client *c, lua_State *lua, char *funcname, robj *body);
 
 /* Blocked clients */
 void processUnblockedClients(void);
@@ -1696,6 +2013,7 @@ void readonlyCommand(client *c);
 void readwriteCommand(client *c);
 void dumpCommand(client *c);
 void objectCommand(client *c);
+void memoryCommand(client *c);
 void clientCommand(client *c);
 void evalCommand(client *c);
 void evalShaCommand(client *c);
@@ -1741,6 +2059,7 @@ void enableWatchdog(int period);
 void disableWatchdog(void);
 void watchdogScheduleSignal(int period);
 void serverLogHexDump(int level, char *descr, void *value, size_t len);
+void inputCatSds(void *result, const char *str);
 int memtest_preserving_test(unsigned long *m, size_t bytes, int passes);
 
 #define redisDebug(fmt, ...) \
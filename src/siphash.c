@@ -0,0 +1,229 @@
+/* SipHash reference C implementation, modified for Redis.
+ *
+ * SipHash is a keyed hash function designed by Jean-Philippe Aumasson and
+ * Daniel J. Bernstein: it is fast on short inputs, that are the common case
+ * for hash table keys, and since the output depends on a secret 128 bit key
+ * it is not possible for an attacker to generate inputs colliding in the
+ * hash table (hash flooding), as long as the key is random and not exposed.
+ *
+ * Redis uses the SipHash-1-2 variant (one compression round per message
+ * block and two finalization rounds) that is about twice as fast as the
+ * standard SipHash-2-4 and still offers a large security margin for hash
+ * table usage. The rounds can be changed at compile time defining
+ * SIPHASH_C_ROUNDS and SIPHASH_D_ROUNDS, for instance in order to check the
+ * implementation against the SipHash-2-4 reference test vectors.
+ *
+ * Changes compared to the reference implementation:
+ *
+ * 1) The function returns the 64 bit hash directly instead of writing it
+ *    into an output buffer.
+ * 2) A case insensitive variant is provided, siphash_nocase(), that hashes
+ *    the input as if it was lower case, without the need of a copy.
+ * 3) Unaligned 64 bit loads are used on little endian architectures where
+ *    they are known to be fast.
+ *
+ * Copyright (c) 2012-2016 Jean-Philippe Aumasson
+ * Copyright (c) 2012-2014 Daniel J. Bernstein
+ * Copyright (c) 2016, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE. */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <ctype.h>
+#include "siphash.h"
+
+#ifndef SIPHASH_C_ROUNDS
+#define SIPHASH_C_ROUNDS 1
+#endif
+#ifndef SIPHASH_D_ROUNDS
+#define SIPHASH_D_ROUNDS 2
+#endif
+
+/* Use unaligned loads only on architectures where they are safe and fast,
+ * and where the byte order matches the one SipHash is specified with. */
+#if ((defined(__i386__) || defined(__x86_64__)) && \
+     defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__))
+#define UNALIGNED_LE_CPU
+#endif
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define U32TO8_LE(p, v)                                                        \
+    (p)[0] = (uint8_t)((v));                                                   \
+    (p)[1] = (uint8_t)((v) >> 8);                                              \
+    (p)[2] = (uint8_t)((v) >> 16);                                             \
+    (p)[3] = (uint8_t)((v) >> 24);
+
+#define U64TO8_LE(p, v)                                                        \
+    U32TO8_LE((p), (uint32_t)((v)));                                           \
+    U32TO8_LE((p) + 4, (uint32_t)((v) >> 32));
+
+#ifdef UNALIGNED_LE_CPU
+#define U8TO64_LE(p) (*((uint64_t*)(p)))
+#else
+#define U8TO64_LE(p)                                                           \
+    (((uint64_t)((p)[0])) | ((uint64_t)((p)[1]) << 8) |                        \
+     ((uint64_t)((p)[2]) << 16) | ((uint64_t)((p)[3]) << 24) |                 \
+     ((uint64_t)((p)[4]) << 32) | ((uint64_t)((p)[5]) << 40) |                 \
+     ((uint64_t)((p)[6]) << 48) | ((uint64_t)((p)[7]) << 56))
+#endif
+
+#define U8TO64_LE_NOCASE(p)                                                    \
+    (((uint64_t)(tolower((p)[0]))) |                                           \
+     ((uint64_t)(tolower((p)[1])) << 8) |                                      \
+     ((uint64_t)(tolower((p)[2])) << 16) |                                     \
+     ((uint64_t)(tolower((p)[3])) << 24) |                                     \
+     ((uint64_t)(tolower((p)[4])) << 32) |                                     \
+     ((uint64_t)(tolower((p)[5])) << 40) |                                     \
+     ((uint64_t)(tolower((p)[6])) << 48) |                                     \
+     ((uint64_t)(tolower((p)[7])) << 56))
+
+#define SIPROUND                                                               \
+    do {                                                                       \
+        v0 += v1;                                                              \
+        v1 = ROTL(v1, 13);                                                     \
+        v1 ^= v0;                                                              \
+        v0 = ROTL(v0, 32);                                                     \
+        v2 += v3;                                                              \
+        v3 = ROTL(v3, 16);                                                     \
+        v3 ^= v2;                                                              \
+        v0 += v3;                                                              \
+        v3 = ROTL(v3, 21);                                                     \
+        v3 ^= v0;                                                              \
+        v2 += v1;                                                              \
+        v1 = ROTL(v1, 17);                                                     \
+        v1 ^= v2;                                                              \
+        v2 = ROTL(v2, 32);                                                     \
+    } while (0)
+
+/* The body of the two functions is the same, only the way 8 bytes words
+ * and the trailing bytes are fetched from the input changes, so it is
+ * generated by this macro. */
+#define SIPHASH_BODY(LOAD64, LOADBYTE)                                         \
+    uint64_t k0 = U8TO64_LE(k);                                                \
+    uint64_t k1 = U8TO64_LE(k + 8);                                            \
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;                                  \
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;                                  \
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;                                  \
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;                                  \
+    const uint8_t *end = in + inlen - (inlen % sizeof(uint64_t));              \
+    const int left = inlen & 7;                                                \
+    uint64_t b = ((uint64_t)inlen) << 56;                                      \
+    uint64_t m;                                                                \
+    int i;                                                                     \
+                                                                               \
+    for (; in != end; in += 8) {                                               \
+        m = LOAD64(in);                                                        \
+        v3 ^= m;                                                               \
+        for (i = 0; i < SIPHASH_C_ROUNDS; i++) SIPROUND;                       \
+        v0 ^= m;                                                               \
+    }                                                                          \
+                                                                               \
+    switch (left) {                                                            \
+    case 7: b |= ((uint64_t)LOADBYTE(in[6])) << 48; /* fall through */         \
+    case 6: b |= ((uint64_t)LOADBYTE(in[5])) << 40; /* fall through */         \
+    case 5: b |= ((uint64_t)LOADBYTE(in[4])) << 32; /* fall through */         \
+    case 4: b |= ((uint64_t)LOADBYTE(in[3])) << 24; /* fall through */         \
+    case 3: b |= ((uint64_t)LOADBYTE(in[2])) << 16; /* fall through */         \
+    case 2: b |= ((uint64_t)LOADBYTE(in[1])) << 8; /* fall through */          \
+    case 1: b |= ((uint64_t)LOADBYTE(in[0])); break;                           \
+    case 0: break;                                                             \
+    }                                                                          \
+                                                                               \
+    v3 ^= b;                                                                   \
+    for (i = 0; i < SIPHASH_C_ROUNDS; i++) SIPROUND;                           \
+    v0 ^= b;                                                                   \
+    v2 ^= 0xff;                                                                \
+    for (i = 0; i < SIPHASH_D_ROUNDS; i++) SIPROUND;                           \
+    b = v0 ^ v1 ^ v2 ^ v3;                                                     \
+    return b;
+
+#define SIPHASH_BYTE(c) (c)
+#define SIPHASH_BYTE_NOCASE(c) tolower(c)
+
+/* Return the SipHash of the 'inlen' bytes at 'in', using the 16 bytes
+ * key 'k'. */
+uint64_t siphash(const uint8_t *in, const size_t inlen, const uint8_t *k) {
+    SIPHASH_BODY(U8TO64_LE, SIPHASH_BYTE)
+}
+
+/* Like siphash() but the input is hashed as if it was lower case, so
+ * strings that only differ in case have the same hash. */
+uint64_t siphash_nocase(const uint8_t *in, const size_t inlen, const uint8_t *k)
+{
+    SIPHASH_BODY(U8TO64_LE_NOCASE, SIPHASH_BYTE_NOCASE)
+}
+
+/* Test main */
+#ifdef REDIS_TEST
+#include <stdio.h>
+#include <string.h>
+
+#define UNUSED(x) (void)(x)
+int siphashTest(int argc, char *argv[]) {
+    uint8_t key[SIPHASH_KEY_LEN], in[64];
+    char upper[64];
+    int j, errors = 0;
+
+    UNUSED(argc);
+    UNUSED(argv);
+
+    for (j = 0; j < SIPHASH_KEY_LEN; j++) key[j] = j;
+    for (j = 0; j < 64; j++) in[j] = j;
+
+    /* With SIPHASH_C_ROUNDS=2 and SIPHASH_D_ROUNDS=4 the following is the
+     * SipHash-2-4 test vector for the 15 bytes input of the paper. */
+    printf("siphash-%d-%d(00..0e) = %016llx\n",
+        SIPHASH_C_ROUNDS, SIPHASH_D_ROUNDS,
+        (unsigned long long) siphash(in,15,key));
+#if SIPHASH_C_ROUNDS == 2 && SIPHASH_D_ROUNDS == 4
+    if (siphash(in,15,key) != 0xa129ca6149be45e5ULL) errors++;
+#endif
+
+    /* The case insensitive variant must match the case sensitive one
+     * for lower case input, for every length of the trailing block. */
+    for (j = 0; j < 64; j++) {
+        char lower[64];
+        int i;
+
+        for (i = 0; i < j; i++) {
+            lower[i] = 'a' + (i % 26);
+            upper[i] = 'A' + (i % 26);
+        }
+        if (siphash((uint8_t*)lower,j,key) !=
+            siphash_nocase((uint8_t*)upper,j,key) ||
+            siphash((uint8_t*)lower,j,key) !=
+            siphash_nocase((uint8_t*)lower,j,key))
+        {
+            printf("Case insensitive hash mismatch for length %d\n", j);
+            errors++;
+        }
+    }
+    printf("%s\n", errors ? "SipHash test FAILED" : "SipHash test passed");
+    return errors ? 1 : 0;
+}
+#endif
@@ -0,0 +1,16 @@
+#ifndef SIPHASH_H
+#define SIPHASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SIPHASH_KEY_LEN 16
+
+uint64_t siphash(const uint8_t *in, const size_t inlen, const uint8_t *k);
+uint64_t siphash_nocase(const uint8_t *in, const size_t inlen, const uint8_t *k);
+
+#ifdef REDIS_TEST
+int siphashTest(int argc, char *argv[]);
+#endif
+
+#endif
@@ -0,0 +1,461 @@
+/* Fork-less BGSAVE.
+ *
+ * When rdb-forkless-bgsave is enabled, BGSAVE does not fork a child
+ * process to write the point in time copy of the data set that the kernel
+ * provides via copy-on-write. The keyspace is instead walked by the main
+ * thread itself, a bucket of the main dictionaries at a time, in time
+ * slices of SNAPSHOT_STEP_USEC microseconds driven by a timer, so that
+ * clients keep being served meanwhile. The RDB payload is accumulated in
+ * a memory buffer that is handed to a bio.c thread every SNAPSHOT_WRITE_BYTES
+ * bytes, so the main thread never blocks writing to disk.
+ *
+ * DESIGN
+ * ------
+ *
+ * The file must still contain the data set as it was when BGSAVE was
+ * called. Since Redis objects can only be accessed by the main thread, we
+ * don't copy them aside: a key is written to the payload right before it is
+ * modified or deleted for the first time, if the walk did not reach it yet.
+ * The keyspace access API (db.c) calls snapshotKeyWillChange() before a key
+ * is modified, and snapshotKeyAdded() after a key is added. The names of
+ * the keys saved on write, and of the keys added after the start of the
+ * snapshot, are remembered so that the walk skips them.
+ *
+ * To tell the keys the walk already visited from the others, the rehashing
+ * of the main dictionaries is paused for the whole duration of the
+ * snapshot: this way keys never move from their bucket, and a key was
+ * visited if the position of its bucket is before the walk cursor (see
+ * dictPauseRehashing() and the related functions in dict.c).
+ *
+ * Databases flushed while the snapshot is in progress are detached from
+ * the keyspace, that gets new empty dictionaries: the old ones are walked
+ * to the end and released in background by the lazyfree thread.
+ *
+ * Compared to the fork based BGSAVE there is no fork latency and no memory
+ * used by copy-on-write pages. The cost is paid by the main thread, that
+ * serializes the data set itself, and by the first write against every
+ * key not yet saved. Only BGSAVE and the save points use this path: the
+ * RDB files used for replication and AOF rewrites are still produced by
+ * a child process.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2016, Redis Labs
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "bio.h"
+#include "atomicvar.h"
+
+#include <fcntl.h>
+
+#define SNAPSHOT_STEP_USEC 1000             /* Walk time slice. */
+#define SNAPSHOT_WRITE_BYTES (1024*1024)    /* Payload handed to bio.c. */
+#define SNAPSHOT_MAX_PENDING_WRITES 16      /* Pause the walk over this. */
+
+typedef struct snapshotDb {
+    dict *dict;             /* Main dictionary of the DB. */
+    dict *expires;          /* Expires of the DB, only set once detached. */
+    unsigned long cursor;   /* Next bucket position to walk. */
+    unsigned long end;      /* Bucket positions when the walk started. */
+    dict *skip;             /* Keys after the cursor the walk must skip. */
+    unsigned long size;     /* Keys when the snapshot started. */
+    unsigned long expires_size;
+    int selected;           /* Was the DB already selected in the payload? */
+} snapshotDb;
+
+typedef struct snapshot {
+    snapshotDb *dbs;
+    int walkdb;             /* DB the walk is visiting. */
+    int curdb;              /* Last DB selected in the payload, or -1. */
+    rio rdb;                /* Payload not yet handed to the bio thread. */
+    int error;              /* Set on error serializing the payload. */
+    int fd;                 /* Temp file descriptor. */
+    sds tmpfile;            /* Absolute path: "dir" may change meanwhile. */
+    sds filename;           /* Absolute path of the target RDB file. */
+    long long start;        /* Start time in milliseconds. */
+    long long dirty_before; /* Value of server.dirty at start. */
+    int save_lua;           /* Save the scripts, see rdbSaveRio(). */
+    int ending;             /* Walk done, waiting for the writes. */
+    long long timer_id;
+} snapshot;
+
+/* Set by the bio thread when writing the temp file fails. */
+static int snapshot_write_errno = 0;
+pthread_mutex_t snapshot_write_errno_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Write 'buf' to 'fd', or fsync 'fd' if 'buf' is NULL. Called by the bio
+ * thread, that also releases the buffer. Returns the bytes written. */
+size_t snapshotWriteFromBioThread(long fd, sds buf) {
+    size_t len = buf ? sdslen(buf) : 0, nwritten = 0;
+    int err;
+
+    atomicGetWithSync(snapshot_write_errno,err,snapshot_write_errno_mutex);
+    if (err == 0) {
+        if (buf == NULL) {
+            if (fsync(fd) == -1) err = errno;
+        }
+        while (nwritten < len) {
+            ssize_t n = write(fd,buf+nwritten,len-nwritten);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                err = errno;
+                break;
+            }
+            nwritten += n;
+        }
+        if (err)
+            atomicSetWithSync(snapshot_write_errno,err,
+                              snapshot_write_errno_mutex);
+    }
+    sdsfree(buf);
+    return nwritten;
+}
+
+/* Hand the accumulated payload to the bio thread. */
+static void snapshotFlush(snapshot *snap) {
+    if (sdslen(snap->rdb.io.buffer.ptr) == 0) return;
+    bioCreateBackgroundJob(BIO_RDB_WRITE,(void*)(long)snap->fd,
+                           snap->rdb.io.buffer.ptr,NULL);
+    snap->rdb.io.buffer.ptr = sdsempty();
+    snap->rdb.io.buffer.pos = 0;
+}
+
+/* Select the DB 'dbid' in the payload if needed. The first time a DB is
+ * selected its size when the snapshot started is also emitted. */
+static int snapshotSelectDb(snapshot *snap, int dbid) {
+    snapshotDb *sdb = snap->dbs+dbid;
+
+    if (snap->curdb == dbid) return 1;
+    if (rdbSaveType(&snap->rdb,RDB_OPCODE_SELECTDB) == -1) return -1;
+    if (rdbSaveLen(&snap->rdb,dbid) == -1) return -1;
+    snap->curdb = dbid;
+    if (sdb->selected) return 1;
+    sdb->selected = 1;
+
+    if (rdbSaveType(&snap->rdb,RDB_OPCODE_RESIZEDB) == -1) return -1;
+    if (rdbSaveLen(&snap->rdb,sdb->size) == -1) return -1;
+    if (rdbSaveLen(&snap->rdb,sdb->expires_size) == -1) return -1;
+    return 1;
+}
+
+/* Append the key stored at 'de' in the DB 'dbid' to the payload. */
+static void snapshotSaveEntry(snapshot *snap, int dbid, const dictEntry *de) {
+    robj key;
+
+    if (snapshotSelectDb(snap,dbid) == -1) {
+        snap->error = 1;
+        return;
+    }
+    initStaticStringObject(key,dictGetKey(de));
+    if (rdbSaveKeyValuePair(&snap->rdb,&key,dictGetVal(de),
+            dbEntryGetExpire((dictEntry*)de),snap->start) == -1)
+    {
+        snap->error = 1;
+    }
+}
+
+/* dictScanBucketAt() callback of the walk. */
+static void snapshotWalkCallback(void *privdata, const dictEntry *de) {
+    snapshot *snap = privdata;
+    snapshotDb *sdb = snap->dbs+snap->walkdb;
+
+    /* Already saved on write, or added after the start of the snapshot. */
+    if (dictSize(sdb->skip) && dictDelete(sdb->skip,dictGetKey(de)) == DICT_OK)
+        return;
+    snapshotSaveEntry(snap,snap->walkdb,de);
+}
+
+/* Release the snapshot state. The dictionaries of detached DBs are
+ * released in background, the others resume rehashing. */
+static void snapshotRelease(snapshot *snap) {
+    int j;
+
+    for (j = 0; j < server.dbnum; j++) {
+        snapshotDb *sdb = snap->dbs+j;
+
+        if (sdb->expires)
+            freeDbDictsAsync(sdb->dict,sdb->expires);
+        else
+            dictResumeRehashing(sdb->dict);
+        dictRelease(sdb->skip);
+    }
+    close(snap->fd);
+    sdsfree(snap->rdb.io.buffer.ptr);
+    sdsfree(snap->tmpfile);
+    sdsfree(snap->filename);
+    zfree(snap->dbs);
+    zfree(snap);
+    server.rdb_snapshot = NULL;
+    server.rdb_save_time_last = time(NULL)-server.rdb_save_time_start;
+    server.rdb_save_time_start = -1;
+}
+
+/* All the payload is on disk, or writing it failed: rename the temp file
+ * on success and update the BGSAVE status like the handler of the saving
+ * child (see backgroundSaveDoneHandlerDisk()). */
+static void snapshotDone(snapshot *snap) {
+    int err, oldfd;
+
+    atomicGetWithSync(snapshot_write_errno,err,snapshot_write_errno_mutex);
+    if (err == 0 && snap->error) err = EIO;
+    if (err == 0) {
+        /* Like for the AOF rewrite, the old file is opened so that the
+         * rename does not unlink it: the final close(2) happens in the
+         * background. */
+        oldfd = open(snap->filename,O_RDONLY|O_NONBLOCK);
+        if (rename(snap->tmpfile,snap->filename) == -1) {
+            err = errno;
+            if (oldfd != -1) close(oldfd);
+        } else if (oldfd != -1) {
+            bioCreateBackgroundJob(BIO_CLOSE_FILE,(void*)(long)oldfd,
+                                   NULL,NULL);
+        }
+    }
+
+    if (err == 0) {
+        serverLog(LL_NOTICE,
+            "Background saving terminated with success");
+        server.dirty = server.dirty - snap->dirty_before;
+        server.lastsave = time(NULL);
+        server.lastbgsave_status = C_OK;
+    } else {
+        serverLog(LL_WARNING,"Background saving error: %s",strerror(err));
+        unlink(snap->tmpfile);
+        server.lastbgsave_status = C_ERR;
+    }
+    snapshotRelease(snap);
+}
+
+/* Write the scripts, the EOF opcode and the checksum once all the DBs
+ * were walked. The fsync is queued after the last write. */
+static void snapshotEnd(snapshot *snap) {
+    dictIterator *di;
+    dictEntry *de;
+    uint64_t cksum;
+
+    if (snap->save_lua) {
+        di = dictGetIterator(server.lua_scripts);
+        while((de = dictNext(di)) != NULL) {
+            robj *body = dictGetVal(de);
+            if (rdbSaveAuxField(&snap->rdb,"lua",3,body->ptr,
+                                sdslen(body->ptr)) == -1) snap->error = 1;
+        }
+        dictReleaseIterator(di);
+    }
+    if (rdbSaveType(&snap->rdb,RDB_OPCODE_EOF) == -1) snap->error = 1;
+    cksum = snap->rdb.cksum;
+    memrev64ifbe(&cksum);
+    if (rioWrite(&snap->rdb,&cksum,8) == 0) snap->error = 1;
+    snapshotFlush(snap);
+    bioCreateBackgroundJob(BIO_RDB_WRITE,(void*)(long)snap->fd,NULL,NULL);
+    snap->ending = 1;
+}
+
+/* Timer callback walking the keyspace for SNAPSHOT_STEP_USEC microseconds
+ * at every call. */
+static int snapshotCron(struct aeEventLoop *eventLoop, long long id,
+                        void *clientData)
+{
+    snapshot *snap = server.rdb_snapshot;
+    long long start = ustime();
+    unsigned long buckets = 0;
+    int err;
+    UNUSED(eventLoop);
+    UNUSED(id);
+    UNUSED(clientData);
+
+    /* Once the walk is done, just wait for the writes to complete. */
+    if (snap->ending) {
+        if (bioPendingJobsOfType(BIO_RDB_WRITE)) return 1;
+        snapshotDone(snap);
+        return AE_NOMORE;
+    }
+
+    /* Stop at the first write error. */
+    atomicGetWithSync(snapshot_write_errno,err,snapshot_write_errno_mutex);
+    if (err || snap->error) {
+        snap->ending = 1;
+        return 1;
+    }
+
+    /* Don't accumulate in memory more than what the disk can take. */
+    if (bioPendingJobsOfType(BIO_RDB_WRITE) > SNAPSHOT_MAX_PENDING_WRITES)
+        return 1;
+
+    while (snap->walkdb < server.dbnum) {
+        snapshotDb *sdb = snap->dbs+snap->walkdb;
+
+        if (sdb->cursor == sdb->end) {
+            snap->walkdb++;
+            continue;
+        }
+        dictScanBucketAt(sdb->dict,sdb->cursor++,snapshotWalkCallback,snap);
+        if (sdslen(snap->rdb.io.buffer.ptr) >= SNAPSHOT_WRITE_BYTES)
+            snapshotFlush(snap);
+        if ((++buckets & 63) == 0 && ustime()-start > SNAPSHOT_STEP_USEC)
+            return 1;
+    }
+    snapshotEnd(snap);
+    return 1;
+}
+
+/* Start a fork-less BGSAVE writing to 'filename'. Returns C_ERR if a
+ * fork-less BGSAVE is already in progress, or the temp file can't be
+ * created. */
+int snapshotStart(char *filename, rdbSaveInfo *rsi) {
+    snapshot *snap;
+    char tmpfile[256], magic[10];
+    int j;
+
+    if (server.rdb_snapshot) return C_ERR;
+
+    server.lastbgsave_try = time(NULL);
+    snap = zcalloc(sizeof(*snap));
+    snprintf(tmpfile,sizeof(tmpfile),"temp-forkless-%d.rdb",(int) getpid());
+    snap->tmpfile = getAbsolutePath(tmpfile);
+    snap->filename = getAbsolutePath(filename);
+    if (snap->tmpfile == NULL || snap->filename == NULL) {
+        serverLog(LL_WARNING,"Can't save in background: getcwd: %s",
+            strerror(errno));
+        goto werr;
+    }
+    snap->fd = open(snap->tmpfile,O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if (snap->fd == -1) {
+        serverLog(LL_WARNING,"Can't save in background: open %s: %s",
+            snap->tmpfile, strerror(errno));
+        goto werr;
+    }
+    snap->start = mstime();
+    snap->dirty_before = server.dirty;
+    snap->save_lua = rsi && dictSize(server.lua_scripts);
+    snap->curdb = -1;
+    atomicSetWithSync(snapshot_write_errno,0,snapshot_write_errno_mutex);
+
+    /* The header and the aux fields are generated right away. */
+    rioInitWithBuffer(&snap->rdb,sdsempty());
+    if (server.rdb_checksum)
+        snap->rdb.update_cksum = rioGenericUpdateChecksum;
+    snprintf(magic,sizeof(magic),"REDIS%04d",RDB_VERSION);
+    rioWrite(&snap->rdb,magic,9);
+    rdbSaveInfoAuxFields(&snap->rdb,RDB_SAVE_NONE,rsi);
+
+    snap->dbs = zcalloc(sizeof(snapshotDb)*server.dbnum);
+    for (j = 0; j < server.dbnum; j++) {
+        snapshotDb *sdb = snap->dbs+j;
+
+        sdb->dict = server.db[j].dict;
+        dictPauseRehashing(sdb->dict);
+        sdb->end = dictSize(sdb->dict) ? dictBucketPositions(sdb->dict) : 0;
+        sdb->skip = dictCreate(&setDictType,NULL);
+        sdb->size = dictSize(server.db[j].dict);
+        sdb->expires_size = dictSize(server.db[j].expires);
+    }
+
+    snap->timer_id = aeCreateTimeEvent(server.el,1,snapshotCron,NULL,NULL);
+    server.rdb_snapshot = snap;
+    server.rdb_save_time_start = time(NULL);
+    serverLog(LL_NOTICE,"Background saving started without fork");
+    return C_OK;
+
+werr:
+    sdsfree(snap->tmpfile);
+    sdsfree(snap->filename);
+    zfree(snap);
+    server.lastbgsave_status = C_ERR;
+    return C_ERR;
+}
+
+/* Stop the fork-less BGSAVE in progress, if any, removing the temp file.
+ * Like killing the saving child with SIGUSR1, this is not an error. */
+void snapshotAbort(void) {
+    snapshot *snap = server.rdb_snapshot;
+
+    if (snap == NULL) return;
+    while (bioPendingJobsOfType(BIO_RDB_WRITE))
+        bioWaitStepOfType(BIO_RDB_WRITE);
+    aeDeleteTimeEvent(server.el,snap->timer_id);
+    unlink(snap->tmpfile);
+    serverLog(LL_NOTICE,"Background saving without fork aborted");
+    snapshotRelease(snap);
+}
+
+/* Return the snapshot state of 'db', or NULL if changes to the keys of
+ * 'db' don't concern the snapshot. */
+static snapshotDb *snapshotGetDb(redisDb *db) {
+    snapshot *snap = server.rdb_snapshot;
+    snapshotDb *sdb;
+
+    if (snap->ending || snap->error) return NULL;
+    sdb = snap->dbs+db->id;
+    return (sdb->dict == db->dict) ? sdb : NULL;
+}
+
+/* Called before the key 'key' of 'db' is modified, deleted, or has its
+ * expire changed: the key is saved now if the walk did not reach it yet. */
+void snapshotKeyWillChange(redisDb *db, sds key) {
+    snapshot *snap = server.rdb_snapshot;
+    snapshotDb *sdb = snapshotGetDb(db);
+    unsigned long pos;
+    dictEntry *de;
+
+    if (sdb == NULL) return;
+    de = dictFindPosition(sdb->dict,key,&pos);
+    if (de == NULL || pos < sdb->cursor || pos >= sdb->end) return;
+    if (dictFind(sdb->skip,key) != NULL) return;
+
+    snapshotSaveEntry(snap,db->id,de);
+    dictAdd(sdb->skip,sdsdup(key),NULL);
+    server.stat_rdb_saved_on_write++;
+    if (sdslen(snap->rdb.io.buffer.ptr) >= SNAPSHOT_WRITE_BYTES)
+        snapshotFlush(snap);
+}
+
+/* Called after the key 'key' was added to 'db': the walk must skip it. */
+void snapshotKeyAdded(redisDb *db, sds key) {
+    snapshotDb *sdb = snapshotGetDb(db);
+    unsigned long pos;
+
+    if (sdb == NULL) return;
+    if (dictFindPosition(sdb->dict,key,&pos) == NULL ||
+        pos < sdb->cursor || pos >= sdb->end) return;
+    if (dictFind(sdb->skip,key) == NULL) dictAdd(sdb->skip,sdsdup(key),NULL);
+}
+
+/* Called before all the keys of 'db' are removed at once: the snapshot
+ * takes the current dictionaries of the DB, that gets new empty ones. */
+void snapshotDetachDb(redisDb *db) {
+    snapshotDb *sdb = server.rdb_snapshot->dbs+db->id;
+
+    /* Even once the walk is done the dictionaries can't be released
+     * before the snapshot, since their rehashing is paused. */
+    if (sdb->dict != db->dict) return;
+    sdb->expires = db->expires;
+    db->dict = dictCreate(&dbDictType,NULL);
+    db->expires = dictCreate(&keyptrDictType,NULL);
+}
@@ -117,6 +117,41 @@ ssize_t syncRead(int fd, char *ptr, ssize_t size, long long timeout) {
     }
 }
 
+/* Read up to 'size' bytes from 'fd', returning as soon as at least one byte
+ * is available. If nothing can be read within 'timeout' milliseconds the
+ * operation fails and -1 is returned, otherwise the number of bytes read
+ * is returned. This is useful to consume many small replies with a few
+ * system calls, leaving the parsing to the caller. */
+ssize_t syncReadSome(int fd, char *ptr, ssize_t size, long long timeout) {
+    ssize_t nread;
+    long long start = mstime();
+    long long remaining = timeout;
+
+    if (size == 0) return 0;
+    while(1) {
+        long long wait = (remaining > SYNCIO__RESOLUTION) ?
+                          remaining : SYNCIO__RESOLUTION;
+        long long elapsed;
+
+        nread = read(fd,ptr,size);
+        if (nread == 0) return -1; /* short read. */
+        if (nread == -1) {
+            if (errno != EAGAIN) return -1;
+        } else {
+            return nread;
+        }
+
+        /* Wait */
+        aeWait(fd,AE_READABLE,wait);
+        elapsed = mstime() - start;
+        if (elapsed >= timeout) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        remaining = timeout - elapsed;
+    }
+}
+
 /* Read a line making sure that every char will not require more than 'timeout'
  * milliseconds to be read.
  *
@@ -773,6 +773,8 @@ int serveClientBlockedOnList(client *receiver, robj *key, robj *dstkey, redisDb
             return C_ERR;
         }
     }
+    /* The reply must wait for the propagated operations to be durable. */
+    aofUpdateClientWaitOffset(receiver);
     return C_OK;
 }
 
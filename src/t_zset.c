@@ -2111,7 +2111,7 @@ inline static void zunionInterAggregate(double *target, double val, int aggregat
     }
 }
 
-unsigned int dictSdsHash(const void *key);
+uint64_t dictSdsHash(const void *key);
 int dictSdsKeyCompare(void *privdata, const void *key1, const void *key2);
 
 dictType setAccumulatorDictType = {
@@ -2120,7 +2120,11 @@ dictType setAccumulatorDictType = {
     NULL,                      /* val dup */
     dictSdsKeyCompare,         /* key compare */
     NULL,                      /* key destructor */
-    NULL                       /* val destructor */
+    NULL,                      /* val destructor */
+    NULL,                      /* entry metadata size */
+    NULL,                      /* embedded key size */
+    NULL,                      /* embed key */
+    0                          /* shared entries */
 };
 
 void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
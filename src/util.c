@@ -536,14 +536,13 @@ int ld2string(char *buf, size_t len, long double value, int humanfriendly) {
     return l;
 }
 
-/* Generate the Redis "Run ID", a SHA1-sized random number that identifies a
- * given execution of Redis, so that if you are talking with an instance
- * having run_id == A, and you reconnect and it has run_id == B, you can be
- * sure that it is either a different instance or it was restarted. */
-void getRandomHexChars(char *p, unsigned int len) {
-    char *charset = "0123456789abcdef";
-    unsigned int j;
-
+/* Fill 'p' with 'len' random bytes. SHA1 is used in counter mode, hashing
+ * a seed read from /dev/urandom with a progressive counter, so the function
+ * is fast enough to be called often. If /dev/urandom is not available some
+ * reasonable effort is made in order to create some entropy, since this
+ * function is used to generate run_id, cluster instance IDs and the seed of
+ * the hash tables hash function. */
+void getRandomBytes(unsigned char *p, size_t len) {
     /* Global state. */
     static int seed_initialized = 0;
     static unsigned char seed[20]; /* The SHA1 seed, from /dev/urandom. */
@@ -564,7 +563,7 @@ void getRandomHexChars(char *p, unsigned int len) {
         while(len) {
             unsigned char digest[20];
             SHA1_CTX ctx;
-            unsigned int copylen = len > 20 ? 20 : len;
+            size_t copylen = len > 20 ? 20 : len;
 
             SHA1Init(&ctx);
             SHA1Update(&ctx, seed, sizeof(seed));
@@ -573,21 +572,17 @@ void getRandomHexChars(char *p, unsigned int len) {
             counter++;
 
             memcpy(p,digest,copylen);
-            /* Convert to hex digits. */
-            for (j = 0; j < copylen; j++) p[j] = charset[p[j] & 0x0F];
             len -= copylen;
             p += copylen;
         }
     } else {
-        /* If we can't read from /dev/urandom, do some reasonable effort
-         * in order to create some entropy, since this function is used to
-         * generate run_id and cluster instance IDs */
-        char *x = p;
-        unsigned int l = len;
+        unsigned char *x = p;
+        size_t l = len, j;
         struct timeval tv;
         pid_t pid = getpid();
 
         /* Use time and PID to fill the initial array. */
+        memset(p,0,len);
         gettimeofday(&tv,NULL);
         if (l >= sizeof(tv.tv_usec)) {
             memcpy(x,&tv.tv_usec,sizeof(tv.tv_usec));
@@ -605,14 +600,23 @@ void getRandomHexChars(char *p, unsigned int len) {
             x += sizeof(pid);
         }
         /* Finally xor it with rand() output, that was already seeded with
-         * time() at startup, and convert to hex digits. */
-        for (j = 0; j < len; j++) {
-            p[j] ^= rand();
-            p[j] = charset[p[j] & 0x0F];
-        }
+         * time() at startup. */
+        for (j = 0; j < len; j++) p[j] ^= rand();
     }
 }
 
+/* Generate the Redis "Run ID", a SHA1-sized random number that identifies a
+ * given execution of Redis, so that if you are talking with an instance
+ * having run_id == A, and you reconnect and it has run_id == B, you can be
+ * sure that it is either a different instance or it was restarted. */
+void getRandomHexChars(char *p, unsigned int len) {
+    char *charset = "0123456789abcdef";
+    unsigned int j;
+
+    getRandomBytes((unsigned char*)p,len);
+    for (j = 0; j < len; j++) p[j] = charset[p[j] & 0x0F];
+}
+
 /* Given the filename, return the absolute path as an SDS string, or NULL
  * if it fails for some reason. Note that "filename" may be an absolute path
  * already, this will be detected and handled correctly.
@@ -0,0 +1,75 @@
+# Check the slots -> keys mapping used by CLUSTER COUNTKEYSINSLOT,
+# CLUSTER GETKEYSINSLOT and by the slots cleanup code.
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 5 nodes cluster" {
+    create_cluster 5 5
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+# Return the ID of the master instance serving 'slot'.
+proc slot_owner {slot} {
+    foreach range [R 0 cluster slots] {
+        lassign $range start end master
+        if {$slot < $start || $slot > $end} continue
+        foreach_redis_id id {
+            if {[get_instance_attrib redis $id port] == [lindex $master 1]} {
+                return $id
+            }
+        }
+    }
+    return -1
+}
+
+test "Keys are added to the slots -> keys map" {
+    set ::slot [R 0 cluster keyslot {foo}]
+    set ::owner [slot_owner $::slot]
+    assert {$::owner != -1}
+    for {set j 0} {$j < 100} {incr j} {
+        R $::owner set "{foo}.$j" $j
+    }
+    assert_equal 100 [R $::owner cluster countkeysinslot $::slot]
+    set keys [lsort [R $::owner cluster getkeysinslot $::slot 1000]]
+    set expected {}
+    for {set j 0} {$j < 100} {incr j} {lappend expected "{foo}.$j"}
+    assert_equal [lsort $expected] $keys
+    assert_equal 10 [llength [R $::owner cluster getkeysinslot $::slot 10]]
+}
+
+test "Keys are removed from the slots -> keys map" {
+    for {set j 0} {$j < 50} {incr j} {
+        if {$j % 2} {
+            R $::owner del "{foo}.$j"
+        } else {
+            R $::owner unlink "{foo}.$j"
+        }
+    }
+    # Overwrites and expires must not touch the mapping.
+    R $::owner set "{foo}.99" overwritten
+    R $::owner expire "{foo}.98" 1000
+    assert_equal 50 [R $::owner cluster countkeysinslot $::slot]
+    set keys [lsort [R $::owner cluster getkeysinslot $::slot 1000]]
+    set expected {}
+    for {set j 50} {$j < 100} {incr j} {lappend expected "{foo}.$j"}
+    assert_equal [lsort $expected] $keys
+}
+
+test "The slots -> keys map is rebuilt on reload" {
+    R $::owner debug reload
+    assert_equal 50 [R $::owner cluster countkeysinslot $::slot]
+    assert_equal 50 [llength [R $::owner cluster getkeysinslot $::slot 1000]]
+}
+
+test "The slots -> keys map is emptied by FLUSHALL" {
+    R $::owner flushall async
+    assert_equal 0 [R $::owner cluster countkeysinslot $::slot]
+    assert_equal {} [R $::owner cluster getkeysinslot $::slot 1000]
+    R $::owner set "{foo}.new" 1
+    assert_equal 1 [R $::owner cluster countkeysinslot $::slot]
+    R $::owner flushall
+    assert_equal 0 [R $::owner cluster countkeysinslot $::slot]
+}
@@ -0,0 +1,146 @@
+# Check the background slot migration performed by CLUSTER MIGRATESLOT.
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 3 nodes cluster" {
+    create_cluster 3 3
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+# Return the ID of the master instance serving 'slot'.
+proc slot_owner {slot} {
+    foreach range [R 0 cluster slots] {
+        lassign $range start end master
+        if {$slot >= $start && $slot <= $end} {
+            return [get_instance_id_by_port redis [lindex $master 1]]
+        }
+    }
+    return -1
+}
+
+# Run a command against the owner of the slot we migrate, following the
+# MOVED redirection once the slot was handed over to the target.
+proc slot_cmd {args} {
+    if {[catch {R $::owner {*}$args} e]} {
+        if {[string match {MOVED*} $e]} {
+            return [R $::target {*}$args]
+        }
+        error $e
+    }
+    return $e
+}
+
+test "Populate the slot to migrate" {
+    set ::slot [R 0 cluster keyslot {foo}]
+    set ::owner [slot_owner $::slot]
+    foreach_redis_id id {
+        if {$id != $::owner && [lindex [R $id role] 0] eq {master}} {
+            set ::target $id
+            break
+        }
+    }
+    set ::expected {}
+    for {set j 0} {$j < 1000} {incr j} {
+        R $::owner set "{foo}.$j" $j
+        dict set ::expected "{foo}.$j" $j
+    }
+    R $::owner expire "{foo}.0" 1000
+    for {set j 0} {$j < 3000} {incr j} {
+        lappend list $j
+        lappend zset $j member:$j
+        lappend hash field:$j $j
+    }
+    R $::owner rpush "{foo}.list" {*}$list
+    R $::owner zadd "{foo}.zset" {*}$zset
+    R $::owner hmset "{foo}.hash" {*}$hash
+    R $::owner sadd "{foo}.set" {*}$list
+    R $::owner expire "{foo}.zset" 1000
+    assert_equal 1004 [R $::owner cluster countkeysinslot $::slot]
+}
+
+test "Migrate the slot while writing to it" {
+    set target_id [R $::target cluster myid]
+    R $::owner cluster migrateslot $::slot $target_id
+    # Keys changed during the migration must reach the target as well.
+    for {set j 0} {$j < 100} {incr j} {
+        slot_cmd set "{foo}.$j" changed
+        dict set ::expected "{foo}.$j" changed
+    }
+    for {set j 100} {$j < 200} {incr j} {
+        slot_cmd del "{foo}.$j"
+        dict unset ::expected "{foo}.$j"
+    }
+    slot_cmd set "{foo}.new" new
+    dict set ::expected "{foo}.new" new
+    slot_cmd rpush "{foo}.list" last
+    wait_for_condition 1000 50 {
+        [CI $::owner cluster_slot_migration_in_progress] == 0
+    } else {
+        fail "Slot migration not completed"
+    }
+}
+
+test "The target is the new owner of the slot" {
+    assert_equal 0 [R $::owner cluster countkeysinslot $::slot]
+    assert_equal 905 [R $::target cluster countkeysinslot $::slot]
+    assert_equal $::target [slot_owner $::slot]
+    catch {R $::owner get "{foo}.1"} e
+    assert_match {MOVED*} $e
+}
+
+test "Migrated keys have the right values" {
+    dict for {key val} $::expected {
+        assert_equal $val [R $::target get $key]
+    }
+    assert {[R $::target ttl "{foo}.0"] == -1}
+    assert {[R $::target ttl "{foo}.zset"] > 0}
+    # The list is sent in chunks: every element must arrive once, in order.
+    set list {}
+    for {set j 0} {$j < 3000} {incr j} {lappend list $j}
+    lappend list last
+    assert_equal $list [R $::target lrange "{foo}.list" 0 -1]
+    assert_equal 3000 [R $::target zcard "{foo}.zset"]
+    assert_equal 1234 [R $::target zscore "{foo}.zset" member:1234]
+    assert_equal 3000 [R $::target hlen "{foo}.hash"]
+    assert_equal 1234 [R $::target hget "{foo}.hash" field:1234]
+    assert_equal 3000 [R $::target scard "{foo}.set"]
+}
+
+test "The cluster agrees on the new slot owner" {
+    wait_for_condition 1000 50 {
+        [CI 0 cluster_state] eq {ok} &&
+        [slot_owner $::slot] == $::target
+    } else {
+        fail "The cluster did not learn the new slot configuration"
+    }
+    foreach_redis_id id {
+        if {[lindex [R $id role] 0] eq {master}} {
+            assert_equal $::target [slot_owner $::slot]
+        }
+    }
+}
+
+test "A migration can be aborted" {
+    set slot [R 0 cluster keyslot {bar}]
+    set owner [slot_owner $slot]
+    R $owner set "{bar}.1" 1
+    foreach_redis_id id {
+        if {$id != $owner && [lindex [R $id role] 0] eq {master}} {
+            set target $id
+            break
+        }
+    }
+    R $owner multi
+    R $owner cluster migrateslot $slot [R $target cluster myid]
+    R $owner cluster migrateslot abort
+    R $owner exec
+    assert_equal 0 [CI $owner cluster_slot_migration_in_progress]
+    assert_equal 1 [R $owner get "{bar}.1"]
+    assert_equal $owner [slot_owner $slot]
+    catch {R $owner cluster migrateslot abort} e
+    assert_match {*No slot migration*} $e
+    R $target cluster setslot $slot stable
+}
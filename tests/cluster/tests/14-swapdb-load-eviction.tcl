@@ -0,0 +1,67 @@
+# Check that a replica loading the data set from its master with
+# repl-diskless-load swapdb does not evict keys of the old data set while
+# it keeps serving clients.
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 3 nodes cluster" {
+    create_cluster 3 3
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+# Return the ID of the master instance serving 'slot'.
+proc slot_owner {slot} {
+    foreach range [R 0 cluster slots] {
+        lassign $range start end master
+        if {$slot >= $start && $slot <= $end} {
+            return [get_instance_id_by_port redis [lindex $master 1]]
+        }
+    }
+    return -1
+}
+
+test "Populate the old and the new data set" {
+    set ::old_master [slot_owner [R 0 cluster keyslot "{foo}"]]
+    set old_port [get_instance_attrib redis $::old_master port]
+    foreach_redis_id id {
+        set role [R $id role]
+        if {[lindex $role 0] eq {slave} && [lindex $role 2] == $old_port} {
+            set ::replica $id
+        }
+    }
+    # A hash tag served by another master.
+    for {set j 0} {1} {incr j} {
+        set tag "{tag$j}"
+        set ::new_master [slot_owner [R 0 cluster keyslot $tag]]
+        if {$::new_master != $::old_master} break
+    }
+    # DEBUG POPULATE is not propagated: fill the replica directly.
+    R $::replica debug populate 400000 "{foo}"
+    R $::new_master debug populate 200000 $tag
+    set ::new_digest [R $::new_master debug digest]
+    assert_equal 400000 [R $::replica cluster countkeysinslot \
+        [R 0 cluster keyslot "{foo}"]]
+}
+
+test "Reads during a swapdb load don't evict the old data set" {
+    set used [get_info_field [R $::replica info memory] used_memory]
+    R $::replica config set repl-diskless-load swapdb
+    R $::replica config set maxmemory-policy allkeys-random
+    R $::replica config set maxmemory [expr {$used+5*1024*1024}]
+    R $::replica cluster replicate [R $::new_master cluster myid]
+
+    # Every command is served while loading only every few MB of payload,
+    # when the new data set already exceeds the memory limit.
+    wait_for_condition 1000 10 {
+        [R $::replica dbsize] == 200000 &&
+        [get_info_field [R $::replica info persistence] loading] == 0
+    } else {
+        fail "The replica did not load the new data set"
+    }
+    assert_equal 0 [get_info_field [R $::replica info stats] evicted_keys]
+    assert_equal $::new_digest [R $::replica debug digest]
+    R $::replica config set maxmemory 0
+}
@@ -0,0 +1,215 @@
+set defaults { appendonly {yes} appendfilename {appendonly.aof} aof-multi-part {yes} }
+set server_path [tmpdir server.multi.aof]
+set aof_dir "$server_path/appendonlydir"
+set manifest_path "$aof_dir/appendonly.aof.manifest"
+
+proc read_manifest {} {
+    upvar manifest_path manifest_path
+    set fp [open $manifest_path r]
+    set content [read $fp]
+    close $fp
+    return [string trim $content]
+}
+
+proc start_server_aof {overrides code} {
+    upvar defaults defaults srv srv server_path server_path
+    set config [concat $defaults $overrides]
+    set srv [start_server [list overrides $config]]
+    uplevel 1 $code
+    kill_server $srv
+}
+
+proc wait_aof_rewrite {client} {
+    wait_for_condition 50 100 {
+        [string match {*aof_rewrite_in_progress:0*} [$client info persistence]]
+    } else {
+        fail "AOF rewrite did not terminate"
+    }
+}
+
+tags {"aof"} {
+    start_server_aof [list dir $server_path] {
+        set client [redis [dict get $srv host] [dict get $srv port]]
+
+        test "Multi part AOF: an INCR file is created at startup" {
+            assert_equal {file appendonly.aof.1.incr.aof seq 1 type i} \
+                [read_manifest]
+            $client set foo bar
+            $client rpush list a b c
+            assert {[file size $aof_dir/appendonly.aof.1.incr.aof] > 0}
+        }
+
+        test "Multi part AOF: BGREWRITEAOF creates a BASE file" {
+            $client bgrewriteaof
+            wait_aof_rewrite $client
+            assert_equal [join {
+                {file appendonly.aof.1.base.aof seq 1 type b}
+                {file appendonly.aof.2.incr.aof seq 2 type i}
+            } "\n"] [read_manifest]
+            assert {![file exists $aof_dir/appendonly.aof.1.incr.aof]}
+            $client set tail 1
+            $client incr tail
+        }
+
+        test "Multi part AOF: the RDB format is used for the BASE file" {
+            $client config set aof-use-rdb-preamble yes
+            $client bgrewriteaof
+            wait_aof_rewrite $client
+            assert_equal [join {
+                {file appendonly.aof.2.base.rdb seq 2 type b}
+                {file appendonly.aof.3.incr.aof seq 3 type i}
+            } "\n"] [read_manifest]
+            assert {![file exists $aof_dir/appendonly.aof.1.base.aof]}
+            assert {![file exists $aof_dir/appendonly.aof.2.incr.aof]}
+            $client hset hash field value
+        }
+
+        test "Multi part AOF: DEBUG LOADAOF loads the BASE and INCR files" {
+            set digest [$client debug digest]
+            $client debug loadaof
+            assert_equal $digest [$client debug digest]
+            assert_equal 2 [$client get tail]
+            assert_equal value [$client hget hash field]
+        }
+    }
+
+    start_server_aof [list dir $server_path] {
+        test "Multi part AOF: the dataset is reloaded at startup" {
+            set client [redis [dict get $srv host] [dict get $srv port]]
+            wait_for_condition 50 100 {
+                [catch {$client ping} e] == 0
+            } else {
+                fail "Loading DB is taking too much time."
+            }
+            assert_equal bar [$client get foo]
+            assert_equal {a b c} [$client lrange list 0 -1]
+            assert_equal 2 [$client get tail]
+            assert_equal value [$client hget hash field]
+        }
+    }
+
+    ## The last INCR file can be truncated by a crash: make sure it is
+    ## loaded anyway when aof-load-truncated is set to yes.
+    set fp [open $aof_dir/appendonly.aof.3.incr.aof a]
+    puts -nonewline $fp [string range [formatCommand set foo truncated] 0 end-1]
+    close $fp
+
+    start_server_aof [list dir $server_path aof-load-truncated yes] {
+        test "Multi part AOF: truncated last INCR file is loaded" {
+            set client [redis [dict get $srv host] [dict get $srv port]]
+            wait_for_condition 50 100 {
+                [catch {$client ping} e] == 0
+            } else {
+                fail "Loading DB is taking too much time."
+            }
+            assert_equal bar [$client get foo]
+            assert_equal value [$client hget hash field]
+        }
+    }
+
+    ## A single file AOF is used as first INCR file of the multi part AOF.
+    file delete -force $aof_dir
+    set fp [open $server_path/appendonly.aof w]
+    puts -nonewline $fp [formatCommand set legacy 1]
+    close $fp
+
+    start_server_aof [list dir $server_path aof-checksum yes] {
+        test "Multi part AOF: a single file AOF is upgraded" {
+            set client [redis [dict get $srv host] [dict get $srv port]]
+            wait_for_condition 50 100 {
+                [catch {$client ping} e] == 0
+            } else {
+                fail "Loading DB is taking too much time."
+            }
+            assert_equal 1 [$client get legacy]
+            assert {![file exists $server_path/appendonly.aof]}
+            assert_equal {file appendonly.aof.1.incr.aof seq 1 type i} \
+                [read_manifest]
+            # Make the BASE file span multiple checksum segments.
+            $client debug populate 5000
+            $client bgrewriteaof
+            wait_aof_rewrite $client
+        }
+    }
+
+    ## BASE files written with aof-checksum enabled are terminated by a
+    ## checksum trailer: a BASE file with trailers but not ending with one
+    ## was truncated and can't be loaded.
+    set base [lindex [split [read_manifest] " "] 1]
+    set fp [open $aof_dir/$base r]
+    fconfigure $fp -translation binary
+    set content [read $fp]
+    close $fp
+    set fp [open $aof_dir/$base w]
+    fconfigure $fp -translation binary
+    puts -nonewline $fp [string range $content 0 [string last "#CRC64:" $content]-1]
+    close $fp
+
+    start_server_aof [list dir $server_path aof-load-truncated yes] {
+        test "Multi part AOF: BASE file without checksum trailer is fatal" {
+            set pattern "*does not end with a checksum trailer: it is truncated*"
+            set retry 10
+            while {$retry} {
+                set result [exec tail -n1 < [dict get $srv stdout]]
+                if {[string match $pattern $result]} {
+                    break
+                }
+                incr retry -1
+                after 1000
+            }
+            if {$retry == 0} {
+                error "assertion:expected error not found in the log file"
+            }
+        }
+    }
+}
+
+start_server {tags {"aof"} overrides {aof-multi-part yes}} {
+    r config set appendonly yes
+    r config set auto-aof-rewrite-percentage 0 ; # Disable auto-rewrite.
+    waitForBgrewriteaof r
+
+    test "Multi part AOF: rewrite during write load needs no rewrite buffer" {
+        set master_host [srv 0 host]
+        set master_port [srv 0 port]
+        set load_handle0 [start_write_load $master_host $master_port 10]
+        set load_handle1 [start_write_load $master_host $master_port 10]
+
+        wait_for_condition 50 100 {
+            [r dbsize] > 0
+        } else {
+            fail "No write load detected."
+        }
+
+        after 1000
+        r bgrewriteaof
+        while {[s aof_rewrite_in_progress]} {
+            assert_equal 0 [s aof_rewrite_buffer_length]
+            after 10
+        }
+        after 500
+
+        stop_write_load $load_handle0
+        stop_write_load $load_handle1
+        wait_for_condition 50 100 {
+            [llength [split [string trim [r client list]] "\n"]] == 1
+        } else {
+            fail "Clients generating loads are not disconnecting"
+        }
+
+        set digest [r debug digest]
+        r debug loadaof
+        assert_equal $digest [r debug digest]
+    }
+
+    test "Multi part AOF: turning the AOF off and on again" {
+        r config set appendonly no
+        r set afteroff 1
+        r config set appendonly yes
+        waitForBgrewriteaof r
+        r set afteron 1
+        set digest [r debug digest]
+        r debug loadaof
+        assert_equal $digest [r debug digest]
+    }
+}
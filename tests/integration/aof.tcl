@@ -251,6 +251,152 @@ tags {"aof"} {
         }
     }
 
+    ## Test that an AOF rewritten with an RDB preamble, followed by an
+    ## AOF tail, is loaded correctly at startup.
+    start_server_aof [list dir $server_path aof-use-rdb-preamble yes] {
+        test "AOF+RDB preamble: the rewritten AOF starts with an RDB payload" {
+            set client [redis [dict get $srv host] [dict get $srv port]]
+            $client set foo bar
+            $client rpush list a b c
+            $client hset hash field value
+            $client setex volatile 1000 x
+            $client bgrewriteaof
+            wait_for_condition 50 100 {
+                [string match {*aof_rewrite_in_progress:0*} [$client info persistence]]
+            } else {
+                fail "AOF rewrite did not terminate"
+            }
+            $client set tail 1
+            $client incr tail
+            set fp [open $aof_path r]
+            fconfigure $fp -translation binary
+            set sig [read $fp 5]
+            close $fp
+            assert_equal REDIS $sig
+        }
+    }
+
+    start_server_aof [list dir $server_path aof-load-truncated no] {
+        test "AOF+RDB preamble: Server should have been started" {
+            assert_equal 1 [is_alive $srv]
+        }
+
+        test "AOF+RDB preamble: both the preamble and the tail are loaded" {
+            set client [redis [dict get $srv host] [dict get $srv port]]
+            wait_for_condition 50 100 {
+                [catch {$client ping} e] == 0
+            } else {
+                fail "Loading DB is taking too much time."
+            }
+            assert_equal bar [$client get foo]
+            assert_equal {a b c} [$client lrange list 0 -1]
+            assert_equal value [$client hget hash field]
+            assert {[$client ttl volatile] > 0}
+            assert_equal 2 [$client get tail]
+        }
+    }
+
+    ## Test that a rewritten AOF is terminated by a checksum trailer, and
+    ## that it is loaded correctly, even using the reader thread.
+    start_server_aof [list dir $server_path aof-use-rdb-preamble no] {
+        test "AOF checksum: no checksum trailers unless enabled" {
+            set client [redis [dict get $srv host] [dict get $srv port]]
+            $client flushall
+            $client set foo bar
+            $client bgrewriteaof
+            wait_for_condition 50 100 {
+                [string match {*aof_rewrite_in_progress:0*} [$client info persistence]]
+            } else {
+                fail "AOF rewrite did not terminate"
+            }
+            set fp [open $aof_path r]
+            fconfigure $fp -translation binary
+            set content [read $fp]
+            close $fp
+            assert {![string match "*#CRC64:*" $content]}
+        }
+    }
+
+    start_server_aof [list dir $server_path aof-use-rdb-preamble no aof-checksum yes] {
+        test "AOF checksum: the rewritten AOF ends with a checksum trailer" {
+            set client [redis [dict get $srv host] [dict get $srv port]]
+            $client flushall
+            $client set foo bar
+            $client rpush list a b c
+            $client bgrewriteaof
+            wait_for_condition 50 100 {
+                [string match {*aof_rewrite_in_progress:0*} [$client info persistence]]
+            } else {
+                fail "AOF rewrite did not terminate"
+            }
+            $client set tail 1
+            set fp [open $aof_path r]
+            fconfigure $fp -translation binary
+            set content [read $fp]
+            close $fp
+            assert_match "*#CRC64:*" $content
+        }
+    }
+
+    start_server_aof [list dir $server_path aof-load-reader-thread yes] {
+        test "AOF checksum: Server should have been started" {
+            assert_equal 1 [is_alive $srv]
+        }
+
+        test "AOF checksum: the AOF is loaded by the reader thread" {
+            set client [redis [dict get $srv host] [dict get $srv port]]
+            wait_for_condition 50 100 {
+                [catch {$client ping} e] == 0
+            } else {
+                fail "Loading DB is taking too much time."
+            }
+            assert_equal bar [$client get foo]
+            assert_equal {a b c} [$client lrange list 0 -1]
+            assert_equal 1 [$client get tail]
+        }
+    }
+
+    test "AOF checksum: Utility should confirm the AOF is valid" {
+        set result [exec src/redis-check-aof $aof_path]
+        assert_match "*AOF is valid*" $result
+    }
+
+    ## Corrupt a value inside the checksummed segment, keeping the AOF
+    ## syntactically valid: only the checksum can detect it.
+    set fp [open $aof_path r]
+    fconfigure $fp -translation binary
+    set content [read $fp]
+    close $fp
+    set fp [open $aof_path w]
+    fconfigure $fp -translation binary
+    puts -nonewline $fp [string map {"\$3\r\nbar" "\$3\r\nbaz"} $content]
+    close $fp
+
+    start_server_aof [list dir $server_path aof-load-truncated yes] {
+        test "AOF checksum: Server should have logged a checksum mismatch" {
+            set pattern "*Checksum mismatch in the append only file*"
+            set retry 10
+            while {$retry} {
+                set result [exec tail -n1 < [dict get $srv stdout]]
+                if {[string match $pattern $result]} {
+                    break
+                }
+                incr retry -1
+                after 1000
+            }
+            if {$retry == 0} {
+                error "assertion:expected error not found in the log file"
+            }
+        }
+    }
+
+    test "AOF checksum: Utility should confirm the AOF is not valid" {
+        catch {
+            exec src/redis-check-aof $aof_path
+        } result
+        assert_match "*not valid*" $result
+    }
+
     start_server {overrides {appendonly {yes} appendfilename {appendonly.aof}}} {
         test {Redis should not try to convert DEL into EXPIREAT for EXPIRE -1} {
             r set x 10
@@ -0,0 +1,114 @@
+start_server {tags {"psync2"}} {
+start_server {} {
+start_server {} {
+    set master [srv -2 client]
+    set master_host [srv -2 host]
+    set master_port [srv -2 port]
+    set slave1 [srv -1 client]
+    set slave1_host [srv -1 host]
+    set slave1_port [srv -1 port]
+    set slave2 [srv 0 client]
+
+    test {PSYNC2: Set up a master with two slaves} {
+        $slave1 slaveof $master_host $master_port
+        $slave2 slaveof $master_host $master_port
+        wait_for_condition 50 100 {
+            [status $slave1 master_link_status] eq {up} &&
+            [status $slave2 master_link_status] eq {up}
+        } else {
+            fail "Replication not started."
+        }
+        for {set j 0} {$j < 1000} {incr j} {
+            $master incr counter
+            $master rpush list $j
+        }
+        wait_for_condition 50 100 {
+            [$master debug digest] eq [$slave1 debug digest] &&
+            [$master debug digest] eq [$slave2 debug digest]
+        } else {
+            fail "Slaves not in sync with the master."
+        }
+    }
+
+    test {PSYNC2: Slaves inherit the replication ID of the master} {
+        set replid [status $master master_replid]
+        assert_equal $replid [status $slave1 master_replid]
+        assert_equal $replid [status $slave2 master_replid]
+        assert_equal [status $master master_repl_offset] \
+                     [status $slave1 master_repl_offset]
+    }
+
+    test {PSYNC2: Promoted slave keeps the old ID as secondary ID} {
+        set old_replid [status $slave1 master_replid]
+        set old_offset [status $slave1 master_repl_offset]
+        $slave1 slaveof no one
+        assert {[status $slave1 master_replid] ne $old_replid}
+        assert_equal $old_replid [status $slave1 master_replid2]
+        assert_equal [expr {$old_offset+1}] \
+                     [status $slave1 second_repl_offset]
+    }
+
+    test {PSYNC2: Old master and other slave partially resync with the new master} {
+        $master slaveof $slave1_host $slave1_port
+        $slave2 slaveof $slave1_host $slave1_port
+        wait_for_condition 50 100 {
+            [status $master master_link_status] eq {up} &&
+            [status $slave2 master_link_status] eq {up}
+        } else {
+            fail "Replication with the promoted slave not started."
+        }
+        assert_equal 0 [status $slave1 sync_full]
+        assert_equal 2 [status $slave1 sync_partial_ok]
+        set replid [status $slave1 master_replid]
+        assert_equal $replid [status $master master_replid]
+        assert_equal $replid [status $slave2 master_replid]
+    }
+
+    test {PSYNC2: The new replication chain is consistent} {
+        for {set j 0} {$j < 1000} {incr j} {
+            $slave1 incr counter
+            $slave1 select 9
+            $slave1 rpush list $j
+        }
+        wait_for_condition 50 100 {
+            [$slave1 debug digest] eq [$master debug digest] &&
+            [$slave1 debug digest] eq [$slave2 debug digest]
+        } else {
+            fail "Slaves not in sync with the promoted master."
+        }
+        assert_equal 2000 [$master get counter]
+    }
+
+    test {PSYNC2: A restarted slave partially resyncs using its RDB file} {
+        set sha [$slave1 script load {return redis.call('incr',KEYS[1])}]
+        $slave1 evalsha $sha 1 counter
+        wait_for_condition 50 100 {
+            [status $slave1 master_repl_offset] eq
+            [status $slave2 master_repl_offset]
+        } else {
+            fail "Slave offset not in sync with the master."
+        }
+        $slave2 save
+        set dir [lindex [$slave2 config get dir] 1]
+        set partial_ok [status $slave1 sync_partial_ok]
+        $slave1 incr counter
+
+        start_server [list overrides [list dir $dir \
+                slaveof "$slave1_host $slave1_port"]] {
+            wait_for_condition 50 100 {
+                [status [srv 0 client] master_link_status] eq {up}
+            } else {
+                fail "Restarted slave not connected to the master."
+            }
+            assert_equal 0 [status $slave1 sync_full]
+            assert_equal [expr {$partial_ok+1}] \
+                         [status $slave1 sync_partial_ok]
+            wait_for_condition 50 100 {
+                [$slave1 debug digest] eq [r debug digest]
+            } else {
+                fail "Restarted slave not in sync with the master."
+            }
+            assert_equal {1} [r script exists $sha]
+        }
+    }
+}}}
@@ -96,3 +96,181 @@ start_server_and_kill_it [list "dir" $server_path] {
         }
     }
 }
+
+set server_path [tmpdir "server.rdb-threaded-load-test"]
+
+start_server [list overrides [list "dir" $server_path "rdb-load-threads" 4]] {
+    test {RDB loaded by multiple threads has the same digest} {
+        createComplexDataset r 10000
+        foreach key [lrange [r keys *] 0 99] {
+            r expire $key 1000
+        }
+        # Values big enough to span multiple loading batches.
+        r rpush biglist {*}[lrepeat 2000 [string repeat x 1000]]
+        r set bigstring [string repeat y 2000000]
+        set digest [r debug digest]
+        r debug reload
+        assert_equal $digest [r debug digest]
+        r config set rdb-load-threads 1
+        r debug reload
+        assert_equal $digest [r debug digest]
+    }
+
+    test {RDB threaded loading drops expired keys} {
+        r config set rdb-load-threads 4
+        r flushall
+        r debug set-active-expire 0
+        r set persistent foo
+        r set volatile foo
+        r pexpire volatile 100
+        after 200
+        # Active expire is disabled, so the key is still saved on disk.
+        assert_equal 2 [r dbsize]
+        r debug reload
+        r debug set-active-expire 1
+        r dbsize
+    } {1}
+}
+
+set server_path [tmpdir "server.rdb-compression-test"]
+
+start_server [list overrides [list "dir" $server_path "rdbcompression" zstd]] {
+    test {RDB compressed with zstd is reloaded correctly} {
+        createComplexDataset r 10000
+        r set bigstring [string repeat "abcdefghij" 10000]
+        set digest [r debug digest]
+        foreach codec {zstd zstd-fast lzf} {
+            r config set rdbcompression $codec
+            r debug reload
+            assert_equal $digest [r debug digest]
+        }
+    }
+
+    test {RDB compressed with zstd is valid for redis-check-rdb} {
+        r config set rdbcompression zstd
+        r save
+        catch {
+            exec src/redis-check-rdb [file join $server_path dump.rdb]
+        } output
+        assert_match {*CRC64 checksum is OK*} $output
+        assert {![string match {*Error*} $output]}
+    }
+}
+
+set server_path [tmpdir "server.rdb-forkless-test"]
+
+start_server [list overrides [list "dir" $server_path "rdb-forkless-bgsave" yes]] {
+    test {Fork-less BGSAVE saves the data set as it was when started} {
+        r debug populate 100000
+        createComplexDataset r 1000
+        for {set j 0} {$j < 1000} {incr j} {
+            r expire key:[expr {$j+3000}] 10000
+        }
+        r select 10
+        r set foo bar
+        r select 9
+        set digest [r debug digest]
+        r bgsave
+        for {set j 0} {$j < 1000} {incr j} {
+            r set key:$j changed
+            r del key:[expr {$j+1000}]
+            r set newkey:$j value
+            r expire key:[expr {$j+2000}] 100
+            r persist key:[expr {$j+3000}]
+        }
+        r select 10
+        r flushdb
+        r select 9
+        waitForBgsave r
+        assert_equal ok [s rdb_last_bgsave_status]
+        assert {[s rdb_forkless_saved_on_write] > 0}
+        # The server saves again on shutdown: keep a copy of the file.
+        file copy -force [file join $server_path dump.rdb] \
+            [file join $server_path forkless.rdb]
+    }
+}
+
+start_server [list overrides [list "dir" $server_path "dbfilename" "forkless.rdb"]] {
+    test {Fork-less BGSAVE file is loaded with the data set at its start} {
+        assert_equal $digest [r debug digest]
+    }
+}
+
+start_server [list overrides [list "dir" $server_path "rdb-forkless-bgsave" yes]] {
+    test {BGSAVE is refused while a fork-less BGSAVE is in progress} {
+        r bgsave
+        catch {r bgsave} e
+        waitForBgsave r
+        set e
+    } {*already in progress*}
+
+    test {FLUSHALL stops the fork-less BGSAVE and removes its temp file} {
+        r debug populate 200000
+        r config set save ""
+        r bgsave
+        r flushall
+        assert_equal 0 [s rdb_bgsave_in_progress]
+        glob -nocomplain -directory $server_path temp-forkless-*.rdb
+    } {}
+
+    test {Fork-less BGSAVE writes to the "dir" it was started in} {
+        set other_path [file normalize [tmpdir "server.rdb-forkless-other"]]
+        r debug populate 200000
+        file delete [file join $server_path dump.rdb]
+        r bgsave
+        r config set dir $other_path
+        waitForBgsave r
+        r config set dir [file normalize $server_path]
+        assert_equal ok [s rdb_last_bgsave_status]
+        assert {[file exists [file join $server_path dump.rdb]]}
+        glob -nocomplain -directory $other_path *.rdb
+    } {}
+}
+
+set server_path [tmpdir "server.rdb-lru-lfu-test"]
+
+start_server [list overrides [list "dir" $server_path]] {
+    test {RDB saves and restores the LRU idle time of keys} {
+        r config set maxmemory-policy allkeys-lru
+        r set foo bar
+        r rpush mylist a b c
+        after 2100
+        r set hot bar
+        foreach threads {1 4} {
+            r config set rdb-load-threads $threads
+            r debug reload
+            assert {[r object idletime foo] >= 2}
+            assert {[r object idletime mylist] >= 2}
+            assert {[r object idletime hot] < 2}
+        }
+    }
+
+    test {RDB saves and restores the LFU counter of keys} {
+        r config set maxmemory-policy allkeys-lfu
+        r config set lfu-log-factor 0
+        r flushall
+        r set foo bar
+        for {set j 0} {$j < 100} {incr j} {r get foo}
+        set freq [r object freq foo]
+        assert {$freq > 100}
+        foreach threads {1 4} {
+            r config set rdb-load-threads $threads
+            r debug reload
+            assert_equal $freq [r object freq foo]
+        }
+    }
+
+    test {RDB with LRU and LFU metadata is valid for redis-check-rdb} {
+        r set bar baz
+        r expire bar 1000
+        foreach policy {allkeys-lfu allkeys-lru} {
+            r config set maxmemory-policy $policy
+            r save
+            catch {
+                exec src/redis-check-rdb [file join $server_path dump.rdb]
+            } output
+            assert_match {*CRC64 checksum is OK*} $output
+            assert {![string match {*Error*} $output]}
+        }
+    }
+}
@@ -266,3 +266,68 @@ foreach dl {no yes} {
         }
     }
 }
+
+foreach mdl {no yes} {
+    foreach sdl {on-empty-db swapdb} {
+        start_server {tags {"repl"}} {
+            set master [srv 0 client]
+            $master config set repl-diskless-sync $mdl
+            $master config set repl-diskless-sync-delay 1
+            set master_host [srv 0 host]
+            set master_port [srv 0 port]
+            $master debug populate 10000 master
+            $master rpush list a b c
+            $master sadd set a b c
+            start_server {} {
+                set slave [srv 0 client]
+                $slave config set repl-diskless-load $sdl
+                $slave set oldkey oldvalue
+                test "Diskless load from the socket, master diskless=$mdl, slave load=$sdl" {
+                    set load_handle [start_write_load $master_host $master_port 3]
+                    $slave slaveof $master_host $master_port
+                    wait_for_condition 500 100 {
+                        [lindex [$slave role] 3] eq {connected}
+                    } else {
+                        fail "Slave not connected after some time"
+                    }
+                    stop_write_load $load_handle
+                    wait_for_condition 500 100 {
+                        [$master debug digest] eq [$slave debug digest]
+                    } else {
+                        fail "Slave not in sync with the master"
+                    }
+                    assert_equal 0 [$slave exists oldkey]
+                    assert_equal 0 [status $slave async_loading]
+                }
+            }
+        }
+    }
+}
+
+start_server {tags {"repl"} overrides {rdb-forkless-bgsave yes repl-diskless-sync-delay 0}} {
+    set master [srv 0 client]
+    set master_host [srv 0 host]
+    set master_port [srv 0 port]
+    $master debug populate 1000000
+    start_server {} {
+        set slave [srv 0 client]
+        test {Slave syncs after the fork-less BGSAVE in progress} {
+            $master bgsave
+            $slave slaveof $master_host $master_port
+            $master set foo bar
+            wait_for_condition 500 100 {
+                [lindex [$slave role] 3] eq {connected}
+            } else {
+                fail "Slave not connected after some time"
+            }
+            wait_for_condition 500 100 {
+                [$master debug digest] eq [$slave debug digest]
+            } else {
+                fail "Slave not in sync with the master"
+            }
+            waitForBgsave $master
+            assert_equal ok [status $master rdb_last_bgsave_status]
+            assert {[status $master rdb_changes_since_last_save] >= 0}
+        }
+    }
+}
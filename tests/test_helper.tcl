@@ -37,7 +37,9 @@ set ::all_tests {
     integration/replication-3
     integration/replication-4
     integration/replication-psync
+    integration/psync2
     integration/aof
+    integration/aof-multi-part
     integration/rdb
     integration/convert-zipmap-hash-on-load
     integration/logging
@@ -4,61 +4,147 @@ start_server {tags {"aofrw"}} {
     r config set auto-aof-rewrite-percentage 0 ; # Disable auto-rewrite.
     waitForBgrewriteaof r
 
-    test {AOF rewrite during write load} {
-        # Start a write load for 10 seconds
-        set master [srv 0 client]
+    foreach rdbpre {yes no} {
+        r config set aof-use-rdb-preamble $rdbpre
+        test "AOF rewrite during write load: RDB preamble=$rdbpre" {
+            # Start a write load for 10 seconds
+            set master [srv 0 client]
+            set master_host [srv 0 host]
+            set master_port [srv 0 port]
+            set load_handle0 [start_write_load $master_host $master_port 10]
+            set load_handle1 [start_write_load $master_host $master_port 10]
+            set load_handle2 [start_write_load $master_host $master_port 10]
+            set load_handle3 [start_write_load $master_host $master_port 10]
+            set load_handle4 [start_write_load $master_host $master_port 10]
+
+            # Make sure the instance is really receiving data
+            wait_for_condition 50 100 {
+                [r dbsize] > 0
+            } else {
+                fail "No write load detected."
+            }
+
+            # After 3 seconds, start a rewrite, while the write load is still
+            # active.
+            after 3000
+            r bgrewriteaof
+            waitForBgrewriteaof r
+
+            # Let it run a bit more so that we'll append some data to the new
+            # AOF.
+            after 1000
+
+            # Stop the processes generating the load if they are still active
+            stop_write_load $load_handle0
+            stop_write_load $load_handle1
+            stop_write_load $load_handle2
+            stop_write_load $load_handle3
+            stop_write_load $load_handle4
+
+            # Make sure that we remain the only connected client.
+            # This step is needed to make sure there are no pending writes
+            # that will be processed between the two "debug digest" calls.
+            wait_for_condition 50 100 {
+                [llength [split [string trim [r client list]] "\n"]] == 1
+            } else {
+                puts [r client list]
+                fail "Clients generating loads are not disconnecting"
+            }
+
+            # Get the data set digest
+            set d1 [r debug digest]
+
+            # Load the AOF
+            r debug loadaof
+            set d2 [r debug digest]
+
+            # Make sure they are the same
+            assert {$d1 eq $d2}
+        }
+    }
+}
+
+start_server {tags {"aofrw"} overrides {aof-writer-thread yes appendfsync always}} {
+    r config set appendonly yes
+    r config set auto-aof-rewrite-percentage 0 ; # Disable auto-rewrite.
+    waitForBgrewriteaof r
+
+    test {AOF writer thread: rewrite during write load with group commit} {
         set master_host [srv 0 host]
         set master_port [srv 0 port]
-        set load_handle0 [start_write_load $master_host $master_port 10]
-        set load_handle1 [start_write_load $master_host $master_port 10]
-        set load_handle2 [start_write_load $master_host $master_port 10]
-        set load_handle3 [start_write_load $master_host $master_port 10]
-        set load_handle4 [start_write_load $master_host $master_port 10]
+        set load_handle0 [start_write_load $master_host $master_port 5]
+        set load_handle1 [start_write_load $master_host $master_port 5]
+        set load_handle2 [start_write_load $master_host $master_port 5]
 
-        # Make sure the instance is really receiving data
         wait_for_condition 50 100 {
             [r dbsize] > 0
         } else {
             fail "No write load detected."
         }
 
-        # After 3 seconds, start a rewrite, while the write load is still
-        # active.
-        after 3000
+        # Switch to a new AOF file while the writer thread is busy.
+        after 1000
         r bgrewriteaof
         waitForBgrewriteaof r
-
-        # Let it run a bit more so that we'll append some data to the new
-        # AOF.
         after 1000
 
-        # Stop the processes generating the load if they are still active
         stop_write_load $load_handle0
         stop_write_load $load_handle1
         stop_write_load $load_handle2
-        stop_write_load $load_handle3
-        stop_write_load $load_handle4
-
-        # Make sure that we remain the only connected client.
-        # This step is needed to make sure there are no pending writes
-        # that will be processed between the two "debug digest" calls.
         wait_for_condition 50 100 {
             [llength [split [string trim [r client list]] "\n"]] == 1
         } else {
-            puts [r client list]
             fail "Clients generating loads are not disconnecting"
         }
 
-        # Get the data set digest
-        set d1 [r debug digest]
+        # Every reply was sent after the fsync of the AOF.
+        assert {[s aof_group_commit_clients] > 0}
+        assert_equal [s aof_writer_enqueued_offset] [s aof_writer_durable_offset]
+        assert_equal 0 [s aof_writer_waiting_clients]
+        assert_match {*lt_*} [s aof_fsync_latency_usec]
 
-        # Load the AOF
+        set d1 [r debug digest]
         r debug loadaof
         set d2 [r debug digest]
-
-        # Make sure they are the same
         assert {$d1 eq $d2}
     }
+
+    test {AOF writer thread: the reply of a write waits for its fsync} {
+        r debug aof-writer-pause 1
+        set rd [redis_deferring_client]
+        $rd set fsynckey 1
+        after 500
+
+        # The reply is held until the write is fsynced. Note that any other
+        # reply would be held as well, so we can't query the server here.
+        set fd [$rd channel]
+        fconfigure $fd -blocking 0
+        set data [read $fd]
+        fconfigure $fd -blocking 1
+        assert_equal {} $data
+
+        r debug aof-writer-pause 0
+        assert_equal OK [$rd read]
+        $rd close
+        assert_equal 1 [r get fsynckey]
+        assert_equal [s aof_writer_enqueued_offset] [s aof_writer_durable_offset]
+    }
+
+    test {AOF writer thread: everysec policy fsyncs in background} {
+        r config set appendfsync everysec
+        r set foo bar
+        wait_for_condition 50 100 {
+            [s aof_writer_durable_offset] == [s aof_writer_enqueued_offset]
+        } else {
+            fail "The writer thread did not fsync the AOF"
+        }
+        r config set appendfsync always
+    }
+
+    test {AOF writer thread can't be toggled at runtime} {
+        catch {r config set aof-writer-thread no} e
+        set e
+    } {ERR*}
 }
 
 start_server {tags {"aofrw"}} {
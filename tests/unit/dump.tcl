@@ -53,6 +53,31 @@ start_server {tags {"dump"}} {
         r dump nonexisting_key
     } {}
 
+    test {DUMP / RESTORE of compressed values with every rdbcompression codec} {
+        set value [string repeat "{\"id\":1234,\"name\":\"foo\"}" 200]
+        r rpush biglist $value [string range $value 0 299] short
+        set payloads {}
+        foreach codec {no lzf zstd-fast zstd} {
+            r config set rdbcompression $codec
+            r set foo $value
+            set encoded [r dump foo]
+            lappend payloads [string length $encoded]
+            r del foo
+            r restore foo 0 $encoded
+            assert_equal $value [r get foo]
+            set encoded [r dump biglist]
+            r restore biglist2 0 $encoded
+            assert_equal [r lrange biglist 0 -1] [r lrange biglist2 0 -1]
+            r del biglist2
+        }
+        r config set rdbcompression yes
+        r del biglist
+        # Every codec should be able to compress such a repetitive value.
+        lassign $payloads none lzf zstdfast zstd
+        assert {$lzf < $none && $zstdfast < $none && $zstd < $none}
+        assert {$zstd < $lzf}
+    }
+
     test {MIGRATE is caching connections} {
         # Note, we run this as first test so that the connection cache
         # is empty.
@@ -308,4 +333,32 @@ start_server {tags {"dump"}} {
         }
     }
 
+    test {MIGRATE with multiple keys: large pipelined batch} {
+        set first [srv 0 client]
+        r flushdb
+        set keys {}
+        for {set j 0} {$j < 1000} {incr j} {
+            r set key:$j [string repeat x 200]
+            if {$j % 2} {r expire key:$j 1000}
+            lappend keys key:$j
+        }
+        r rpush biglist {*}[lrepeat 1000 [string repeat y 100]]
+        lappend keys biglist
+        set digest [r debug digest]
+        start_server {tags {"repl"}} {
+            set second [srv 0 client]
+            set second_host [srv 0 host]
+            set second_port [srv 0 port]
+
+            set ret [r -1 migrate $second_host $second_port "" 9 5000 keys {*}$keys]
+
+            assert_equal OK $ret
+            assert {[$first dbsize] == 0}
+            assert {[$second dbsize] == 1001}
+            assert_equal $digest [$second debug digest]
+            assert {[$second ttl key:1] > 0}
+            assert {[$second ttl key:2] == -1}
+            assert {[$second llen biglist] == 1000}
+        }
+    }
 }
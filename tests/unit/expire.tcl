@@ -160,6 +160,40 @@ start_server {tags {"expire"}} {
         list $size1 $size2
     } {3 0}
 
+    test {Active expire reclaims all the stale keys among alive ones} {
+        r flushdb
+        r config set active-expire-effort 10
+        r debug set-active-expire 0
+        # Interleave short lived keys with keys that will not expire
+        # during the test, so that the expire cycle has to skip them.
+        r eval {
+            for i=1,10000 do
+                redis.call('psetex','short:'..i,100,'a')
+                redis.call('setex','long:'..i,1000,'a')
+            end
+        } 0
+        after 200
+        r debug set-active-expire 1
+        wait_for_condition 50 100 {
+            [r dbsize] == 10000
+        } else {
+            fail "Stale keys were not actively reclaimed"
+        }
+        r config set active-expire-effort 1
+        set info [r info stats]
+        assert_match {*expired_stale_perc:*} $info
+        assert_match {*expire_cycle_cpu_milliseconds:*} $info
+        assert {[status r expired_keys] >= 10000}
+        r scan 0 match short:* count 20000
+    } {0 {}}
+
+    test {CONFIG SET active-expire-effort checks its range} {
+        catch {r config set active-expire-effort 11} e1
+        catch {r config set active-expire-effort 0} e2
+        list [string match {*ERR*} $e1] [string match {*ERR*} $e2] \
+             [lindex [r config get active-expire-effort] 1]
+    } {1 1 1}
+
     test {Redis should lazy expire keys} {
         r flushdb
         r debug set-active-expire 0
@@ -36,4 +36,79 @@ start_server {tags {"lazyfree"}} {
             fail "Memory is not reclaimed by FLUSHDB ASYNC"
         }
     }
+
+    test "lazyfree-lazy-server-del releases overwritten values in background" {
+        r config set lazyfree-lazy-server-del yes
+        set args {}
+        for {set i 0} {$i < 100000} {incr i} {
+            lappend args $i
+        }
+        r sadd myset {*}$args
+        set freed [s lazyfreed_objects]
+        r set myset foo
+        wait_for_condition 50 100 {
+            [s lazyfreed_objects] == $freed+1 &&
+            [s lazyfree_pending_objects] == 0
+        } else {
+            fail "Overwritten value was not released in background"
+        }
+        r config set lazyfree-lazy-server-del no
+        r get myset
+    } {foo}
+
+    test "lazyfree-lazy-expire releases expired values in background" {
+        r config set lazyfree-lazy-expire yes
+        r del myset
+        set args {}
+        for {set i 0} {$i < 100000} {incr i} {
+            lappend args $i
+        }
+        r sadd myset {*}$args
+        r pexpire myset 100
+        set freed [s lazyfreed_objects]
+        wait_for_condition 50 100 {
+            [s lazyfreed_objects] == $freed+1 &&
+            [r exists myset] == 0
+        } else {
+            fail "Expired value was not released in background"
+        }
+        r config set lazyfree-lazy-expire no
+    }
+}
+
+start_server {tags {"lazyfree"} overrides {lazyfree-threads 4}} {
+    test "Multiple lazyfree threads release batched and big objects" {
+        set freed [s lazyfreed_objects]
+        # Medium objects are batched, big objects get a job each and are
+        # spread among the threads.
+        r eval {
+            for i=1,500 do
+                for j=1,100 do redis.call('sadd','medium:'..i,'m'..j) end
+            end
+            for i=1,8 do
+                for j=1,5000 do redis.call('sadd','big:'..i,'m'..j) end
+            end
+        } 0
+        set keys [r keys *]
+        r unlink {*}$keys
+        wait_for_condition 50 100 {
+            [s lazyfree_pending_objects] == 0 &&
+            [s lazyfreed_objects] == $freed+508
+        } else {
+            fail "Objects were not released by the lazyfree threads"
+        }
+        set busy 0
+        set jobs 0
+        for {set j 0} {$j < 4} {incr j} {
+            set stats [s lazyfree_thread_$j]
+            assert_match {pending_jobs=0,*} $stats
+            regexp {processed_jobs=(\d+)} $stats - processed
+            if {$processed > 0} {incr busy}
+            incr jobs $processed
+        }
+        # Fewer jobs than objects proves the batching.
+        assert {$busy > 1 && $jobs < 508}
+        assert_equal {} [s lazyfree_thread_4]
+        lindex [r config get lazyfree-threads] 1
+    } {4}
 }
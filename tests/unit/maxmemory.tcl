@@ -23,8 +23,68 @@ start_server {tags {"maxmemory"}} {
         r config set maxmemory 0
     }
 
+    test "With maxmemory and LFU policy integers are not shared" {
+        r config set maxmemory 1073741824
+        r config set maxmemory-policy allkeys-lfu
+        r set a 1
+        r config set maxmemory-policy volatile-lfu
+        r set b 1
+        assert {[r object refcount a] == 1}
+        assert {[r object refcount b] == 1}
+        r config set maxmemory 0
+    }
+
+    test "OBJECT FREQ is only available with an LFU policy" {
+        r config set maxmemory-policy allkeys-lru
+        r set foo bar
+        assert_error "*LFU maxmemory policy is not selected*" {r object freq foo}
+        r config set maxmemory-policy allkeys-lfu
+        assert_error "*LFU maxmemory policy is selected*" {r object idletime foo}
+        r config set maxmemory-policy noeviction
+    }
+
+    test "OBJECT FREQ grows logarithmically with accesses" {
+        r config set maxmemory-policy allkeys-lfu
+        r config set lfu-decay-time 0
+        r set foo bar
+        # New keys start with LFU_INIT_VAL.
+        assert_equal 5 [r object freq foo]
+        for {set j 0} {$j < 1000} {incr j} {r get foo}
+        set freq [r object freq foo]
+        assert {$freq > 5 && $freq < 255}
+        assert_equal {} [r object freq nokey]
+        r config set lfu-decay-time 1
+        r config set maxmemory-policy noeviction
+    }
+
+    test "maxmemory - allkeys-lfu evicts rarely accessed keys first" {
+        r flushall
+        r config set maxmemory-policy allkeys-lfu
+        r config set lfu-decay-time 0
+        # Create a few hot keys with a high access frequency.
+        for {set j 0} {$j < 10} {incr j} {
+            r set "hot:$j" x
+            for {set i 0} {$i < 200} {incr i} {r get "hot:$j"}
+        }
+        set used [s used_memory]
+        set limit [expr {$used+100*1024}]
+        r config set maxmemory $limit
+        # Flood the server with keys that are written once and never read.
+        for {set j 0} {$j < 10000} {incr j} {
+            r set "cold:$j" x
+        }
+        assert {[s evicted_keys] > 0}
+        for {set j 0} {$j < 10} {incr j} {
+            assert {[r exists "hot:$j"]}
+        }
+        r config set maxmemory 0
+        r config set lfu-decay-time 1
+        r config set maxmemory-policy noeviction
+    }
+
     foreach policy {
-        allkeys-random allkeys-lru volatile-lru volatile-random volatile-ttl
+        allkeys-random allkeys-lru allkeys-lfu volatile-lru volatile-lfu
+        volatile-random volatile-ttl
     } {
         test "maxmemory - is the memory limit honoured? (policy $policy)" {
             # make sure to start with a blank instance
@@ -56,7 +116,8 @@ start_server {tags {"maxmemory"}} {
     }
 
     foreach policy {
-        allkeys-random allkeys-lru volatile-lru volatile-random volatile-ttl
+        allkeys-random allkeys-lru allkeys-lfu volatile-lru volatile-lfu
+        volatile-random volatile-ttl
     } {
         test "maxmemory - only allkeys-* should remove non-volatile keys ($policy)" {
             # make sure to start with a blank instance
@@ -98,7 +159,7 @@ start_server {tags {"maxmemory"}} {
     }
 
     foreach policy {
-        volatile-lru volatile-random volatile-ttl
+        volatile-lru volatile-lfu volatile-random volatile-ttl
     } {
         test "maxmemory - policy $policy should only remove volatile keys." {
             # make sure to start with a blank instance
@@ -141,4 +202,28 @@ start_server {tags {"maxmemory"}} {
             }
         }
     }
+
+    test "maxmemory - eviction continues in background after the time limit" {
+        r flushall
+        r config set maxmemory-policy allkeys-random
+        r config set maxmemory-eviction-tenacity 0
+        set used [s used_memory]
+        for {set j 0} {$j < 20000} {incr j} {
+            r set "key:$j" [string repeat x 50]
+        }
+        # With a tenacity of 0 a single eviction cycle only evicts a few
+        # keys, so lowering maxmemory can't reclaim all the memory at once:
+        # the remaining keys are evicted incrementally by the server.
+        set limit [expr {$used+100*1024}]
+        r config set maxmemory $limit
+        wait_for_condition 100 100 {
+            [s used_memory] < $limit + 4096
+        } else {
+            fail "Eviction did not complete in background"
+        }
+        assert {[s evicted_keys] > 10000}
+        r config set maxmemory 0
+        r config set maxmemory-eviction-tenacity 10
+        r config set maxmemory-policy noeviction
+    }
 }
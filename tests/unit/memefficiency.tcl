@@ -35,3 +35,171 @@ start_server {tags {"memefficiency"}} {
         }
     }
 }
+
+# Return the used memory per key after creating 'count' keys with a name of
+# 16 bytes and a shared integer value, so that just the keyspace overhead
+# is measured. If 'ttl' is true every key is also set an expire.
+proc keyspace_bytes_per_key {count ttl} {
+    r flushall
+    set base_mem [s used_memory]
+    r eval {
+        for i=1,tonumber(ARGV[1]) do
+            local key = string.format('key:%012d',i)
+            redis.call('set',key,1)
+            if ARGV[2] == '1' then redis.call('pexpire',key,100000000) end
+        end
+    } 0 $count $ttl
+    expr {([s used_memory]-$base_mem)/$count}
+}
+
+start_server {tags {"memefficiency"}} {
+    test {Keyspace overhead per key} {
+        # The dict entry embeds the key name: one allocation per key.
+        set plain [keyspace_bytes_per_key 100000 0]
+        assert {$plain < 72}
+        # The expire is stored in the same entry, that the expires dict
+        # just references: volatile keys only cost a slot of its table.
+        set volatile [keyspace_bytes_per_key 100000 1]
+        assert {$volatile-$plain < 32}
+    }
+}
+
+start_server {tags {"memefficiency"}} {
+    test {MEMORY USAGE reports a size for every encoding} {
+        r flushall
+        r set int 12345
+        r set embstr foo
+        r set raw [string repeat x 200]
+        r rpush list a b c
+        r sadd intset 1 2 3
+        r hset hash f v
+        r zadd zset 1 a
+        foreach key {int embstr raw list intset hash zset} {
+            assert {[r memory usage $key] > 0}
+        }
+        assert {[r memory usage raw] > 200}
+        assert_equal {} [r memory usage nokey]
+    }
+
+    test {MEMORY USAGE SAMPLES 0 walks the whole hashtable encoded object} {
+        r del myset
+        for {set j 0} {$j < 1000} {incr j} {
+            r sadd myset "element:$j"
+        }
+        assert_encoding hashtable myset
+        set exact [r memory usage myset samples 0]
+        set sampled [r memory usage myset samples 5]
+        assert {$exact > 1000*16}
+        assert {abs($exact-$sampled) < $exact/2}
+    }
+
+    test {MEMORY USAGE rejects bad options} {
+        catch {r memory usage myset samples -1} e
+        assert_match {*syntax*} $e
+        catch {r memory usage myset foo} e
+        assert_match {*syntax*} $e
+    }
+
+    test {MEMORY STATS accounts for the keyspace} {
+        r flushall
+        r set foo bar
+        r expire foo 100
+        set stats [r memory stats]
+        assert_equal 1 [dict get $stats keys.count]
+        assert {[dict get $stats total.allocated] >= [dict get $stats startup.allocated]}
+        set db9 [dict get $stats db.9]
+        assert {[dict get $db9 overhead.hashtable.expires] > 0}
+        assert {[s used_memory_overhead] > 0}
+    }
+
+    test {MEMORY DOCTOR and MALLOC-STATS return a report} {
+        assert {[string length [r memory doctor]] > 0}
+        assert {[string length [r memory malloc-stats]] > 0}
+        r memory purge
+    } {OK}
+
+    test {COMMAND GETKEYS extracts the key of MEMORY USAGE} {
+        r command getkeys memory usage foo samples 10
+    } {foo}
+}
+
+start_server {tags {"defrag"}} {
+    if {[string match {*jemalloc*} [s mem_allocator]]} {
+        test "Active defrag" {
+            r config set activedefrag no
+            r config set active-defrag-threshold-lower 5
+            r config set active-defrag-ignore-bytes 1mb
+            r debug populate 300000 asdf
+            # Delete four keys out of five to leave sparse jemalloc runs.
+            r eval {
+                for i=0,299999 do
+                    if i % 5 ~= 0 then redis.call('del','asdf:'..i) end
+                end
+            } 0
+            set digest [r debug digest]
+            set frag [s mem_fragmentation_ratio]
+            r config set activedefrag yes
+            wait_for_condition 50 100 {
+                [s active_defrag_hits] > 0 && [s active_defrag_running] eq 0
+            } else {
+                puts [r info memory]
+                fail "defrag didn't run or didn't stop."
+            }
+            assert {[s active_defrag_key_hits] > 0}
+            assert_equal $digest [r debug digest]
+            # serverCron only samples the RSS once in 100ms, and the ratio
+            # may be transiently higher while the emptied keyspace hash
+            # table is shrunk and its memory returned to the system.
+            wait_for_condition 20 100 {
+                [s mem_fragmentation_ratio] < $frag
+            } else {
+                fail "Fragmentation not reduced: [s mem_fragmentation_ratio] >= $frag"
+            }
+            r config set activedefrag no
+        }
+
+        test "Active defrag keeps aggregate types intact" {
+            r flushall
+            r config set hash-max-ziplist-entries 0
+            r config set set-max-intset-entries 0
+            r config set zset-max-ziplist-entries 0
+            r config set list-max-ziplist-size 4
+            for {set k 0} {$k < 50} {incr k} {
+                r eval {
+                    for i=0,2999 do
+                        redis.call('hset','hash:'..ARGV[1],'field:'..i,'v'..i)
+                        redis.call('sadd','set:'..ARGV[1],i)
+                        redis.call('zadd','zset:'..ARGV[1],i,'member:'..i)
+                        redis.call('rpush','list:'..ARGV[1],'item:'..i)
+                    end
+                    for i=0,2999 do
+                        if i % 3 ~= 0 then
+                            redis.call('hdel','hash:'..ARGV[1],'field:'..i)
+                            redis.call('srem','set:'..ARGV[1],i)
+                            redis.call('zrem','zset:'..ARGV[1],'member:'..i)
+                        end
+                    end
+                    redis.call('ltrim','list:'..ARGV[1],0,999)
+                    redis.call('expire','hash:'..ARGV[1],1000)
+                } 0 $k
+            }
+            assert_encoding hashtable hash:0
+            assert_encoding hashtable set:0
+            assert_encoding skiplist zset:0
+            set digest [r debug digest]
+            set hits [s active_defrag_hits]
+            r config set activedefrag yes
+            wait_for_condition 50 100 {
+                [s active_defrag_hits] > $hits && [s active_defrag_running] eq 0
+            } else {
+                fail "defrag didn't run or didn't stop."
+            }
+            r config set activedefrag no
+            assert_equal $digest [r debug digest]
+            assert_equal {member:0 0 member:3 3} \
+                [r zrange zset:7 0 1 withscores]
+            assert_equal 1000 [r zcard zset:7]
+            assert {[r ttl hash:7] > 0}
+        }
+    }
+}
@@ -115,3 +115,202 @@ start_server {tags {"regression"}} {
         $rd read
     }
 }
+
+start_server {tags {"protocol"}} {
+    test "Big values are sent referencing the object, without copy" {
+        r set bigkey [string repeat x 5000000]
+        set rd [redis_deferring_client]
+        # We don't read the replies yet, so they stay in the output buffer.
+        $rd get bigkey
+        $rd get bigkey
+        $rd get bigkey
+        wait_for_condition 50 100 {
+            [r object refcount bigkey] > 1
+        } else {
+            fail "Big reply not referenced by the output buffer"
+        }
+        # The value can be modified while referenced: the pending replies
+        # still carry the old content.
+        r append bigkey yyy
+        assert_equal 5000003 [r strlen bigkey]
+        for {set j 0} {$j < 3} {incr j} {
+            assert_equal 5000000 [string length [$rd read]]
+        }
+        $rd close
+    }
+
+    test "Big values referenced by replies are copied by FLUSHALL ASYNC" {
+        r set bigkey [string repeat x 5000000]
+        set rd [redis_deferring_client]
+        $rd get bigkey
+        $rd get bigkey
+        $rd get bigkey
+        wait_for_condition 50 100 {
+            [r object refcount bigkey] > 1
+        } else {
+            fail "Big reply not referenced by the output buffer"
+        }
+        # The database is released by the lazyfree thread while the replies
+        # are still pending: they must not reference its values anymore.
+        r flushall async
+        for {set j 0} {$j < 3} {incr j} {
+            assert_equal [string repeat x 5000000] [$rd read]
+        }
+        $rd close
+        r ping
+    } {PONG}
+
+    test "Small and big replies are interleaved correctly" {
+        r set big1 [string repeat a 100000]
+        r set big2 [string repeat b 20000]
+        r set small c
+        set rd [redis_deferring_client]
+        for {set j 0} {$j < 100} {incr j} {
+            $rd mget small big1 small big2 small
+            $rd get big2
+            $rd lrange nolist 0 -1
+        }
+        for {set j 0} {$j < 100} {incr j} {
+            set r [$rd read]
+            assert_equal c [lindex $r 0]
+            assert_equal [string repeat a 100000] [lindex $r 1]
+            assert_equal [string repeat b 20000] [lindex $r 3]
+            assert_equal c [lindex $r 4]
+            assert_equal [string repeat b 20000] [$rd read]
+            assert_equal {} [$rd read]
+        }
+        $rd close
+    }
+
+    test "Big values in MULTI and scripts replies" {
+        r set big [string repeat z 50000]
+        r multi
+        r get big
+        r strlen big
+        r get big
+        set res [r exec]
+        assert_equal [string repeat z 50000] [lindex $res 0]
+        assert_equal [string repeat z 50000] [lindex $res 2]
+        r eval {return redis.call('get',KEYS[1])} 1 big
+    } [string repeat z 50000]
+
+    test "Pipelined deferred replies don't take a reply block each" {
+        r set bigkey [string repeat x 5000000]
+        set rd [redis_deferring_client]
+        $rd client setname obuf
+        $rd read
+        # Fill the socket, so the next replies stay in the output buffer.
+        $rd get bigkey
+        $rd get bigkey
+        $rd get bigkey
+        set omem -1
+        wait_for_condition 50 100 {
+            [regexp {name=obuf .*omem=([0-9]+)} [r client list] - m] &&
+            $m == $omem || [set omem $m] == -1
+        } else {
+            fail "The output buffer of the client is not stable"
+        }
+        for {set j 0} {$j < 1000} {incr j} {
+            $rd config get maxmemory
+        }
+        $rd client setname done
+        wait_for_condition 50 100 {
+            [regexp {name=done .*omem=([0-9]+)} [r client list] - m]
+        } else {
+            fail "Pipelined commands not processed"
+        }
+        # About 60 bytes per reply, plus the block and list node headers.
+        assert {$m - $omem < 1000*1000}
+        for {set j 0} {$j < 3} {incr j} {
+            assert_equal 5000000 [string length [$rd read]]
+        }
+        for {set j 0} {$j < 1000} {incr j} {
+            assert_equal {maxmemory 0} [$rd read]
+        }
+        $rd close
+    }
+}
+
+start_server {tags {"protocol threadedio"} overrides {io-threads 4 io-threads-do-reads yes}} {
+    proc io_threads_burst {clients cmd} {
+        # Keep the server busy so that all the clients requests are served
+        # in the same event loop iteration, and the I/O threads get active.
+        set busy [redis_deferring_client]
+        $busy debug sleep 0.5
+        after 100
+        foreach rd $clients {$rd {*}$cmd}
+        assert_equal OK [$busy read]
+        $busy close
+    }
+
+    test "Threaded I/O: replies are delivered to many clients" {
+        set clients {}
+        for {set j 0} {$j < 20} {incr j} {
+            lappend clients [redis_deferring_client]
+        }
+        for {set j 0} {$j < 20} {incr j} {
+            [lindex $clients $j] set key:$j val:$j
+        }
+        foreach rd $clients {assert_equal OK [$rd read]}
+
+        io_threads_burst $clients {get key:0}
+        foreach rd $clients {assert_equal val:0 [$rd read]}
+        assert {[s io_threaded_writes_processed] > 0}
+
+        # Now the threads are active: pipeline a few commands in every
+        # client so that reads are likely to be handled by the threads as
+        # well.
+        for {set i 0} {$i < 10} {incr i} {
+            for {set j 0} {$j < 20} {incr j} {
+                [lindex $clients $j] incr counter:$j
+            }
+        }
+        for {set i 1} {$i <= 10} {incr i} {
+            for {set j 0} {$j < 20} {incr j} {
+                assert_equal $i [[lindex $clients $j] read]
+            }
+        }
+        foreach rd $clients {$rd close}
+    }
+
+    test "Threaded I/O: big values are written by the threads without copy" {
+        r set bigkey [string repeat x 1000000]
+        set clients {}
+        for {set j 0} {$j < 20} {incr j} {
+            lappend clients [redis_deferring_client]
+        }
+        io_threads_burst $clients {get bigkey}
+        foreach rd $clients {
+            assert_equal 1000000 [string length [$rd read]]
+        }
+        # All the references taken by the output buffers were released.
+        wait_for_condition 50 100 {
+            [r object refcount bigkey] == 1
+        } else {
+            fail "Big reply references were not released"
+        }
+        foreach rd $clients {$rd close}
+    }
+
+    test "Threaded I/O: protocol errors are reported" {
+        set clients {}
+        for {set j 0} {$j < 20} {incr j} {
+            lappend clients [redis_deferring_client]
+        }
+        io_threads_burst $clients {ping}
+        foreach rd $clients {assert_equal PONG [$rd read]}
+
+        set rd [lindex $clients 0]
+        $rd write "*3\r\n\$3\r\nSET\r\n\$1\r\nx\r\nfooz\r\n"
+        $rd flush
+        assert_error "*expected '$', got 'f'*" {$rd read}
+        foreach rd $clients {$rd close}
+        assert_equal PONG [r ping]
+    }
+
+    test "Threaded I/O: io-threads can't be changed at runtime" {
+        assert_equal {io-threads 4} [r config get io-threads]
+        catch {r config set io-threads 2} e
+        set e
+    } {*ERR*}
+}
@@ -6,7 +6,7 @@ void _redisAssert(char *x, char *y, int l) {
     exit(1);
 }
 
-unsigned int dictKeyHash(const void *keyp) {
+uint64_t dictKeyHash(const void *keyp) {
     unsigned long key = (unsigned long)keyp;
     key = dictGenHashFunction(&key,sizeof(key));
     key += ~(key << 15);
@@ -39,7 +39,7 @@ void showBuckets(dictht ht) {
     } else {
         int j;
         for (j = 0; j < ht.size; j++) {
-            printf("%c", ht.table[j] ? '1' : '0');
+            printf("%c", (ht.table[j].presence || ht.table[j].child) ? '1' : '0');
         }
         printf("\n");
     }